@@ -0,0 +1,262 @@
+#include "include/async_log.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>         // For memcpy
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Records a thread can have queued before further ones are dropped
+#define LOG_RING_SLOTS 1024
+// How long the writer sleeps when every ring is empty
+#define LOG_FLUSH_INTERVAL_MS 5
+// HOT_LOG statements a thread can have open at once, e.g. one streaming a
+// value whose operator<< logs itself
+#define LOG_MAX_NESTING 4
+
+// One formatted record. A slot of a ring, or a thread's scratch record for
+// synchronous writes and dropped records.
+struct LogRecord {
+	const char *file;
+	int line;
+	int severity;
+	uint16_t length;
+	char text[LOG_RECORD_TEXT];
+};
+
+// The records of one thread. Only that thread produces and only the writer
+// consumes, so each index has a single writer.
+struct LogRing {
+	LogRecord slots[LOG_RING_SLOTS];
+	std::atomic<uint64_t> head{0}; // Next slot to fill (producer)
+	std::atomic<uint64_t> tail{0}; // Next slot to write (writer)
+	std::atomic<uint64_t> dropped{0};
+};
+
+// The rings of every thread that has logged in ASYNC mode
+struct LogRegistry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<LogRing>> rings;
+};
+
+// Formats into a fixed buffer, cutting off what does not fit
+class FixedBuffer : public std::streambuf
+{
+public:
+	void reset(char *begin, size_t size)
+	{
+		setp(begin, begin + size);
+		truncated_ = false;
+	}
+
+	size_t length() const
+	{
+		return pptr() - pbase();
+	}
+
+	bool truncated() const
+	{
+		return truncated_;
+	}
+
+protected:
+	int_type overflow(int_type) override
+	{
+		truncated_ = true;
+		return traits_type::eof();
+	}
+
+private:
+	bool truncated_ = false;
+};
+
+// A stream over a FixedBuffer. Building an ostream sets up a locale, so each
+// thread keeps a few and reuses them.
+struct LineStream {
+	FixedBuffer buffer;
+	std::ostream stream{&buffer};
+};
+
+static std::atomic<LogMode> g_mode{LogMode::SYNC};
+static std::atomic<uint32_t> g_sample_every{1};
+static std::atomic<bool> g_writer_running{false};
+static std::thread g_writer;
+
+static thread_local LogRing *t_ring = nullptr;
+static thread_local uint32_t t_sample_count = 0;
+static thread_local int t_depth = 0;
+
+static LogRegistry &registry()
+{
+	static LogRegistry instance;
+	return instance;
+}
+
+static LogRing &local_ring()
+{
+	if (__builtin_expect(t_ring == nullptr, 0)) {
+		auto ring = std::make_unique<LogRing>();
+		t_ring = ring.get();
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		registry().rings.push_back(std::move(ring));
+	}
+	return *t_ring;
+}
+
+static LineStream &line_stream(int depth)
+{
+	static thread_local LineStream streams[LOG_MAX_NESTING];
+	return streams[depth];
+}
+
+static LogRecord &scratch_record(int depth)
+{
+	static thread_local LogRecord records[LOG_MAX_NESTING];
+	return records[depth];
+}
+
+static void write_record(const LogRecord &record)
+{
+	google::LogMessage(record.file, record.line, record.severity).stream()
+	        << std::string_view(record.text, record.length);
+}
+
+// Writes the queued records of every ring. Returns the number written.
+static size_t drain_rings()
+{
+	std::vector<LogRing *> rings;
+	{
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		for (const auto &ring : registry().rings) {
+			rings.push_back(ring.get());
+		}
+	}
+
+	size_t written = 0;
+	for (LogRing *ring : rings) {
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		for (; tail != head; tail++) {
+			write_record(ring->slots[tail % LOG_RING_SLOTS]);
+			written++;
+		}
+		// Release, so the producer reuses the slots only after they are read
+		ring->tail.store(tail, std::memory_order_release);
+	}
+	return written;
+}
+
+static void run_writer()
+{
+	uint64_t reported_drops = 0;
+	while (g_writer_running.load(std::memory_order_acquire)) {
+		size_t written = drain_rings();
+		uint64_t drops = AsyncLog::dropped();
+		if (drops != reported_drops) {
+			LOG(WARNING) << "[Warning] " << drops - reported_drops
+			             << " log records dropped: the log writer fell behind.";
+			reported_drops = drops;
+		}
+		if (written == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+		}
+	}
+	drain_rings();
+}
+
+void AsyncLog::start(LogMode mode, uint32_t sample_every)
+{
+	g_sample_every.store(sample_every == 0 ? 1 : sample_every, std::memory_order_relaxed);
+	g_mode.store(mode, std::memory_order_release);
+	if (mode == LogMode::ASYNC && !g_writer_running.exchange(true)) {
+		g_writer = std::thread(run_writer);
+	}
+}
+
+void AsyncLog::stop()
+{
+	g_mode.store(LogMode::SYNC, std::memory_order_release);
+	if (g_writer_running.exchange(false)) {
+		g_writer.join();
+	}
+}
+
+bool AsyncLog::sample()
+{
+	uint32_t every = g_sample_every.load(std::memory_order_relaxed);
+	return every <= 1 || t_sample_count++ % every == 0;
+}
+
+uint64_t AsyncLog::dropped()
+{
+	uint64_t dropped = 0;
+	std::lock_guard<std::mutex> lock(registry().mutex);
+	for (const auto &ring : registry().rings) {
+		dropped += ring->dropped.load(std::memory_order_relaxed);
+	}
+	return dropped;
+}
+
+LogLine::LogLine(int severity, const char *file, int line) : ring_(nullptr)
+{
+	int depth = t_depth < LOG_MAX_NESTING ? t_depth : LOG_MAX_NESTING - 1;
+	t_depth++;
+	record_ = &scratch_record(depth);
+
+	if (g_mode.load(std::memory_order_acquire) == LogMode::ASYNC) {
+		// A nested record would share the slot of the one it is part of
+		if (depth == 0) {
+			LogRing &ring = local_ring();
+			uint64_t head = ring.head.load(std::memory_order_relaxed);
+			if (head - ring.tail.load(std::memory_order_acquire) < LOG_RING_SLOTS) {
+				record_ = &ring.slots[head % LOG_RING_SLOTS];
+				ring_ = &ring;
+			} else {
+				ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1,
+				                   std::memory_order_relaxed);
+				record_ = nullptr;
+			}
+		}
+	}
+
+	LineStream &line_out = line_stream(depth);
+	if (record_ == nullptr) {
+		// Formatted into the scratch record and thrown away
+		line_out.buffer.reset(scratch_record(depth).text, LOG_RECORD_TEXT);
+	} else {
+		record_->file = file;
+		record_->line = line;
+		record_->severity = severity;
+		line_out.buffer.reset(record_->text, LOG_RECORD_TEXT);
+	}
+	// Undo manipulators a previous record may have left, such as std::hex
+	line_out.stream.clear();
+	line_out.stream.flags(std::ios_base::dec | std::ios_base::skipws);
+	line_out.stream.precision(6);
+	line_out.stream.fill(' ');
+	stream_ = &line_out.stream;
+}
+
+LogLine::~LogLine()
+{
+	t_depth--;
+	if (record_ == nullptr) {
+		return;
+	}
+	auto &buffer = static_cast<FixedBuffer &>(*stream_->rdbuf());
+	record_->length = static_cast<uint16_t>(buffer.length());
+	if (buffer.truncated()) {
+		memcpy(record_->text + LOG_RECORD_TEXT - 3, "...", 3);
+	}
+
+	if (ring_ == nullptr) {
+		// SYNC mode, or a nested record
+		write_record(*record_);
+		return;
+	}
+	ring_->head.store(ring_->head.load(std::memory_order_relaxed) + 1,
+	                  std::memory_order_release);
+}
@@ -0,0 +1,233 @@
+#include "include/buffer_pool.h"
+#include <new>             // For operator new
+#include <vector>
+
+// Size classes are 64 bytes times powers of 4, up to MAX_PACKET_SIZE
+#define SMALLEST_CLASS 64
+#define CLASS_COUNT 6
+// Bytes of a pooled reference count; larger control blocks are allocated
+#define BLOCK_SIZE 64
+// Spare payload holders and reference-count blocks kept per thread
+#define SPARE_LIMIT 4096
+
+static_assert(SMALLEST_CLASS << (2 * (CLASS_COUNT - 1)) == MAX_PACKET_SIZE,
+              "The largest class must hold a whole packet");
+
+// Buffers kept per class. Fewer of the large ones, so that a thread's pool
+// stays near 2 MiB.
+static const size_t CLASS_LIMITS[CLASS_COUNT] = {1024, 1024, 256, 64, 32, 16};
+
+struct ThreadPool {
+	std::vector<std::string> buffers[CLASS_COUNT];
+	std::vector<std::string *> holders; // Empty strings for share()
+	std::vector<void *> blocks;         // BLOCK_SIZE bytes each
+	BufferPoolStats stats;
+
+	ThreadPool()
+	{
+		// Reserved up front, so that returning a buffer never allocates
+		for (size_t i = 0; i < CLASS_COUNT; i++) {
+			buffers[i].reserve(CLASS_LIMITS[i]);
+		}
+		holders.reserve(SPARE_LIMIT);
+		blocks.reserve(SPARE_LIMIT);
+	}
+
+	~ThreadPool()
+	{
+		for (std::string *holder : holders) {
+			delete holder;
+		}
+		for (void *block : blocks) {
+			::operator delete(block);
+		}
+	}
+};
+
+// Frees the thread's pool when the thread exits. Payloads released after
+// that, e.g. by other thread-local objects, are freed instead of pooled.
+struct ThreadPoolOwner {
+	~ThreadPoolOwner();
+};
+
+static thread_local ThreadPool *t_pool = nullptr;
+static thread_local bool t_pool_gone = false;
+
+ThreadPoolOwner::~ThreadPoolOwner()
+{
+	delete t_pool;
+	t_pool = nullptr;
+	t_pool_gone = true;
+}
+
+static ThreadPool *local_pool()
+{
+	if (__builtin_expect(t_pool == nullptr, 0) && !t_pool_gone) {
+		static thread_local ThreadPoolOwner owner;
+		t_pool = new ThreadPool();
+	}
+	return t_pool;
+}
+
+static size_t class_size(size_t index)
+{
+	return size_t(SMALLEST_CLASS) << (2 * index);
+}
+
+// The smallest class that holds a request, or CLASS_COUNT if none does
+static size_t class_for_request(size_t capacity)
+{
+	size_t index = 0;
+	while (index < CLASS_COUNT && class_size(index) < capacity) {
+		index++;
+	}
+	return index;
+}
+
+// The largest class a buffer can serve, or CLASS_COUNT if it is too small
+// or larger than any packet. Such large buffers, e.g. a long text after
+// escaping, are freed, so that one cannot pin them in the largest class.
+static size_t class_for_buffer(size_t capacity)
+{
+	if (capacity < SMALLEST_CLASS || capacity > MAX_PACKET_SIZE) {
+		return CLASS_COUNT;
+	}
+	size_t index = 0;
+	while (index + 1 < CLASS_COUNT && class_size(index + 1) <= capacity) {
+		index++;
+	}
+	return index;
+}
+
+// Allocates the reference counts of pooled payloads from the pool's blocks
+template <typename T>
+struct BlockAllocator {
+	using value_type = T;
+
+	BlockAllocator() = default;
+	template <typename U>
+	BlockAllocator(const BlockAllocator<U> &)
+	{
+	}
+
+	T *allocate(size_t n)
+	{
+		size_t bytes = n * sizeof(T);
+		if (bytes > BLOCK_SIZE) {
+			return static_cast<T *>(::operator new(bytes));
+		}
+		ThreadPool *pool = local_pool();
+		if (pool && !pool->blocks.empty()) {
+			void *block = pool->blocks.back();
+			pool->blocks.pop_back();
+			pool->stats.hits++;
+			return static_cast<T *>(block);
+		}
+		if (pool) {
+			pool->stats.misses++;
+		}
+		// Always a whole block, so that any block can be reused for any
+		// control block that fits
+		return static_cast<T *>(::operator new(BLOCK_SIZE));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		ThreadPool *pool = local_pool();
+		if (n * sizeof(T) <= BLOCK_SIZE && pool && pool->blocks.size() < SPARE_LIMIT) {
+			pool->blocks.push_back(p);
+			return;
+		}
+		::operator delete(p);
+	}
+
+	template <typename U>
+	bool operator==(const BlockAllocator<U> &) const
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator!=(const BlockAllocator<U> &) const
+	{
+		return false;
+	}
+};
+
+// Deleter of a shared payload: its buffer and the string holding it go
+// back to the releasing thread's pool
+struct PayloadRecycler {
+	void operator()(const std::string *payload) const
+	{
+		auto *holder = const_cast<std::string *>(payload);
+		ThreadPool *pool = local_pool();
+		if (pool == nullptr) {
+			delete holder;
+			return;
+		}
+		BufferPool::give(std::move(*holder));
+		if (pool->holders.size() < SPARE_LIMIT) {
+			holder->clear();
+			pool->holders.push_back(holder);
+		} else {
+			delete holder;
+		}
+	}
+};
+
+std::string BufferPool::take(size_t capacity)
+{
+	std::string buffer;
+	size_t index = class_for_request(capacity);
+	ThreadPool *pool = local_pool();
+	if (index == CLASS_COUNT || pool == nullptr) {
+		buffer.reserve(capacity);
+		return buffer;
+	}
+	if (pool->buffers[index].empty()) {
+		pool->stats.misses++;
+		buffer.reserve(class_size(index));
+		return buffer;
+	}
+	pool->stats.hits++;
+	buffer = std::move(pool->buffers[index].back());
+	pool->buffers[index].pop_back();
+	return buffer;
+}
+
+void BufferPool::give(std::string &&buffer)
+{
+	size_t index = class_for_buffer(buffer.capacity());
+	ThreadPool *pool = local_pool();
+	if (index != CLASS_COUNT && pool && pool->buffers[index].size() >= CLASS_LIMITS[index]) {
+		pool->stats.released++;
+		index = CLASS_COUNT;
+	}
+	if (index == CLASS_COUNT || pool == nullptr) {
+		// Frees the buffer now rather than whenever the caller drops it
+		std::string discarded = std::move(buffer);
+		return;
+	}
+	buffer.clear();
+	pool->buffers[index].push_back(std::move(buffer));
+}
+
+SharedPayload BufferPool::share(std::string &&payload)
+{
+	ThreadPool *pool = local_pool();
+	std::string *holder;
+	if (pool && !pool->holders.empty()) {
+		holder = pool->holders.back();
+		pool->holders.pop_back();
+		*holder = std::move(payload);
+	} else {
+		holder = new std::string(std::move(payload));
+	}
+	return SharedPayload(holder, PayloadRecycler(), BlockAllocator<std::string>());
+}
+
+BufferPoolStats BufferPool::stats()
+{
+	ThreadPool *pool = local_pool();
+	return pool ? pool->stats : BufferPoolStats();
+}
@@ -5,11 +5,17 @@
 #include <unistd.h>        // For close
 #include <sys/socket.h>    // For socket functions
 #include <netinet/in.h>    // For sockaddr_in
-#include <arpa/inet.h>     // For inet_addr()
+#include <arpa/inet.h>     // For inet_addr(), inet_ntop()
 #include <thread>          // For threading
 #include <mutex>           // For std::mutex
 #include <condition_variable> // For std::condition_variable
 #include <queue>           // For std::queue
+#include <map>             // For the files being received
+#include <algorithm>       // For std::max, std::min
+#include <random>          // For transfer IDs
+#include <fcntl.h>         // For open
+#include <sys/stat.h>      // For fstat
+#include <fstream>         // For the mailbox file
 #include <nlohmann/json.hpp>
 #include <iomanip>
 #include <sstream>
@@ -18,6 +24,8 @@
 #include "include/glog_wrapper.h"
 #include "include/packet.h"
 #include "include/protocol.h"
+#include "include/frame_decoder.h"
+#include "include/payload_codec.h"
 
 #define SERVER_ADDRESS "127.0.0.1"
 #define SERVER_PORT 4468
@@ -29,6 +37,48 @@ std::mutex g_msg_queue_mutex;
 std::condition_variable g_cv;
 std::queue<Packet> g_msg_queue;
 std::atomic<bool> g_client_running(true);
+// Codec of outgoing payloads, switched once the server answers the HELLO
+std::atomic<PayloadCodec> g_codec(PayloadCodec::JSON);
+// Compression of outgoing payloads, also settled by the HELLO
+std::atomic<FrameCompression> g_compression(FrameCompression::NONE);
+// Cursor of the next page of the client list, 0 if the last one was shown
+std::atomic<uint64_t> g_list_cursor(0);
+// Correlation ID of the next request
+std::atomic<uint16_t> g_next_correlation_id(1);
+// Guards writes to the socket: the presenter acknowledges the files it
+// receives while the input thread sends requests
+std::mutex g_send_mutex;
+
+// The file the input thread is sending, if any. The presenter updates it
+// as the server answers, and the input thread waits on changed.
+struct OutgoingTransfer {
+	enum State { NONE, OFFERED, STARTED, ENDED };
+
+	std::mutex mutex; // Guards the members below
+	std::condition_variable changed;
+	State state = NONE;
+	uint64_t receiver_id = 0;
+	uint32_t transfer_id = 0;
+	uint64_t acknowledged = 0; // Bytes the receiver has stored
+	std::string error;         // Why the server refused or stopped it
+};
+OutgoingTransfer g_outgoing;
+
+// A file being received; presenter thread only
+struct IncomingFile {
+	int fd = -1; // -1 if the file could not be created
+	std::string path;
+	uint64_t size = 0;
+	uint64_t received = 0;
+	uint64_t acknowledged = 0; // Bytes reported to the sender
+};
+// Keyed by sender and transfer ID
+std::map<std::pair<uint64_t, uint32_t>, IncomingFile> g_incoming;
+
+// Where --mailbox keeps the client's ID and mailbox token between runs;
+// empty if the client did not ask for a mailbox. Set before the threads
+// start.
+std::string g_mailbox_path;
 
 const char *g_prompt = "$ ";
 
@@ -41,13 +91,14 @@ void client_signal_handler(int signum)
 }
 
 // Producer thread function
-// Receives messages from the server and puts them into the shared queue
+// Receives messages from the server and puts them into the shared queue.
+// Each recv() takes everything the socket has, which may be many packets.
 void receive_messages(int client_socket)
 {
+	FrameDecoder decoder;
 	while (g_client_running) {
-		Packet received_pkt;
-		if (!read_packet(client_socket, received_pkt)) {
-			// read_packet returns false on disconnect or critical error
+		if (decoder.read_from(client_socket) <= 0) {
+			// read_from returns 0 on disconnect or -1 on error
 			if (g_client_running) { // Avoid error message on clean shutdown
 				LOG(INFO) << "[Info] Server disconnected.";
 			}
@@ -56,19 +107,232 @@ void receive_messages(int client_socket)
 			break;
 		}
 
+		PacketView received_pkt;
+		DecodeStatus status;
+		bool received = false;
 		{
 			std::lock_guard<std::mutex> lock(g_msg_queue_mutex);
-			g_msg_queue.push(received_pkt);
+			while ((status = decoder.next(received_pkt)) == DecodeStatus::PACKET) {
+				g_msg_queue.push(received_pkt.to_packet());
+				received = true;
+			}
+		}
+		if (received) {
+			g_cv.notify_one();
+		}
+		if (status == DecodeStatus::INVALID) {
+			LOG(ERROR) << "[Error] Invalid data from server.";
+			g_client_running = false;
+			g_cv.notify_all();
+			break;
 		}
-		g_cv.notify_one();
 	}
 	LOG(INFO) << "[Info] Receiver thread finished";
 }
 
+// Returns a correlation ID for a new request. IDs wrap around but skip 0,
+// which would ask the server to answer in order.
+uint16_t next_correlation_id()
+{
+	uint16_t id = g_next_correlation_id++;
+	return id != 0 ? id : g_next_correlation_id++;
+}
+
+// Sends a request from any thread, tagged with a fresh correlation ID
+// unless it has one, and compressed if one was negotiated and the payload
+// is large enough
+bool send_packet(int socket, const Packet &pkt)
+{
+	uint16_t correlation_id = pkt.correlation_id ? pkt.correlation_id : next_correlation_id();
+	// File data goes out as it is, as the server relays it
+	bool compress = g_compression != FrameCompression::NONE &&
+	                pkt.type != MessageType::TRANSFER_CHUNK_REQUEST;
+	bool sent;
+	std::unique_lock<std::mutex> lock(g_send_mutex);
+	if (compress) {
+		sent = write_frame(socket, make_frame(pkt.type, pkt.content, pkt.codec,
+		                                      correlation_id, g_compression));
+	} else {
+		// Header and content go out in one gathering write, without a copy
+		sent = write_packet(socket, pkt.type, pkt.content, pkt.codec, correlation_id);
+	}
+	lock.unlock();
+	if (!sent) {
+		LOG(ERROR) << "[Error] Failed to send packet: "
+		           << MessageTypeToString(pkt.type);
+		g_client_running = false;
+		g_cv.notify_all();
+		return false;
+	}
+	return true;
+}
+
+// Returns text, or fallback if the server sent none
+std::string or_default(const std::string &text, const char *fallback)
+{
+	return text.empty() ? fallback : text;
+}
+
+// Reads the ID and token of the previous run from the mailbox file. Both
+// stay 0 if there is none, which claims nothing.
+void load_mailbox(uint64_t &client_id, uint64_t &token)
+{
+	std::ifstream in(g_mailbox_path);
+	if (!(in >> client_id >> token)) {
+		client_id = 0;
+		token = 0;
+	}
+}
+
+// Remembers the current ID and its token for the next run
+std::string save_mailbox(const MailboxResponse &response)
+{
+	std::ofstream out(g_mailbox_path, std::ios::trunc);
+	out << response.client_id << " " << response.token << "\n";
+	out.close();
+	if (!out) {
+		return " Cannot write " + g_mailbox_path + ": " + strerror(errno) + ".";
+	}
+	return " Messages to ID " + std::to_string(response.client_id) +
+	       " are kept while you are offline.";
+}
+
+// Names a received file received_<sender>_<transfer>_<name> in the working
+// directory. Only the last component of the name is kept, and only
+// characters that are safe in a file name.
+std::string received_file_path(uint64_t sender_id, uint32_t transfer_id, const std::string &name)
+{
+	std::string base = name.substr(name.find_last_of('/') + 1);
+	for (char &c : base) {
+		if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '_') {
+			c = '_';
+		}
+	}
+	return "received_" + std::to_string(sender_id) + "_" + std::to_string(transfer_id) +
+	       "_" + base;
+}
+
+// Writes all of data to a file. Returns false on failure, with errno set.
+bool write_all(int fd, std::string_view data)
+{
+	while (!data.empty()) {
+		ssize_t written = write(fd, data.data(), data.size());
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		data.remove_prefix(written);
+	}
+	return true;
+}
+
+// Deletes a file that will not be complete
+void discard_file(IncomingFile &file)
+{
+	if (file.fd >= 0) {
+		close(file.fd);
+		unlink(file.path.c_str());
+		file.fd = -1;
+	}
+}
+
+// Gives up a file being received and tells its sender why
+void decline_file(int socket, uint64_t sender_id, uint32_t transfer_id, const std::string &reason)
+{
+	send_packet(socket, encode_packet(MessageType::TRANSFER_END_REQUEST, g_codec,
+	                                  TransferEnd{sender_id, transfer_id, false, reason}));
+}
+
+// Creates the file a TRANSFER_BEGIN_INDICATION offers, or declines it
+std::string on_transfer_begin(int socket, const TransferBegin &offer)
+{
+	std::string from = "[File from " + std::to_string(offer.peer_id) + "]: ";
+	IncomingFile &file = g_incoming[{offer.peer_id, offer.transfer_id}];
+	discard_file(file);
+	file = IncomingFile();
+	file.path = received_file_path(offer.peer_id, offer.transfer_id, offer.name);
+	file.size = offer.size;
+	file.fd = open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file.fd < 0) {
+		std::string reason = "Cannot create " + file.path + ": " + strerror(errno);
+		g_incoming.erase({offer.peer_id, offer.transfer_id});
+		decline_file(socket, offer.peer_id, offer.transfer_id, reason);
+		return from + "Declined '" + offer.name + "'. " + reason;
+	}
+	return from + "Receiving '" + offer.name + "' (" + std::to_string(offer.size) +
+	       " bytes) as " + file.path;
+}
+
+// Stores a chunk and, every quarter window and at the end of the file, tells
+// the sender how much is stored. Shows nothing unless the file is given up.
+std::string on_transfer_chunk(int socket, const TransferChunk &chunk)
+{
+	auto it = g_incoming.find({chunk.peer_id, chunk.transfer_id});
+	if (it == g_incoming.end()) {
+		return "";
+	}
+	IncomingFile &file = it->second;
+	std::string reason;
+	if (chunk.data.size() > file.size - file.received) {
+		reason = "More data than announced";
+	} else if (!write_all(file.fd, chunk.data)) {
+		reason = "Cannot write " + file.path + ": " + strerror(errno);
+	}
+	if (!reason.empty()) {
+		discard_file(file);
+		g_incoming.erase(it);
+		decline_file(socket, chunk.peer_id, chunk.transfer_id, reason);
+		return "[File from " + std::to_string(chunk.peer_id) + "]: Aborted. " + reason;
+	}
+	file.received += chunk.data.size();
+	if (file.received == file.size || file.received - file.acknowledged >= TRANSFER_WINDOW / 4) {
+		file.acknowledged = file.received;
+		send_packet(socket, encode_packet(MessageType::TRANSFER_ACK_REQUEST, g_codec,
+		                                  TransferAck{chunk.peer_id, chunk.transfer_id,
+		                                              file.received}));
+	}
+	return "";
+}
+
+// Closes a file being received, or stops the file being sent if the
+// indication is about that one
+std::string on_transfer_end(const TransferEnd &end)
+{
+	auto it = g_incoming.find({end.peer_id, end.transfer_id});
+	if (it == g_incoming.end()) {
+		std::lock_guard<std::mutex> lock(g_outgoing.mutex);
+		if (g_outgoing.state != OutgoingTransfer::NONE &&
+		    g_outgoing.receiver_id == end.peer_id && g_outgoing.transfer_id == end.transfer_id) {
+			g_outgoing.state = OutgoingTransfer::ENDED;
+			g_outgoing.error = or_default(end.message, "Aborted by the receiver");
+			g_outgoing.changed.notify_all();
+		}
+		return "";
+	}
+	IncomingFile &file = it->second;
+	std::string from = "[File from " + std::to_string(end.peer_id) + "]: ";
+	std::string output;
+	if (end.complete && file.received == file.size) {
+		close(file.fd);
+		output = from + "Saved " + file.path + " (" + std::to_string(file.size) + " bytes)";
+	} else {
+		discard_file(file);
+		output = from + "Aborted " + file.path + ". " +
+		         or_default(end.message, "The file is incomplete");
+	}
+	g_incoming.erase(it);
+	return output;
+}
+
 // Consumer thread function
-// Takes packets from the shared queue and displays them to the user
-void present_messages()
+// Takes packets from the shared queue and displays them to the user. Also
+// stores the files other clients send, acknowledging them on the socket.
+void present_messages(int client_socket)
 {
+	// Clients in the frames of a presence snapshot received so far
+	size_t presence_snapshot = 0;
 	while (g_client_running) {
 		Packet packet_to_show;
 		bool has_message = false;
@@ -95,108 +359,360 @@ void present_messages()
 			std::string output;
 			std::string type_str = MessageTypeToString(packet_to_show.type);
 
-			// Format different types of messages
+			// Format different types of messages. The payload is
+			// decoded in whatever codec the server used for it.
+			PacketView view{packet_to_show.type, packet_to_show.content,
+			                packet_to_show.codec};
 			switch (packet_to_show.type) {
-			case MessageType::GET_TIME_RESPONSE:
-				try {
-					json data = json::parse(packet_to_show.content);
-					output =
-					    "[Server Time]: " + data.value("time", "...");
-				} catch (const json::parse_error &) {
+			case MessageType::GET_TIME_RESPONSE: {
+				TimeResponse response;
+				if (decode_payload(view, response)) {
+					output = "[Server Time]: " + response.time;
+				} else {
 					output = "[Server Time]: (Parse Error)";
 				}
 				break;
-			case MessageType::GET_NAME_RESPONSE:
-				try {
-					json data = json::parse(packet_to_show.content);
-					output =
-					    "[Server Name]: " + data.value("name", "...");
-				} catch (const json::parse_error &) {
+			}
+			case MessageType::GET_NAME_RESPONSE: {
+				NameResponse response;
+				if (decode_payload(view, response)) {
+					output = "[Server Name]: " + response.name;
+				} else {
 					output = "[Server Name]: (Parse Error)";
 				}
 				break;
-			case MessageType::GET_CLIENT_LIST_RESPONSE:
-				try {
-					json data = json::parse(packet_to_show.content);
+			}
+			case MessageType::GET_CLIENT_LIST_RESPONSE: {
+				ClientListResponse response;
+				if (decode_payload(view, response)) {
 					std::ostringstream oss;
 					oss << "[Client List]:\n"
 					    << "  ID  | IP Address      | Port\n"
 					    << "-----------------------------------";
-					for (const auto &client : data.at("clients")) {
+					for (const auto &client : response.clients) {
+						char ip[INET_ADDRSTRLEN];
+						inet_ntop(AF_INET, &client.ipv4, ip, sizeof(ip));
 						oss << "\n  " << std::setw(3) << std::left
-						    << client.value("id", 0) << " | "
+						    << client.client_id << " | "
 						    << std::setw(15) << std::left
-						    << client.value("ip", "...") << " | "
-						    << client.value("port", 0);
+						    << ip << " | "
+						    << client.port;
 					}
+					if (response.next_cursor != 0) {
+						oss << "\n  (More clients follow; type 'next' to list them)";
+					}
+					g_list_cursor = response.next_cursor;
 					output = oss.str();
-				} catch (const json::parse_error &) {
+				} else {
 					output = "[Client List]: (Parse Error)";
 				}
 				break;
-			case MessageType::SEND_MESSAGE_RESPONSE:
-				try {
-					json data = json::parse(packet_to_show.content);
-					if (data.value("status", "") == "success") {
-						output = "[Info]: Message sent to ID " +
-						         std::to_string(
-						             data.value("target_id", 0)) +
-						         " successfully.";
-					} else {
-						output = "[Error]: Failed to send "
-						         "message. Reason: " +
-						         data.value("message",
-						                    "Unknown error");
-					}
-				} catch (const json::parse_error &) {
+			}
+			case MessageType::SEND_MESSAGE_RESPONSE: {
+				SendMessageResponse response;
+				if (!decode_payload(view, response)) {
 					output = "[Info]: (Send Status Parse Error)";
+				} else if (response.success) {
+					output = "[Info]: Message #" +
+					         std::to_string(packet_to_show.correlation_id) +
+					         " sent to ID " + std::to_string(response.target_id) +
+					         " successfully.";
+				} else {
+					output = "[Error]: Failed to send message #" +
+					         std::to_string(packet_to_show.correlation_id) +
+					         ". Reason: " +
+					         or_default(response.message, "Unknown error");
 				}
 				break;
-			case MessageType::MESSAGE_INDICATION:
-				try {
-					json data = json::parse(packet_to_show.content);
-					std::string from =
-					    std::to_string(data.value("from_id", 0));
-					output = "[Message from " + from +
-					         "]: " + data.value("message", "...");
-				} catch (const json::parse_error &) {
+			}
+			case MessageType::MESSAGE_INDICATION: {
+				ChatIndication indication;
+				if (decode_payload(view, indication)) {
+					output = "[Message from " + std::to_string(indication.from_id) +
+					         "]: " + indication.message;
+				} else {
 					output = "[Message]: (Parse Error)";
 				}
 				break;
-			case MessageType::SERVER_SHUTDOWN_INDICATION:
-				try {
-					json data = json::parse(packet_to_show.content);
-					output =
-					    "[Server Shutdown]: " + data.value("notice", "Server is shutting down.");
-				} catch (const json::parse_error &) {
+			}
+			case MessageType::BROADCAST_RESPONSE: {
+				BroadcastResponse response;
+				if (!decode_payload(view, response)) {
+					output = "[Info]: (Broadcast Status Parse Error)";
+				} else if (response.success) {
+					output = "[Info]: Broadcast sent to " +
+					         std::to_string(response.recipients) +
+					         " client(s).";
+				} else {
+					output = "[Error]: Failed to broadcast. Reason: " +
+					         or_default(response.message, "Unknown error");
+				}
+				break;
+			}
+			case MessageType::JOIN_GROUP_RESPONSE:
+			case MessageType::LEAVE_GROUP_RESPONSE:
+			case MessageType::GROUP_MESSAGE_RESPONSE: {
+				GroupResponse response;
+				if (!decode_payload(view, response)) {
+					output = "[Info]: (Group Status Parse Error)";
+				} else if (!response.success) {
+					output = "[Error]: Group request failed. Reason: " +
+					         or_default(response.message, "Unknown error");
+				} else if (packet_to_show.type == MessageType::JOIN_GROUP_RESPONSE) {
+					output = "[Info]: Joined group '" + response.group + "' (" +
+					         std::to_string(response.count) +
+					         " member(s)).";
+				} else if (packet_to_show.type == MessageType::LEAVE_GROUP_RESPONSE) {
+					output = "[Info]: Left group '" + response.group + "'.";
+				} else {
+					output = "[Info]: Message sent to " +
+					         std::to_string(response.count) +
+					         " member(s) of '" + response.group + "'.";
+				}
+				break;
+			}
+			case MessageType::BROADCAST_INDICATION: {
+				ChatIndication indication;
+				if (decode_payload(view, indication)) {
+					output = "[Broadcast from " + std::to_string(indication.from_id) +
+					         "]: " + indication.message;
+				} else {
+					output = "[Broadcast]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::GROUP_MESSAGE_INDICATION: {
+				GroupMessageIndication indication;
+				if (decode_payload(view, indication)) {
+					output = "[" + or_default(indication.group, "?") + " | " +
+					         std::to_string(indication.from_id) +
+					         "]: " + indication.message;
+				} else {
+					output = "[Group Message]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::HELLO_RESPONSE: {
+				HelloResponse response;
+				if (decode_payload(view, response)) {
+					// Requests from now on use the server's choice
+					g_codec = response.codec;
+					g_compression = response.compression;
+					output = "[Info]: Using the " +
+					         std::string(PayloadCodecToString(response.codec)) +
+					         " payload codec";
+					if (response.compression != FrameCompression::NONE) {
+						output += " with " +
+						          std::string(FrameCompressionToString(
+						                  response.compression)) +
+						          " compression";
+					}
+					output += ".";
+				} else {
+					output = "[Info]: (Codec Negotiation Parse Error)";
+				}
+				break;
+			}
+			case MessageType::PRESENCE_SUBSCRIBE_RESPONSE: {
+				PresenceDelta snapshot;
+				if (decode_payload(view, snapshot)) {
+					// A large snapshot comes in several frames
+					presence_snapshot += snapshot.joined.size();
+					if (!snapshot.more) {
+						output = "[Presence]: Watching " +
+						         std::to_string(presence_snapshot) +
+						         " connected client(s).";
+						presence_snapshot = 0;
+					}
+				} else {
+					output = "[Presence]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::PRESENCE_UNSUBSCRIBE_RESPONSE: {
+				PresenceResponse response;
+				if (!decode_payload(view, response)) {
+					output = "[Presence]: (Parse Error)";
+				} else if (response.success) {
+					output = "[Presence]: Stopped watching.";
+				} else {
+					output = "[Error]: Failed to stop watching. Reason: " +
+					         or_default(response.message, "Unknown error");
+				}
+				break;
+			}
+			case MessageType::PRESENCE_DELTA_INDICATION: {
+				PresenceDelta delta;
+				if (decode_payload(view, delta)) {
+					std::ostringstream oss;
+					for (const auto &client : delta.joined) {
+						char ip[INET_ADDRSTRLEN];
+						inet_ntop(AF_INET, &client.ipv4, ip, sizeof(ip));
+						oss << (oss.tellp() > 0 ? "\n" : "") << "[Presence]: Client "
+						    << client.client_id << " (" << ip << ":" << client.port
+						    << ") connected.";
+					}
+					for (uint64_t client_id : delta.left) {
+						oss << (oss.tellp() > 0 ? "\n" : "") << "[Presence]: Client "
+						    << client_id << " disconnected.";
+					}
+					output = oss.str();
+				} else {
+					output = "[Presence]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::GET_STATS_RESPONSE: {
+				StatsResponse stats;
+				if (decode_payload(view, stats)) {
+					std::ostringstream oss;
+					oss << "[Stats]:";
+					for (const auto &counter : stats.counters) {
+						oss << "\n  " << std::left << std::setw(40) << counter.name
+						    << std::right << counter.value;
+					}
+					if (!stats.latencies.empty()) {
+						oss << "\n  " << std::left << std::setw(36) << "Handler latency (us)"
+						    << std::right << std::setw(9) << "count";
+						for (const char *column : {"p50", "p90", "p99", "p99.9", "max"}) {
+							oss << std::setw(7) << column;
+						}
+					}
+					for (const auto &latency : stats.latencies) {
+						oss << "\n  " << std::left << std::setw(36) << latency.type
+						    << std::right << std::setw(9) << latency.count;
+						for (uint64_t value : {latency.p50, latency.p90, latency.p99,
+						                       latency.p999, latency.max}) {
+							oss << std::setw(7) << (value + 500) / 1000;
+						}
+					}
+					output = oss.str();
+				} else {
+					output = "[Stats]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::MAILBOX_RESPONSE: {
+				MailboxResponse response;
+				if (!decode_payload(view, response)) {
+					output = "[Mailbox]: (Parse Error)";
+					break;
+				}
+				// The messages claimed follow as MESSAGE_INDICATIONs
+				output = "[Mailbox]:";
+				if (!response.success) {
+					output += " " + or_default(response.message, "Unknown error") + ".";
+				}
+				if (response.delivered > 0) {
+					output += " " + std::to_string(response.delivered) +
+					          " message(s) arrived while you were offline.";
+				}
+				if (response.token != 0) {
+					output += save_mailbox(response);
+				}
+				break;
+			}
+			case MessageType::TRANSFER_BEGIN_RESPONSE: {
+				TransferResponse response;
+				if (!decode_payload(view, response)) {
+					output = "[Transfer]: (Parse Error)";
+					break;
+				}
+				std::lock_guard<std::mutex> lock(g_outgoing.mutex);
+				if (g_outgoing.state == OutgoingTransfer::OFFERED &&
+				    g_outgoing.transfer_id == response.transfer_id) {
+					g_outgoing.state = response.success ? OutgoingTransfer::STARTED
+					                                    : OutgoingTransfer::ENDED;
+					g_outgoing.error = or_default(response.message, "Unknown error");
+					g_outgoing.changed.notify_all();
+				}
+				break;
+			}
+			case MessageType::TRANSFER_ACK_INDICATION: {
+				TransferAck ack;
+				if (!decode_payload(view, ack)) {
+					output = "[Transfer]: (Parse Error)";
+					break;
+				}
+				std::lock_guard<std::mutex> lock(g_outgoing.mutex);
+				if (g_outgoing.state == OutgoingTransfer::STARTED &&
+				    g_outgoing.receiver_id == ack.peer_id &&
+				    g_outgoing.transfer_id == ack.transfer_id) {
+					g_outgoing.acknowledged = std::max(g_outgoing.acknowledged, ack.received);
+					g_outgoing.changed.notify_all();
+				}
+				break;
+			}
+			case MessageType::TRANSFER_BEGIN_INDICATION: {
+				TransferBegin offer;
+				if (decode_payload(view, offer)) {
+					output = on_transfer_begin(client_socket, offer);
+				} else {
+					output = "[File]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::TRANSFER_CHUNK_INDICATION: {
+				TransferChunk chunk;
+				if (decode_payload(view, chunk)) {
+					output = on_transfer_chunk(client_socket, chunk);
+				} else {
+					output = "[File]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::TRANSFER_END_INDICATION: {
+				TransferEnd end;
+				if (decode_payload(view, end)) {
+					output = on_transfer_end(end);
+				} else {
+					output = "[File]: (Parse Error)";
+				}
+				break;
+			}
+			case MessageType::SERVER_SHUTDOWN_INDICATION: {
+				NoticeIndication indication;
+				if (decode_payload(view, indication)) {
+					output = "[Server Shutdown]: " +
+					         or_default(indication.notice, "Server is shutting down.");
+				} else {
 					output = "[Server Shutdown]: (Parse Error)";
 				}
 				// No more to do
 				// receiver_thread will stop afterward
 				break;
-			case MessageType::SYSTEM_NOTICE_INDICATION:
-				try {
-					json data = json::parse(packet_to_show.content);
-					output =
-					    "[System]: " + data.value("notice", "...");
-				} catch (const json::parse_error &) {
+			}
+			case MessageType::SYSTEM_NOTICE_INDICATION: {
+				NoticeIndication indication;
+				if (decode_payload(view, indication)) {
+					output = "[System]: " + indication.notice;
+				} else {
 					output = "[System]: (Parse Error)";
 				}
 				break;
+			}
 
-			default:
+			default: {
 				// For unknown or unhandled types, print type and content
-				try {
-					json data = json::parse(packet_to_show.content);
+				json data = json::value_t::discarded;
+				if (packet_to_show.codec == PayloadCodec::JSON) {
+					data = json::parse(packet_to_show.content, nullptr, false);
+				}
+				if (!data.is_discarded()) {
 					output = "[Server | " + type_str +
 					         " | UNHANDLED]:\n" + data.dump(4);
-				} catch (const json::parse_error &) {
+				} else {
 					output =
 					    "[Server | " + type_str +
 					    " | UNHANDLED]: " + packet_to_show.content;
 				}
 				break;
 			}
+			}
+			// Chunks and window updates of transfers show nothing
+			if (output.empty()) {
+				continue;
+			}
 			// \x1b[2K : Erases the entire current line.
 			// \r      : Moves the cursor to the beginning of the
 			// line.
@@ -204,6 +720,10 @@ void present_messages()
 			std::cout << g_prompt << std::flush;
 		}
 	}
+	// Files still being received will not be complete
+	for (auto &incoming : g_incoming) {
+		discard_file(incoming.second);
+	}
 	LOG(INFO) << "[Info] Presenter thread finished";
 }
 
@@ -214,24 +734,20 @@ void on_command_help()
 	          << "  time       - Request server time\n"
 	          << "  name       - Request server name\n"
 	          << "  list       - Request client list\n"
+	          << "  next       - Request the next page of the client list\n"
 	          << "  send       - Send a message to a client\n"
+	          << "  broadcast  - Send a message to every client\n"
+	          << "  join       - Join a group\n"
+	          << "  leave      - Leave a group\n"
+	          << "  group      - Send a message to a group you joined\n"
+	          << "  watch      - Get notified when clients connect or disconnect\n"
+	          << "  unwatch    - Stop those notifications\n"
+	          << "  stats      - Show the server's counters and latencies\n"
+	          << "  sendfile   - Send a file to a client\n"
 	          << "  disconnect - Disconnect from server and exit\n"
 	          << "---------------------\n";
 }
 
-bool send_packet(int socket, const Packet &pkt)
-{
-	std::vector<char> message_stream = create_message_stream(pkt);
-	if (send(socket, message_stream.data(), message_stream.size(), 0) < 0) {
-		LOG(ERROR) << "[Error] Failed to send packet: "
-		           << MessageTypeToString(pkt.type);
-		g_client_running = false;
-		g_cv.notify_all();
-		return false;
-	}
-	return true;
-}
-
 void on_command_get_time(int socket)
 {
 	LOG(INFO) << "[Cmd] Requesting server time...";
@@ -256,15 +772,29 @@ void on_command_get_list(int socket)
 	send_packet(socket, pkt);
 }
 
-void on_command_send_message(int socket)
+void on_command_get_next_list_page(int socket)
+{
+	uint64_t cursor = g_list_cursor;
+	if (cursor == 0) {
+		std::cout << "[Info] No more clients to list. Type 'list' to start over."
+		          << std::endl;
+		return;
+	}
+	LOG(INFO) << "[Cmd] Requesting client list from ID " << cursor << "...";
+	ClientListRequest request;
+	request.cursor = cursor;
+	send_packet(socket, encode_packet(MessageType::GET_CLIENT_LIST_REQUEST, g_codec, request));
+}
+
+// Prompts for a client ID. Returns false if none or an invalid one was
+// entered.
+bool read_client_id(uint64_t &client_id)
 {
-	uint64_t target_id;
-	std::string message;
 	std::string temp_id_input;
 
 	std::cout << "Enter target client ID: " << std::flush;
 	if (!std::getline(std::cin, temp_id_input)) {
-		return;
+		return false;
 	}
 
 	long long signed_target_id;
@@ -274,37 +804,278 @@ void on_command_send_message(int socket)
 		signed_target_id = std::stoll(temp_id_input, &pos_after_parse);
 	} catch (const std::invalid_argument &e) {
 		std::cout << "[Error] Invalid ID. Must be a number." << std::endl;
-		return;
+		return false;
 	} catch (const std::out_of_range &e) {
 		std::cout << "[Error] ID is too large." << std::endl;
-		return;
+		return false;
 	}
 
 	if (pos_after_parse != temp_id_input.length()) {
 		std::cout << "[Error] Invalid ID. Contains non-numeric characters." << std::endl;
-		return;
+		return false;
 	}
 
 	if (signed_target_id <= 0) {
 		std::cout << "[Error] Invalid ID. Client ID must be a positive number." << std::endl;
+		return false;
+	}
+
+	client_id = static_cast<uint64_t>(signed_target_id);
+	return true;
+}
+
+void on_command_send_message(int socket)
+{
+	uint64_t target_id;
+	std::string message;
+
+	if (!read_client_id(target_id)) {
+		return;
+	}
+
+	std::cout << "Enter message: " << std::flush;
+	if (!std::getline(std::cin, message) || message.empty()) {
+		std::cout << "[Info] Message canceled." << std::endl;
+		return;
+	}
+
+	// Several sends may be in flight; the ID tells their results apart
+	Packet pkt = encode_packet(MessageType::SEND_MESSAGE_REQUEST, g_codec,
+	                           SendMessageRequest{target_id, message});
+	pkt.correlation_id = next_correlation_id();
+	LOG(INFO) << "[Cmd] Sending message to ID " << target_id << " as request #"
+	          << pkt.correlation_id;
+	std::cout << "[Info] Sending as request #" << pkt.correlation_id << "." << std::endl;
+	send_packet(socket, pkt);
+}
+
+void on_command_broadcast(int socket)
+{
+	std::string message;
+	std::cout << "Enter message: " << std::flush;
+	if (!std::getline(std::cin, message) || message.empty()) {
+		std::cout << "[Info] Message canceled." << std::endl;
+		return;
+	}
+
+	LOG(INFO) << "[Cmd] Broadcasting message";
+	send_packet(socket, encode_packet(MessageType::BROADCAST_REQUEST, g_codec,
+	                                  BroadcastRequest{message}));
+}
+
+// Prompts for a group name. Returns false if none was entered.
+bool read_group_name(std::string &group)
+{
+	std::cout << "Enter group name: " << std::flush;
+	if (!std::getline(std::cin, group) || group.empty()) {
+		std::cout << "[Info] Canceled." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void on_command_join_group(int socket)
+{
+	std::string group;
+	if (!read_group_name(group)) {
 		return;
 	}
+	LOG(INFO) << "[Cmd] Joining group " << group;
+	send_packet(socket, encode_packet(MessageType::JOIN_GROUP_REQUEST, g_codec,
+	                                  GroupRequest{group, ""}));
+}
 
-	target_id = static_cast<uint64_t>(signed_target_id);
+void on_command_leave_group(int socket)
+{
+	std::string group;
+	if (!read_group_name(group)) {
+		return;
+	}
+	LOG(INFO) << "[Cmd] Leaving group " << group;
+	send_packet(socket, encode_packet(MessageType::LEAVE_GROUP_REQUEST, g_codec,
+	                                  GroupRequest{group, ""}));
+}
 
+void on_command_group_message(int socket)
+{
+	std::string group;
+	std::string message;
+	if (!read_group_name(group)) {
+		return;
+	}
 	std::cout << "Enter message: " << std::flush;
 	if (!std::getline(std::cin, message) || message.empty()) {
 		std::cout << "[Info] Message canceled." << std::endl;
 		return;
 	}
 
-	LOG(INFO) << "[Cmd] Sending message to ID " << target_id;
+	LOG(INFO) << "[Cmd] Sending message to group " << group;
+	send_packet(socket, encode_packet(MessageType::GROUP_MESSAGE_REQUEST, g_codec,
+	                                  GroupRequest{group, message}));
+}
+
+void on_command_watch(int socket)
+{
+	LOG(INFO) << "[Cmd] Subscribing to presence...";
+	Packet pkt;
+	pkt.type = MessageType::PRESENCE_SUBSCRIBE_REQUEST;
+	send_packet(socket, pkt);
+}
+
+void on_command_unwatch(int socket)
+{
+	LOG(INFO) << "[Cmd] Unsubscribing from presence...";
+	Packet pkt;
+	pkt.type = MessageType::PRESENCE_UNSUBSCRIBE_REQUEST;
+	send_packet(socket, pkt);
+}
+
+void on_command_stats(int socket)
+{
+	LOG(INFO) << "[Cmd] Requesting server stats...";
 	Packet pkt;
-	pkt.type = MessageType::SEND_MESSAGE_REQUEST;
-	pkt.content = json{{"target_id", target_id}, {"message", message}}.dump();
+	pkt.type = MessageType::GET_STATS_REQUEST;
 	send_packet(socket, pkt);
 }
 
+// Waits with g_outgoing locked until ready() holds. Returns false instead
+// if the transfer ended first or the client is stopping.
+template <typename Ready>
+bool wait_outgoing(std::unique_lock<std::mutex> &lock, Ready ready)
+{
+	while (!ready()) {
+		if (g_outgoing.state == OutgoingTransfer::ENDED || !g_client_running) {
+			return false;
+		}
+		// Timed, as Ctrl+C stops the client without a notification
+		g_outgoing.changed.wait_for(lock, std::chrono::milliseconds(200));
+	}
+	return true;
+}
+
+// Streams a file to another client in chunks, reading the next one only
+// while the receiver is less than a window behind, so that a file of any
+// size costs the same memory. Returns once the receiver has stored every
+// byte or the transfer stopped.
+void on_command_send_file(int socket)
+{
+	uint64_t target_id;
+	if (!read_client_id(target_id)) {
+		return;
+	}
+	std::string path;
+	std::cout << "Enter file path: " << std::flush;
+	if (!std::getline(std::cin, path) || path.empty()) {
+		std::cout << "[Info] Canceled." << std::endl;
+		return;
+	}
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) < 0) {
+		std::cout << "[Error] Cannot open " << path << ": " << strerror(errno) << std::endl;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	if (!S_ISREG(info.st_mode)) {
+		std::cout << "[Error] " << path << " is not a regular file." << std::endl;
+		close(fd);
+		return;
+	}
+
+	// Random, so that two clients sending each other files at once are
+	// unlikely to pick the same ID
+	static std::mt19937 random_ids{std::random_device{}()};
+	TransferBegin begin;
+	begin.peer_id = target_id;
+	begin.transfer_id = static_cast<uint32_t>(random_ids());
+	begin.size = static_cast<uint64_t>(info.st_size);
+	begin.name = path.substr(path.find_last_of('/') + 1);
+	{
+		std::lock_guard<std::mutex> lock(g_outgoing.mutex);
+		g_outgoing.state = OutgoingTransfer::OFFERED;
+		g_outgoing.receiver_id = target_id;
+		g_outgoing.transfer_id = begin.transfer_id;
+		g_outgoing.acknowledged = 0;
+		g_outgoing.error.clear();
+	}
+	LOG(INFO) << "[Cmd] Sending " << path << " to ID " << target_id << " as transfer "
+	          << begin.transfer_id;
+	std::cout << "[Info] Sending " << begin.name << " (" << begin.size << " bytes) to ID "
+	          << target_id << "..." << std::endl;
+	auto started = std::chrono::steady_clock::now();
+	bool ok = send_packet(socket,
+	                      encode_packet(MessageType::TRANSFER_BEGIN_REQUEST, g_codec, begin));
+	if (ok) {
+		std::unique_lock<std::mutex> lock(g_outgoing.mutex);
+		ok = wait_outgoing(lock, []() { return g_outgoing.state == OutgoingTransfer::STARTED; });
+	}
+
+	std::string buffer(TRANSFER_CHUNK_SIZE, '\0');
+	std::string error;
+	uint64_t sent = 0;
+	while (ok && sent < begin.size) {
+		size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), begin.size - sent));
+		ssize_t got = read(fd, &buffer[0], want);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			error = got < 0 ? std::string("Cannot read file: ") + strerror(errno)
+			                : "The file shrank while it was sent";
+			ok = false;
+			break;
+		}
+		{
+			std::unique_lock<std::mutex> lock(g_outgoing.mutex);
+			ok = wait_outgoing(lock, [&]() {
+				return sent + got - g_outgoing.acknowledged <= TRANSFER_WINDOW;
+			});
+		}
+		if (!ok) {
+			break;
+		}
+		// Always BINARY, whatever the codec of other requests
+		TransferChunk chunk{target_id, begin.transfer_id, std::string_view(buffer.data(), got)};
+		ok = send_packet(socket, encode_packet(MessageType::TRANSFER_CHUNK_REQUEST,
+		                                       PayloadCodec::BINARY, chunk));
+		sent += got;
+	}
+	close(fd);
+	if (ok) {
+		// Ended only once stored, so that success means the file arrived
+		std::unique_lock<std::mutex> lock(g_outgoing.mutex);
+		ok = wait_outgoing(lock, [&]() { return g_outgoing.acknowledged == begin.size; });
+	}
+
+	std::unique_lock<std::mutex> lock(g_outgoing.mutex);
+	bool ended = g_outgoing.state == OutgoingTransfer::ENDED;
+	if (ended) {
+		error = g_outgoing.error;
+	}
+	g_outgoing.state = OutgoingTransfer::NONE;
+	lock.unlock();
+	if (!g_client_running) {
+		return;
+	}
+	if (!ended) {
+		send_packet(socket, encode_packet(MessageType::TRANSFER_END_REQUEST, g_codec,
+		                                  TransferEnd{target_id, begin.transfer_id, ok, error}));
+	}
+	if (!ok) {
+		std::cout << "[Error] Failed to send " << begin.name << ". Reason: " << error
+		          << std::endl;
+		return;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started)
+	                         .count();
+	std::cout << "[Info] Sent " << begin.name << " to ID " << target_id << ": " << begin.size
+	          << " bytes in " << std::fixed << std::setprecision(2) << seconds << " s ("
+	          << begin.size / std::max(seconds, 1e-6) / (1024 * 1024) << " MiB/s)."
+	          << std::defaultfloat << std::endl;
+}
+
 void on_command_disconnect(int socket)
 {
 	LOG(INFO) << "[Cmd] Sending disconnect request...";
@@ -330,8 +1101,23 @@ int main(int argc, char *argv[])
 	signal(SIGINT, client_signal_handler);
 
 	std::string target_ip = SERVER_ADDRESS; // Default is 127.0.0.1
-	if (argc > 1) {
-		target_ip = argv[1];
+	bool offer_binary = true;
+	bool offer_compression = true;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--json") {
+			// Keep every payload in JSON, e.g. to read them in a capture
+			offer_binary = false;
+		} else if (arg == "--no-compress") {
+			// Keep every payload uncompressed, for the same reason
+			offer_compression = false;
+		} else if (arg == "--mailbox" && i + 1 < argc) {
+			// Keep messages sent while offline, and claim those of the
+			// previous run
+			g_mailbox_path = argv[++i];
+		} else {
+			target_ip = arg;
+		}
 	}
 
 	int client_socket;
@@ -361,9 +1147,36 @@ int main(int argc, char *argv[])
 	LOG(INFO) << "[Info] Connected to server at " << SERVER_ADDRESS << ":"
 	          << SERVER_PORT;
 
+	// Offer the compact binary codec and compression. The HELLO itself is
+	// JSON, which every server reads; one that does not know it just
+	// reports it as unhandled and the client stays on uncompressed JSON.
+	HelloRequest hello;
+	if (offer_binary) {
+		hello.codecs.push_back(PayloadCodec::BINARY);
+	}
+	hello.codecs.push_back(PayloadCodec::JSON);
+	if (offer_compression) {
+		hello.compressions.push_back(FrameCompression::LZ4_DICT);
+		hello.compressions.push_back(FrameCompression::LZ4);
+	}
+	if (!send_packet(client_socket,
+	                 encode_packet(MessageType::HELLO_REQUEST, PayloadCodec::JSON, hello))) {
+		close(client_socket);
+		return -1;
+	}
+	if (!g_mailbox_path.empty()) {
+		MailboxRequest claim;
+		load_mailbox(claim.client_id, claim.token);
+		if (!send_packet(client_socket, encode_packet(MessageType::MAILBOX_REQUEST,
+		                                              PayloadCodec::JSON, claim))) {
+			close(client_socket);
+			return -1;
+		}
+	}
+
 	// Launch the background receiver and presenter threads
 	std::thread receiver_thread(receive_messages, client_socket);
-	std::thread presenter_thread(present_messages);
+	std::thread presenter_thread(present_messages, client_socket);
 
 	// Main loop for handling user input
 	// Uses select() to avoid blocking on std::getline
@@ -393,8 +1206,26 @@ int main(int argc, char *argv[])
 					on_command_get_name(client_socket);
 				} else if (command == "list") {
 					on_command_get_list(client_socket);
+				} else if (command == "next") {
+					on_command_get_next_list_page(client_socket);
 				} else if (command == "send") {
 					on_command_send_message(client_socket);
+				} else if (command == "broadcast") {
+					on_command_broadcast(client_socket);
+				} else if (command == "join") {
+					on_command_join_group(client_socket);
+				} else if (command == "leave") {
+					on_command_leave_group(client_socket);
+				} else if (command == "group") {
+					on_command_group_message(client_socket);
+				} else if (command == "watch") {
+					on_command_watch(client_socket);
+				} else if (command == "unwatch") {
+					on_command_unwatch(client_socket);
+				} else if (command == "stats") {
+					on_command_stats(client_socket);
+				} else if (command == "sendfile") {
+					on_command_send_file(client_socket);
 				} else if (command == "disconnect") {
 					on_command_disconnect(client_socket);
 				} else if (command.empty()) {
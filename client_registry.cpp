@@ -0,0 +1,221 @@
+#include "include/client_registry.h"
+#include <arpa/inet.h>     // For inet_pton, inet_ntop
+#include <algorithm>       // For std::sort
+
+// Slots per chunk and the most chunks a registry can have
+#define SLOT_CHUNK_SIZE 1024
+#define MAX_SLOT_CHUNKS 1024
+#define SLOT_CAPACITY (SLOT_CHUNK_SIZE * MAX_SLOT_CHUNKS)
+
+ClientRegistry::ClientRegistry(uint64_t first_id, uint64_t id_stride)
+    : first_id_(first_id), id_stride_(id_stride), chunks_(MAX_SLOT_CHUNKS),
+      slots_used_(0), size_(0)
+{
+	for (auto &chunk : chunks_) {
+		chunk.store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+ClientRegistry::~ClientRegistry()
+{
+	for (auto &chunk : chunks_) {
+		delete[] chunk.load(std::memory_order_relaxed);
+	}
+}
+
+size_t ClientRegistry::capacity()
+{
+	return SLOT_CAPACITY;
+}
+
+uint64_t ClientRegistry::insert(int socket_fd, const std::string &ip_address, int port)
+{
+	std::lock_guard<std::mutex> lock(writer_mutex_);
+
+	uint32_t index;
+	uint32_t used = slots_used_.load(std::memory_order_relaxed);
+	if (used < SLOT_CAPACITY) {
+		index = used;
+	} else if (!free_slots_.empty()) {
+		index = free_slots_.back();
+		free_slots_.pop_back();
+	} else {
+		return 0;
+	}
+
+	Slot &slot = slot_at(index);
+	uint64_t client_id =
+	        first_id_ + id_stride_ * (slot.generation * SLOT_CAPACITY + index);
+
+	// Readers that still hold an older ID of this slot see the fields
+	// change only after they see the ID change
+	std::atomic_thread_fence(std::memory_order_release);
+	uint32_t ipv4 = 0;
+	inet_pton(AF_INET, ip_address.c_str(), &ipv4);
+	slot.socket_fd.store(socket_fd, std::memory_order_relaxed);
+	slot.ipv4.store(ipv4, std::memory_order_relaxed);
+	slot.port.store(port, std::memory_order_relaxed);
+	slot.codec.store(static_cast<uint8_t>(PayloadCodec::JSON), std::memory_order_relaxed);
+	slot.compression.store(static_cast<uint8_t>(FrameCompression::NONE),
+	                       std::memory_order_relaxed);
+	slot.id.store(client_id, std::memory_order_release);
+
+	if (index == used) {
+		slots_used_.store(used + 1, std::memory_order_release);
+	}
+	size_.fetch_add(1, std::memory_order_relaxed);
+	return client_id;
+}
+
+bool ClientRegistry::erase(uint64_t client_id, int &socket_fd)
+{
+	std::lock_guard<std::mutex> lock(writer_mutex_);
+
+	const Slot *found = slot_for(client_id);
+	if (found == nullptr || found->id.load(std::memory_order_relaxed) != client_id) {
+		return false;
+	}
+	Slot &slot = const_cast<Slot &>(*found);
+	socket_fd = slot.socket_fd.load(std::memory_order_relaxed);
+	slot.id.store(0, std::memory_order_relaxed);
+	slot.generation++;
+
+	uint32_t index = ((client_id - first_id_) / id_stride_) % SLOT_CAPACITY;
+	free_slots_.push_back(index);
+	size_.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool ClientRegistry::set_format(uint64_t client_id, WireFormat format)
+{
+	std::lock_guard<std::mutex> lock(writer_mutex_);
+
+	const Slot *found = slot_for(client_id);
+	if (found == nullptr || found->id.load(std::memory_order_relaxed) != client_id) {
+		return false;
+	}
+	Slot &slot = const_cast<Slot &>(*found);
+	slot.codec.store(static_cast<uint8_t>(format.codec), std::memory_order_relaxed);
+	slot.compression.store(static_cast<uint8_t>(format.compression),
+	                       std::memory_order_relaxed);
+	return true;
+}
+
+int ClientRegistry::find_socket(uint64_t client_id) const
+{
+	const Slot *slot = slot_for(client_id);
+	SlotData data;
+	if (slot == nullptr || !read_slot(*slot, client_id, data)) {
+		return -1;
+	}
+	return data.socket_fd;
+}
+
+int ClientRegistry::find_socket(uint64_t client_id, WireFormat &format) const
+{
+	const Slot *slot = slot_for(client_id);
+	SlotData data;
+	if (slot == nullptr || !read_slot(*slot, client_id, data)) {
+		return -1;
+	}
+	format = data.format;
+	return data.socket_fd;
+}
+
+bool ClientRegistry::find(uint64_t client_id, ClientInfo &info) const
+{
+	const Slot *slot = slot_for(client_id);
+	SlotData data;
+	if (slot == nullptr || !read_slot(*slot, client_id, data)) {
+		return false;
+	}
+	info = to_info(client_id, data);
+	return true;
+}
+
+std::vector<ClientInfo> ClientRegistry::snapshot() const
+{
+	std::vector<ClientInfo> clients;
+	clients.reserve(size());
+
+	uint32_t used = slots_used_.load(std::memory_order_acquire);
+	for (uint32_t index = 0; index < used; index++) {
+		const Slot &slot = slot_at(index);
+		uint64_t client_id = slot.id.load(std::memory_order_acquire);
+		SlotData data;
+		if (client_id != 0 && read_slot(slot, client_id, data)) {
+			clients.push_back(to_info(client_id, data));
+		}
+	}
+	// Reused slots hand out larger IDs than their neighbours
+	std::sort(clients.begin(), clients.end(),
+	          [](const ClientInfo &a, const ClientInfo &b) {
+		          return a.client_id < b.client_id;
+	          });
+	return clients;
+}
+
+size_t ClientRegistry::size() const
+{
+	return size_.load(std::memory_order_relaxed);
+}
+
+const ClientRegistry::Slot *ClientRegistry::slot_for(uint64_t client_id) const
+{
+	if (client_id < first_id_ || (client_id - first_id_) % id_stride_ != 0) {
+		return nullptr;
+	}
+	uint64_t index = ((client_id - first_id_) / id_stride_) % SLOT_CAPACITY;
+	if (index >= slots_used_.load(std::memory_order_acquire)) {
+		return nullptr;
+	}
+	return &slot_at(index);
+}
+
+bool ClientRegistry::read_slot(const Slot &slot, uint64_t client_id, SlotData &data) const
+{
+	if (slot.id.load(std::memory_order_acquire) != client_id) {
+		return false;
+	}
+	data.socket_fd = slot.socket_fd.load(std::memory_order_relaxed);
+	data.ipv4 = slot.ipv4.load(std::memory_order_relaxed);
+	data.port = slot.port.load(std::memory_order_relaxed);
+	data.format.codec = static_cast<PayloadCodec>(slot.codec.load(std::memory_order_relaxed));
+	data.format.compression =
+	        static_cast<FrameCompression>(slot.compression.load(std::memory_order_relaxed));
+	// The fields belong to this client only if the slot was not reused
+	// while they were read
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot.id.load(std::memory_order_relaxed) == client_id;
+}
+
+ClientRegistry::Slot &ClientRegistry::slot_at(uint32_t index)
+{
+	std::atomic<Slot *> &chunk = chunks_[index / SLOT_CHUNK_SIZE];
+	Slot *slots = chunk.load(std::memory_order_relaxed);
+	if (slots == nullptr) {
+		slots = new Slot[SLOT_CHUNK_SIZE];
+		chunk.store(slots, std::memory_order_release);
+	}
+	return slots[index % SLOT_CHUNK_SIZE];
+}
+
+const ClientRegistry::Slot &ClientRegistry::slot_at(uint32_t index) const
+{
+	// Only called for indexes below slots_used_, whose chunks exist
+	const Slot *chunk = chunks_[index / SLOT_CHUNK_SIZE].load(std::memory_order_acquire);
+	return chunk[index % SLOT_CHUNK_SIZE];
+}
+
+ClientInfo ClientRegistry::to_info(uint64_t client_id, const SlotData &data) const
+{
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &data.ipv4, ip, sizeof(ip));
+
+	ClientInfo info;
+	info.client_id = client_id;
+	info.socket_fd = data.socket_fd;
+	info.ip_address = ip;
+	info.port = data.port;
+	return info;
+}
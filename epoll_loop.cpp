@@ -0,0 +1,332 @@
+#include "include/epoll_loop.h"
+#include "include/async_log.h"
+#include "include/metrics.h"
+#include "include/protocol.h"
+#include <sys/epoll.h>     // For epoll_create1, epoll_ctl, epoll_wait
+#include <sys/socket.h>    // For accept4, recv, sendmsg
+#include <netinet/in.h>    // For sockaddr_in
+#include <arpa/inet.h>     // For inet_ntoa, ntohs
+#include <fcntl.h>         // For open
+#include <unistd.h>        // For close
+#include <climits>         // For IOV_MAX
+#include <cerrno>          // For errno
+#include <cstring>         // For strerror
+#include <glog/logging.h>
+
+#define MAX_EPOLL_EVENTS 256
+#define EPOLL_TIMEOUT_MS 1000
+
+// A socket is read at most this many times per iteration, so a client that
+// sends without pause cannot starve the others. Whatever is left is read on
+// the next iteration.
+#define MAX_READS_PER_WAKEUP 16
+
+EpollLoop::EpollLoop(int listen_fd, EventLoopCallbacks callbacks)
+    : EventLoop(listen_fd, std::move(callbacks)), epoll_fd_(-1), spare_fd_(-1),
+      read_buffer_(4 + MAX_PACKET_SIZE)
+{
+}
+
+EpollLoop::~EpollLoop()
+{
+	if (epoll_fd_ >= 0) {
+		close(epoll_fd_);
+	}
+	if (spare_fd_ >= 0) {
+		close(spare_fd_);
+	}
+}
+
+bool EpollLoop::init()
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		LOG(ERROR) << "[Error] epoll_create1() failed: " << strerror(errno);
+		return false;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = listen_fd_;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) < 0) {
+		LOG(ERROR) << "[Error] Failed to register listening socket: "
+		           << strerror(errno);
+		return false;
+	}
+
+	if (!create_wakeup_fd()) {
+		return false;
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = wakeup_fd_;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev) < 0) {
+		LOG(ERROR) << "[Error] Failed to register wakeup descriptor: "
+		           << strerror(errno);
+		return false;
+	}
+
+	spare_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return true;
+}
+
+void EpollLoop::run(const std::atomic<bool> &running)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	mark_loop_thread();
+
+	std::vector<int> retry_reads;
+
+	while (running) {
+		// Do not sleep while sockets with unread data are waiting their turn
+		int timeout = read_list_.empty() ? EPOLL_TIMEOUT_MS : 0;
+		int n = epoll_wait(epoll_fd_, events, MAX_EPOLL_EVENTS, timeout);
+		stats_.syscalls++;
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(ERROR) << "[Error] epoll_wait() error: " << strerror(errno);
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_) {
+				accept_connections();
+				continue;
+			}
+			if (fd == wakeup_fd_) {
+				run_posted_tasks();
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				// Reading also discovers hang-ups and socket errors
+				handle_readable(fd);
+			}
+			if (events[i].events & EPOLLOUT) {
+				handle_writable(fd);
+			}
+		}
+
+		retry_reads.swap(read_list_);
+		for (int fd : retry_reads) {
+			auto it = connections_.find(fd);
+			if (it != connections_.end() && it->second.read_pending) {
+				it->second.read_pending = false;
+				handle_readable(fd);
+			}
+		}
+		retry_reads.clear();
+		flush_sends();
+	}
+}
+
+bool EpollLoop::send_frame(int socket_fd, const OutboundFrame &frame)
+{
+	auto it = connections_.find(socket_fd);
+	if (it == connections_.end()) {
+		return false;
+	}
+	EpollConnection &conn = it->second;
+	bool queued = queue_frame(conn, frame);
+	// Written at the end of the iteration, together with everything else
+	// queued for this connection in the meantime. An overflowed connection
+	// is closed there too.
+	schedule_flush(socket_fd, conn);
+	return queued;
+}
+
+void EpollLoop::handle_writable(int socket_fd)
+{
+	auto it = connections_.find(socket_fd);
+	if (it == connections_.end()) {
+		return;
+	}
+	it->second.writable = true;
+	if (!it->second.outbound.empty()) {
+		schedule_flush(socket_fd, it->second);
+	}
+}
+
+void EpollLoop::schedule_flush(int socket_fd, EpollConnection &conn)
+{
+	if (!conn.flush_scheduled) {
+		conn.flush_scheduled = true;
+		flush_list_.push_back(socket_fd);
+	}
+}
+
+// Closing a connection runs on_close, which may queue frames for other
+// clients, e.g. the peer of a transfer, and so schedule them while the list
+// is walked. The list is therefore taken whole and walked again until
+// nothing new was scheduled.
+void EpollLoop::flush_sends()
+{
+	while (!flush_list_.empty()) {
+		flushing_.swap(flush_list_);
+		for (int socket_fd : flushing_) {
+			auto it = connections_.find(socket_fd);
+			if (it == connections_.end()) {
+				continue;
+			}
+			EpollConnection &conn = it->second;
+			conn.flush_scheduled = false;
+			if (conn.overflowed || !write_queued(socket_fd, conn)) {
+				close_connection(socket_fd);
+			}
+		}
+		flushing_.clear();
+	}
+}
+
+bool EpollLoop::write_queued(int socket_fd, EpollConnection &conn)
+{
+	while (conn.writable && !conn.outbound.empty()) {
+		conn.outbound.gather(write_iov_, IOV_MAX);
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = write_iov_.data();
+		msg.msg_iovlen = write_iov_.size();
+
+		ssize_t result = sendmsg(socket_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		stats_.syscalls++;
+		if (result >= 0) {
+			Metrics::count(Counter::BYTES_OUT, result);
+			conn.outbound.consume(result);
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			// Edge-triggered EPOLLOUT reports when there is room again
+			conn.writable = false;
+			return true;
+		}
+		HOT_LOG(ERROR) << "[Error] Failed to send to Client ID " << conn.client_id
+		               << ": " << strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+void EpollLoop::accept_connections()
+{
+	// Edge-triggered: drain the whole accept queue before returning
+	for (;;) {
+		struct sockaddr_in client_address;
+		socklen_t client_address_length = sizeof(client_address);
+
+		int client_socket = accept4(listen_fd_, (struct sockaddr *)&client_address,
+		                            &client_address_length,
+		                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+		stats_.syscalls++;
+		if (client_socket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			if ((errno == EMFILE || errno == ENFILE) && spare_fd_ >= 0) {
+				// Out of descriptors. Release the spare one to accept and
+				// immediately drop the pending connection, otherwise the
+				// edge-triggered listener would never fire again.
+				LOG(ERROR) << "[Error] accept() failed: " << strerror(errno)
+				           << ". Dropping connection.";
+				close(spare_fd_);
+				int fd = accept(listen_fd_, NULL, NULL);
+				if (fd >= 0) {
+					close(fd);
+				}
+				spare_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				continue;
+			}
+			LOG(ERROR) << "[Error] accept() failed: " << strerror(errno);
+			return;
+		}
+
+		std::string ip = inet_ntoa(client_address.sin_addr);
+		int port = ntohs(client_address.sin_port);
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		// Edge-triggered EPOLLOUT only fires after a write ran out of room,
+		// so it costs nothing while the socket keeps up
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.fd = client_socket;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+			LOG(ERROR) << "[Error] Failed to register client socket: "
+			           << strerror(errno);
+			close(client_socket);
+			continue;
+		}
+
+		EpollConnection &conn = connections_[client_socket];
+		conn.client_id = callbacks_.on_accept(client_socket, ip, port);
+		if (conn.client_id == 0) {
+			// Refused; closing the socket also removes it from epoll
+			connections_.erase(client_socket);
+			close(client_socket);
+		}
+	}
+}
+
+void EpollLoop::handle_readable(int socket_fd)
+{
+	auto it = connections_.find(socket_fd);
+	if (it == connections_.end()) {
+		return;
+	}
+	EpollConnection &conn = it->second;
+
+	// Edge-triggered: read until the socket is drained or the budget is used
+	for (int reads = 0;; reads++) {
+		if (conn.overflowed) {
+			// The connection is closed at the end of the iteration
+			return;
+		}
+		if (reads == MAX_READS_PER_WAKEUP) {
+			if (!conn.read_pending) {
+				conn.read_pending = true;
+				read_list_.push_back(socket_fd);
+			}
+			return;
+		}
+		ssize_t result = recv(socket_fd, read_buffer_.data(), read_buffer_.size(),
+		                      MSG_DONTWAIT);
+		stats_.syscalls++;
+		if (result > 0) {
+			if (!consume(conn, read_buffer_.data(), result)) {
+				close_connection(socket_fd);
+				return;
+			}
+			continue;
+		}
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		peer_closed(conn);
+		close_connection(socket_fd);
+		return;
+	}
+}
+
+void EpollLoop::close_connection(int socket_fd)
+{
+	auto it = connections_.find(socket_fd);
+	if (it == connections_.end()) {
+		return;
+	}
+	uint64_t client_id = it->second.client_id;
+
+	// Forget the descriptor before the callback closes it, so a new
+	// connection that reuses the number starts from a clean state.
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket_fd, NULL);
+	connections_.erase(it);
+	callbacks_.on_close(client_id);
+}
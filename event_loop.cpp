@@ -0,0 +1,151 @@
+#include "include/event_loop.h"
+#include "include/epoll_loop.h"
+#include "include/uring_loop.h"
+#include "include/async_log.h"
+#include "include/metrics.h"
+#include "include/protocol.h"
+#include <sys/eventfd.h>   // For eventfd
+#include <unistd.h>        // For read, write, close
+#include <cerrno>          // For errno
+#include <cstring>         // For strerror
+#include <glog/logging.h>
+
+std::unique_ptr<EventLoop> EventLoop::create(IoBackend backend, int listen_fd,
+                                             EventLoopCallbacks callbacks)
+{
+	switch (backend) {
+	case IoBackend::IO_URING:
+		return std::make_unique<UringLoop>(listen_fd, std::move(callbacks));
+	case IoBackend::EPOLL:
+	default:
+		return std::make_unique<EpollLoop>(listen_fd, std::move(callbacks));
+	}
+}
+
+EventLoop::EventLoop(int listen_fd, EventLoopCallbacks callbacks)
+    : listen_fd_(listen_fd), wakeup_fd_(-1), callbacks_(std::move(callbacks)),
+      outbound_limit_(DEFAULT_OUTBOUND_LIMIT), wakeup_pending_(false)
+{
+}
+
+EventLoop::~EventLoop()
+{
+	if (wakeup_fd_ >= 0) {
+		close(wakeup_fd_);
+	}
+}
+
+bool EventLoop::create_wakeup_fd()
+{
+	wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd_ < 0) {
+		LOG(ERROR) << "[Error] eventfd() failed: " << strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+void EventLoop::mark_loop_thread()
+{
+	loop_thread_ = std::this_thread::get_id();
+}
+
+void EventLoop::set_outbound_limit(size_t bytes)
+{
+	outbound_limit_ = bytes;
+}
+
+void EventLoop::post(std::function<void()> task)
+{
+	posted_tasks_.push(std::move(task));
+	// Only the first post after the loop drained the queue pays for a write
+	if (!wakeup_pending_.exchange(true, std::memory_order_acq_rel)) {
+		uint64_t one = 1;
+		if (write(wakeup_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			LOG(ERROR) << "[Error] Failed to wake event loop: " << strerror(errno);
+		}
+	}
+}
+
+bool EventLoop::in_loop_thread() const
+{
+	return loop_thread_.load(std::memory_order_relaxed) == std::this_thread::get_id();
+}
+
+const IoStats &EventLoop::stats() const
+{
+	return stats_;
+}
+
+void EventLoop::run_posted_tasks()
+{
+	uint64_t count;
+	if (read(wakeup_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		LOG(ERROR) << "[Error] Failed to read wakeup descriptor: " << strerror(errno);
+	}
+	stats_.syscalls++;
+	// Clear the flag before draining so a post that races with the drain
+	// signals the eventfd again instead of being left behind
+	wakeup_pending_.store(false, std::memory_order_release);
+
+	std::function<void()> task;
+	while (posted_tasks_.pop(task)) {
+		task();
+	}
+}
+
+bool EventLoop::consume(Connection &conn, const char *data, size_t len)
+{
+	// Packets are decoded straight out of the caller's buffer; only a packet
+	// that spans reads is copied into the connection's decoder
+	conn.decoder.feed(data, len);
+	Metrics::count(Counter::BYTES_IN, len);
+
+	PacketView pkt;
+	DecodeStatus status;
+	while ((status = conn.decoder.next(pkt)) == DecodeStatus::PACKET) {
+		stats_.frames_in++;
+		Metrics::count_frame_in(pkt.type);
+		// A connection whose own responses overflowed its queue is not
+		// read any further
+		if (!callbacks_.on_packet(conn.client_id, pkt) || conn.overflowed) {
+			return false;
+		}
+	}
+	if (status == DecodeStatus::INVALID) {
+		Metrics::count_frame_error(conn.decoder.error());
+		return false;
+	}
+	conn.decoder.finish();
+	return true;
+}
+
+// Called when a recv reports the end of the stream or an error
+void EventLoop::peer_closed(const Connection &conn)
+{
+	HOT_LOG(INFO) << "[Info] Client " << conn.client_id << " connection closed or errored.";
+	if (conn.decoder.has_partial()) {
+		Metrics::count_frame_error(FrameError::TRUNCATED);
+	}
+}
+
+bool EventLoop::queue_frame(Connection &conn, const OutboundFrame &frame)
+{
+	if (conn.overflowed) {
+		return false;
+	}
+	if (!conn.outbound.push(frame, outbound_limit_)) {
+		HOT_LOG(WARNING) << "[Warning] Client " << conn.client_id << " has "
+		                 << conn.outbound.bytes() << " unsent bytes queued, over the limit of "
+		                 << outbound_limit_ << ". Dropping the connection.";
+		// The queue is released with the connection; an in-flight write
+		// may still reference it
+		conn.overflowed = true;
+		stats_.overflows++;
+		Metrics::count(Counter::OUTBOUND_OVERFLOWS);
+		return false;
+	}
+	stats_.frames_out++;
+	Metrics::count_frame_out(frame.type());
+	return true;
+}
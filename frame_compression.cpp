@@ -0,0 +1,264 @@
+#include "include/frame_compression.h"
+#include "include/protocol.h"  // For MAX_PACKET_SIZE, HEADER_SIZE
+#include <algorithm>           // For std::min
+#include <arpa/inet.h>         // For htonl, ntohl
+#include <cstring>             // For memcpy, memset
+#include <vector>
+
+// Payloads shorter than this are sent as they are
+#define MIN_COMPRESSED_PAYLOAD 256
+// Mode and original length in front of the LZ4 block
+#define COMPRESSED_HEADER_SIZE 5
+// Limits of the LZ4 block format: a match is at least 4 bytes long and at
+// most 64 KiB back, no match starts in the last 12 bytes of a block and the
+// last 5 bytes are always literals
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_MATCH_FIND_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+// The compressor remembers one position per 4-byte hash
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+
+// Members and values that most JSON payloads of the protocol contain. Never
+// change it: peers decompress with their own copy.
+static const char DICTIONARY[] =
+        "{\"name\":\"\"}{\"time\":\"2025-01-01T00:00:00Z\"}"
+        "{\"codec\":\"binary\",\"compression\":\"lz4-dict\"}"
+        "{\"message\":\"Bad request format\",\"status\":\"error\"}"
+        "{\"message\":\"Client not found\",\"status\":\"error\",\"target_id\":1}"
+        "{\"group\":\"\",\"members\":1,\"status\":\"success\"}"
+        "{\"group\":\"\",\"recipients\":1,\"status\":\"success\"}"
+        "{\"from_id\":1,\"group\":\"\",\"message\":\"\"}"
+        "{\"message\":\"\",\"target_id\":1}{\"status\":\"success\",\"target_id\":1}"
+        "{\"notice\":\"\"}{\"joined\":[],\"left\":[]}\"next_cursor\":"
+        "{\"from_id\":1,\"message\":\"\"}"
+        "{\"clients\":[{\"id\":1,\"ip\":\"192.168.0.1\",\"port\":50000},"
+        "{\"id\":2,\"ip\":\"127.0.0.1\",\"port\":50001},"
+        "{\"id\":3,\"ip\":\"127.0.0.1\",\"port\":5";
+static const size_t DICTIONARY_SIZE = sizeof(DICTIONARY) - 1;
+
+static uint32_t read32(const char *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static uint32_t hash_position(const char *data)
+{
+	return (read32(data) * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Positions are stored plus one, so that 0 marks an empty entry
+static const uint32_t *dictionary_table()
+{
+	static const std::vector<uint32_t> table = []() {
+		std::vector<uint32_t> positions(HASH_SIZE, 0);
+		for (size_t pos = 0; pos + 4 <= DICTIONARY_SIZE; pos++) {
+			positions[hash_position(DICTIONARY + pos)] = pos + 1;
+		}
+		return positions;
+	}();
+	return table.data();
+}
+
+// Lengths that do not fit in a token's 4 bits continue in bytes of 255
+static void write_length(std::string &out, size_t length)
+{
+	while (length >= 255) {
+		out.push_back(static_cast<char>(255));
+		length -= 255;
+	}
+	out.push_back(static_cast<char>(length));
+}
+
+static bool read_length(const uint8_t *&in, const uint8_t *end, size_t &length)
+{
+	uint8_t byte;
+	do {
+		if (in == end || length > MAX_PACKET_SIZE) {
+			return false;
+		}
+		byte = *in++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// Appends literals followed by a match; the last sequence of a block has
+// only literals and a match_len of 0
+static void write_sequence(std::string &out, const char *literals, size_t literal_len,
+                           size_t offset, size_t match_len)
+{
+	size_t match_code = match_len > 0 ? match_len - LZ4_MIN_MATCH : 0;
+	out.push_back(static_cast<char>((std::min<size_t>(literal_len, 15) << 4) |
+	                                std::min<size_t>(match_code, 15)));
+	if (literal_len >= 15) {
+		write_length(out, literal_len - 15);
+	}
+	out.append(literals, literal_len);
+	if (match_len == 0) {
+		return;
+	}
+	out.push_back(static_cast<char>(offset & 0xff));
+	out.push_back(static_cast<char>(offset >> 8));
+	if (match_code >= 15) {
+		write_length(out, match_code - 15);
+	}
+}
+
+// Compresses input[start, end) as one LZ4 block. Matches may reach back into
+// input[0, start), whose positions table already holds.
+static void compress_block(const char *input, size_t start, size_t end, uint32_t *table,
+                           std::string &out)
+{
+	size_t anchor = start;
+	if (end - start > LZ4_MATCH_FIND_LIMIT) {
+		size_t find_limit = end - LZ4_MATCH_FIND_LIMIT;
+		size_t match_limit = end - LZ4_LAST_LITERALS;
+		size_t pos = start;
+		while (pos <= find_limit) {
+			uint32_t hash = hash_position(input + pos);
+			size_t candidate = table[hash];
+			table[hash] = pos + 1;
+			if (candidate == 0 || pos - (candidate - 1) > LZ4_MAX_OFFSET ||
+			    read32(input + candidate - 1) != read32(input + pos)) {
+				// Take bigger steps through data that does not compress
+				pos += 1 + ((pos - anchor) >> 6);
+				continue;
+			}
+
+			size_t ref = candidate - 1;
+			while (pos > anchor && ref > 0 && input[pos - 1] == input[ref - 1]) {
+				pos--;
+				ref--;
+			}
+			size_t length = LZ4_MIN_MATCH;
+			while (pos + length < match_limit && input[ref + length] == input[pos + length]) {
+				length++;
+			}
+			write_sequence(out, input + anchor, pos - anchor, pos - ref, length);
+			pos += length;
+			anchor = pos;
+			if (pos <= find_limit) {
+				table[hash_position(input + pos - 2)] = pos - 2 + 1;
+			}
+		}
+	}
+	write_sequence(out, input + anchor, end - anchor, 0, 0);
+}
+
+bool compress_payload(std::string_view payload, FrameCompression mode, std::string &out)
+{
+	if (mode == FrameCompression::NONE || payload.size() < MIN_COMPRESSED_PAYLOAD ||
+	    payload.size() > MAX_PACKET_SIZE - HEADER_SIZE) {
+		return false;
+	}
+
+	uint32_t table[HASH_SIZE];
+	const char *input = payload.data();
+	size_t start = 0;
+	if (mode == FrameCompression::LZ4_DICT) {
+		// Compress the payload as the continuation of the dictionary
+		thread_local std::string window;
+		window.assign(DICTIONARY, DICTIONARY_SIZE);
+		window.append(payload);
+		memcpy(table, dictionary_table(), sizeof(table));
+		input = window.data();
+		start = DICTIONARY_SIZE;
+	} else {
+		memset(table, 0, sizeof(table));
+	}
+
+	out.clear();
+	out.reserve(COMPRESSED_HEADER_SIZE + payload.size());
+	uint32_t original_len_n = htonl(payload.size());
+	out.push_back(static_cast<char>(mode));
+	out.append(reinterpret_cast<const char *>(&original_len_n), sizeof(original_len_n));
+	compress_block(input, start, start + payload.size(), table, out);
+	return out.size() < payload.size();
+}
+
+bool decompress_payload(std::string_view payload, std::string &out)
+{
+	if (payload.size() < COMPRESSED_HEADER_SIZE) {
+		return false;
+	}
+	const char *dictionary = nullptr;
+	size_t dictionary_size = 0;
+	switch (static_cast<FrameCompression>(payload[0])) {
+	case FrameCompression::LZ4:
+		break;
+	case FrameCompression::LZ4_DICT:
+		dictionary = DICTIONARY;
+		dictionary_size = DICTIONARY_SIZE;
+		break;
+	default:
+		return false;
+	}
+	uint32_t original_len;
+	memcpy(&original_len, payload.data() + 1, sizeof(original_len));
+	original_len = ntohl(original_len);
+	if (original_len > MAX_PACKET_SIZE - HEADER_SIZE) {
+		return false;
+	}
+
+	out.resize(original_len);
+	char *dst = &out[0];
+	size_t pos = 0;
+	const uint8_t *in = reinterpret_cast<const uint8_t *>(payload.data()) + COMPRESSED_HEADER_SIZE;
+	const uint8_t *end = reinterpret_cast<const uint8_t *>(payload.data()) + payload.size();
+	for (;;) {
+		if (in == end) {
+			return false;
+		}
+		uint8_t token = *in++;
+
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && !read_length(in, end, literal_len)) {
+			return false;
+		}
+		if (literal_len > static_cast<size_t>(end - in) || literal_len > original_len - pos) {
+			return false;
+		}
+		memcpy(dst + pos, in, literal_len);
+		pos += literal_len;
+		in += literal_len;
+		if (in == end) {
+			// The last sequence ends after its literals
+			break;
+		}
+
+		if (end - in < 2) {
+			return false;
+		}
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !read_length(in, end, match_len)) {
+			return false;
+		}
+		match_len += LZ4_MIN_MATCH;
+		if (offset == 0 || offset > pos + dictionary_size || match_len > original_len - pos) {
+			return false;
+		}
+		if (offset > pos) {
+			// The match starts in the dictionary and may run on into the output
+			size_t from_dictionary = std::min(offset - pos, match_len);
+			memcpy(dst + pos, dictionary + dictionary_size - (offset - pos), from_dictionary);
+			pos += from_dictionary;
+			match_len -= from_dictionary;
+		}
+		if (offset >= match_len) {
+			memcpy(dst + pos, dst + pos - offset, match_len);
+		} else {
+			// The match overlaps the bytes it produces
+			for (size_t i = 0; i < match_len; i++) {
+				dst[pos + i] = dst[pos + i - offset];
+			}
+		}
+		pos += match_len;
+	}
+	return pos == original_len;
+}
@@ -0,0 +1,129 @@
+#include "include/frame_decoder.h"
+#include "include/protocol.h"
+#include "include/frame_compression.h"
+#include <sys/socket.h>    // For recv
+#include <cstring>         // For memcpy, memmove
+#include <glog/logging.h>
+
+// read_from() keeps room for two maximum-size packets, so a packet that has
+// only partly arrived always fits next to the one being read
+#define DECODER_READ_CAPACITY (2 * (4 + MAX_PACKET_SIZE))
+
+void FrameDecoder::feed(const char *data, size_t len)
+{
+	if (begin_ != end_) {
+		// A packet is already split across reads, join the new bytes to it
+		append(data, len);
+		return;
+	}
+	input_ = data;
+	input_len_ = len;
+	input_pos_ = 0;
+}
+
+void FrameDecoder::finish()
+{
+	if (input_ != nullptr) {
+		// Keep the incomplete tail of the borrowed bytes
+		if (input_pos_ < input_len_) {
+			append(input_ + input_pos_, input_len_ - input_pos_);
+		}
+		input_ = nullptr;
+		input_len_ = 0;
+		input_pos_ = 0;
+	}
+	if (begin_ == end_) {
+		// Release the buffers so idle connections hold no memory
+		std::vector<char>().swap(buffer_);
+		std::string().swap(inflated_);
+		begin_ = 0;
+		end_ = 0;
+	} else {
+		compact();
+	}
+}
+
+ssize_t FrameDecoder::read_from(int socket)
+{
+	compact();
+	if (buffer_.size() < DECODER_READ_CAPACITY) {
+		buffer_.resize(DECODER_READ_CAPACITY);
+	}
+	ssize_t result = recv(socket, buffer_.data() + end_, buffer_.size() - end_, 0);
+	if (result > 0) {
+		end_ += result;
+	}
+	return result;
+}
+
+DecodeStatus FrameDecoder::next(PacketView &pkt)
+{
+	const char *data;
+	size_t len;
+	if (begin_ != end_) {
+		data = buffer_.data() + begin_;
+		len = end_ - begin_;
+	} else if (input_ != nullptr) {
+		data = input_ + input_pos_;
+		len = input_len_ - input_pos_;
+	} else {
+		return DecodeStatus::NEED_MORE;
+	}
+
+	ssize_t used = parse_packet(data, len, pkt, &error_);
+	if (used < 0) {
+		return DecodeStatus::INVALID;
+	}
+	if (used == 0) {
+		return DecodeStatus::NEED_MORE;
+	}
+
+	if (begin_ != end_) {
+		begin_ += used;
+	} else {
+		input_pos_ += used;
+	}
+
+	if (pkt.compressed) {
+		if (!decompress_payload(pkt.content, inflated_)) {
+			LOG(ERROR) << "[Error] Malformed compressed payload.";
+			error_ = FrameError::BAD_COMPRESSION;
+			return DecodeStatus::INVALID;
+		}
+		pkt.content = inflated_;
+		pkt.compressed = false;
+	}
+	return DecodeStatus::PACKET;
+}
+
+bool FrameDecoder::has_partial() const
+{
+	return begin_ != end_ || (input_ != nullptr && input_pos_ < input_len_);
+}
+
+FrameError FrameDecoder::error() const
+{
+	return error_;
+}
+
+void FrameDecoder::append(const char *data, size_t len)
+{
+	compact();
+	if (buffer_.size() < end_ + len) {
+		buffer_.resize(end_ + len);
+	}
+	memcpy(buffer_.data() + end_, data, len);
+	end_ += len;
+}
+
+void FrameDecoder::compact()
+{
+	if (begin_ == 0) {
+		return;
+	}
+	if (begin_ != end_) {
+		memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+	}
+	end_ -= begin_;
+	begin_ = 0;
+}
@@ -0,0 +1,86 @@
+#include "include/group_directory.h"
+#include <algorithm>       // For std::find
+
+size_t GroupDirectory::join(const std::string &group, uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	MemberList &members = groups_[group];
+	if (members && std::find(members->begin(), members->end(), client_id) != members->end()) {
+		return members->size();
+	}
+
+	auto updated = members ? std::make_shared<std::vector<uint64_t>>(*members)
+	                       : std::make_shared<std::vector<uint64_t>>();
+	updated->push_back(client_id);
+	members = std::move(updated);
+	memberships_[client_id].push_back(group);
+	return members->size();
+}
+
+bool GroupDirectory::leave(const std::string &group, uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (!remove_member(group, client_id)) {
+		return false;
+	}
+	auto it = memberships_.find(client_id);
+	if (it != memberships_.end()) {
+		std::vector<std::string> &joined = it->second;
+		joined.erase(std::find(joined.begin(), joined.end(), group));
+		if (joined.empty()) {
+			memberships_.erase(it);
+		}
+	}
+	return true;
+}
+
+void GroupDirectory::leave_all(uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = memberships_.find(client_id);
+	if (it == memberships_.end()) {
+		return;
+	}
+	for (const std::string &group : it->second) {
+		remove_member(group, client_id);
+	}
+	memberships_.erase(it);
+}
+
+GroupDirectory::MemberList GroupDirectory::members(const std::string &group) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = groups_.find(group);
+	if (it == groups_.end()) {
+		return nullptr;
+	}
+	return it->second;
+}
+
+bool GroupDirectory::remove_member(const std::string &group, uint64_t client_id)
+{
+	auto it = groups_.find(group);
+	if (it == groups_.end()) {
+		return false;
+	}
+	const std::vector<uint64_t> &current = *it->second;
+	auto member = std::find(current.begin(), current.end(), client_id);
+	if (member == current.end()) {
+		return false;
+	}
+
+	if (current.size() == 1) {
+		groups_.erase(it);
+		return true;
+	}
+	auto updated = std::make_shared<std::vector<uint64_t>>();
+	updated->reserve(current.size() - 1);
+	updated->insert(updated->end(), current.begin(), member);
+	updated->insert(updated->end(), member + 1, current.end());
+	it->second = std::move(updated);
+	return true;
+}
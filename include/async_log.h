@@ -0,0 +1,130 @@
+#ifndef ASYNC_LOG_H_
+#define ASYNC_LOG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <glog/logging.h> // For google::GLOG_INFO and friends
+
+// HOT_LOG statements below this severity are compiled out, e.g. build with
+// -DHOT_LOG_MIN_SEVERITY=1 to drop the INFO ones: 0 INFO, 1 WARNING, 2 ERROR
+#ifndef HOT_LOG_MIN_SEVERITY
+#define HOT_LOG_MIN_SEVERITY 0
+#endif
+
+// Text of one record; longer lines are cut and end in "..."
+const size_t LOG_RECORD_TEXT = 232;
+
+struct LogRecord;
+struct LogRing;
+
+/**
+ * @enum LogMode
+ * @brief Who writes the records of HOT_LOG statements.
+ */
+enum class LogMode : uint8_t {
+	SYNC = 0, // The logging thread hands each record to glog itself
+	ASYNC     // A background thread writes them
+};
+
+/**
+ * @class AsyncLog
+ * @brief Takes glog's formatting and writes off the threads that log.
+ *
+ * In ASYNC mode a HOT_LOG statement formats its text into a slot of a ring
+ * buffer that belongs to the calling thread, and a background thread hands
+ * the records of every ring to glog a few milliseconds later. A record
+ * costs no lock, no allocation and no system call on the logging thread.
+ * When a ring is full its records are dropped and counted rather than
+ * waited for, and the writer logs how many went missing.
+ *
+ * glog stamps a record with the time and thread it was written on, so in
+ * ASYNC mode the time is up to a flush interval late and the thread is the
+ * writer's. Records still in a ring when the process crashes are lost, so
+ * fatal errors are logged with LOG, never HOT_LOG.
+ */
+class AsyncLog
+{
+public:
+	/**
+	 * @brief Starts writing HOT_LOG records, in the background for
+	 * LogMode::ASYNC. Call once, before the threads that log start.
+	 * @param mode Who writes the records.
+	 * @param sample_every HOT_LOG_SAMPLED writes one in this many of the
+	 * calling thread's records; 1 writes all of them.
+	 */
+	static void start(LogMode mode, uint32_t sample_every);
+
+	/**
+	 * @brief Writes every queued record and stops the background writer;
+	 * later records are written synchronously. Call after the threads that
+	 * log have stopped, or their last records may be lost.
+	 */
+	static void stop();
+
+	/**
+	 * @brief Returns whether records of a severity are logged at all.
+	 */
+	static bool enabled(int severity)
+	{
+		return severity >= FLAGS_minloglevel;
+	}
+
+	/**
+	 * @brief Returns true for one in sample_every calls on each thread.
+	 */
+	static bool sample();
+
+	/**
+	 * @brief Returns the number of records dropped because a ring was full.
+	 */
+	static uint64_t dropped();
+};
+
+/**
+ * @class LogLine
+ * @brief One record of a HOT_LOG statement, committed when it is destroyed.
+ */
+class LogLine
+{
+public:
+	LogLine(int severity, const char *file, int line);
+	~LogLine();
+
+	LogLine(const LogLine &) = delete;
+	LogLine &operator=(const LogLine &) = delete;
+
+	std::ostream &stream()
+	{
+		return *stream_;
+	}
+
+private:
+	std::ostream *stream_;
+	LogRecord *record_;
+	LogRing *ring_; // Null if the record is written synchronously
+};
+
+/**
+ * @brief Logs like LOG(severity), but through AsyncLog. Meant for records
+ * on the request path: connects, disconnects, failed sends, malformed
+ * requests. Severities under HOT_LOG_MIN_SEVERITY cost nothing, and the
+ * streamed values are only evaluated if the record is logged.
+ */
+#define HOT_LOG(severity)                                                        \
+	if (!(google::GLOG_##severity >= HOT_LOG_MIN_SEVERITY &&                     \
+	      AsyncLog::enabled(google::GLOG_##severity))) {                         \
+	} else                                                                       \
+		LogLine(google::GLOG_##severity, __FILE__, __LINE__).stream()
+
+/**
+ * @brief Like HOT_LOG, but only logs one in every sample_every records of
+ * the calling thread, for records written once per packet.
+ */
+#define HOT_LOG_SAMPLED(severity)                                                \
+	if (!(google::GLOG_##severity >= HOT_LOG_MIN_SEVERITY &&                     \
+	      AsyncLog::enabled(google::GLOG_##severity) && AsyncLog::sample())) {   \
+	} else                                                                       \
+		LogLine(google::GLOG_##severity, __FILE__, __LINE__).stream()
+
+#endif // ASYNC_LOG_H_
@@ -0,0 +1,64 @@
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "protocol.h" // For SharedPayload, MAX_PACKET_SIZE
+
+/**
+ * @struct BufferPoolStats
+ * @brief What the calling thread's pool has handed out since it started.
+ */
+struct BufferPoolStats {
+	uint64_t hits = 0;     // Buffers and blocks reused from the pool
+	uint64_t misses = 0;   // Ones that had to be allocated
+	uint64_t released = 0; // Ones freed because their free list was full
+};
+
+/**
+ * @class BufferPool
+ * @brief Recycles payload buffers per thread, so that encoding and sending
+ * a message costs no allocation once a thread has warmed up.
+ *
+ * Buffers come in size classes from 64 bytes up to MAX_PACKET_SIZE, each
+ * with a free list of its own. take() hands out a buffer with at least the
+ * requested capacity, and share() turns a finished payload into a
+ * SharedPayload that returns the buffer to a pool when the last frame
+ * referencing it is released, which is once it has been written to every
+ * recipient. The reference count of a SharedPayload is allocated from the
+ * pool as well.
+ *
+ * Every thread has a pool of its own, so nothing here takes a lock. A
+ * buffer goes back to the pool of the thread that releases it, which for a
+ * message sent to a client of another shard is that shard's thread. Free
+ * lists are bounded, so the pools hold on to a few MiB at most.
+ */
+class BufferPool
+{
+public:
+	/**
+	 * @brief Returns an empty string with at least the given capacity.
+	 * Larger ones than MAX_PACKET_SIZE are allocated and never pooled.
+	 */
+	static std::string take(size_t capacity);
+
+	/**
+	 * @brief Hands a buffer back, e.g. a payload that was decoded and is no
+	 * longer needed.
+	 */
+	static void give(std::string &&buffer);
+
+	/**
+	 * @brief Wraps a payload for frames that may be sent to many clients,
+	 * and returns its buffer to a pool when the last of them is released.
+	 */
+	static SharedPayload share(std::string &&payload);
+
+	/**
+	 * @brief Returns the counts of the calling thread's pool.
+	 */
+	static BufferPoolStats stats();
+};
+
+#endif // BUFFER_POOL_H_
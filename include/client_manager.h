@@ -2,14 +2,16 @@
 #ifndef CLIENT_MANAGER_H_
 #define CLIENT_MANAGER_H_
 
-#include <map>
-#include <mutex>
 #include <vector>
 #include <string>
-#include <atomic>
+#include <cstdint>
 #include <optional>
+#include <functional>
+#include <atomic>
 #include "client_info.h"
-#include "protocol.h"       // For Packet
+#include "client_registry.h"
+#include "protocol.h"       // For Packet, OutboundFrame
+#include "async_log.h"      // For HOT_LOG
 #include <arpa/inet.h>      // For htonl, ntohl
 #include <unistd.h>         // For close
 #include <glog/logging.h>
@@ -19,34 +21,48 @@
  * @brief A thread-safe class to manage all connected clients.
  *
  * This class handles adding, removing, and finding clients, as well as
- * sending messages to specific clients.
+ * sending messages to specific clients. Clients are kept in a
+ * ClientRegistry, so finding one never takes a lock.
  */
 class ClientManager {
 public:
-    ClientManager() : next_client_id_(1) {} // Start IDs from 1
+    ClientManager() : ClientManager(1, 1) {} // Start IDs from 1
+
+    /**
+     * @brief Creates a manager that hands out every id_stride-th ID.
+     * Several managers with the same stride and distinct first IDs never
+     * assign the same ID, so the owner of an ID can be computed from it.
+     * @param first_id The first client_id to assign.
+     * @param id_stride The distance between consecutive IDs.
+     */
+    ClientManager(uint64_t first_id, uint64_t id_stride)
+        : clients_(first_id, id_stride) {}
 
     /**
      * @brief Adds a new client to the manager.
      * @param socket_fd The new client's socket file descriptor.
      * @param ip_address The new client's IP address.
      * @param port The new client's port.
-     * @return The unique client_id assigned to this client.
+     * @return The unique client_id assigned to this client, or 0 if the
+     * manager is full.
      */
-    int add_client(int socket_fd, const std::string& ip_address, int port) {
-        int client_id = next_client_id_.fetch_add(1);
-
-        ClientInfo new_client;
-        new_client.client_id = client_id;
-        new_client.socket_fd = socket_fd;
-        new_client.ip_address = ip_address;
-        new_client.port = port;
+    uint64_t add_client(int socket_fd, const std::string& ip_address, int port) {
+        uint64_t client_id = clients_.insert(socket_fd, ip_address, port);
+        if (client_id == 0) {
+            HOT_LOG(ERROR) << "[ClientManager] Cannot accept FD " << socket_fd
+                           << ": all " << ClientRegistry::capacity()
+                           << " client slots are in use.";
+            return 0;
+        }
 
-        std::lock_guard<std::mutex> lock(clients_mutex_);
-        clients_[client_id] = new_client;
+        version_.fetch_add(1, std::memory_order_release);
+        if (presence_listener_) {
+            presence_listener_(ClientInfo{client_id, socket_fd, ip_address, port}, true);
+        }
 
-        LOG(INFO) << "[ClientManager] Client " << client_id << " (FD: "
-                  << socket_fd << ", IP: " << ip_address << ":" << port
-                  << ") connected.";
+        HOT_LOG(INFO) << "[ClientManager] Client " << client_id << " (FD: "
+                      << socket_fd << ", IP: " << ip_address << ":" << port
+                      << ") connected.";
         return client_id;
     }
 
@@ -55,19 +71,20 @@ public:
      * Also closes the client's socket.
      * @param client_id The ID of the client to remove.
      */
-    void remove_client(int client_id) {
-        std::lock_guard<std::mutex> lock(clients_mutex_);
-
-        auto it = clients_.find(client_id);
-        if (it != clients_.end()) {
+    void remove_client(uint64_t client_id) {
+        int socket_fd;
+        if (clients_.erase(client_id, socket_fd)) {
+            version_.fetch_add(1, std::memory_order_release);
+            if (presence_listener_) {
+                presence_listener_(ClientInfo{client_id, socket_fd, "", 0}, false);
+            }
             // Close the socket when removing the client
-            close(it->second.socket_fd);
-            LOG(INFO) << "[ClientManager] Client " << client_id
-                      << " (FD: " << it->second.socket_fd << ") disconnected.";
-            clients_.erase(it);
+            close(socket_fd);
+            HOT_LOG(INFO) << "[ClientManager] Client " << client_id
+                          << " (FD: " << socket_fd << ") disconnected.";
         } else {
-            LOG(WARNING) << "[ClientManager] Attempted to remove non-existent client ID: "
-                         << client_id;
+            HOT_LOG(WARNING) << "[ClientManager] Attempted to remove non-existent client ID: "
+                             << client_id;
         }
     }
 
@@ -77,26 +94,102 @@ public:
      * @return An std::optional<ClientInfo> containing the client's info if
      * found, otherwise std::nullopt.
      */
-    std::optional<ClientInfo> get_client(int client_id) {
-        std::lock_guard<std::mutex> lock(clients_mutex_);
-        auto it = clients_.find(client_id);
-        if (it != clients_.end()) {
-            return it->second;
+    std::optional<ClientInfo> get_client(uint64_t client_id) const {
+        ClientInfo info;
+        if (clients_.find(client_id, info)) {
+            return info;
         }
         return std::nullopt;
     }
 
+    /**
+     * @brief Checks whether a client is connected, without copying its
+     * information.
+     * @param client_id The ID of the client to find.
+     * @return True if the client is connected.
+     */
+    bool has_client(uint64_t client_id) const {
+        return clients_.find_socket(client_id) >= 0;
+    }
+
+    /**
+     * @brief Returns a counter that changes whenever a client is added or
+     * removed, so a copy of the client list can tell when it is stale.
+     * A list taken after reading the version is at least that new.
+     */
+    uint64_t version() const {
+        return version_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Records the payload codec and compression a client negotiated.
+     * @param client_id The ID of the client.
+     * @param format The format of packets sent to the client.
+     * @return True if the client was found.
+     */
+    bool set_client_format(uint64_t client_id, WireFormat format) {
+        return clients_.set_format(client_id, format);
+    }
+
+    /**
+     * @brief Gets the payload codec and compression a client negotiated.
+     * @param client_id The ID of the client.
+     * @return The client's format, or the default WireFormat if it is
+     * unknown.
+     */
+    WireFormat get_client_format(uint64_t client_id) const {
+        WireFormat format;
+        clients_.find_socket(client_id, format);
+        return format;
+    }
+
     /**
      * @brief Gets a list of all currently connected clients.
-     * @return A std::vector containing the ClientInfo for all clients.
+     * @return A std::vector containing the ClientInfo for all clients,
+     * ordered by ID.
      */
-    std::vector<ClientInfo> get_all_clients() {
-        std::lock_guard<std::mutex> lock(clients_mutex_);
-        std::vector<ClientInfo> client_list;
-        for (const auto& pair : clients_) {
-            client_list.push_back(pair.second);
-        }
-        return client_list;
+    std::vector<ClientInfo> get_all_clients() const {
+        return clients_.snapshot();
+    }
+
+    /**
+     * @brief Calls visit(const ClientRegistry::Entry&) for every client,
+     * in no particular order, without locking or allocating.
+     * @param visit The function to call.
+     */
+    template <typename Visitor>
+    void for_each_client(Visitor&& visit) const {
+        clients_.for_each(std::forward<Visitor>(visit));
+    }
+
+    /**
+     * @brief Returns the number of connected clients.
+     */
+    size_t client_count() const {
+        return clients_.size();
+    }
+
+    /**
+     * @brief Routes outgoing frames through a custom writer, such as an
+     * event loop's I/O backend, instead of a blocking sendmsg() on the
+     * client's socket. Must not be changed while other threads send.
+     * @param writer Called with the client's socket and the encoded frame;
+     * returns false on failure. An empty writer restores sendmsg().
+     */
+    void set_frame_writer(std::function<bool(int, const OutboundFrame&)> writer) {
+        frame_writer_ = std::move(writer);
+    }
+
+    /**
+     * @brief Sets a function to be told about every client added or removed,
+     * once the change is visible to lookups. Must not be changed while
+     * other threads add or remove clients.
+     * @param listener Called with the client and true from add_client(), or
+     * with only client_id and socket_fd set and false from remove_client().
+     * An empty listener turns the notifications off.
+     */
+    void set_presence_listener(std::function<void(const ClientInfo&, bool)> listener) {
+        presence_listener_ = std::move(listener);
     }
 
     /**
@@ -106,21 +199,28 @@ public:
      * @return True if send was successful (or at least attempted), false if
      * client was not found.
      */
-    bool send_to_client(int client_id, const Packet& pkt) {
-        std::optional<ClientInfo> client = get_client(client_id);
-        if (!client) {
-            LOG(WARNING) << "[ClientManager] Failed to send: Client ID "
-                         << client_id << " not found.";
-            return false;
+    bool send_to_client(uint64_t client_id, const Packet& pkt) {
+        if (frame_writer_ || pkt.compression != FrameCompression::NONE) {
+            // The writer may queue the frame, so it needs its own payload,
+            // as does a payload that gets compressed
+            return send_frame(client_id, make_frame(pkt.type, pkt.content, pkt.codec,
+                                                    pkt.correlation_id, pkt.compression));
         }
 
-        std::vector<char> message_stream = create_message_stream(pkt);
+        int socket_fd = clients_.find_socket(client_id);
+        if (socket_fd < 0) {
+            HOT_LOG(WARNING) << "[ClientManager] Failed to send: Client ID "
+                             << client_id << " not found.";
+            return false;
+        }
 
         // Note: This send operation is blocking and is done while holding
-        // no locks on the manager, which is good.
-        if (send(client->socket_fd, message_stream.data(), message_stream.size(), 0) < 0) {
-            LOG(ERROR) << "[ClientManager] Failed to send message to Client ID "
-                       << client_id << " (FD: " << client->socket_fd << ")";
+        // no locks on the manager, which is good. The header is encoded on
+        // the stack and the content is sent in place.
+        if (!write_packet(socket_fd, pkt.type, pkt.content, pkt.codec,
+                          pkt.correlation_id)) {
+            HOT_LOG(ERROR) << "[ClientManager] Failed to send message to Client ID "
+                           << client_id << " (FD: " << socket_fd << ")";
             // We might want to trigger a removal here, but for now we'll let
             // the client's own handler thread detect the disconnect.
             return false;
@@ -128,10 +228,89 @@ public:
         return true;
     }
 
+    /**
+     * @brief Sends an encoded frame to a specific client. The frame's payload
+     * is shared, so the same frame can be sent to many clients without
+     * copying it.
+     * @param client_id The ID of the target client.
+     * @param frame The frame to send.
+     * @return True if send was successful (or at least attempted), false if
+     * client was not found.
+     */
+    bool send_frame(uint64_t client_id, const OutboundFrame& frame) {
+        int socket_fd = clients_.find_socket(client_id);
+        if (socket_fd < 0) {
+            HOT_LOG(WARNING) << "[ClientManager] Failed to send: Client ID "
+                             << client_id << " not found.";
+            return false;
+        }
+
+        bool sent = frame_writer_ ? frame_writer_(socket_fd, frame)
+                                  : write_frame(socket_fd, frame);
+        if (!sent) {
+            HOT_LOG(ERROR) << "[ClientManager] Failed to send message to Client ID "
+                           << client_id << " (FD: " << socket_fd << ")";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sends a client the frame encoded in the codec it negotiated,
+     * compressed if it negotiated that too.
+     * @param client_id The ID of the target client.
+     * @param frames The message in every codec.
+     * @return True if send was successful (or at least attempted), false if
+     * client was not found.
+     */
+    bool send_frame(uint64_t client_id, const FrameSet& frames) {
+        WireFormat format;
+        int socket_fd = clients_.find_socket(client_id, format);
+        if (socket_fd < 0) {
+            HOT_LOG(WARNING) << "[ClientManager] Failed to send: Client ID "
+                             << client_id << " not found.";
+            return false;
+        }
+
+        const OutboundFrame& frame = frames.for_format(format);
+        bool sent = frame_writer_ ? frame_writer_(socket_fd, frame)
+                                  : write_frame(socket_fd, frame);
+        if (!sent) {
+            HOT_LOG(ERROR) << "[ClientManager] Failed to send message to Client ID "
+                           << client_id << " (FD: " << socket_fd << ")";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sends one message to every client, except possibly one. Each
+     * client gets the frame in its own codec and compression, and all
+     * recipients of a WireFormat share that frame's payload.
+     * @param frames The message in every codec.
+     * @param exclude_id A client to skip, or 0 to skip none.
+     * @return The number of clients the frame was sent or queued to.
+     */
+    size_t broadcast(const FrameSet& frames, uint64_t exclude_id = 0) {
+        size_t sent = 0;
+        clients_.for_each([&](const ClientRegistry::Entry& client) {
+            if (client.client_id == exclude_id) {
+                return;
+            }
+            const OutboundFrame& frame = frames.for_format(client.format);
+            if (frame_writer_ ? frame_writer_(client.socket_fd, frame)
+                              : write_frame(client.socket_fd, frame)) {
+                sent++;
+            }
+        });
+        return sent;
+    }
+
 private:
-    std::map<int, ClientInfo> clients_; // Map from client_id to ClientInfo
-    std::mutex clients_mutex_;           // Mutex to protect the clients_ map
-    std::atomic<uint64_t> next_client_id_;  // Atomic counter for unique client IDs
+    ClientRegistry clients_; // Slot table indexed by client_id
+    std::atomic<uint64_t> version_{0}; // Bumped by add_client() and remove_client()
+    std::function<bool(int, const OutboundFrame&)> frame_writer_; // Optional transport
+    std::function<void(const ClientInfo&, bool)> presence_listener_; // Optional observer
 };
 
 #endif // CLIENT_MANAGER_H_
\ No newline at end of file
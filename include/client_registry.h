@@ -0,0 +1,183 @@
+#ifndef CLIENT_REGISTRY_H_
+#define CLIENT_REGISTRY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "client_info.h"
+#include "packet.h"       // For WireFormat
+
+/**
+ * @class ClientRegistry
+ * @brief A dense, fixed-capacity table of clients with lock-free lookups.
+ *
+ * Clients live in an array of slots. A client's ID is a handle that encodes
+ * its slot and the slot's generation, so looking it up is an index
+ * computation followed by a comparison: no lock, no search and no
+ * allocation. When a slot is reused its generation changes, and the IDs
+ * handed out for earlier occupants no longer match.
+ *
+ * IDs are laid out as first_id + id_stride * (generation * capacity + slot),
+ * so registries that share a stride and use distinct first IDs never assign
+ * the same ID. Slots that were never used are filled before freed ones are
+ * reused, which keeps the first IDs small and sequential.
+ *
+ * Lookups may run on any thread at any time. Insertions and removals are
+ * serialized internally; they never block lookups. A lookup that races with
+ * the removal of the same client may still find it.
+ */
+class ClientRegistry
+{
+public:
+	/**
+	 * @struct Entry
+	 * @brief What a visitor is told about a client, without allocating.
+	 */
+	struct Entry {
+		uint64_t client_id;
+		int socket_fd;
+		uint32_t ipv4; // Network byte order
+		int port;
+		WireFormat format;
+	};
+
+	/**
+	 * @brief Creates an empty registry.
+	 * @param first_id The ID of the first client.
+	 * @param id_stride The distance between consecutive IDs.
+	 */
+	ClientRegistry(uint64_t first_id, uint64_t id_stride);
+	~ClientRegistry();
+
+	ClientRegistry(const ClientRegistry &) = delete;
+	ClientRegistry &operator=(const ClientRegistry &) = delete;
+
+	/**
+	 * @brief Adds a client.
+	 * @param socket_fd The client's socket file descriptor.
+	 * @param ip_address The client's IPv4 address in dotted notation.
+	 * @param port The client's port.
+	 * @return The client's ID, or 0 if every slot is taken.
+	 */
+	uint64_t insert(int socket_fd, const std::string &ip_address, int port);
+
+	/**
+	 * @brief Removes a client.
+	 * @param client_id The ID of the client to remove.
+	 * @param socket_fd Receives the removed client's socket.
+	 * @return True if the client was found and removed.
+	 */
+	bool erase(uint64_t client_id, int &socket_fd);
+
+	/**
+	 * @brief Records the wire format a client negotiated. New clients start
+	 * with a default WireFormat: JSON, uncompressed.
+	 * @param client_id The ID of the client.
+	 * @param format The format to use for the client.
+	 * @return True if the client was found.
+	 */
+	bool set_format(uint64_t client_id, WireFormat format);
+
+	/**
+	 * @brief Looks up a client's socket without locking or allocating.
+	 * @param client_id The ID of the client to find.
+	 * @return The client's socket, or -1 if there is no such client.
+	 */
+	int find_socket(uint64_t client_id) const;
+
+	/**
+	 * @brief Looks up a client's socket and wire format without locking or
+	 * allocating.
+	 * @param client_id The ID of the client to find.
+	 * @param format Receives the client's format if found.
+	 * @return The client's socket, or -1 if there is no such client.
+	 */
+	int find_socket(uint64_t client_id, WireFormat &format) const;
+
+	/**
+	 * @brief Looks up everything known about a client.
+	 * @param client_id The ID of the client to find.
+	 * @param info Receives the client's information if found.
+	 * @return True if the client was found.
+	 */
+	bool find(uint64_t client_id, ClientInfo &info) const;
+
+	/**
+	 * @brief Calls visit(const Entry &) for every client, in slot order,
+	 * without locking or allocating.
+	 * @param visit The function to call.
+	 */
+	template <typename Visitor>
+	void for_each(Visitor &&visit) const;
+
+	/**
+	 * @brief Lists every client, ordered by ID.
+	 */
+	std::vector<ClientInfo> snapshot() const;
+
+	/**
+	 * @brief Returns the number of clients.
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Returns the largest number of clients the registry can hold.
+	 */
+	static size_t capacity();
+
+private:
+	// The fields of an occupied slot are only trusted if the slot's ID is
+	// the same before and after reading them
+	struct Slot {
+		std::atomic<uint64_t> id{0}; // 0 while the slot is free
+		std::atomic<int> socket_fd{-1};
+		std::atomic<uint32_t> ipv4{0}; // Network byte order
+		std::atomic<int> port{0};
+		std::atomic<uint8_t> codec{0}; // A PayloadCodec
+		std::atomic<uint8_t> compression{0}; // A FrameCompression
+		uint64_t generation = 0;      // Writers only
+	};
+
+	struct SlotData {
+		int socket_fd;
+		uint32_t ipv4;
+		int port;
+		WireFormat format;
+	};
+
+	const Slot *slot_for(uint64_t client_id) const;
+	bool read_slot(const Slot &slot, uint64_t client_id, SlotData &data) const;
+	Slot &slot_at(uint32_t index);
+	const Slot &slot_at(uint32_t index) const;
+	ClientInfo to_info(uint64_t client_id, const SlotData &data) const;
+
+	const uint64_t first_id_;
+	const uint64_t id_stride_;
+
+	// Slots are allocated in chunks that never move, so readers can index
+	// them while a writer adds more
+	std::vector<std::atomic<Slot *>> chunks_;
+	std::atomic<uint32_t> slots_used_; // Slots ever occupied, a prefix
+	std::atomic<size_t> size_;
+
+	std::mutex writer_mutex_;          // Serializes insert(), erase() and set_format()
+	std::vector<uint32_t> free_slots_; // Writers only
+};
+
+template <typename Visitor>
+void ClientRegistry::for_each(Visitor &&visit) const
+{
+	uint32_t used = slots_used_.load(std::memory_order_acquire);
+	for (uint32_t index = 0; index < used; index++) {
+		const Slot &slot = slot_at(index);
+		uint64_t client_id = slot.id.load(std::memory_order_acquire);
+		SlotData data;
+		if (client_id != 0 && read_slot(slot, client_id, data)) {
+			visit(Entry{client_id, data.socket_fd, data.ipv4, data.port, data.format});
+		}
+	}
+}
+
+#endif // CLIENT_REGISTRY_H_
@@ -0,0 +1,52 @@
+#ifndef EPOLL_LOOP_H_
+#define EPOLL_LOOP_H_
+
+#include <unordered_map>
+#include "event_loop.h"
+
+/**
+ * @class EpollLoop
+ * @brief An edge-triggered epoll reactor.
+ *
+ * Each readable socket is drained with recv() calls into a buffer shared by
+ * all connections, up to a fixed number of reads per iteration. Client
+ * sockets are non-blocking: frames queued during an iteration are written
+ * with one sendmsg() per connection at its end, and a connection whose
+ * socket buffer is full waits for EPOLLOUT.
+ */
+class EpollLoop : public EventLoop
+{
+public:
+	EpollLoop(int listen_fd, EventLoopCallbacks callbacks);
+	~EpollLoop() override;
+
+	bool init() override;
+	void run(const std::atomic<bool> &running) override;
+	bool send_frame(int socket_fd, const OutboundFrame &frame) override;
+
+private:
+	struct EpollConnection : Connection {
+		bool writable = true;         // No EAGAIN since the last EPOLLOUT
+		bool flush_scheduled = false; // Queued in flush_list_
+		bool read_pending = false;    // Queued in read_list_
+	};
+
+	void accept_connections();
+	void handle_readable(int socket_fd);
+	void handle_writable(int socket_fd);
+	void schedule_flush(int socket_fd, EpollConnection &conn);
+	void flush_sends();
+	bool write_queued(int socket_fd, EpollConnection &conn);
+	void close_connection(int socket_fd);
+
+	int epoll_fd_;
+	int spare_fd_; // Reserved descriptor used to shed connections on EMFILE
+	std::unordered_map<int, EpollConnection> connections_; // Keyed by socket fd
+	std::vector<char> read_buffer_;                        // Shared by all connections
+	std::vector<int> read_list_;           // Sockets left unread by the read budget
+	std::vector<int> flush_list_;          // Sockets to write at the end of the turn
+	std::vector<int> flushing_;            // flush_list_ while flush_sends() walks it
+	std::vector<struct iovec> write_iov_; // Shared by all connections
+};
+
+#endif // EPOLL_LOOP_H_
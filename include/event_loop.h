@@ -0,0 +1,173 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "frame_decoder.h"
+#include "mpsc_queue.h"
+#include "outbound_queue.h"
+#include "packet.h"
+#include "protocol.h"
+
+/**
+ * @struct EventLoopCallbacks
+ * @brief Hooks the event loop uses to hand connection events to the server.
+ */
+struct EventLoopCallbacks {
+	// A new connection was accepted. Returns the client_id assigned to it,
+	// or 0 to refuse the connection, which the loop then closes.
+	std::function<uint64_t(int socket_fd, const std::string &ip_address, int port)> on_accept;
+	// A complete packet was decoded. The view is only valid during the call.
+	// Returns false to close the connection.
+	std::function<bool(uint64_t client_id, const PacketView &pkt)> on_packet;
+	// The connection was closed by the peer, by an error or by on_packet.
+	std::function<void(uint64_t client_id)> on_close;
+};
+
+/**
+ * @enum IoBackend
+ * @brief The kernel interface an event loop uses for socket I/O.
+ */
+enum class IoBackend {
+	EPOLL,    // Readiness notification with one recv()/send() per operation
+	IO_URING  // Multishot recv into provided buffers, batched submissions
+};
+
+/**
+ * @struct IoStats
+ * @brief Counters kept by an event loop. Only the loop thread updates them,
+ * so read them after run() has returned.
+ */
+struct IoStats {
+	uint64_t frames_in = 0;  // Packets decoded from clients
+	uint64_t frames_out = 0; // Frames handed to send_frame()
+	uint64_t syscalls = 0;   // System calls made by the loop thread
+	uint64_t overflows = 0;  // Connections dropped for exceeding the outbound limit
+};
+
+// Unsent bytes a connection may have queued before it is dropped
+const size_t DEFAULT_OUTBOUND_LIMIT = 4 * 1024 * 1024;
+
+/**
+ * @class EventLoop
+ * @brief A reactor that owns a listening socket and every client socket
+ * accepted on it.
+ *
+ * All sockets are served from the thread that calls run(). Incoming bytes are
+ * decoded without blocking and every complete packet is passed to
+ * EventLoopCallbacks::on_packet. An idle connection holds no buffer memory.
+ *
+ * Outgoing frames are queued on their connection and written without
+ * blocking, coalesced into one gathering write per connection and loop
+ * iteration. A connection whose queue grows past the outbound limit is
+ * closed, so a client that stops reading cannot hold up the others.
+ *
+ * Other threads hand work to the loop with post(). Several loops, each with
+ * its own listening socket, can run side by side on different threads.
+ */
+class EventLoop
+{
+public:
+	/**
+	 * @brief Creates an event loop using the given I/O backend.
+	 * @param backend The kernel interface to use.
+	 * @param listen_fd A bound, listening, non-blocking socket.
+	 * @param callbacks The hooks used to report connection events.
+	 * @return The new loop. It must be initialized with init().
+	 */
+	static std::unique_ptr<EventLoop> create(IoBackend backend, int listen_fd,
+	                                         EventLoopCallbacks callbacks);
+
+	virtual ~EventLoop();
+
+	EventLoop(const EventLoop &) = delete;
+	EventLoop &operator=(const EventLoop &) = delete;
+
+	/**
+	 * @brief Sets up the kernel objects and registers the listening socket.
+	 * @return True on success, false on failure.
+	 */
+	virtual bool init() = 0;
+
+	/**
+	 * @brief Runs the reactor until running becomes false.
+	 * @param running Flag checked at least once per second.
+	 */
+	virtual void run(const std::atomic<bool> &running) = 0;
+
+	/**
+	 * @brief Queues an encoded frame for a client socket served by this loop.
+	 * The payload is sent from the frame's shared buffer without copying.
+	 * Never blocks. Must be called on the loop thread.
+	 * @param socket_fd The client socket.
+	 * @param frame The frame to send.
+	 * @return True if the frame was queued, false if the socket is unknown or
+	 * its queue is full, in which case the connection is closed.
+	 */
+	virtual bool send_frame(int socket_fd, const OutboundFrame &frame) = 0;
+
+	/**
+	 * @brief Sets how many unsent bytes a connection may have queued.
+	 * Call before run().
+	 * @param bytes The per-connection limit.
+	 */
+	void set_outbound_limit(size_t bytes);
+
+	/**
+	 * @brief Queues a task to run on the loop thread and wakes the loop.
+	 * Safe to call from any thread; never blocks on a lock.
+	 * @param task The task to run.
+	 */
+	void post(std::function<void()> task);
+
+	/**
+	 * @brief Checks whether the caller is the thread running this loop.
+	 * @return True if called from inside run().
+	 */
+	bool in_loop_thread() const;
+
+	/**
+	 * @brief Returns the loop's I/O counters.
+	 */
+	const IoStats &stats() const;
+
+protected:
+	struct Connection {
+		uint64_t client_id = 0;
+		// Holds the bytes of a packet that spans reads. Empty (and
+		// unallocated) whenever the connection is idle.
+		FrameDecoder decoder;
+		// Frames not yet written, at most outbound_limit_ bytes
+		OutboundQueue outbound;
+		// Set when the queue overflowed; the connection is closed once the
+		// current callbacks have returned
+		bool overflowed = false;
+	};
+
+	EventLoop(int listen_fd, EventLoopCallbacks callbacks);
+
+	bool create_wakeup_fd();
+	void mark_loop_thread();
+	bool consume(Connection &conn, const char *data, size_t len);
+	void peer_closed(const Connection &conn);
+	bool queue_frame(Connection &conn, const OutboundFrame &frame);
+	void run_posted_tasks();
+
+	int listen_fd_;
+	int wakeup_fd_; // eventfd signalled by post()
+	EventLoopCallbacks callbacks_;
+	IoStats stats_;
+	size_t outbound_limit_;
+
+private:
+	MpscQueue<std::function<void()>> posted_tasks_;
+	std::atomic<bool> wakeup_pending_;
+	std::atomic<std::thread::id> loop_thread_;
+};
+
+#endif // EVENT_LOOP_H_
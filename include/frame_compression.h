@@ -0,0 +1,45 @@
+#ifndef FRAME_COMPRESSION_H_
+#define FRAME_COMPRESSION_H_
+
+#include <string>
+#include <string_view>
+#include "packet.h"
+
+/*
+ * Optional compression of frame payloads.
+ *
+ * A compressed frame has PAYLOAD_COMPRESSED set in its codec byte. Its
+ * payload starts with a small header and holds the original payload as one
+ * LZ4 block:
+ *
+ *   u8 FrameCompression, u32 original length (big-endian), LZ4 block
+ *
+ * With FrameCompression::LZ4_DICT the block is compressed as if a built-in
+ * dictionary of common JSON members and values preceded the payload, so
+ * even short messages find matches. The dictionary is part of the protocol
+ * and must never change; a new one needs a new FrameCompression value.
+ *
+ * Payloads shorter than a few hundred bytes are not worth the CPU and are
+ * always sent as they are, as are payloads that do not get smaller.
+ */
+
+/**
+ * @brief Compresses a payload.
+ * @param payload The payload to compress.
+ * @param mode The compression to use.
+ * @param out Receives the compressed payload, header included.
+ * @return True if out holds a payload smaller than the original, false if
+ * the payload should be sent as it is.
+ */
+bool compress_payload(std::string_view payload, FrameCompression mode, std::string &out);
+
+/**
+ * @brief Restores a payload compressed by compress_payload().
+ * @param payload The compressed payload, header included.
+ * @param out Receives the original payload.
+ * @return True on success, false if the payload is malformed or would grow
+ * beyond the largest payload a packet can carry.
+ */
+bool decompress_payload(std::string_view payload, std::string &out);
+
+#endif // FRAME_COMPRESSION_H_
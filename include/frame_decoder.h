@@ -0,0 +1,101 @@
+#ifndef FRAME_DECODER_H_
+#define FRAME_DECODER_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h> // For ssize_t
+#include "packet.h"
+#include "protocol.h"  // For FrameError
+
+/**
+ * @enum DecodeStatus
+ * @brief Result of asking a FrameDecoder for the next packet.
+ */
+enum class DecodeStatus {
+	PACKET,    // A complete packet was decoded
+	NEED_MORE, // The buffered bytes end in the middle of a packet
+	INVALID    // The stream is corrupt; the connection should be dropped
+};
+
+/**
+ * @class FrameDecoder
+ * @brief Incremental, per-connection decoder for the length-prefixed stream.
+ *
+ * Bytes go in either with feed(), for callers that own their receive buffer,
+ * or with read_from(), which takes as many bytes as the socket has in one
+ * recv(). next() then yields every complete packet in the buffered bytes,
+ * pipelined ones included, as views that point into the buffer.
+ *
+ * feed() borrows the caller's bytes and only copies the tail of a packet that
+ * is still incomplete, so a connection that is not in the middle of a packet
+ * holds no memory.
+ *
+ * Compressed payloads are decompressed by next() into a buffer of the
+ * decoder, so the views it returns are always uncompressed.
+ */
+class FrameDecoder
+{
+public:
+	FrameDecoder() = default;
+
+	FrameDecoder(const FrameDecoder &) = delete;
+	FrameDecoder &operator=(const FrameDecoder &) = delete;
+	FrameDecoder(FrameDecoder &&) = default;
+	FrameDecoder &operator=(FrameDecoder &&) = default;
+
+	/**
+	 * @brief Makes received bytes available to next().
+	 * The bytes are borrowed until finish() is called.
+	 * @param data The received bytes.
+	 * @param len The number of received bytes.
+	 */
+	void feed(const char *data, size_t len);
+
+	/**
+	 * @brief Ends a feed(): keeps a copy of any incomplete packet and
+	 * releases the buffer if nothing is left.
+	 */
+	void finish();
+
+	/**
+	 * @brief Reads as many bytes as the socket has available with one recv().
+	 * Views returned earlier are invalidated.
+	 * @param socket The socket file descriptor.
+	 * @return The number of bytes read, 0 on disconnect, -1 on error.
+	 */
+	ssize_t read_from(int socket);
+
+	/**
+	 * @brief Decodes the next complete packet.
+	 * @param pkt Receives the packet. Its content stays valid until the next
+	 * call to feed(), finish() or read_from(), or, if the payload was
+	 * compressed, until the next call to next().
+	 * @return The outcome; pkt is only set for DecodeStatus::PACKET.
+	 */
+	DecodeStatus next(PacketView &pkt);
+
+	/**
+	 * @brief Checks whether bytes of an incomplete packet are buffered.
+	 */
+	bool has_partial() const;
+
+	/**
+	 * @brief Returns why next() last reported DecodeStatus::INVALID.
+	 */
+	FrameError error() const;
+
+private:
+	void append(const char *data, size_t len);
+	void compact();
+
+	std::vector<char> buffer_; // Owned bytes, live in [begin_, end_)
+	size_t begin_ = 0;
+	size_t end_ = 0;
+	const char *input_ = nullptr; // Borrowed bytes from feed()
+	size_t input_len_ = 0;
+	size_t input_pos_ = 0;
+	std::string inflated_; // Payload of the last compressed packet
+	FrameError error_ = FrameError::NONE;
+};
+
+#endif // FRAME_DECODER_H_
@@ -28,6 +28,16 @@ public:
 		google::InstallFailureSignalHandler();
 	}
 
+	/**
+	 * @brief Prints only warnings and errors to stderr. Writing every INFO
+	 * record to a terminal, in color, costs more than the log files.
+	 */
+	void quiet_stderr()
+	{
+		FLAGS_alsologtostderr = false;
+		FLAGS_stderrthreshold = google::GLOG_WARNING;
+	}
+
 	~GlogWrapper()
 	{
 		google::ShutdownGoogleLogging();
@@ -0,0 +1,63 @@
+#ifndef GROUP_DIRECTORY_H_
+#define GROUP_DIRECTORY_H_
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @class GroupDirectory
+ * @brief Named groups of clients, for fan-out messaging.
+ *
+ * A group's member list is immutable once published: joining or leaving
+ * replaces it with a new list. A sender takes a reference to the current
+ * list under a short lock and then walks it without any lock held, however
+ * many members it has. Empty groups are removed.
+ */
+class GroupDirectory
+{
+public:
+	using MemberList = std::shared_ptr<const std::vector<uint64_t>>;
+
+	/**
+	 * @brief Adds a client to a group, creating the group if needed.
+	 * @param group The group's name.
+	 * @param client_id The client to add. Joining twice has no effect.
+	 * @return The number of members after joining.
+	 */
+	size_t join(const std::string &group, uint64_t client_id);
+
+	/**
+	 * @brief Removes a client from a group.
+	 * @param group The group's name.
+	 * @param client_id The client to remove.
+	 * @return True if the client was a member.
+	 */
+	bool leave(const std::string &group, uint64_t client_id);
+
+	/**
+	 * @brief Removes a client from every group it joined.
+	 * @param client_id The client to remove.
+	 */
+	void leave_all(uint64_t client_id);
+
+	/**
+	 * @brief Returns a group's current members.
+	 * @param group The group's name.
+	 * @return The member list, or nullptr if the group does not exist.
+	 */
+	MemberList members(const std::string &group) const;
+
+private:
+	bool remove_member(const std::string &group, uint64_t client_id);
+
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, MemberList> groups_;
+	// The groups each client joined, so that leave_all() need not search
+	std::unordered_map<uint64_t, std::vector<std::string>> memberships_;
+};
+
+#endif // GROUP_DIRECTORY_H_
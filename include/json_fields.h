@@ -0,0 +1,106 @@
+#ifndef JSON_FIELDS_H_
+#define JSON_FIELDS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Most fields one extractor can look for
+#define MAX_JSON_FIELDS 4
+
+/**
+ * @class JsonFieldExtractor
+ * @brief Pulls a few known members out of a flat JSON object in a single
+ * pass, without building a DOM.
+ *
+ * Every payload of the protocol is a small object of strings and unsigned
+ * integers, and a handler needs only some of its members. The extractor
+ * walks the payload once, skipping string contents 16 bytes at a time with
+ * SSE2 where available, and stores the members it was asked for. A string
+ * without escapes is copied into its destination with a single allocation;
+ * a view field allocates nothing.
+ *
+ * Anything unusual makes extract() give up: nested objects or arrays, a
+ * requested member with another type, a repeated member, a negative,
+ * fractional or oversized number, or malformed JSON. The caller then falls
+ * back to the full parser, which also produces the right error. Strings are
+ * taken as bytes; their UTF-8 is not validated.
+ */
+class JsonFieldExtractor
+{
+public:
+	JsonFieldExtractor();
+
+	/**
+	 * @brief Looks for a string member.
+	 * @param name The member's name.
+	 * @param out Receives the unescaped value.
+	 */
+	void add(std::string_view name, std::string &out);
+
+	/**
+	 * @brief Looks for a string member and points into the payload instead
+	 * of copying it. Values with escapes make extract() give up.
+	 * @param name The member's name.
+	 * @param out Receives the value; valid as long as the payload.
+	 */
+	void add(std::string_view name, std::string_view &out);
+
+	/**
+	 * @brief Looks for an unsigned integer member.
+	 * @param name The member's name.
+	 * @param out Receives the value.
+	 */
+	void add(std::string_view name, uint64_t &out);
+
+	/**
+	 * @brief Scans a payload and stores the members that were asked for.
+	 * Outputs of members that are absent are left alone; outputs of present
+	 * members may have been written even if extraction fails.
+	 * @param payload The JSON text.
+	 * @return True if the payload is a plain object and every member found
+	 * has the expected type, false if the caller must use the full parser.
+	 */
+	bool extract(std::string_view payload);
+
+	/**
+	 * @brief Checks whether a member was present in the last payload.
+	 * @param name The member's name, as passed to add().
+	 */
+	bool found(std::string_view name) const;
+
+	/**
+	 * @brief Checks whether every member asked for was present.
+	 */
+	bool found_all() const;
+
+private:
+	enum class FieldType { STRING, VIEW, UNSIGNED };
+
+	struct Field {
+		std::string_view name;
+		FieldType type;
+		void *out;
+		bool found;
+	};
+
+	void add_field(std::string_view name, FieldType type, void *out);
+	Field *find_field(std::string_view name);
+	bool read_string(std::string_view &raw, bool &escaped);
+	bool read_value(Field *field);
+	bool skip_value();
+	bool skip_number();
+	size_t skip_digits();
+	void skip_whitespace();
+
+	Field fields_[MAX_JSON_FIELDS];
+	size_t count_;
+
+	// Scan state during extract()
+	const char *data_;
+	size_t size_;
+	size_t pos_;
+};
+
+#endif // JSON_FIELDS_H_
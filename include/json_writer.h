@@ -0,0 +1,61 @@
+#ifndef JSON_WRITER_H_
+#define JSON_WRITER_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * @class JsonWriter
+ * @brief Appends compact JSON text straight to a string, without building
+ * a DOM.
+ *
+ * Values are written in order and the writer puts the commas between them,
+ * so a large array can be produced while walking its source. The output
+ * matches json::dump() for the same members in the same order. Strings are
+ * escaped like json::dump() does, and bytes that are not valid UTF-8 are
+ * replaced with U+FFFD like json::dump() with error_handler_t::replace
+ * does.
+ */
+class JsonWriter
+{
+public:
+	/**
+	 * @brief Creates a writer that appends to a string.
+	 * @param out The string to append to. Reserve capacity in it up front
+	 * to write without reallocating.
+	 */
+	explicit JsonWriter(std::string &out);
+
+	void begin_object();
+	void end_object();
+	void begin_array();
+	void end_array();
+
+	/**
+	 * @brief Writes the name of the next member of the current object.
+	 */
+	void key(std::string_view name);
+
+	void value(uint64_t number);
+	void value(std::string_view text);
+	void value(bool flag);
+
+	/**
+	 * @brief Writes a member of the current object.
+	 */
+	template <typename T>
+	void member(std::string_view name, const T &value_of_member)
+	{
+		key(name);
+		value(value_of_member);
+	}
+
+private:
+	void separate();
+
+	std::string &out_;
+	bool need_comma_; // A value was completed at the current level
+};
+
+#endif // JSON_WRITER_H_
@@ -0,0 +1,81 @@
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @class LatencyHistogram
+ * @brief Counts values in log-linear buckets, like an HDR histogram with a
+ * precision of one part in 16.
+ *
+ * Values below 16 get a bucket each. Above that every power of two is split
+ * into 16 buckets, so a value is never reported more than 1/16 too high and
+ * the whole uint64_t range fits in under a thousand buckets. Recording a
+ * value is a bit scan, a shift and three stores.
+ *
+ * A histogram has one writer. Its counts are atomics that the writer
+ * updates with relaxed loads and stores instead of locked instructions, so
+ * any thread may read or merge it meanwhile and sees every count whole,
+ * if perhaps a few samples behind.
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	LatencyHistogram(const LatencyHistogram &) = delete;
+	LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+	/**
+	 * @brief Adds a sample. Only the histogram's writer may call it.
+	 * @param value The sample, e.g. a latency in nanoseconds.
+	 */
+	void record(uint64_t value);
+
+	/**
+	 * @brief Adds every sample of another histogram, e.g. of another thread.
+	 * Only this histogram's writer may call it.
+	 * @param other The histogram to add; it may be written meanwhile.
+	 */
+	void merge(const LatencyHistogram &other);
+
+	/**
+	 * @brief Returns the number of samples.
+	 */
+	uint64_t count() const;
+
+	/**
+	 * @brief Returns the sum of the samples.
+	 */
+	uint64_t sum() const;
+
+	/**
+	 * @brief Returns the largest sample, or 0 if there is none.
+	 */
+	uint64_t max() const;
+
+	/**
+	 * @brief Returns the value that a fraction of the samples do not
+	 * exceed, rounded up to the top of its bucket.
+	 * @param fraction The fraction, e.g. 0.99.
+	 * @return The value, or 0 if there are no samples.
+	 */
+	uint64_t percentile(double fraction) const;
+
+private:
+	static const size_t SUB_BUCKETS = 16;
+	// 16 exact buckets, then 16 for each of the powers 2^4 to 2^63
+	static const size_t BUCKET_COUNT = SUB_BUCKETS + (64 - 4) * SUB_BUCKETS;
+
+	static size_t bucket_of(uint64_t value);
+	static uint64_t bucket_top(size_t bucket);
+
+	std::atomic<uint64_t> buckets_[BUCKET_COUNT];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+};
+
+#endif // LATENCY_HISTOGRAM_H_
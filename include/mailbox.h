@@ -0,0 +1,195 @@
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @struct MailboxStats
+ * @brief What a Mailbox has done since it was opened.
+ */
+struct MailboxStats {
+	uint64_t stored = 0;    // Messages kept for offline clients
+	uint64_t delivered = 0; // Of those, messages claimed by a reconnected client
+	uint64_t expired = 0;   // Of those, messages dropped unclaimed
+	uint64_t segments = 0;  // Segment files created
+};
+
+/**
+ * @class Mailbox
+ * @brief Keeps the messages sent to clients while they are disconnected, so
+ * that they can claim them once they reconnect.
+ *
+ * Only clients that asked for a mailbox while connected have one; the
+ * token they were given then proves, after a reconnect under a new ID,
+ * that the old ID was theirs. Tokens come from the kernel's CSPRNG, so
+ * the tokens a client is given tell nothing about anyone else's.
+ *
+ * Messages for a client that is offline are appended to segment files of
+ * SEGMENT_SIZE bytes in one directory. The segment being written is mapped
+ * into memory, so an append is a copy under a short lock; full segments
+ * are unmapped and only read again when their messages are claimed, and a
+ * segment whose messages are all claimed or expired is deleted. Each
+ * message records where the previous one for the same client is, so the
+ * memory kept per offline client is a few words, whatever its backlog.
+ *
+ * A reconnected client is sent its whole mailbox at once, so a mailbox
+ * holds at most MAX_MAILBOX_MESSAGES messages and only as many as fit in
+ * the byte budget given to open(). A message is counted by the size of
+ * its MESSAGE_INDICATION frame in JSON, the larger codec, so the claim
+ * takes at most that much of the client's outbound queue whatever the
+ * text escapes to. A mailbox is dropped a day after its client went
+ * offline. The store does not outlive the server: client IDs start over
+ * on every start, so open() deletes the segments left by an earlier run.
+ * Thread-safe.
+ */
+class Mailbox
+{
+public:
+	// Bytes of one segment file
+	static const size_t SEGMENT_SIZE = 64 * 1024 * 1024;
+	// Messages one offline client may be sent
+	static const uint32_t MAX_MAILBOX_MESSAGES = 10000;
+	// Bytes of encoded frames one offline client may be sent, at most
+	static const size_t MAX_MAILBOX_BYTES = 2 * 1024 * 1024;
+
+	/**
+	 * @struct Message
+	 * @brief A message claimed from a mailbox.
+	 */
+	struct Message {
+		uint64_t from_id = 0;
+		std::string text;
+	};
+
+	/**
+	 * @enum StoreResult
+	 * @brief The outcome of store().
+	 */
+	enum class StoreResult {
+		STORED,  // The client will be sent the message once it reconnects
+		UNKNOWN, // The client has no mailbox, or is still connected
+		FULL,    // The client's mailbox has no room left
+		TOO_LONG // The message would not fit in a packet
+	};
+
+	Mailbox() = default;
+
+	/**
+	 * @brief Unmaps the segment being written and closes it. The segment
+	 * files are left behind for the next open() to delete.
+	 */
+	~Mailbox();
+
+	Mailbox(const Mailbox &) = delete;
+	Mailbox &operator=(const Mailbox &) = delete;
+
+	/**
+	 * @brief Creates the directory if needed, deletes the segments of an
+	 * earlier run and starts the first segment.
+	 * @param directory Where the segment files go.
+	 * @param max_bytes Bytes of encoded frames one claim may send, at most
+	 * MAX_MAILBOX_BYTES; well below the outbound limit, so that the claim
+	 * does not get its client disconnected.
+	 * @param error Receives the reason of a failure.
+	 * @return True on success.
+	 */
+	bool open(const std::string &directory, size_t max_bytes, std::string &error);
+
+	/**
+	 * @brief Returns whether open() succeeded.
+	 */
+	bool is_open() const;
+
+	/**
+	 * @brief Gives a connected client a mailbox for the time it is offline.
+	 * Asking again returns the same token.
+	 * @param client_id The client.
+	 * @return The token that claims the mailbox after a reconnect, or 0 if
+	 * no random token could be drawn.
+	 */
+	uint64_t add_client(uint64_t client_id);
+
+	/**
+	 * @brief Starts keeping messages for a client that disconnected, if it
+	 * has a mailbox.
+	 * @param client_id The client.
+	 */
+	void client_offline(uint64_t client_id);
+
+	/**
+	 * @brief Appends a message to an offline client's mailbox.
+	 * @param target_id The offline client.
+	 * @param from_id The sender.
+	 * @param text The message, as the client would have been sent it.
+	 * @return Whether the message was kept.
+	 */
+	StoreResult store(uint64_t target_id, uint64_t from_id, std::string_view text);
+
+	/**
+	 * @brief Removes an offline client's mailbox and returns its messages.
+	 * @param client_id The ID the client had before it reconnected.
+	 * @param token The token it was given for that ID.
+	 * @param messages Receives the messages, oldest first.
+	 * @return False if the ID has no mailbox, is still connected, or the
+	 * token does not match, or if its messages could not all be read; the
+	 * mailbox is removed in that case too.
+	 */
+	bool claim(uint64_t client_id, uint64_t token, std::vector<Message> &messages);
+
+	/**
+	 * @brief Returns the counts since open().
+	 */
+	MailboxStats stats();
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	// A client with a mailbox. Its messages form a chain through the
+	// segments, newest first.
+	struct Owner {
+		uint64_t token = 0;
+		bool online = true;
+		Clock::time_point expires; // Once offline
+		uint64_t newest = 0;       // Position of the newest message, if any
+		uint32_t count = 0;
+		size_t bytes = 0;          // Of the frames that deliver the messages
+		// Messages in each segment, in segment order. Appends only go to
+		// the last segment, so this rarely has more than a couple of entries.
+		std::vector<std::pair<uint64_t, uint32_t>> segments;
+	};
+
+	bool start_segment(std::string &error);
+	void finish_segment();
+	void expire_owners(Clock::time_point now);
+	void release_segments(const Owner &owner);
+	bool read_messages(uint64_t client_id, const Owner &owner, std::vector<Message> &messages);
+	std::string segment_path(uint64_t segment) const;
+
+	bool open_ = false; // Set once by open()
+	std::mutex mutex_;  // Guards the members below
+	std::string directory_;
+	size_t max_bytes_ = 0;
+	std::unordered_map<uint64_t, Owner> owners_;
+	// Offline owners by the time they expire, oldest first. Entries whose
+	// owner was claimed in the meantime are skipped.
+	std::deque<std::pair<Clock::time_point, uint64_t>> expiry_;
+	// Messages not yet claimed or expired in each segment; a segment leaves
+	// the map, and the disk, once it has none and is not being written
+	std::map<uint64_t, uint32_t> live_;
+	uint64_t segment_ = 0; // The segment being written
+	int segment_fd_ = -1;
+	char *segment_map_ = nullptr;
+	size_t segment_used_ = 0;
+	MailboxStats stats_;
+};
+
+#endif // MAILBOX_H_
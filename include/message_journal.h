@@ -0,0 +1,207 @@
+#ifndef MESSAGE_JOURNAL_H_
+#define MESSAGE_JOURNAL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/*
+ * A journal is one append-only file. It starts with the 8 bytes
+ * JOURNAL_MAGIC, and every record after it is a 32-byte header followed by
+ * the message text. Integers are little-endian:
+ *
+ *   u32 checksum   CRC-32C of the rest of the record, header and text
+ *   u32 length     Bytes of text
+ *   u64 time_us    When the server accepted the message, in microseconds
+ *                  since the Unix epoch
+ *   u64 from_id    The sender
+ *   u64 target_id  The recipient
+ *
+ * A record is named by its offset in the file. A crash can leave a partly
+ * written record at the end, which the checksum exposes; the journal
+ * removes it when it is opened again.
+ */
+
+// The first bytes of a journal file
+const char JOURNAL_MAGIC[8] = {'M', 'S', 'G', 'J', 'R', 'N', 'L', '1'};
+// Bytes of a record before its text
+const size_t JOURNAL_HEADER_SIZE = 32;
+// Longest text of a record. The server only records messages whose
+// indication fits in a packet, so no text is longer than MAX_PACKET_SIZE.
+const size_t MAX_JOURNAL_TEXT_SIZE = 65536;
+
+/**
+ * @struct JournalRecord
+ * @brief One message read back from a journal.
+ */
+struct JournalRecord {
+	uint64_t offset = 0; // Where the record starts in the file
+	uint64_t time_us = 0;
+	uint64_t from_id = 0;
+	uint64_t target_id = 0;
+	std::string_view text; // Valid until the next call of JournalReader::next()
+};
+
+/**
+ * @class JournalReader
+ * @brief Reads the records of a journal in order, in large blocks and
+ * without allocating per record.
+ *
+ * Only the records in the file when it was opened are read, so that a
+ * journal the server is still writing, e.g. with the messages a replay
+ * sends, has a fixed end.
+ */
+class JournalReader
+{
+public:
+	JournalReader() = default;
+	~JournalReader();
+
+	JournalReader(const JournalReader &) = delete;
+	JournalReader &operator=(const JournalReader &) = delete;
+
+	/**
+	 * @brief Opens a journal for reading.
+	 * @param path The journal file.
+	 * @param offset The record to start at, or 0 for the first one.
+	 * @param error Receives the reason of a failure.
+	 * @return True on success.
+	 */
+	bool open(const std::string &path, uint64_t offset, std::string &error);
+
+	/**
+	 * @brief Reads the next record.
+	 * @param record Receives it.
+	 * @return False at the end of the file, or at a record that is torn or
+	 * corrupt, which ends the journal.
+	 */
+	bool next(JournalRecord &record);
+
+	/**
+	 * @brief Returns where the next record starts; once next() returned
+	 * false, where the valid part of the journal ends.
+	 */
+	uint64_t offset() const;
+
+	/**
+	 * @brief Returns the size of the file when it was opened. Larger than
+	 * offset() at the end if the journal ends in a torn or corrupt record.
+	 */
+	uint64_t file_size() const;
+
+private:
+	bool fill(size_t needed);
+
+	int fd_ = -1;
+	uint64_t file_size_ = 0;
+	uint64_t offset_ = 0;     // File offset of buffer_[start_]
+	std::vector<char> buffer_;
+	size_t start_ = 0;        // The unread bytes are buffer_[start_, end_)
+	size_t end_ = 0;
+};
+
+/**
+ * @struct JournalStats
+ * @brief What a MessageJournal has written since it was opened.
+ */
+struct JournalStats {
+	uint64_t records = 0;      // Records written and synced
+	uint64_t bytes = 0;        // Their bytes
+	uint64_t syncs = 0;        // fdatasync() calls, one per batch
+	uint64_t stalls = 0;       // Appends that waited for the writer to catch up
+	uint64_t write_errors = 0; // Batches lost to a failed write or sync
+};
+
+/**
+ * @class MessageJournal
+ * @brief Writes every message the server accepts to an append-only file,
+ * on a thread of its own and with group commit.
+ *
+ * append() only encodes the record into a buffer under a short lock. A
+ * writer thread takes the whole buffer at once, checksums its records and
+ * writes them with one write() and one fdatasync(); whatever is appended
+ * meanwhile goes into the next batch, so the number of syncs follows the
+ * disk's speed rather than the message rate. Because appends never wait
+ * for the disk, a message may be delivered before its record is synced,
+ * and a crash loses at most the batch being written and the one being
+ * collected. Only if more than MAX_PENDING_BYTES are waiting does append()
+ * wait for the writer, as a record is never dropped. Thread-safe.
+ */
+class MessageJournal
+{
+public:
+	// Bytes of records that may wait for the writer before append() blocks
+	static const size_t MAX_PENDING_BYTES = 16 * 1024 * 1024;
+
+	MessageJournal() = default;
+
+	/**
+	 * @brief Writes the records still waiting, like stop().
+	 */
+	~MessageJournal();
+
+	MessageJournal(const MessageJournal &) = delete;
+	MessageJournal &operator=(const MessageJournal &) = delete;
+
+	/**
+	 * @brief Opens or creates a journal, cuts off a torn record at its end
+	 * and starts the writer.
+	 * @param path The journal file.
+	 * @param error Receives the reason of a failure.
+	 * @return True on success.
+	 */
+	bool open(const std::string &path, std::string &error);
+
+	/**
+	 * @brief Returns whether open() succeeded.
+	 */
+	bool is_open() const;
+
+	/**
+	 * @brief Queues the record of a message for the writer.
+	 * @param from_id The sender.
+	 * @param target_id The recipient.
+	 * @param text The message, as the recipient is sent it. Only the first
+	 * MAX_JOURNAL_TEXT_SIZE bytes are kept.
+	 */
+	void append(uint64_t from_id, uint64_t target_id, std::string_view text);
+
+	/**
+	 * @brief Writes and syncs the records appended so far and stops the
+	 * writer. Later appends are ignored.
+	 */
+	void stop();
+
+	/**
+	 * @brief Returns the counts since open().
+	 */
+	JournalStats stats();
+
+	/**
+	 * @brief Returns the offset the journal ended at when it was opened,
+	 * where the records of this run start.
+	 */
+	uint64_t start_offset() const;
+
+private:
+	void run_writer();
+
+	int fd_ = -1;
+	bool open_ = false;
+	uint64_t start_offset_ = 0;
+	std::thread writer_;
+
+	std::mutex mutex_; // Guards the members below
+	std::condition_variable wakeup_; // The writer waits for records
+	std::condition_variable room_;   // Appends wait for pending_ to shrink
+	std::string pending_;            // Records not yet taken by the writer
+	bool stopping_ = false;
+	JournalStats stats_;
+};
+
+#endif // MESSAGE_JOURNAL_H_
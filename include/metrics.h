@@ -0,0 +1,127 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "latency_histogram.h"
+#include "packet.h"
+#include "payload_codec.h" // For StatsResponse
+#include "protocol.h"      // For FrameError
+
+/**
+ * @enum Counter
+ * @brief Server events counted by Metrics, besides frames and frame errors.
+ */
+enum class Counter : uint8_t {
+	BYTES_IN = 0,       // Bytes received from clients
+	BYTES_OUT,          // Bytes written to clients
+	CLIENTS_ACCEPTED,
+	CLIENTS_CLOSED,
+	OUTBOUND_OVERFLOWS, // Clients dropped for not reading their replies
+	MALFORMED_REQUESTS, // Requests whose payload could not be read
+	UNKNOWN_REQUESTS,   // Requests of a type the server does not handle
+	TRANSFER_BYTES,     // File bytes relayed in transfer chunks
+	TRANSFERS_ABORTED   // Transfers that ended without the whole file
+};
+
+// Number of Counter values
+const size_t COUNTER_COUNT = 9;
+
+// Every value the type byte of a frame can take
+const size_t MESSAGE_TYPE_SLOTS = 256;
+
+/**
+ * @struct MetricsSnapshot
+ * @brief The metrics of every thread added up.
+ */
+struct MetricsSnapshot {
+	uint64_t uptime_seconds = 0;
+	uint64_t counters[COUNTER_COUNT] = {};         // Indexed by Counter
+	uint64_t frame_errors[FRAME_ERROR_COUNT] = {}; // Indexed by FrameError
+	uint64_t frames_in[MESSAGE_TYPE_SLOTS] = {};   // Indexed by MessageType
+	uint64_t frames_out[MESSAGE_TYPE_SLOTS] = {};  // Indexed by MessageType
+	// Handler latency in nanoseconds by request type; null for types that
+	// were never handled
+	std::unique_ptr<LatencyHistogram> latency[MESSAGE_TYPE_SLOTS];
+
+	uint64_t counter(Counter which) const
+	{
+		return counters[static_cast<size_t>(which)];
+	}
+};
+
+/**
+ * @class Metrics
+ * @brief Process-wide counters and latency histograms, cheap enough to
+ * update on every frame.
+ *
+ * Every thread records into a block of its own, allocated on its first
+ * update, so an update is a relaxed load and store to memory that no other
+ * thread writes: a few nanoseconds, no lock and no contended cache line.
+ * snapshot() adds the blocks of all threads up. Only it and the first update
+ * of a thread take the registry's lock. Blocks are kept until the process
+ * exits, so the counts of a thread that has ended still show.
+ */
+class Metrics
+{
+public:
+	/**
+	 * @brief Adds to a counter.
+	 * @param which The counter.
+	 * @param amount The amount to add.
+	 */
+	static void count(Counter which, uint64_t amount = 1);
+
+	/**
+	 * @brief Counts a stream that was dropped because it could not be
+	 * decoded.
+	 * @param error Why it could not be decoded.
+	 */
+	static void count_frame_error(FrameError error);
+
+	/**
+	 * @brief Counts a frame received from a client.
+	 * @param type The frame's type.
+	 */
+	static void count_frame_in(MessageType type);
+
+	/**
+	 * @brief Counts a frame queued for a client.
+	 * @param type The frame's type.
+	 */
+	static void count_frame_out(MessageType type);
+
+	/**
+	 * @brief Records how long a request took to handle.
+	 * @param type The request's type.
+	 * @param nanoseconds The time it took.
+	 */
+	static void record_latency(MessageType type, uint64_t nanoseconds);
+
+	/**
+	 * @brief Adds up the metrics of every thread. Threads keep recording
+	 * meanwhile, so the totals may be a few updates apart from each other.
+	 */
+	static MetricsSnapshot snapshot();
+};
+
+/**
+ * @brief Returns the name of a counter, e.g. "bytes_in".
+ */
+const char *CounterToString(Counter which);
+
+/**
+ * @brief Lists a snapshot's metrics for a GET_STATS_RESPONSE. Frames are
+ * only listed for the types that were seen.
+ */
+StatsResponse make_stats_response(const MetricsSnapshot &snapshot);
+
+/**
+ * @brief Formats a snapshot in the Prometheus text exposition format, for
+ * the scrape endpoint.
+ */
+std::string format_metrics_text(const MetricsSnapshot &snapshot);
+
+#endif // METRICS_H_
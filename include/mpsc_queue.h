@@ -0,0 +1,82 @@
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+#include <atomic>
+#include <thread>
+#include <utility>
+
+/**
+ * @class MpscQueue
+ * @brief An unbounded lock-free queue for many producers and one consumer.
+ *
+ * Producers link a node with a single atomic exchange, so push() never takes
+ * a lock and never waits for other producers. Only the owning thread may call
+ * pop().
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+	MpscQueue() : head_(new Node()), tail_(head_.load())
+	{
+	}
+
+	~MpscQueue()
+	{
+		T discarded;
+		while (pop(discarded)) {
+		}
+		delete tail_;
+	}
+
+	MpscQueue(const MpscQueue &) = delete;
+	MpscQueue &operator=(const MpscQueue &) = delete;
+
+	/**
+	 * @brief Appends a value. Safe to call from any thread.
+	 * @param value The value to enqueue.
+	 */
+	void push(T value)
+	{
+		Node *node = new Node();
+		node->value = std::move(value);
+		Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Removes the oldest value. Must only be called by the consumer.
+	 * @param out Receives the value.
+	 * @return True if a value was removed, false if the queue was empty.
+	 */
+	bool pop(T &out)
+	{
+		Node *tail = tail_;
+		Node *next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			if (head_.load(std::memory_order_acquire) == tail) {
+				return false;
+			}
+			// A producer has swapped head_ but not linked its node yet.
+			// It is between two instructions, so wait for the link.
+			while ((next = tail->next.load(std::memory_order_acquire)) == nullptr) {
+				std::this_thread::yield();
+			}
+		}
+		out = std::move(next->value);
+		tail_ = next;
+		delete tail;
+		return true;
+	}
+
+private:
+	struct Node {
+		std::atomic<Node *> next{nullptr};
+		T value;
+	};
+
+	std::atomic<Node *> head_; // Most recently pushed node (producers)
+	Node *tail_;               // Already consumed stub node (consumer)
+};
+
+#endif // MPSC_QUEUE_H_
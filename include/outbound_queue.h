@@ -0,0 +1,72 @@
+#ifndef OUTBOUND_QUEUE_H_
+#define OUTBOUND_QUEUE_H_
+
+#include <vector>
+#include <sys/uio.h> // For iovec
+#include "protocol.h"
+
+/**
+ * @class OutboundQueue
+ * @brief The frames a connection still has to write, in order.
+ *
+ * Frames are queued by reference to their shared payloads and written back
+ * out with gather(): every queued frame, including the unsent rest of a
+ * partially written one, is described by iovecs for a single writev() or
+ * sendmsg(). The queue keeps count of its bytes so that a connection whose
+ * peer stops reading can be cut off at a fixed memory limit. An empty queue
+ * holds no memory beyond a few slots.
+ */
+class OutboundQueue
+{
+public:
+	/**
+	 * @brief Appends a frame unless that would exceed the limit.
+	 * A frame is always accepted into an empty queue, whatever its size.
+	 * @param frame The frame to append.
+	 * @param limit The most bytes the queue may hold.
+	 * @return True if the frame was queued, false if the limit was reached.
+	 */
+	bool push(const OutboundFrame &frame, size_t limit);
+
+	/**
+	 * @brief Describes the queued bytes, oldest first.
+	 * The iovecs stay valid until the next gather(), consume() or clear(),
+	 * even if more frames are pushed in the meantime, so they can be used
+	 * by an asynchronous write.
+	 * @param iov Cleared, then filled with at most max_iov entries.
+	 * @param max_iov The largest number of entries to produce.
+	 */
+	void gather(std::vector<struct iovec> &iov, size_t max_iov);
+
+	/**
+	 * @brief Drops bytes that have been written.
+	 * @param bytes The number of bytes written from the front of the queue.
+	 */
+	void consume(size_t bytes);
+
+	/**
+	 * @brief Drops every queued frame.
+	 */
+	void clear();
+
+	bool empty() const
+	{
+		return head_ == frames_.size();
+	}
+
+	size_t bytes() const
+	{
+		return bytes_;
+	}
+
+private:
+	std::vector<OutboundFrame> frames_; // Unwritten frames start at head_
+	size_t head_ = 0;
+	size_t offset_ = 0; // Bytes of the front frame already written
+	size_t bytes_ = 0;  // Unwritten bytes of all frames
+	// Copies of the gathered frames' headers. Pushing may move the frames,
+	// but not these.
+	std::vector<char> prefixes_;
+};
+
+#endif // OUTBOUND_QUEUE_H_
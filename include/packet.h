@@ -2,6 +2,7 @@
 #define PACKET_H_
 
 #include <string>
+#include <string_view>
 #include <cstdint> // For uint8_t and so on
 #include <vector>
 
@@ -19,17 +20,84 @@ enum class MessageType : uint8_t {
 	GET_CLIENT_LIST_REQUEST = 12,
 	SEND_MESSAGE_REQUEST = 13,
 	DISCONNECT_REQUEST = 14,
+	BROADCAST_REQUEST = 15,     // Message to every other client
+	JOIN_GROUP_REQUEST = 16,
+	LEAVE_GROUP_REQUEST = 17,
+	GROUP_MESSAGE_REQUEST = 18, // Message to every other member of a group
+	HELLO_REQUEST = 19,         // Offers payload codecs, sent as JSON
+	PRESENCE_SUBSCRIBE_REQUEST = 40,   // Asks for a snapshot, then deltas
+	PRESENCE_UNSUBSCRIBE_REQUEST = 41,
+	GET_STATS_REQUEST = 42,            // Asks for the server's metrics
+	TRANSFER_BEGIN_REQUEST = 43,       // Offers a file to another client
+	TRANSFER_CHUNK_REQUEST = 44,       // The next piece of a file, BINARY only
+	TRANSFER_END_REQUEST = 45,         // The file is complete, or given up
+	TRANSFER_ACK_REQUEST = 46,         // Bytes of a file the receiver has stored
+	MAILBOX_REQUEST = 47,              // Keeps messages while offline; claims old ones
 
 	// Server to Client Responses (synchronous reply to a request)
 	GET_TIME_RESPONSE = 20,
 	GET_NAME_RESPONSE = 21,
 	GET_CLIENT_LIST_RESPONSE = 22,
 	SEND_MESSAGE_RESPONSE = 23,
+	BROADCAST_RESPONSE = 24,
+	JOIN_GROUP_RESPONSE = 25,
+	LEAVE_GROUP_RESPONSE = 26,
+	GROUP_MESSAGE_RESPONSE = 27,
+	HELLO_RESPONSE = 28,        // The codec chosen by the server
+	PRESENCE_SUBSCRIBE_RESPONSE = 50,  // Every connected client
+	PRESENCE_UNSUBSCRIBE_RESPONSE = 51,
+	GET_STATS_RESPONSE = 52,
+	TRANSFER_BEGIN_RESPONSE = 53,      // Whether the transfer may start
+	MAILBOX_RESPONSE = 54,             // The token, and how many messages follow
 
 	// Server to Client Indications (asynchronous message)
 	MESSAGE_INDICATION = 30, // A message from another client
 	SERVER_SHUTDOWN_INDICATION = 31, // Server is shutting down
-	SYSTEM_NOTICE_INDICATION = 32
+	SYSTEM_NOTICE_INDICATION = 32,
+	BROADCAST_INDICATION = 33, // A broadcast from another client
+	GROUP_MESSAGE_INDICATION = 34, // A message to a group the client is in
+	PRESENCE_DELTA_INDICATION = 35, // Clients that came or went, for subscribers
+	TRANSFER_BEGIN_INDICATION = 36, // A file another client is about to send
+	TRANSFER_CHUNK_INDICATION = 37, // A piece of that file, BINARY only
+	TRANSFER_END_INDICATION = 38,   // A transfer finished or was aborted
+	TRANSFER_ACK_INDICATION = 39    // Bytes the receiver of a file has stored
+};
+
+/**
+ * @enum PayloadCodec
+ * @brief How a packet's payload is encoded. Carried in the first reserved
+ * byte of the header, so peers that predate it always send JSON.
+ */
+enum class PayloadCodec : uint8_t {
+	JSON = 0,  // A JSON object, understood by every peer
+	BINARY = 1 // A fixed layout per MessageType, see payload_codec.h
+};
+
+// Number of PayloadCodec values
+const size_t PAYLOAD_CODEC_COUNT = 2;
+
+/**
+ * @enum FrameCompression
+ * @brief How a compressed payload was compressed, see frame_compression.h.
+ * A peer only compresses after both sides agreed on a mode in the HELLO.
+ */
+enum class FrameCompression : uint8_t {
+	NONE = 0,    // Payloads are sent as they are
+	LZ4 = 1,     // LZ4 block format
+	LZ4_DICT = 2 // LZ4 block format, matches may refer to a built-in dictionary
+};
+
+// Number of FrameCompression values
+const size_t FRAME_COMPRESSION_COUNT = 3;
+
+/**
+ * @struct WireFormat
+ * @brief How the payloads sent to a peer are encoded, as negotiated with a
+ * HELLO.
+ */
+struct WireFormat {
+	PayloadCodec codec = PayloadCodec::JSON;
+	FrameCompression compression = FrameCompression::NONE;
 };
 
 /**
@@ -45,6 +113,34 @@ struct Packet {
 	// e.g., for SEND_MESSAGE_REQUEST: content = R"({"target_id": 123, "message": "Hello"})"
 	// e.g., for GET_TIME_RESPONSE: content = R"({"time": "2025-10-06 15:30:00 JST"})"
 	std::string content; // Content of packet (payload)
+	PayloadCodec codec = PayloadCodec::JSON; // Encoding of the content
+	uint16_t correlation_id = 0; // Echoed in the reply to a request; 0 for none
+	// Applied when the packet is sent, if it makes the payload smaller.
+	// Received packets are always decompressed already.
+	FrameCompression compression = FrameCompression::NONE;
+};
+
+/**
+ * @struct PacketView
+ * @brief A packet decoded in place from a receive buffer.
+ * The content points into that buffer and is only valid until the decoder
+ * that produced the view is fed or reads again.
+ */
+struct PacketView {
+	MessageType type = MessageType::UNDEFINED; // Type of packet
+	std::string_view content;                  // Content of packet (payload)
+	PayloadCodec codec = PayloadCodec::JSON;   // Encoding of the content
+	uint16_t correlation_id = 0;               // See Packet::correlation_id
+	bool compressed = false; // Set by parse_packet() until the content is inflated
+
+	/**
+	 * @brief Copies the view into an owning Packet. The view must not be
+	 * compressed.
+	 */
+	Packet to_packet() const
+	{
+		return Packet{type, std::string(content), codec, correlation_id};
+	}
 };
 
 #endif // PACKET_H_
\ No newline at end of file
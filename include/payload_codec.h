@@ -0,0 +1,411 @@
+#ifndef PAYLOAD_CODEC_H_
+#define PAYLOAD_CODEC_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "packet.h"
+#include "protocol.h"
+
+/*
+ * Typed payloads and their two encodings.
+ *
+ * JSON payloads are the objects the protocol has always used. BINARY
+ * payloads have a fixed layout per message; integers are big-endian, a
+ * "short string" is a 1-byte length followed by that many bytes, and a
+ * trailing text field takes up the rest of the payload:
+ *
+ *   SendMessageRequest      u64 target_id, text message
+ *   SendMessageResponse     u8 success, u64 target_id (0 if none), text message
+ *   TimeResponse            text time
+ *   NameResponse            text name
+ *   ClientListRequest       u64 cursor, u32 limit (or empty)
+ *   ClientListResponse      u32 count, count x (u64 id, 4-byte IPv4, u16 port),
+ *                           u64 next_cursor
+ *   ChatIndication          u64 from_id, text message
+ *   NoticeIndication        text notice
+ *   BroadcastRequest        text message
+ *   BroadcastResponse       u8 success, u64 recipients, text message
+ *   GroupRequest            short string group, text message
+ *   GroupResponse           u8 success, u64 count, short string group, text message
+ *   GroupMessageIndication  u64 from_id, short string group, text message
+ *   HelloRequest            count x u8 codec or (0x80 | u8 compression)
+ *   HelloResponse           u8 codec, optional (0x80 | u8 compression)
+ *   PresenceDelta           u32 count, count x (u64 id, 4-byte IPv4, u16 port),
+ *                           u32 count, count x u64 id, u8 more
+ *   PresenceResponse        u8 success, text message
+ *   StatsResponse           u32 count, count x (short string name, u64 value),
+ *                           u32 count, count x (short string type, u64 count,
+ *                           u64 p50, u64 p90, u64 p99, u64 p999, u64 max)
+ *   TransferBegin           u64 peer_id, u32 transfer_id, u64 size, text name
+ *   TransferResponse        u8 success, u32 transfer_id, text message
+ *   TransferChunk           u64 peer_id, u32 transfer_id, data to the end
+ *   TransferEnd             u64 peer_id, u32 transfer_id, u8 complete, text message
+ *   TransferAck             u64 peer_id, u32 transfer_id, u64 received
+ *   MailboxRequest          u64 client_id, u64 token
+ *   MailboxResponse         u8 success, u64 client_id, u64 token, u32 delivered,
+ *                           text message
+ *
+ * The peer_id of a transfer message is called target_id in requests and
+ * from_id in indications, as in JSON. Chunks carry file data, which has no
+ * JSON form: they are always BINARY, whatever codec the peers negotiated.
+ *
+ * Requests without content (GET_TIME, GET_NAME, DISCONNECT,
+ * PRESENCE_SUBSCRIBE, PRESENCE_UNSUBSCRIBE, GET_STATS) have an empty payload in both
+ * encodings, as does a GET_CLIENT_LIST for the first page.
+ */
+
+// SEND_MESSAGE_REQUEST
+struct SendMessageRequest {
+	uint64_t target_id = 0;
+	std::string message;
+};
+
+// SEND_MESSAGE_RESPONSE. message holds the reason of a failure.
+struct SendMessageResponse {
+	bool success = false;
+	uint64_t target_id = 0; // 0 if the request could not be read
+	std::string message;
+};
+
+// GET_TIME_RESPONSE
+struct TimeResponse {
+	std::string time;
+};
+
+// GET_NAME_RESPONSE
+struct NameResponse {
+	std::string name;
+};
+
+// GET_CLIENT_LIST_REQUEST. Asks for the clients whose IDs are at least
+// cursor, in ID order.
+struct ClientListRequest {
+	uint64_t cursor = 0; // 0 for the first page
+	uint32_t limit = 0;  // Most clients to list; 0 lets the server choose
+};
+
+// One client in a GET_CLIENT_LIST_RESPONSE
+struct ClientListEntry {
+	uint64_t client_id = 0;
+	uint32_t ipv4 = 0; // Network byte order
+	uint16_t port = 0;
+};
+
+// GET_CLIENT_LIST_RESPONSE: one page of clients, ordered by ID
+struct ClientListResponse {
+	std::vector<ClientListEntry> clients;
+	uint64_t next_cursor = 0; // Cursor of the next page, 0 on the last one
+};
+
+// MESSAGE_INDICATION and BROADCAST_INDICATION
+struct ChatIndication {
+	uint64_t from_id = 0;
+	std::string message;
+};
+
+// SYSTEM_NOTICE_INDICATION and SERVER_SHUTDOWN_INDICATION
+struct NoticeIndication {
+	std::string notice;
+};
+
+// BROADCAST_REQUEST
+struct BroadcastRequest {
+	std::string message;
+};
+
+// BROADCAST_RESPONSE. message holds the reason of a failure.
+struct BroadcastResponse {
+	bool success = false;
+	uint64_t recipients = 0;
+	std::string message;
+};
+
+// JOIN_GROUP_REQUEST, LEAVE_GROUP_REQUEST and GROUP_MESSAGE_REQUEST. Only
+// the last one has a message.
+struct GroupRequest {
+	std::string group;
+	std::string message;
+};
+
+// JOIN_GROUP_RESPONSE, LEAVE_GROUP_RESPONSE and GROUP_MESSAGE_RESPONSE.
+// count is the number of members after a join and the number of
+// recipients of a message. message holds the reason of a failure.
+struct GroupResponse {
+	bool success = false;
+	std::string group; // Empty if the request could not be read
+	uint64_t count = 0;
+	std::string message;
+};
+
+// GROUP_MESSAGE_INDICATION
+struct GroupMessageIndication {
+	uint64_t from_id = 0;
+	std::string group;
+	std::string message;
+};
+
+// HELLO_REQUEST: the codecs and compressions the client can use, preferred
+// first. Peers that predate compression ignore the compressions.
+struct HelloRequest {
+	std::vector<PayloadCodec> codecs;
+	std::vector<FrameCompression> compressions;
+};
+
+// HELLO_RESPONSE: the codec and compression the server will use for this
+// client, and that the client may use from now on
+struct HelloResponse {
+	PayloadCodec codec = PayloadCodec::JSON;
+	FrameCompression compression = FrameCompression::NONE;
+};
+
+// PRESENCE_DELTA_INDICATION: the clients that connected and disconnected
+// since the last delta, each ordered by ID. A PRESENCE_SUBSCRIBE_RESPONSE
+// carries the same payload with every connected client in joined. Either
+// is split into frames of at most CLIENT_LIST_PAGE_SIZE clients, each but
+// the last with more set; the frames of a delta hold all its joins before
+// its leaves.
+struct PresenceDelta {
+	std::vector<ClientListEntry> joined;
+	std::vector<uint64_t> left;
+	bool more = false; // Further frames of the same snapshot or delta follow
+};
+
+// PRESENCE_UNSUBSCRIBE_RESPONSE. message holds the reason of a failure.
+struct PresenceResponse {
+	bool success = false;
+	std::string message;
+};
+
+// One counter in a GET_STATS_RESPONSE
+struct StatsCounter {
+	std::string name; // e.g. "bytes_in" or "frames_in.GET_TIME_REQUEST"
+	uint64_t value = 0;
+};
+
+// How long the server took to handle one type of request, in nanoseconds
+struct StatsLatency {
+	std::string type; // e.g. "GET_TIME_REQUEST"
+	uint64_t count = 0;
+	uint64_t p50 = 0;
+	uint64_t p90 = 0;
+	uint64_t p99 = 0;
+	uint64_t p999 = 0;
+	uint64_t max = 0;
+};
+
+// GET_STATS_RESPONSE
+struct StatsResponse {
+	std::vector<StatsCounter> counters;
+	std::vector<StatsLatency> latencies;
+};
+
+// Largest piece of a file a client puts in one TRANSFER_CHUNK_REQUEST
+const size_t TRANSFER_CHUNK_SIZE = 32 * 1024;
+// Bytes of a file that may be relayed to its receiver and not yet
+// acknowledged. The server aborts a transfer whose sender goes past it, so
+// that a file never takes more than this much of the receiver's outbound
+// queue, however large it is.
+const uint64_t TRANSFER_WINDOW = 512 * 1024;
+
+// A transfer is named by its sender's ID and the transfer_id the sender
+// picked. peer_id is the other client: the receiver of the file in the
+// requests the sender makes, the sender in those the receiver makes, and
+// the client the message came from in indications.
+
+// TRANSFER_BEGIN_REQUEST and TRANSFER_BEGIN_INDICATION
+struct TransferBegin {
+	uint64_t peer_id = 0;
+	uint32_t transfer_id = 0;
+	uint64_t size = 0; // Bytes of the file
+	std::string name;  // The file's name, without its directory
+};
+
+// TRANSFER_BEGIN_RESPONSE. message holds the reason of a failure.
+struct TransferResponse {
+	bool success = false;
+	uint32_t transfer_id = 0;
+	std::string message;
+};
+
+// TRANSFER_CHUNK_REQUEST and TRANSFER_CHUNK_INDICATION. A decoded chunk's
+// data points into the packet's content.
+struct TransferChunk {
+	uint64_t peer_id = 0;
+	uint32_t transfer_id = 0;
+	std::string_view data;
+};
+
+// TRANSFER_END_REQUEST and TRANSFER_END_INDICATION. message holds the
+// reason a transfer was aborted.
+struct TransferEnd {
+	uint64_t peer_id = 0;
+	uint32_t transfer_id = 0;
+	bool complete = false; // False if the transfer was aborted
+	std::string message;
+};
+
+// TRANSFER_ACK_REQUEST and TRANSFER_ACK_INDICATION
+struct TransferAck {
+	uint64_t peer_id = 0;
+	uint32_t transfer_id = 0;
+	uint64_t received = 0; // Bytes of the file the receiver has stored
+};
+
+// MAILBOX_REQUEST: asks for a mailbox that keeps the client's messages
+// while it is offline, and claims the one it had under an earlier ID.
+// client_id and token are 0 when there is nothing to claim.
+struct MailboxRequest {
+	uint64_t client_id = 0; // The client's ID before it reconnected
+	uint64_t token = 0;     // The token it was given for that ID
+};
+
+// MAILBOX_RESPONSE. The claimed messages follow it as MESSAGE_INDICATIONs.
+// The token is issued even if the claim failed. message holds the reason
+// of a failure.
+struct MailboxResponse {
+	bool success = false;
+	uint64_t client_id = 0; // The client's current ID
+	uint64_t token = 0;     // Claims this ID's mailbox after the next reconnect
+	uint32_t delivered = 0; // Messages claimed
+	std::string message;
+};
+
+/**
+ * @brief Encodes a typed payload.
+ * @param codec The encoding to use.
+ * @param type The message type the payload is sent as.
+ * @param msg The payload.
+ * @return The encoded bytes.
+ */
+std::string encode_payload(PayloadCodec codec, MessageType type, const SendMessageRequest &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const SendMessageResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const TimeResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const NameResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const ClientListRequest &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const ClientListResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const ChatIndication &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const NoticeIndication &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const BroadcastRequest &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const BroadcastResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const GroupRequest &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const GroupResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const GroupMessageIndication &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const HelloRequest &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const HelloResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const PresenceDelta &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const PresenceResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const StatsResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferBegin &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferResponse &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferChunk &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferEnd &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferAck &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const MailboxRequest &msg);
+std::string encode_payload(PayloadCodec codec, MessageType type, const MailboxResponse &msg);
+
+/**
+ * @brief Decodes a typed payload in the packet's codec.
+ * Requests are read strictly; responses and indications tolerate missing
+ * fields, which keep their defaults.
+ * @param pkt The received packet.
+ * @param msg Receives the payload.
+ * @return True on success, false if the payload is malformed.
+ */
+bool decode_payload(const PacketView &pkt, SendMessageRequest &msg);
+bool decode_payload(const PacketView &pkt, SendMessageResponse &msg);
+bool decode_payload(const PacketView &pkt, TimeResponse &msg);
+bool decode_payload(const PacketView &pkt, NameResponse &msg);
+bool decode_payload(const PacketView &pkt, ClientListRequest &msg);
+bool decode_payload(const PacketView &pkt, ClientListResponse &msg);
+bool decode_payload(const PacketView &pkt, ChatIndication &msg);
+bool decode_payload(const PacketView &pkt, NoticeIndication &msg);
+bool decode_payload(const PacketView &pkt, BroadcastRequest &msg);
+bool decode_payload(const PacketView &pkt, BroadcastResponse &msg);
+bool decode_payload(const PacketView &pkt, GroupRequest &msg);
+bool decode_payload(const PacketView &pkt, GroupResponse &msg);
+bool decode_payload(const PacketView &pkt, GroupMessageIndication &msg);
+bool decode_payload(const PacketView &pkt, HelloRequest &msg);
+bool decode_payload(const PacketView &pkt, HelloResponse &msg);
+bool decode_payload(const PacketView &pkt, PresenceDelta &msg);
+bool decode_payload(const PacketView &pkt, PresenceResponse &msg);
+bool decode_payload(const PacketView &pkt, StatsResponse &msg);
+bool decode_payload(const PacketView &pkt, TransferBegin &msg);
+bool decode_payload(const PacketView &pkt, TransferResponse &msg);
+bool decode_payload(const PacketView &pkt, TransferChunk &msg);
+bool decode_payload(const PacketView &pkt, TransferEnd &msg);
+bool decode_payload(const PacketView &pkt, TransferAck &msg);
+bool decode_payload(const PacketView &pkt, MailboxRequest &msg);
+bool decode_payload(const PacketView &pkt, MailboxResponse &msg);
+
+/**
+ * @brief Encodes a typed payload into a frame ready to be sent.
+ * @param type The message type.
+ * @param codec The encoding to use.
+ * @param msg The payload.
+ * @return The frame.
+ */
+template <typename Message>
+OutboundFrame encode_frame(MessageType type, PayloadCodec codec, const Message &msg)
+{
+	return make_frame(type, encode_payload(codec, type, msg), codec);
+}
+
+/**
+ * @brief Encodes a typed payload once per codec, for a message sent to many
+ * clients.
+ * @param type The message type.
+ * @param msg The payload.
+ * @return The frames.
+ */
+template <typename Message>
+FrameSet encode_frame_set(MessageType type, const Message &msg)
+{
+	FrameSet set;
+	for (size_t i = 0; i < PAYLOAD_CODEC_COUNT; i++) {
+		set.frames[i] = encode_frame(type, static_cast<PayloadCodec>(i), msg);
+	}
+	return set;
+}
+
+/**
+ * @brief Encodes a typed payload into a Packet.
+ * @param type The message type.
+ * @param codec The encoding to use.
+ * @param msg The payload.
+ * @return The packet.
+ */
+template <typename Message>
+Packet encode_packet(MessageType type, PayloadCodec codec, const Message &msg)
+{
+	return Packet{type, encode_payload(codec, type, msg), codec};
+}
+
+/**
+ * @brief Returns the name of a codec as used in HELLO messages.
+ */
+const char *PayloadCodecToString(PayloadCodec codec);
+
+/**
+ * @brief Looks up a codec by its name.
+ * @param name The name, e.g. "json" or "binary".
+ * @param codec Receives the codec if the name is known.
+ * @return True if the name is known.
+ */
+bool parse_codec_name(std::string_view name, PayloadCodec &codec);
+
+/**
+ * @brief Returns the name of a compression as used in HELLO messages.
+ */
+const char *FrameCompressionToString(FrameCompression compression);
+
+/**
+ * @brief Looks up a compression by its name.
+ * @param name The name, e.g. "lz4" or "lz4-dict".
+ * @param compression Receives the compression if the name is known.
+ * @return True if the name is known.
+ */
+bool parse_compression_name(std::string_view name, FrameCompression &compression);
+
+#endif // PAYLOAD_CODEC_H_
@@ -0,0 +1,97 @@
+#ifndef PRESENCE_FEED_H_
+#define PRESENCE_FEED_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "payload_codec.h"
+
+/**
+ * @class PresenceFeed
+ * @brief Batches clients connecting and disconnecting into deltas for the
+ * clients that subscribed to them.
+ *
+ * Connects and disconnects are recorded from every shard and handed out as
+ * one PresenceDelta per batching window, so a burst of churn costs
+ * subscribers one message instead of one per event. Nothing is recorded
+ * while there are no subscribers.
+ *
+ * A batch lists joins before leaves and both may name the same client, so a
+ * subscriber must apply the joins first. Applied to a snapshot taken after
+ * subscribing, the deltas converge on the set of connected clients: client
+ * IDs are never reused, and an event the snapshot already reflects changes
+ * nothing when applied again.
+ *
+ * The subscriber list is copy-on-write like a GroupDirectory member list, so
+ * a batch is fanned out without holding the lock.
+ */
+class PresenceFeed
+{
+public:
+	using SubscriberList = std::shared_ptr<const std::vector<uint64_t>>;
+
+	/**
+	 * @brief Creates a feed without subscribers.
+	 * @param window How long events are collected before a batch goes out.
+	 */
+	explicit PresenceFeed(std::chrono::milliseconds window);
+
+	/**
+	 * @brief Records a client that connected. Call once it can be found in
+	 * its shard's registry.
+	 * @param client The client.
+	 */
+	void client_connected(const ClientListEntry &client);
+
+	/**
+	 * @brief Records a client that disconnected. Call once it has been
+	 * removed from its shard's registry.
+	 * @param client_id The client's ID.
+	 */
+	void client_disconnected(uint64_t client_id);
+
+	/**
+	 * @brief Adds a subscriber. Take its snapshot after this call, so that
+	 * every change the snapshot misses is in a later batch.
+	 * @param client_id The subscribing client.
+	 * @return False if the client was already subscribed.
+	 */
+	bool subscribe(uint64_t client_id);
+
+	/**
+	 * @brief Removes a subscriber.
+	 * @param client_id The client to remove.
+	 * @return True if the client was subscribed.
+	 */
+	bool unsubscribe(uint64_t client_id);
+
+	/**
+	 * @brief Waits until events have been collected for a whole window and
+	 * takes them as one batch.
+	 * @param running Checked at least once per second; the wait ends when it
+	 * becomes false.
+	 * @param delta Receives the batch, joins and leaves each ordered by ID.
+	 * @param subscribers Receives the clients to send the batch to.
+	 * @return True if a batch was taken, false if running became false.
+	 */
+	bool wait_batch(const std::atomic<bool> &running, PresenceDelta &delta,
+	                SubscriberList &subscribers);
+
+private:
+	bool has_pending() const;
+
+	const std::chrono::milliseconds window_;
+	std::mutex mutex_;
+	std::condition_variable pending_cv_; // Signalled by the first event of a batch
+	SubscriberList subscribers_;
+	// Read without the lock to skip recording while nobody subscribed
+	std::atomic<size_t> subscriber_count_;
+	std::vector<ClientListEntry> joined_;
+	std::vector<uint64_t> left_;
+};
+
+#endif // PRESENCE_FEED_H_
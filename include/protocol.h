@@ -6,29 +6,198 @@
 #include "packet.h"
 #include <vector>
 #include <string>
+#include <string_view>
+#include <memory>
+#include <sys/types.h> // For ssize_t
 
 /*
  * +------------------+-------------------------------------------------------------+
  * |   Total Length   |                    Packet Data (N bytes)                    |
- * |    (4 bytes)     +-------------------------+-----------------------------------+
- * |                  |     Header (12 bytes)   |         Payload (M bytes)         |
- * +------------------+-------------------------+-----------------------------------+
- * |                  | Magic | Type |Resv|P Len|                                   |
- * |                  | (4B)  | (1B) |(3B)|(4B) |           (JSON String)           |
- * +------------------+-------+------+----+-----+-----------------------------------+
+ * |    (4 bytes)     +-----------------------------+-------------------------------+
+ * |                  |      Header (12 bytes)      |       Payload (M bytes)       |
+ * +------------------+-----------------------------+-------------------------------+
+ * |                  | Magic |Type|Codec|Corr|P Len|                               |
+ * |                  | (4B)  |(1B)|(1B) |(2B)|(4B) |  (JSON or binary, per Codec)  |
+ * +------------------+-------+----+-----+----+-----+-------------------------------+
+ *
+ * Corr is a correlation ID chosen by the client. The server copies a
+ * request's ID into its reply, so a client may have many requests in flight
+ * and match replies to them in any order. Requests with ID 0 are answered
+ * in the order they were sent, as they were before the field existed;
+ * requests with another ID may be answered out of order.
+ *
+ * The high bit of Codec (PAYLOAD_COMPRESSED) marks a compressed payload, see
+ * frame_compression.h. A peer only sets it once the HELLO exchange settled
+ * on a compression; the remaining bits hold the PayloadCodec.
  */
 
 const uint32_t MAGIC_NUMBER = 0xDBEEAEDF;
-const size_t HEADER_SIZE = 12; // Magic(4) + Type(1) + Reserved(3) + PayloadLength(4)
+const size_t HEADER_SIZE = 12; // Magic(4) + Type(1) + Codec(1) + CorrelationID(2) + PayloadLength(4)
+const size_t FRAME_PREFIX_SIZE = 4 + HEADER_SIZE; // Total Length(4) + Header(12)
+// Largest payload a peer accepts; a longer one makes the packet oversize
+const size_t MAX_PAYLOAD_SIZE = MAX_PACKET_SIZE - HEADER_SIZE;
+const uint8_t PAYLOAD_COMPRESSED = 0x80; // Flag in the Codec byte
+
+/**
+ * @enum FrameError
+ * @brief Why a byte stream could not be decoded into packets.
+ */
+enum class FrameError : uint8_t {
+	NONE = 0,
+	OVERSIZE,        // Total length above MAX_PACKET_SIZE
+	UNDERSIZE,       // Total length too short for a header
+	BAD_MAGIC,       // Magic number missing
+	BAD_CODEC,       // Codec byte names no PayloadCodec
+	BAD_LENGTH,      // Payload length runs past the packet
+	BAD_COMPRESSION, // Compressed payload that does not decompress
+	TRUNCATED        // Stream ended inside a packet
+};
+
+// Number of FrameError values
+const size_t FRAME_ERROR_COUNT = 8;
+
+/**
+ * @brief Payload bytes that may be shared by many outbound frames.
+ */
+using SharedPayload = std::shared_ptr<const std::string>;
+
+/**
+ * @struct OutboundFrame
+ * @brief A packet ready to be sent. The length prefix and header are encoded
+ * inline; the payload is referenced, never copied.
+ */
+struct OutboundFrame {
+	char prefix[FRAME_PREFIX_SIZE]; // Total length and header, network order
+	SharedPayload payload;          // Null for an empty payload
+
+	size_t payload_size() const
+	{
+		return payload ? payload->size() : 0;
+	}
+
+	size_t size() const
+	{
+		return FRAME_PREFIX_SIZE + payload_size();
+	}
+
+	MessageType type() const
+	{
+		// Follows the total length and the magic number
+		return static_cast<MessageType>(prefix[8]);
+	}
+};
+
+/**
+ * @struct FrameSet
+ * @brief The same message encoded once per payload codec, for messages sent
+ * to many clients that may have negotiated different codecs.
+ *
+ * Compressed frames are only built once a recipient needs one, and then
+ * shared by every later recipient with the same WireFormat. A FrameSet is
+ * therefore not thread-safe; copy it to hand it to another thread.
+ */
+struct FrameSet {
+	OutboundFrame frames[PAYLOAD_CODEC_COUNT]; // Indexed by PayloadCodec
+
+	/**
+	 * @brief Returns the frame for a recipient, compressing it first if the
+	 * recipient is the first of its WireFormat.
+	 */
+	const OutboundFrame &for_format(WireFormat format) const;
+
+private:
+	// Indexed by PayloadCodec and FrameCompression; NONE is never used
+	mutable OutboundFrame compressed_[PAYLOAD_CODEC_COUNT][FRAME_COMPRESSION_COUNT];
+	mutable bool compressed_built_[PAYLOAD_CODEC_COUNT][FRAME_COMPRESSION_COUNT] = {};
+};
 
 /**
  * @brief Creates the final byte stream to be sent over the network.
  * It serializes the Packet content to JSON, builds the header, and prepends the total length.
+ * The content is compressed if pkt.compression asks for it and it pays off.
  * @param pkt The Packet object to serialize.
  * @return A vector of bytes ready for sending.
  */
 std::vector<char> create_message_stream(const Packet& pkt);
 
+/**
+ * @brief Encodes the total length prefix and the header of a packet.
+ * @param type The packet's message type.
+ * @param codec The payload's encoding.
+ * @param payload_len The size of the payload that follows the header.
+ * @param out A buffer of at least FRAME_PREFIX_SIZE bytes, e.g. on the stack.
+ * @param correlation_id The request the packet answers, or 0.
+ */
+void encode_frame_prefix(MessageType type, PayloadCodec codec, size_t payload_len,
+                         char *out, uint16_t correlation_id = 0);
+
+/**
+ * @brief Builds an OutboundFrame around a payload the caller already shares.
+ * @param type The packet's message type.
+ * @param payload The payload; may be null for an empty payload.
+ * @param codec The payload's encoding.
+ * @param correlation_id The request the packet answers, or 0.
+ * @return The frame. The payload is referenced, not copied.
+ */
+OutboundFrame make_frame(MessageType type, SharedPayload payload,
+                         PayloadCodec codec = PayloadCodec::JSON,
+                         uint16_t correlation_id = 0);
+
+/**
+ * @brief Builds an OutboundFrame that takes over a payload string.
+ * @param type The packet's message type.
+ * @param payload The payload, moved into the frame without copying. Its
+ * buffer goes back to the BufferPool once the frame has been sent.
+ * @param codec The payload's encoding.
+ * @param correlation_id The request the packet answers, or 0.
+ * @param compression Compresses the payload if that makes it smaller.
+ * @return The frame.
+ */
+OutboundFrame make_frame(MessageType type, std::string payload,
+                         PayloadCodec codec = PayloadCodec::JSON,
+                         uint16_t correlation_id = 0,
+                         FrameCompression compression = FrameCompression::NONE);
+
+/**
+ * @brief Compresses the payload of an encoded frame, e.g. of a cached reply.
+ * @param frame The frame, whose payload must not be compressed yet.
+ * @param compression The compression to use.
+ * @return A frame with the same header fields and a compressed payload, or
+ * a copy of frame that shares its payload if compressing does not make it
+ * smaller.
+ */
+OutboundFrame compress_frame(const OutboundFrame &frame, FrameCompression compression);
+
+/**
+ * @brief Rewrites the correlation ID in a frame's header, e.g. to answer a
+ * request with a copy of a cached frame. The payload is untouched.
+ * @param frame The frame to change.
+ * @param correlation_id The request the frame answers, or 0.
+ */
+void set_correlation_id(OutboundFrame &frame, uint16_t correlation_id);
+
+/**
+ * @brief Sends a packet with gathering sendmsg() calls. The length prefix and
+ * header are encoded on the stack and the payload is sent in place, so
+ * nothing is allocated or copied. Blocks until every byte is written.
+ * @param socket The socket file descriptor.
+ * @param type The packet's message type.
+ * @param payload The payload bytes.
+ * @param codec The payload's encoding.
+ * @param correlation_id The packet's correlation ID, or 0.
+ * @return True on success, false on failure.
+ */
+bool write_packet(int socket, MessageType type, std::string_view payload,
+                  PayloadCodec codec = PayloadCodec::JSON, uint16_t correlation_id = 0);
+
+/**
+ * @brief Sends an OutboundFrame like write_packet().
+ * @param socket The socket file descriptor.
+ * @param frame The frame to send.
+ * @return True on success, false on failure.
+ */
+bool write_frame(int socket, const OutboundFrame& frame);
+
 /**
  * @brief A helper function to read exactly n bytes from a socket.
  * @param socket The socket file descriptor.
@@ -46,12 +215,35 @@ bool read_n_bytes(int socket, size_t n, std::vector<char>& buffer);
 const char* MessageTypeToString(MessageType type);
 
 /**
- * @brief Reads and deserializes a complete packet from the socket.
+ * @brief Returns the name of a FrameError, e.g. "bad_magic".
+ */
+const char *FrameErrorToString(FrameError error);
+
+/**
+ * @brief Reads and deserializes a complete packet from the socket. A
+ * compressed payload is decompressed.
  * @param socket The socket file descriptor to read from.
  * @param pkt A reference to a Packet object to be populated.
+ * @param error If not null, receives why the packet could not be read:
+ * FrameError::NONE for a disconnect between packets.
  * @return True if a packet was successfully read and parsed, false on any
  * failure (e.g., disconnect, bad magic number, incomplete packet).
  */
-bool read_packet(int socket, Packet& pkt);
+bool read_packet(int socket, Packet& pkt, FrameError *error = nullptr);
+
+/**
+ * @brief Decodes one complete packet from the front of a byte buffer in place.
+ * Performs the same checks as read_packet but never touches a socket and
+ * never copies the payload.
+ * @param data The buffered bytes, starting at a length prefix.
+ * @param len The number of buffered bytes.
+ * @param pkt Receives the packet; its content points into data. If
+ * pkt.compressed is set, the content still has to be decompressed.
+ * @param error If not null, receives why the data is invalid.
+ * @return The number of bytes the packet occupied, 0 if the buffer does not
+ * hold a complete packet yet, or -1 if the data is invalid.
+ */
+ssize_t parse_packet(const char *data, size_t len, PacketView& pkt,
+                     FrameError *error = nullptr);
 
 #endif // PROTOCOL_H_
@@ -0,0 +1,94 @@
+#ifndef RESPONSE_CACHE_H_
+#define RESPONSE_CACHE_H_
+
+#include <cstdint>
+#include <vector>
+#include "packet.h"
+#include "protocol.h"
+
+/**
+ * @class ResponseCache
+ * @brief Encoded frames of replies that many requests share.
+ *
+ * A frame is kept per message type and WireFormat, together with a stamp that
+ * identifies the state it was built from: a constant for replies that never
+ * change, the current second for the time, a version counter for the client
+ * list. A request whose stamp matches is answered with the cached frame,
+ * whose payload is shared by every send, so it costs no encoding and no
+ * payload copy. Otherwise the frame is rebuilt and replaces the old one.
+ *
+ * Not thread-safe: each event loop keeps its own cache.
+ */
+class ResponseCache
+{
+public:
+	/**
+	 * @brief Looks up a reply, building it if it is missing or stale.
+	 * @param type The reply's message type.
+	 * @param format The codec and compression of the requesting client.
+	 * @param stamp The state the reply must reflect.
+	 * @param build Called as build() to encode a fresh frame.
+	 * @return The frame, valid until the next call.
+	 */
+	template <typename Build>
+	const OutboundFrame &get(MessageType type, WireFormat format, uint64_t stamp,
+	                         Build &&build)
+	{
+		Entry &entry = entry_for(type, format);
+		if (!entry.valid || entry.stamp != stamp) {
+			entry.frame = build();
+			entry.stamp = stamp;
+			entry.valid = true;
+			misses_++;
+		} else {
+			hits_++;
+		}
+		return entry.frame;
+	}
+
+	/**
+	 * @brief Returns how many lookups were answered from the cache.
+	 */
+	uint64_t hits() const
+	{
+		return hits_;
+	}
+
+	/**
+	 * @brief Returns how many lookups had to build a frame.
+	 */
+	uint64_t misses() const
+	{
+		return misses_;
+	}
+
+private:
+	struct Entry {
+		MessageType type;
+		WireFormat format;
+		uint64_t stamp = 0;
+		bool valid = false;
+		OutboundFrame frame;
+	};
+
+	// A handful of reply types are cached, so a linear search is fastest
+	Entry &entry_for(MessageType type, WireFormat format)
+	{
+		for (auto &entry : entries_) {
+			if (entry.type == type && entry.format.codec == format.codec &&
+			    entry.format.compression == format.compression) {
+				return entry;
+			}
+		}
+		entries_.emplace_back();
+		entries_.back().type = type;
+		entries_.back().format = format;
+		return entries_.back();
+	}
+
+	std::vector<Entry> entries_;
+	uint64_t hits_ = 0;
+	uint64_t misses_ = 0;
+};
+
+#endif // RESPONSE_CACHE_H_
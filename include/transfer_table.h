@@ -0,0 +1,117 @@
+#ifndef TRANSFER_TABLE_H_
+#define TRANSFER_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @class TransferTable
+ * @brief The file transfers being relayed, and the flow-control window of
+ * each.
+ *
+ * A transfer is named by its sender and the transfer ID the sender picked.
+ * The server never holds a file: every chunk is relayed to the receiver as
+ * it arrives, and the table only counts the bytes relayed and those the
+ * receiver acknowledged. A sender that runs more than TRANSFER_WINDOW bytes
+ * ahead of its receiver is cut off, so a transfer of any size takes at most
+ * a window of the receiver's outbound queue. Thread-safe.
+ */
+class TransferTable
+{
+public:
+	/**
+	 * @struct Transfer
+	 * @brief One transfer in progress.
+	 */
+	struct Transfer {
+		uint64_t sender_id = 0;
+		uint32_t transfer_id = 0;
+		uint64_t receiver_id = 0;
+		uint64_t relayed = 0;      // Bytes of chunks relayed to the receiver
+		uint64_t acknowledged = 0; // Bytes the receiver reported stored
+	};
+
+	/**
+	 * @enum ChunkResult
+	 * @brief What to do with a chunk, see chunk().
+	 */
+	enum class ChunkResult {
+		RELAY,      // Send it on to the receiver
+		UNKNOWN,    // No such transfer, e.g. one just aborted; drop it
+		OVER_WINDOW // The sender ignored the window; the transfer was removed
+	};
+
+	/**
+	 * @brief Starts a transfer.
+	 * @param sender_id The client sending the file.
+	 * @param transfer_id The ID the sender picked for it.
+	 * @param receiver_id The client receiving it.
+	 * @param error Receives the reason a transfer cannot start.
+	 * @return True if the transfer was added.
+	 */
+	bool begin(uint64_t sender_id, uint32_t transfer_id, uint64_t receiver_id,
+	           std::string &error);
+
+	/**
+	 * @brief Counts a chunk against its transfer's window.
+	 * @param sender_id The client that sent the chunk.
+	 * @param transfer_id The transfer it belongs to.
+	 * @param bytes Bytes of file data in the chunk.
+	 * @param receiver_id Receives the client to relay the chunk to.
+	 * @return Whether to relay the chunk.
+	 */
+	ChunkResult chunk(uint64_t sender_id, uint32_t transfer_id, size_t bytes,
+	                  uint64_t &receiver_id);
+
+	/**
+	 * @brief Records an acknowledgement, which opens the window again.
+	 * @param sender_id The sender of the file.
+	 * @param transfer_id The transfer acknowledged.
+	 * @param receiver_id The client that acknowledged it. Only the receiver
+	 * of a transfer may.
+	 * @param received Bytes the receiver has stored. Never more than were
+	 * relayed, and never less than it acknowledged before.
+	 * @return True if the acknowledgement is valid and should be passed on to
+	 * the sender.
+	 */
+	bool acknowledge(uint64_t sender_id, uint32_t transfer_id, uint64_t receiver_id,
+	                 uint64_t received);
+
+	/**
+	 * @brief Removes a transfer that one of its ends finished or gave up.
+	 * @param client_id The client ending it: the sender, or the receiver
+	 * turning the file down. A transfer the client sends is looked for first.
+	 * @param peer_id The other end of the transfer.
+	 * @param transfer_id The transfer.
+	 * @return True if there was such a transfer.
+	 */
+	bool end(uint64_t client_id, uint64_t peer_id, uint32_t transfer_id);
+
+	/**
+	 * @brief Removes every transfer a client sends or receives, e.g. once it
+	 * disconnected.
+	 * @param client_id The client.
+	 * @return The transfers removed.
+	 */
+	std::vector<Transfer> remove_client(uint64_t client_id);
+
+private:
+	using Key = std::pair<uint64_t, uint32_t>; // Sender and transfer ID
+
+	void erase(std::map<Key, Transfer>::iterator it);
+
+	std::mutex mutex_;
+	// Ordered by sender, so that a sender's transfers are found together
+	std::map<Key, Transfer> transfers_;
+	// Transfers each client receives, so that a client receiving none need
+	// not be searched for
+	std::unordered_map<uint64_t, size_t> incoming_;
+};
+
+#endif // TRANSFER_TABLE_H_
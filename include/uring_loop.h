@@ -0,0 +1,100 @@
+#ifndef URING_LOOP_H_
+#define URING_LOOP_H_
+
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/uio.h>         // For iovec
+#include <sys/socket.h>      // For msghdr
+#include <linux/io_uring.h>
+#include "event_loop.h"
+
+/**
+ * @class UringLoop
+ * @brief A completion-based reactor built on io_uring.
+ *
+ * Accepts and receives are multishot requests: one submission keeps
+ * producing completions until it is cancelled. Received data lands in a pool
+ * of buffers provided to the kernel up front, so there is no recv() call per
+ * read, and each buffer is handed back as soon as it has been decoded.
+ * Outgoing frames are queued per connection and written with one sendmsg
+ * per connection and loop iteration, gathering each frame's header and
+ * shared payload in place. All new requests of an iteration are
+ * submitted together with the wait for the next completions in a single
+ * io_uring_enter().
+ */
+class UringLoop : public EventLoop
+{
+public:
+	UringLoop(int listen_fd, EventLoopCallbacks callbacks);
+	~UringLoop() override;
+
+	bool init() override;
+	void run(const std::atomic<bool> &running) override;
+	bool send_frame(int socket_fd, const OutboundFrame &frame) override;
+
+private:
+	struct UringConnection : Connection {
+		int socket_fd = -1;
+		int inflight = 0;            // Requests the kernel still references
+		bool closed = false;
+		bool recv_armed = false;
+		bool sending = false;
+		bool flush_scheduled = false; // Queued in flush_list_
+		std::vector<struct iovec> iov;
+		struct msghdr msg;
+	};
+
+	bool setup_ring();
+	bool setup_buffers();
+	struct io_uring_sqe *get_sqe();
+	int enter(unsigned min_complete, bool wait);
+	void process_completions();
+	void flush_sends();
+
+	void arm_accept();
+	void arm_wakeup();
+	void arm_recv(UringConnection *conn);
+	void arm_send(UringConnection *conn);
+	void cancel(uint64_t user_data);
+
+	void handle_accept(int res, uint32_t flags);
+	void handle_recv(UringConnection *conn, int res, uint32_t flags);
+	void handle_send(UringConnection *conn, int res);
+	void recycle_buffer(uint16_t bid);
+	void close_connection(UringConnection *conn);
+	void release_if_done(UringConnection *conn);
+
+	int ring_fd_;
+	int spare_fd_; // Reserved descriptor used to shed connections on EMFILE
+
+	// Submission queue, shared with the kernel
+	void *sq_ring_;
+	size_t sq_ring_size_;
+	unsigned *sq_head_;
+	unsigned *sq_tail_;
+	unsigned *sq_mask_;
+	unsigned *sq_array_;
+	unsigned sq_entries_;
+	unsigned sq_local_tail_;
+	struct io_uring_sqe *sqes_;
+	size_t sqes_size_;
+
+	// Completion queue, shared with the kernel
+	void *cq_ring_;
+	size_t cq_ring_size_;
+	unsigned *cq_head_;
+	unsigned *cq_tail_;
+	unsigned *cq_mask_;
+	struct io_uring_cqe *cqes_;
+
+	// Provided receive buffers
+	char *buffers_;
+	size_t buffers_size_;
+
+	std::unordered_map<int, UringConnection *> connections_; // Open, keyed by fd
+	std::unordered_set<UringConnection *> closing_; // Closed, requests pending
+	std::vector<UringConnection *> flush_list_;     // Sends to submit this turn
+	std::vector<UringConnection *> flushing_;       // flush_list_ while flush_sends() walks it
+};
+
+#endif // URING_LOOP_H_
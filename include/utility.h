@@ -2,6 +2,7 @@
 #define UTILITY_H_
 
 #include <string>
+#include <string_view>
 
 /**
  * @brief Sanitizes a string to prevent terminal injection.
@@ -12,14 +13,58 @@
  */
 inline std::string sanitize_for_terminal(std::string input) {
 	size_t pos = input.find('\x1b');
+	if (pos == std::string::npos) {
+		return input;
+	}
+	// Copy the text between ESCs into a new string. Replacing each ESC in
+	// place would move the rest of the string every time, which a message
+	// full of ESCs turns into quadratic work.
+	std::string output;
+	output.reserve(input.size() + 16);
+	size_t start = 0;
 	while (pos != std::string::npos) {
+		output.append(input, start, pos - start);
 		// Replace \x1b with "[ESC]" so it's visible but harmless
-		input.replace(pos, 1, "[ESC]");
-		// Search for the next one, starting *after* the tag we just inserted
-		// +5 to skip "[ESC]"
-		pos = input.find('\x1b', pos + 5);
+		output.append("[ESC]");
+		start = pos + 1;
+		pos = input.find('\x1b', start);
+	}
+	output.append(input, start, std::string::npos);
+	return output;
+}
+
+/**
+ * @brief Sanitizes a string like sanitize_for_terminal(input), but into
+ * output, whose buffer is reused if it is large enough.
+ */
+inline void sanitize_for_terminal(std::string_view input, std::string &output) {
+	output.clear();
+	size_t start = 0;
+	size_t pos = input.find('\x1b');
+	while (pos != std::string_view::npos) {
+		output.append(input.data() + start, pos - start);
+		output.append("[ESC]");
+		start = pos + 1;
+		pos = input.find('\x1b', start);
+	}
+	output.append(input.data() + start, input.size() - start);
+}
+
+/**
+ * @brief Shortens a string for a log line. Text over the limit is cut and
+ * followed by its full length, e.g. "Hello wo... (5000 bytes)".
+ *
+ * @param input The text to shorten.
+ * @param limit The number of bytes kept of a longer text.
+ * @return The text, or its first limit bytes.
+ */
+inline std::string truncate_for_log(std::string_view input, size_t limit) {
+	if (input.size() <= limit) {
+		return std::string(input);
 	}
-	return input;
+	std::string output(input.substr(0, limit));
+	output.append("... (").append(std::to_string(input.size())).append(" bytes)");
+	return output;
 }
 
 #endif // UTILITY_H_
\ No newline at end of file
@@ -0,0 +1,235 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @struct WorkerStats
+ * @brief Counters of one worker thread.
+ */
+struct WorkerStats {
+	uint64_t tasks = 0;  // Tasks the worker ran
+	uint64_t stolen = 0; // Of those, tasks taken from another worker's queue
+};
+
+/**
+ * @class WorkerPool
+ * @brief A fixed set of threads that run tasks handed to them from any
+ * thread.
+ *
+ * Every worker has a queue of its own. A task submitted by a worker goes to
+ * that worker's queue, and one submitted by another thread, such as an
+ * event loop, goes to the queues in turn. A worker runs the tasks of its
+ * own queue oldest first and, once that is empty, steals the oldest task of
+ * another worker's queue, so that a worker stuck on a long task does not
+ * hold up the tasks queued behind it. Workers with nothing to do sleep
+ * until a task is submitted.
+ *
+ * Tasks submitted together may run at the same time on different workers;
+ * tasks that must run in order go through a SerialQueue.
+ */
+class WorkerPool
+{
+public:
+	using Task = std::function<void()>;
+
+	/**
+	 * @brief Starts the workers.
+	 * @param threads Number of worker threads, at least one.
+	 */
+	explicit WorkerPool(int threads);
+
+	/**
+	 * @brief Stops the pool like stop().
+	 */
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool &operator=(const WorkerPool &) = delete;
+
+	/**
+	 * @brief Queues a task and wakes a sleeping worker, if any. Safe to call
+	 * from any thread, including a worker running a task.
+	 * @param task The task to run.
+	 */
+	void submit(Task task);
+
+	/**
+	 * @brief Runs the tasks still queued, including those they submit, and
+	 * joins the workers. Tasks submitted afterwards are never run.
+	 */
+	void stop();
+
+	/**
+	 * @brief Returns the number of worker threads.
+	 */
+	int size() const;
+
+	/**
+	 * @brief Returns the counters of a worker. Read them after stop().
+	 * @param worker The worker's index, below size().
+	 */
+	const WorkerStats &stats(int worker) const;
+
+	/**
+	 * @brief Returns the index of the calling worker within its pool, or -1
+	 * if the caller is not a worker.
+	 */
+	static int current_worker();
+
+private:
+	struct Worker {
+		std::mutex mutex; // Guards tasks
+		std::deque<Task> tasks;
+		WorkerStats stats;
+		std::thread thread;
+	};
+
+	void run_worker(int index);
+	bool take_task(int index, Task &task);
+
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::atomic<size_t> queued_{0};   // Tasks in all queues together
+	std::atomic<size_t> sleeping_{0}; // Workers waiting on wakeup_
+	std::atomic<uint32_t> next_queue_{0};
+	std::atomic<bool> stopping_{false};
+	std::mutex sleep_mutex_;
+	std::condition_variable wakeup_;
+};
+
+/**
+ * @class SerialQueue
+ * @brief Runs the items posted to it one at a time and in the order they
+ * were posted, on the threads of a WorkerPool.
+ *
+ * A queue only occupies a worker while it has items: the first post()
+ * submits a task that runs the items queued by then, and at most a batch of
+ * them before it resubmits itself, so that a busy queue takes turns with
+ * the others. Items are kept by value, so posting one does not allocate a
+ * task of its own, and an idle queue holds no memory besides its own
+ * object, so that a server can keep one for each of many idle clients.
+ *
+ * @tparam T The item type, e.g. a request to handle.
+ */
+template <typename T>
+class SerialQueue : public std::enable_shared_from_this<SerialQueue<T>>
+{
+public:
+	// Items run before the queue goes to the back of its worker's queue
+	static const size_t BATCH_SIZE = 16;
+	// A drained queue keeps its slots unless it grew past this many
+	static const size_t KEEP_SLOTS = 16;
+
+	/**
+	 * @brief Creates an empty queue.
+	 * @param pool The pool whose workers run the items. Must outlive the
+	 * queue's tasks.
+	 * @param run Called with each item on a worker thread.
+	 */
+	SerialQueue(WorkerPool &pool, std::function<void(T &)> run)
+	    : pool_(pool), run_(std::move(run))
+	{
+	}
+
+	/**
+	 * @brief Appends an item. Safe to call from any thread.
+	 * @param item The item to run after the ones posted before it.
+	 * @return The number of items waiting, this one included.
+	 */
+	size_t post(T item)
+	{
+		bool schedule;
+		size_t waiting;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (closed_) {
+				return 0;
+			}
+			items_.push_back(std::move(item));
+			waiting = items_.size() - head_;
+			schedule = !scheduled_;
+			if (schedule) {
+				scheduled_ = true;
+				keep_alive_ = this->shared_from_this();
+			}
+		}
+		if (schedule) {
+			schedule_drain();
+		}
+		return waiting;
+	}
+
+	/**
+	 * @brief Drops the items not yet run and every item posted later. An
+	 * item already running completes.
+	 */
+	void close()
+	{
+		std::vector<T> dropped;
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		dropped.swap(items_);
+		head_ = 0;
+	}
+
+private:
+	// keep_alive_ holds the queue while a task may refer to it, so the task
+	// captures a plain pointer and fits in a std::function without an
+	// allocation
+	void schedule_drain()
+	{
+		pool_.submit([this]() { drain(); });
+	}
+
+	void drain()
+	{
+		for (size_t i = 0; i < BATCH_SIZE; i++) {
+			T item;
+			// Released after the lock, and possibly the queue with it
+			std::shared_ptr<SerialQueue> self;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (head_ == items_.size()) {
+					if (items_.capacity() > KEEP_SLOTS) {
+						std::vector<T>().swap(items_);
+					} else {
+						items_.clear();
+					}
+					head_ = 0;
+					scheduled_ = false;
+					self = std::move(keep_alive_);
+					return;
+				}
+				item = std::move(items_[head_++]);
+				if (head_ >= KEEP_SLOTS && head_ * 2 >= items_.size()) {
+					// A queue that never quite drains drops its run items here
+					items_.erase(items_.begin(), items_.begin() + head_);
+					head_ = 0;
+				}
+			}
+			run_(item);
+		}
+		// Still scheduled: the remaining items run in a later task
+		schedule_drain();
+	}
+
+	WorkerPool &pool_;
+	std::function<void(T &)> run_;
+	std::mutex mutex_; // Guards the members below
+	std::vector<T> items_; // Items not yet run start at head_
+	size_t head_ = 0;
+	bool scheduled_ = false; // A drain task is queued or running
+	bool closed_ = false;
+	std::shared_ptr<SerialQueue> keep_alive_; // Set while scheduled_
+};
+
+#endif // WORKER_POOL_H_
@@ -0,0 +1,340 @@
+#include <algorithm>       // For std::max
+#include <cerrno>
+#include <cstdio>          // For snprintf
+#include <csignal>         // For signal
+#include <cstdlib>         // For strtoull
+#include <cstring>         // For memset, strerror
+#include <ctime>           // For gmtime_r, strftime
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <arpa/inet.h>     // For inet_pton
+#include <netinet/in.h>    // For sockaddr_in
+#include <netinet/tcp.h>   // For TCP_NODELAY
+#include <sys/socket.h>
+#include <unistd.h>        // For close
+
+#include "include/glog_wrapper.h"
+#include "include/packet.h"
+#include "include/protocol.h"
+#include "include/payload_codec.h"
+#include "include/message_journal.h"
+
+#define SERVER_ADDRESS "127.0.0.1"
+#define SERVER_PORT 4468
+// Messages --deliver-to keeps in flight. Their replies are small, so the
+// server's outbound limit is never near.
+#define DELIVERY_WINDOW 64
+// Payload bytes a delivery may take. The server forwards the text in a
+// MESSAGE_INDICATION, whose from_id may have up to 19 more digits than the
+// request's target_id; the rest of the JSON is shorter than the request's.
+#define MAX_DELIVERY_PAYLOAD (MAX_PAYLOAD_SIZE - 32)
+
+// What to do with the records
+enum class ReplayMode {
+	PRINT,   // Print every record
+	STATE,   // Print what each client sent and received
+	DELIVER  // Send every record to one client through the server
+};
+
+// Settings taken from the command line
+struct ReplayOptions {
+	std::string path;
+	uint64_t from = 0; // Offset of the first record; 0 for the start
+	ReplayMode mode = ReplayMode::PRINT;
+	uint64_t deliver_to = 0;
+	std::string host = SERVER_ADDRESS;
+	int port = SERVER_PORT;
+};
+
+// What one client did, rebuilt from the journal
+struct ClientState {
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t bytes_sent = 0;
+	uint64_t last_time_us = 0; // The last message it sent or received
+};
+
+void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " FILE [--from OFFSET] [--state]\n"
+	          << "       [--deliver-to ID [--host IP] [--port N]]\n"
+	          << "  --from OFFSET    Start at the record at OFFSET, as printed by an\n"
+	          << "                   earlier run (default: the first record)\n"
+	          << "  --state          Print the messages each client sent and received\n"
+	          << "                   instead of the messages\n"
+	          << "  --deliver-to ID  Send every message again to client ID through the\n"
+	          << "                   server, e.g. to show a conversation to an auditor\n"
+	          << "Prints the offset where the journal ends, to resume from.\n";
+}
+
+// Parses a decimal number in [min, max]. Returns false if it is malformed.
+bool parse_number(const char *text, uint64_t min, uint64_t max, uint64_t &value)
+{
+	char *end;
+	errno = 0;
+	value = strtoull(text, &end, 10);
+	return *text != '\0' && *end == '\0' && errno == 0 && value >= min && value <= max;
+}
+
+bool parse_args(int argc, char *argv[], ReplayOptions &options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		uint64_t value;
+		if (arg == "--state") {
+			options.mode = ReplayMode::STATE;
+			continue;
+		}
+		if (arg.compare(0, 2, "--") != 0) {
+			if (!options.path.empty()) {
+				return false;
+			}
+			options.path = arg;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			return false;
+		}
+		if (arg == "--from") {
+			if (!parse_number(argv[++i], 0, UINT64_MAX, options.from)) {
+				return false;
+			}
+		} else if (arg == "--deliver-to") {
+			if (!parse_number(argv[++i], 1, UINT64_MAX, options.deliver_to)) {
+				return false;
+			}
+			options.mode = ReplayMode::DELIVER;
+		} else if (arg == "--host") {
+			options.host = argv[++i];
+		} else if (arg == "--port") {
+			if (!parse_number(argv[++i], 1, 65535, value)) {
+				return false;
+			}
+			options.port = static_cast<int>(value);
+		} else {
+			return false;
+		}
+	}
+	return !options.path.empty();
+}
+
+// Formats a record's time as UTC, e.g. "2025-10-06 06:30:00.123456"
+std::string format_time(uint64_t time_us)
+{
+	time_t seconds = static_cast<time_t>(time_us / 1000000);
+	struct tm parts;
+	gmtime_r(&seconds, &parts);
+	char text[40];
+	size_t length = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &parts);
+	snprintf(text + length, sizeof(text) - length, ".%06u",
+	         static_cast<unsigned>(time_us % 1000000));
+	return text;
+}
+
+// One line per record, written through a large buffer: journals run to
+// millions of records
+void print_records(JournalReader &reader)
+{
+	std::string out;
+	JournalRecord record;
+	while (reader.next(record)) {
+		out += std::to_string(record.offset);
+		out += ' ';
+		out += format_time(record.time_us);
+		out += ' ';
+		out += std::to_string(record.from_id);
+		out += " -> ";
+		out += std::to_string(record.target_id);
+		out += ": ";
+		out += record.text;
+		out += '\n';
+		if (out.size() >= 1024 * 1024) {
+			std::cout.write(out.data(), out.size());
+			out.clear();
+		}
+	}
+	std::cout.write(out.data(), out.size());
+	std::cout.flush();
+}
+
+void print_state(JournalReader &reader)
+{
+	std::map<uint64_t, ClientState> clients;
+	uint64_t records = 0;
+	JournalRecord record;
+	while (reader.next(record)) {
+		ClientState &sender = clients[record.from_id];
+		sender.sent++;
+		sender.bytes_sent += record.text.size();
+		sender.last_time_us = std::max(sender.last_time_us, record.time_us);
+		ClientState &receiver = clients[record.target_id];
+		receiver.received++;
+		receiver.last_time_us = std::max(receiver.last_time_us, record.time_us);
+		records++;
+	}
+	std::cout << "client sent received bytes_sent last_message\n";
+	for (const auto &[client_id, state] : clients) {
+		std::cout << client_id << " " << state.sent << " " << state.received << " "
+		          << state.bytes_sent << " " << format_time(state.last_time_us) << "\n";
+	}
+	std::cout << records << " messages between " << clients.size() << " clients"
+	          << std::endl;
+}
+
+int connect_to_server(const ReplayOptions &options)
+{
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(options.port);
+	if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+		LOG(ERROR) << "[Error] Invalid server address " << options.host;
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 ||
+	    connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0) {
+		LOG(ERROR) << "[Error] Connection failed: " << strerror(errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+// Waits for the reply to the oldest message in flight. The messages are
+// sent untagged, which the server answers in the order they were sent, so
+// it is the reply to that one. Returns false if the connection failed or
+// the message was refused.
+bool await_delivery(int socket, std::deque<uint64_t> &in_flight, uint64_t &delivered_end)
+{
+	Packet pkt;
+	while (read_packet(socket, pkt)) {
+		if (pkt.type != MessageType::SEND_MESSAGE_RESPONSE) {
+			continue;
+		}
+		SendMessageResponse response;
+		if (!decode_payload(PacketView{pkt.type, pkt.content, pkt.codec}, response) ||
+		    !response.success) {
+			LOG(ERROR) << "[Error] The server refused a message: " << response.message;
+			return false;
+		}
+		delivered_end = in_flight.front();
+		in_flight.pop_front();
+		return true;
+	}
+	LOG(ERROR) << "[Error] Lost the connection to the server";
+	return false;
+}
+
+// Encodes the request that delivers a record. JSON escapes a control byte
+// to six bytes, so a record's text may have to be cut to fit in a packet.
+// Dropping a byte of text shortens the payload by at least a byte, except
+// that a cut UTF-8 sequence becomes a three-byte U+FFFD, hence the loop.
+std::string encode_delivery(SendMessageRequest &request, size_t prefix)
+{
+	for (;;) {
+		std::string payload =
+		        encode_payload(PayloadCodec::JSON, MessageType::SEND_MESSAGE_REQUEST, request);
+		if (payload.size() <= MAX_DELIVERY_PAYLOAD || request.message.size() <= prefix) {
+			return payload;
+		}
+		size_t excess = payload.size() - MAX_DELIVERY_PAYLOAD;
+		size_t text = request.message.size() - prefix;
+		request.message.resize(prefix + (text > excess ? text - excess : 0));
+	}
+}
+
+// Sends every record to one client, with a line saying who sent it to whom
+// and when. Returns the offset after the last record the server accepted.
+uint64_t deliver_records(JournalReader &reader, const ReplayOptions &options, bool &complete)
+{
+	complete = false;
+	uint64_t delivered_end = reader.offset();
+	int socket = connect_to_server(options);
+	if (socket < 0) {
+		return delivered_end;
+	}
+
+	std::deque<uint64_t> in_flight; // The end offset of each message sent
+	SendMessageRequest request;
+	request.target_id = options.deliver_to;
+	JournalRecord record;
+	bool failed = false;
+	while (!failed && reader.next(record)) {
+		if (in_flight.size() >= DELIVERY_WINDOW &&
+		    !await_delivery(socket, in_flight, delivered_end)) {
+			failed = true;
+			break;
+		}
+		request.message = "[" + format_time(record.time_us) + " " +
+		                  std::to_string(record.from_id) + " -> " +
+		                  std::to_string(record.target_id) + "] ";
+		size_t prefix = request.message.size();
+		request.message.append(record.text);
+		std::string payload = encode_delivery(request, prefix);
+		// Untagged, so that the replies, and the deliveries to the
+		// recipient, keep the order of the journal
+		if (!write_packet(socket, MessageType::SEND_MESSAGE_REQUEST, payload)) {
+			LOG(ERROR) << "[Error] Failed to send: " << strerror(errno);
+			failed = true;
+			break;
+		}
+		in_flight.push_back(reader.offset());
+	}
+	while (!failed && !in_flight.empty()) {
+		failed = !await_delivery(socket, in_flight, delivered_end);
+	}
+	close(socket);
+	complete = !failed;
+	return delivered_end;
+}
+
+int main(int argc, char *argv[])
+{
+	auto glog = GlogWrapper(argv[0]);
+	signal(SIGPIPE, SIG_IGN);
+
+	ReplayOptions options;
+	if (!parse_args(argc, argv, options)) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	JournalReader reader;
+	std::string error;
+	if (!reader.open(options.path, options.from, error)) {
+		std::cerr << "[Error] " << error << std::endl;
+		return -1;
+	}
+
+	switch (options.mode) {
+	case ReplayMode::PRINT:
+		print_records(reader);
+		break;
+	case ReplayMode::STATE:
+		print_state(reader);
+		break;
+	case ReplayMode::DELIVER: {
+		bool complete;
+		uint64_t end = deliver_records(reader, options, complete);
+		if (!complete) {
+			std::cerr << "[Error] Delivery stopped; resume with --from " << end << std::endl;
+			return -1;
+		}
+		break;
+	}
+	}
+
+	if (reader.offset() < reader.file_size()) {
+		std::cerr << "[Warning] The journal ends in a torn or corrupt record at offset "
+		          << reader.offset() << std::endl;
+	}
+	std::cerr << "[Info] Next offset: " << reader.offset() << std::endl;
+	return 0;
+}
@@ -0,0 +1,488 @@
+#include "include/json_fields.h"
+#include <cstring>         // For memcmp, strchr, strlen
+#ifdef __SSE2__
+#include <emmintrin.h>     // For the 16-byte string scan
+#endif
+
+// Longest integer part of a skipped number that surely fits in a double
+#define MAX_PLAIN_DIGITS 300
+
+// Returns the position of the first '"', '\\', control character or
+// non-ASCII byte at or after pos, or size if there is none. Everything
+// before it is plain string content that needs no further look.
+static size_t find_string_special(const char *data, size_t pos, size_t size)
+{
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i max_control = _mm_set1_epi8(0x1f);
+	while (pos + 16 <= size) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+		// An unsigned byte is a control character if min(byte, 0x1f) == byte
+		__m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, max_control), chunk);
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+		                                            _mm_cmpeq_epi8(chunk, backslash)),
+		                               control);
+		// The sign bit of each byte marks non-ASCII bytes
+		int mask = _mm_movemask_epi8(special) | _mm_movemask_epi8(chunk);
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+		pos += 16;
+	}
+#endif
+	for (; pos < size; pos++) {
+		unsigned char c = data[pos];
+		if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80) {
+			return pos;
+		}
+	}
+	return size;
+}
+
+// Returns the length of the well-formed UTF-8 sequence that starts with a
+// non-ASCII byte at data, or 0 if it is malformed: truncated, overlong, a
+// surrogate or beyond U+10FFFF.
+static size_t utf8_sequence_length(const char *data, size_t size)
+{
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+	size_t len;
+	unsigned char min_second = 0x80, max_second = 0xbf;
+	if (bytes[0] >= 0xc2 && bytes[0] <= 0xdf) {
+		len = 2;
+	} else if (bytes[0] >= 0xe0 && bytes[0] <= 0xef) {
+		len = 3;
+		if (bytes[0] == 0xe0) {
+			min_second = 0xa0; // Overlong
+		} else if (bytes[0] == 0xed) {
+			max_second = 0x9f; // Surrogates
+		}
+	} else if (bytes[0] >= 0xf0 && bytes[0] <= 0xf4) {
+		len = 4;
+		if (bytes[0] == 0xf0) {
+			min_second = 0x90; // Overlong
+		} else if (bytes[0] == 0xf4) {
+			max_second = 0x8f; // Beyond U+10FFFF
+		}
+	} else {
+		return 0;
+	}
+	if (size < len || bytes[1] < min_second || bytes[1] > max_second) {
+		return 0;
+	}
+	for (size_t i = 2; i < len; i++) {
+		if (bytes[i] < 0x80 || bytes[i] > 0xbf) {
+			return 0;
+		}
+	}
+	return len;
+}
+
+// Reads the 4 hex digits of a \u escape. Returns false if they are not hex.
+static bool read_hex4(std::string_view text, size_t pos, uint32_t &value)
+{
+	if (pos + 4 > text.size()) {
+		return false;
+	}
+	value = 0;
+	for (size_t i = pos; i < pos + 4; i++) {
+		char c = text[i];
+		value <<= 4;
+		if (c >= '0' && c <= '9') {
+			value |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			value |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			value |= c - 'A' + 10;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void append_utf8(std::string &out, uint32_t code_point)
+{
+	if (code_point < 0x80) {
+		out.push_back(static_cast<char>(code_point));
+	} else if (code_point < 0x800) {
+		out.push_back(static_cast<char>(0xc0 | code_point >> 6));
+		out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+	} else if (code_point < 0x10000) {
+		out.push_back(static_cast<char>(0xe0 | code_point >> 12));
+		out.push_back(static_cast<char>(0x80 | (code_point >> 6 & 0x3f)));
+		out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+	} else {
+		out.push_back(static_cast<char>(0xf0 | code_point >> 18));
+		out.push_back(static_cast<char>(0x80 | (code_point >> 12 & 0x3f)));
+		out.push_back(static_cast<char>(0x80 | (code_point >> 6 & 0x3f)));
+		out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+	}
+}
+
+// Decodes the escapes of a raw string body. Returns false on an invalid
+// escape, including unpaired surrogates.
+static bool unescape(std::string_view raw, std::string &out)
+{
+	out.clear();
+	out.reserve(raw.size());
+	size_t pos = 0;
+	while (pos < raw.size()) {
+		size_t escape = raw.find('\\', pos);
+		if (escape == std::string_view::npos) {
+			out.append(raw.data() + pos, raw.size() - pos);
+			break;
+		}
+		out.append(raw.data() + pos, escape - pos);
+		if (escape + 1 >= raw.size()) {
+			return false;
+		}
+		pos = escape + 2;
+		switch (raw[escape + 1]) {
+		case '"':
+			out.push_back('"');
+			break;
+		case '\\':
+			out.push_back('\\');
+			break;
+		case '/':
+			out.push_back('/');
+			break;
+		case 'b':
+			out.push_back('\b');
+			break;
+		case 'f':
+			out.push_back('\f');
+			break;
+		case 'n':
+			out.push_back('\n');
+			break;
+		case 'r':
+			out.push_back('\r');
+			break;
+		case 't':
+			out.push_back('\t');
+			break;
+		case 'u': {
+			uint32_t code_point;
+			if (!read_hex4(raw, pos, code_point)) {
+				return false;
+			}
+			pos += 4;
+			if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+				return false;
+			}
+			if (code_point >= 0xd800 && code_point <= 0xdbff) {
+				// A high surrogate must be followed by an escaped low one
+				uint32_t low;
+				if (pos + 2 > raw.size() || raw[pos] != '\\' || raw[pos + 1] != 'u' ||
+				    !read_hex4(raw, pos + 2, low) || low < 0xdc00 || low > 0xdfff) {
+					return false;
+				}
+				pos += 6;
+				code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+			}
+			append_utf8(out, code_point);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+JsonFieldExtractor::JsonFieldExtractor() : count_(0), data_(nullptr), size_(0), pos_(0)
+{
+}
+
+void JsonFieldExtractor::add(std::string_view name, std::string &out)
+{
+	add_field(name, FieldType::STRING, &out);
+}
+
+void JsonFieldExtractor::add(std::string_view name, std::string_view &out)
+{
+	add_field(name, FieldType::VIEW, &out);
+}
+
+void JsonFieldExtractor::add(std::string_view name, uint64_t &out)
+{
+	add_field(name, FieldType::UNSIGNED, &out);
+}
+
+void JsonFieldExtractor::add_field(std::string_view name, FieldType type, void *out)
+{
+	// Callers ask for a fixed handful of members
+	if (count_ < MAX_JSON_FIELDS) {
+		fields_[count_++] = Field{name, type, out, false};
+	}
+}
+
+bool JsonFieldExtractor::extract(std::string_view payload)
+{
+	for (size_t i = 0; i < count_; i++) {
+		fields_[i].found = false;
+	}
+	data_ = payload.data();
+	size_ = payload.size();
+	pos_ = 0;
+
+	skip_whitespace();
+	if (pos_ >= size_ || data_[pos_] != '{') {
+		return false;
+	}
+	pos_++;
+	skip_whitespace();
+	if (pos_ < size_ && data_[pos_] == '}') {
+		pos_++;
+	} else {
+		while (true) {
+			std::string_view name;
+			bool escaped;
+			if (pos_ >= size_ || data_[pos_] != '"' || !read_string(name, escaped) ||
+			    escaped) {
+				return false;
+			}
+			skip_whitespace();
+			if (pos_ >= size_ || data_[pos_] != ':') {
+				return false;
+			}
+			pos_++;
+			skip_whitespace();
+
+			Field *field = find_field(name);
+			if (field != nullptr) {
+				// nlohmann keeps the last of repeated members; leave it to
+				// the full parser
+				if (field->found || !read_value(field)) {
+					return false;
+				}
+				field->found = true;
+			} else if (!skip_value()) {
+				return false;
+			}
+
+			skip_whitespace();
+			if (pos_ >= size_) {
+				return false;
+			}
+			if (data_[pos_] == '}') {
+				pos_++;
+				break;
+			}
+			if (data_[pos_] != ',') {
+				return false;
+			}
+			pos_++;
+			skip_whitespace();
+		}
+	}
+	skip_whitespace();
+	return pos_ == size_;
+}
+
+bool JsonFieldExtractor::found(std::string_view name) const
+{
+	for (size_t i = 0; i < count_; i++) {
+		if (fields_[i].name == name) {
+			return fields_[i].found;
+		}
+	}
+	return false;
+}
+
+bool JsonFieldExtractor::found_all() const
+{
+	for (size_t i = 0; i < count_; i++) {
+		if (!fields_[i].found) {
+			return false;
+		}
+	}
+	return true;
+}
+
+JsonFieldExtractor::Field *JsonFieldExtractor::find_field(std::string_view name)
+{
+	for (size_t i = 0; i < count_; i++) {
+		if (fields_[i].name == name) {
+			return &fields_[i];
+		}
+	}
+	return nullptr;
+}
+
+// Reads the string that starts at pos_ and returns its body without the
+// quotes. escaped tells whether the body still contains escapes.
+bool JsonFieldExtractor::read_string(std::string_view &raw, bool &escaped)
+{
+	size_t start = pos_ + 1;
+	size_t pos = start;
+	escaped = false;
+	while (true) {
+		pos = find_string_special(data_, pos, size_);
+		if (pos >= size_) {
+			return false;
+		}
+		unsigned char c = data_[pos];
+		if (c == '"') {
+			break;
+		}
+		if (c >= 0x80) {
+			// The full parser rejects malformed UTF-8, so this must too
+			size_t len = utf8_sequence_length(data_ + pos, size_ - pos);
+			if (len == 0) {
+				return false;
+			}
+			pos += len;
+			continue;
+		}
+		if (c != '\\') {
+			return false; // Unescaped control character
+		}
+		// Check the escape here so that skipped members are validated too;
+		// stepping over it keeps an escaped quote from ending the string
+		if (pos + 1 >= size_ || std::strchr("\"\\/bfnrtu", data_[pos + 1]) == nullptr ||
+		    data_[pos + 1] == '\0') {
+			return false;
+		}
+		escaped = true;
+		if (data_[pos + 1] != 'u') {
+			pos += 2;
+			continue;
+		}
+		std::string_view text(data_, size_);
+		uint32_t unit;
+		if (!read_hex4(text, pos + 2, unit) || (unit >= 0xdc00 && unit <= 0xdfff)) {
+			return false;
+		}
+		pos += 6;
+		if (unit >= 0xd800 && unit <= 0xdbff) {
+			// A high surrogate must be followed by an escaped low one
+			uint32_t low;
+			if (pos + 2 > size_ || data_[pos] != '\\' || data_[pos + 1] != 'u' ||
+			    !read_hex4(text, pos + 2, low) || low < 0xdc00 || low > 0xdfff) {
+				return false;
+			}
+			pos += 6;
+		}
+	}
+	raw = std::string_view(data_ + start, pos - start);
+	pos_ = pos + 1;
+	return true;
+}
+
+bool JsonFieldExtractor::read_value(Field *field)
+{
+	if (pos_ >= size_) {
+		return false;
+	}
+	if (field->type == FieldType::UNSIGNED) {
+		size_t start = pos_;
+		uint64_t value = 0;
+		while (pos_ < size_ && data_[pos_] >= '0' && data_[pos_] <= '9') {
+			uint64_t digit = data_[pos_] - '0';
+			if (value > (UINT64_MAX - digit) / 10) {
+				return false;
+			}
+			value = value * 10 + digit;
+			pos_++;
+		}
+		size_t digits = pos_ - start;
+		if (digits == 0 || (digits > 1 && data_[start] == '0')) {
+			return false;
+		}
+		// Fractions and exponents are left to the full parser
+		if (pos_ < size_ && (data_[pos_] == '.' || data_[pos_] == 'e' || data_[pos_] == 'E')) {
+			return false;
+		}
+		*static_cast<uint64_t *>(field->out) = value;
+		return true;
+	}
+
+	std::string_view raw;
+	bool escaped;
+	if (data_[pos_] != '"' || !read_string(raw, escaped)) {
+		return false;
+	}
+	if (field->type == FieldType::VIEW) {
+		if (escaped) {
+			return false;
+		}
+		*static_cast<std::string_view *>(field->out) = raw;
+		return true;
+	}
+	std::string &out = *static_cast<std::string *>(field->out);
+	if (escaped) {
+		return unescape(raw, out);
+	}
+	out.assign(raw.data(), raw.size());
+	return true;
+}
+
+bool JsonFieldExtractor::skip_value()
+{
+	if (pos_ >= size_) {
+		return false;
+	}
+	char c = data_[pos_];
+	if (c == '"') {
+		std::string_view raw;
+		bool escaped;
+		return read_string(raw, escaped);
+	}
+	if (c == '-' || (c >= '0' && c <= '9')) {
+		return skip_number();
+	}
+	for (const char *literal : {"true", "false", "null"}) {
+		size_t len = std::strlen(literal);
+		if (size_ - pos_ >= len && memcmp(data_ + pos_, literal, len) == 0) {
+			pos_ += len;
+			return true;
+		}
+	}
+	// Objects and arrays are beyond a flat extractor
+	return false;
+}
+
+// Skips a number: -?(0|[1-9][0-9]*)(\.[0-9]+)?. Exponents and integer
+// parts too long for a double may overflow, which the full parser reports
+// as an error, so those are left to it.
+bool JsonFieldExtractor::skip_number()
+{
+	if (data_[pos_] == '-') {
+		pos_++;
+	}
+	if (pos_ < size_ && data_[pos_] == '0') {
+		pos_++;
+	} else {
+		size_t digits = skip_digits();
+		if (digits == 0 || digits > MAX_PLAIN_DIGITS) {
+			return false;
+		}
+	}
+	if (pos_ < size_ && data_[pos_] == '.') {
+		pos_++;
+		if (skip_digits() == 0) {
+			return false;
+		}
+	}
+	return pos_ >= size_ || (data_[pos_] != 'e' && data_[pos_] != 'E');
+}
+
+size_t JsonFieldExtractor::skip_digits()
+{
+	size_t start = pos_;
+	while (pos_ < size_ && data_[pos_] >= '0' && data_[pos_] <= '9') {
+		pos_++;
+	}
+	return pos_ - start;
+}
+
+void JsonFieldExtractor::skip_whitespace()
+{
+	while (pos_ < size_ && (data_[pos_] == ' ' || data_[pos_] == '\t' ||
+	                        data_[pos_] == '\n' || data_[pos_] == '\r')) {
+		pos_++;
+	}
+}
@@ -0,0 +1,201 @@
+#include "include/json_writer.h"
+#include <charconv>        // For std::to_chars
+
+// U+FFFD, written in place of bytes that are not valid UTF-8
+#define REPLACEMENT_CHARACTER "\xEF\xBF\xBD"
+
+// Returns the range the byte after a UTF-8 lead byte must fall in, and the
+// number of continuation bytes, or false if the byte cannot lead. Ranges
+// narrower than 0x80..0xBF exclude overlong forms, surrogates and code
+// points above U+10FFFF.
+static bool utf8_lead(unsigned char lead, unsigned char &low, unsigned char &high,
+                      size_t &continuations)
+{
+	low = 0x80;
+	high = 0xBF;
+	if (lead >= 0xC2 && lead <= 0xDF) {
+		continuations = 1;
+	} else if (lead >= 0xE0 && lead <= 0xEF) {
+		continuations = 2;
+		if (lead == 0xE0) {
+			low = 0xA0;
+		} else if (lead == 0xED) {
+			high = 0x9F;
+		}
+	} else if (lead >= 0xF0 && lead <= 0xF4) {
+		continuations = 3;
+		if (lead == 0xF0) {
+			low = 0x90;
+		} else if (lead == 0xF4) {
+			high = 0x8F;
+		}
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Counts the bytes of the sequence starting at pos that are valid so far,
+// up to and excluding the first byte that breaks it
+static size_t valid_prefix_length(std::string_view text, size_t pos, size_t &expected)
+{
+	unsigned char low, high;
+	size_t continuations;
+	if (!utf8_lead(static_cast<unsigned char>(text[pos]), low, high, continuations)) {
+		expected = 1;
+		return 0;
+	}
+	expected = 1 + continuations;
+	size_t length = 1;
+	while (length < expected && pos + length < text.size()) {
+		unsigned char c = text[pos + length];
+		if (c < low || c > high) {
+			break;
+		}
+		low = 0x80;
+		high = 0xBF;
+		length++;
+	}
+	return length;
+}
+
+// Returns the length of a complete, valid UTF-8 sequence at pos, or 0
+static size_t utf8_sequence_length(std::string_view text, size_t pos)
+{
+	size_t expected;
+	size_t length = valid_prefix_length(text, pos, expected);
+	return length == expected ? length : 0;
+}
+
+// Returns how many bytes an invalid sequence at pos spans: the lead byte
+// and the continuations that were valid, but not the byte that broke it
+static size_t invalid_sequence_length(std::string_view text, size_t pos)
+{
+	size_t expected;
+	size_t length = valid_prefix_length(text, pos, expected);
+	return length == 0 ? 1 : length;
+}
+
+JsonWriter::JsonWriter(std::string &out) : out_(out), need_comma_(false)
+{
+}
+
+void JsonWriter::begin_object()
+{
+	separate();
+	out_.push_back('{');
+	need_comma_ = false;
+}
+
+void JsonWriter::end_object()
+{
+	out_.push_back('}');
+	need_comma_ = true;
+}
+
+void JsonWriter::begin_array()
+{
+	separate();
+	out_.push_back('[');
+	need_comma_ = false;
+}
+
+void JsonWriter::end_array()
+{
+	out_.push_back(']');
+	need_comma_ = true;
+}
+
+void JsonWriter::key(std::string_view name)
+{
+	value(name);
+	out_.push_back(':');
+	need_comma_ = false;
+}
+
+void JsonWriter::value(uint64_t number)
+{
+	separate();
+	char digits[20];
+	auto result = std::to_chars(digits, digits + sizeof(digits), number);
+	out_.append(digits, result.ptr - digits);
+	need_comma_ = true;
+}
+
+void JsonWriter::value(std::string_view text)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	separate();
+	out_.push_back('"');
+	size_t plain = 0; // Start of the run of characters that need no escape
+	for (size_t i = 0; i < text.size(); i++) {
+		unsigned char c = text[i];
+		if (c >= 0x80) {
+			size_t valid = utf8_sequence_length(text, i);
+			if (valid > 0) {
+				i += valid - 1;
+				continue;
+			}
+			// Replaced like json::dump() with error_handler_t::replace does:
+			// the bytes up to the first that breaks the sequence become one
+			// U+FFFD, and that byte is read again
+			out_.append(text.data() + plain, i - plain);
+			out_.append(REPLACEMENT_CHARACTER);
+			i += invalid_sequence_length(text, i) - 1;
+			plain = i + 1;
+			continue;
+		}
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		out_.append(text.data() + plain, i - plain);
+		plain = i + 1;
+		out_.push_back('\\');
+		switch (c) {
+		case '"':
+			out_.push_back('"');
+			break;
+		case '\\':
+			out_.push_back('\\');
+			break;
+		case '\b':
+			out_.push_back('b');
+			break;
+		case '\f':
+			out_.push_back('f');
+			break;
+		case '\n':
+			out_.push_back('n');
+			break;
+		case '\r':
+			out_.push_back('r');
+			break;
+		case '\t':
+			out_.push_back('t');
+			break;
+		default:
+			out_.append("u00");
+			out_.push_back(hex[c >> 4]);
+			out_.push_back(hex[c & 0xf]);
+			break;
+		}
+	}
+	out_.append(text.data() + plain, text.size() - plain);
+	out_.push_back('"');
+	need_comma_ = true;
+}
+
+void JsonWriter::value(bool flag)
+{
+	separate();
+	out_.append(flag ? "true" : "false");
+	need_comma_ = true;
+}
+
+void JsonWriter::separate()
+{
+	if (need_comma_) {
+		out_.push_back(',');
+	}
+}
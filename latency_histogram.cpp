@@ -0,0 +1,110 @@
+#include "include/latency_histogram.h"
+#include <algorithm>       // For std::min
+#include <cmath>           // For std::ceil
+
+// Bits of a value below its leading one that pick the sub-bucket
+#define SUB_BUCKET_BITS 4
+
+// Adds to a counter that only the calling thread writes. A relaxed load and
+// store cost no more than plain ones; fetch_add would be a locked
+// read-modify-write.
+static void add(std::atomic<uint64_t> &counter, uint64_t amount)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + amount,
+	              std::memory_order_relaxed);
+}
+
+LatencyHistogram::LatencyHistogram() : count_(0), sum_(0), max_(0)
+{
+	for (auto &bucket : buckets_) {
+		bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+size_t LatencyHistogram::bucket_of(uint64_t value)
+{
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+	unsigned int top_bit = 63 - __builtin_clzll(value);
+	unsigned int shift = top_bit - SUB_BUCKET_BITS;
+	size_t sub_bucket = (value >> shift) & (SUB_BUCKETS - 1);
+	return SUB_BUCKETS + shift * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucket_top(size_t bucket)
+{
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	unsigned int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+	uint64_t sub_bucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+	uint64_t bottom = (SUB_BUCKETS + sub_bucket) << shift;
+	return bottom + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+	add(buckets_[bucket_of(value)], 1);
+	add(count_, 1);
+	add(sum_, value);
+	if (value > max_.load(std::memory_order_relaxed)) {
+		max_.store(value, std::memory_order_relaxed);
+	}
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+	for (size_t i = 0; i < BUCKET_COUNT; i++) {
+		uint64_t samples = other.buckets_[i].load(std::memory_order_relaxed);
+		if (samples > 0) {
+			add(buckets_[i], samples);
+		}
+	}
+	add(count_, other.count_.load(std::memory_order_relaxed));
+	add(sum_, other.sum_.load(std::memory_order_relaxed));
+	uint64_t other_max = other.max_.load(std::memory_order_relaxed);
+	if (other_max > max_.load(std::memory_order_relaxed)) {
+		max_.store(other_max, std::memory_order_relaxed);
+	}
+}
+
+uint64_t LatencyHistogram::count() const
+{
+	return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::sum() const
+{
+	return sum_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+	return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+	// The buckets are counted afresh: while the writer records, count_
+	// may be ahead of or behind them
+	uint64_t total = 0;
+	for (const auto &bucket : buckets_) {
+		total += bucket.load(std::memory_order_relaxed);
+	}
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * total));
+	rank = rank < 1 ? 1 : (rank > total ? total : rank);
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKET_COUNT; i++) {
+		seen += buckets_[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			// The top of the highest bucket may lie far above any sample
+			return std::min(bucket_top(i), max());
+		}
+	}
+	return max();
+}
@@ -0,0 +1,722 @@
+#include <algorithm>       // For std::sort, std::min, std::max
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>           // For std::ceil
+#include <csignal>         // For signal
+#include <cstdlib>         // For strtod, strtoull
+#include <cstring>         // For memset, strerror
+#include <iomanip>
+#include <iostream>
+#include <memory>          // For std::unique_ptr
+#include <queue>           // For std::priority_queue
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>     // For inet_pton
+#include <fcntl.h>         // For fcntl
+#include <netinet/in.h>    // For sockaddr_in
+#include <netinet/tcp.h>   // For TCP_NODELAY
+#include <sys/epoll.h>
+#include <sys/resource.h>  // For getrlimit, setrlimit
+#include <sys/socket.h>
+#include <unistd.h>        // For close
+
+#include "include/glog_wrapper.h"
+#include "include/packet.h"
+#include "include/protocol.h"
+#include "include/frame_decoder.h"
+#include "include/payload_codec.h"
+
+#define SERVER_ADDRESS "127.0.0.1"
+#define SERVER_PORT 4468
+#define MAX_EPOLL_EVENTS 256
+// Requests a paced connection may have in flight. A connection that falls
+// further behind sends late, and the latencies, which are measured from the
+// time each request was due, show it.
+#define MAX_PACED_IN_FLIGHT 256
+// How long replies that are still in flight are waited for after the run
+#define DRAIN_TIMEOUT_MS 2000
+
+using Clock = std::chrono::steady_clock;
+
+// A request the load generator sends, and the reply that answers it
+struct RequestKind {
+	const char *name;
+	MessageType request;
+	MessageType response;
+};
+
+static const RequestKind REQUEST_KINDS[] = {
+	{"time", MessageType::GET_TIME_REQUEST, MessageType::GET_TIME_RESPONSE},
+	{"name", MessageType::GET_NAME_REQUEST, MessageType::GET_NAME_RESPONSE},
+	{"list", MessageType::GET_CLIENT_LIST_REQUEST, MessageType::GET_CLIENT_LIST_RESPONSE},
+	{"send", MessageType::SEND_MESSAGE_REQUEST, MessageType::SEND_MESSAGE_RESPONSE},
+};
+static const size_t REQUEST_KIND_COUNT = sizeof(REQUEST_KINDS) / sizeof(REQUEST_KINDS[0]);
+
+// Settings taken from the command line
+struct LoadOptions {
+	std::string host = SERVER_ADDRESS;
+	int port = SERVER_PORT;
+	size_t connections = 100;
+	size_t threads = 0;    // 0 for one per core, at most one per connection
+	double duration = 10;  // Seconds
+	double rate = 0;       // Requests per second over all connections; 0 for unpaced
+	size_t depth = 1;      // Requests each unpaced connection keeps in flight
+	double weights[REQUEST_KIND_COUNT] = {1, 1, 1, 1};
+	size_t message_size = 64;
+	PayloadCodec codec = PayloadCodec::JSON;
+	FrameCompression compression = FrameCompression::NONE;
+};
+
+// A request waiting for its reply
+struct InFlight {
+	Clock::time_point start; // When the request was due, or sent if unpaced
+	size_t kind = 0;
+	bool active = false;
+};
+
+struct Connection {
+	int fd = -1;
+	uint64_t client_id = 0;
+	FrameDecoder decoder;
+	std::string outbox; // Encoded requests the socket did not take yet
+	bool writing = false; // Waiting for EPOLLOUT
+	// Indexed by correlation ID modulo its size, which is a power of two
+	// larger than the number of requests in flight
+	std::vector<InFlight> in_flight;
+	size_t in_flight_count = 0;
+	uint16_t next_correlation_id = 1;
+	Clock::time_point next_due; // Paced runs only
+	bool stalled = false;       // Due, but every in-flight slot is taken
+	bool open = true;
+};
+
+// What one worker thread measured
+struct WorkerStats {
+	std::vector<uint64_t> latencies_ns[REQUEST_KIND_COUNT];
+	uint64_t sent[REQUEST_KIND_COUNT] = {};
+	uint64_t failed[REQUEST_KIND_COUNT] = {}; // Replies that report an error
+	uint64_t indications = 0;  // Messages other connections sent to this one
+	uint64_t unmatched = 0;    // Replies to no request in flight
+	uint64_t lost = 0;         // Requests never answered
+	uint64_t disconnects = 0;
+};
+
+std::atomic<bool> g_stop_sending(false);
+// Client IDs of every connection, for picking SEND_MESSAGE targets. Filled
+// before the workers start and read-only afterwards.
+std::vector<uint64_t> g_client_ids;
+
+void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [--host IP] [--port N] [--connections N]\n"
+	          << "       [--threads N] [--duration S] [--rate R] [--depth N]\n"
+	          << "       [--mix time=W,name=W,list=W,send=W] [--message-size N]\n"
+	          << "       [--codec json|binary] [--compression lz4|lz4-dict]\n"
+	          << "  --connections N   Concurrent connections (default 100)\n"
+	          << "  --threads N       Threads driving them (0 = one per core, default)\n"
+	          << "  --duration S      Seconds to send requests for (default 10)\n"
+	          << "  --rate R          Requests per second over all connections\n"
+	          << "                    (default 0 = as fast as the server answers)\n"
+	          << "  --depth N         Requests each connection keeps in flight when\n"
+	          << "                    no rate is set (default 1)\n"
+	          << "  --mix M           Relative weights of the request types\n"
+	          << "                    (default time=1,name=1,list=1,send=1)\n"
+	          << "  --message-size N  Bytes per SEND_MESSAGE text (default 64)\n"
+	          << "  --codec C         Payload codec to negotiate (default json)\n"
+	          << "  --compression C   Payload compression to negotiate (default none)\n";
+}
+
+// Parses a decimal number in [min, max]. Returns false if it is malformed.
+bool parse_number(const char *text, double min, double max, double &value)
+{
+	char *end;
+	errno = 0;
+	value = strtod(text, &end);
+	return *text != '\0' && *end == '\0' && errno == 0 && value >= min && value <= max;
+}
+
+// Parses a request mix such as "time=1,send=3". Types it leaves out get no
+// requests. Returns false if it is malformed.
+bool parse_mix(const std::string &text, double *weights)
+{
+	std::fill(weights, weights + REQUEST_KIND_COUNT, 0.0);
+	std::stringstream items(text);
+	std::string item;
+	double total = 0;
+	while (std::getline(items, item, ',')) {
+		size_t equals = item.find('=');
+		if (equals == std::string::npos) {
+			return false;
+		}
+		std::string name = item.substr(0, equals);
+		size_t kind = 0;
+		while (kind < REQUEST_KIND_COUNT && name != REQUEST_KINDS[kind].name) {
+			kind++;
+		}
+		double weight;
+		if (kind == REQUEST_KIND_COUNT ||
+		    !parse_number(item.c_str() + equals + 1, 0, 1e6, weight)) {
+			return false;
+		}
+		weights[kind] = weight;
+		total += weight;
+	}
+	return total > 0;
+}
+
+// Parses the command line. Returns false if it is malformed.
+bool parse_args(int argc, char *argv[], LoadOptions &options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		double value;
+		if (i + 1 >= argc) {
+			return false;
+		}
+		if (arg == "--host") {
+			options.host = argv[++i];
+		} else if (arg == "--port") {
+			if (!parse_number(argv[++i], 1, 65535, value)) {
+				return false;
+			}
+			options.port = static_cast<int>(value);
+		} else if (arg == "--connections") {
+			if (!parse_number(argv[++i], 1, 1000000, value)) {
+				return false;
+			}
+			options.connections = static_cast<size_t>(value);
+		} else if (arg == "--threads") {
+			if (!parse_number(argv[++i], 0, 1024, value)) {
+				return false;
+			}
+			options.threads = static_cast<size_t>(value);
+		} else if (arg == "--duration") {
+			if (!parse_number(argv[++i], 0.1, 86400, value)) {
+				return false;
+			}
+			options.duration = value;
+		} else if (arg == "--rate") {
+			if (!parse_number(argv[++i], 0, 1e9, value)) {
+				return false;
+			}
+			options.rate = value;
+		} else if (arg == "--depth") {
+			if (!parse_number(argv[++i], 1, MAX_PACED_IN_FLIGHT, value)) {
+				return false;
+			}
+			options.depth = static_cast<size_t>(value);
+		} else if (arg == "--mix") {
+			if (!parse_mix(argv[++i], options.weights)) {
+				return false;
+			}
+		} else if (arg == "--message-size") {
+			if (!parse_number(argv[++i], 0, MAX_PACKET_SIZE / 2, value)) {
+				return false;
+			}
+			options.message_size = static_cast<size_t>(value);
+		} else if (arg == "--codec") {
+			if (!parse_codec_name(argv[++i], options.codec)) {
+				return false;
+			}
+		} else if (arg == "--compression") {
+			if (!parse_compression_name(argv[++i], options.compression)) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+	if (options.threads == 0) {
+		options.threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	options.threads = std::min(options.threads, options.connections);
+	return true;
+}
+
+// Lift the soft descriptor limit to the hard limit, for runs with tens of
+// thousands of connections
+void raise_fd_limit()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+			LOG(WARNING) << "[Warning] Failed to raise descriptor limit: "
+			             << strerror(errno);
+		}
+	}
+}
+
+// Reads packets until one of the given type arrives. Returns false if the
+// connection fails first.
+bool read_until(int socket, MessageType type, Packet &pkt)
+{
+	while (read_packet(socket, pkt)) {
+		if (pkt.type == type) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Connects, learns the client ID from the greeting and negotiates the
+// payload format, all with blocking calls; then switches the socket to
+// non-blocking for the run. Returns false on failure.
+bool open_connection(const LoadOptions &options, Connection &conn)
+{
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(options.port);
+	if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+		LOG(ERROR) << "[Error] Invalid server address " << options.host;
+		return false;
+	}
+	conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (conn.fd < 0 ||
+	    connect(conn.fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0) {
+		LOG(ERROR) << "[Error] Connection failed: " << strerror(errno);
+		return false;
+	}
+	int one = 1;
+	setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	Packet pkt;
+	NoticeIndication greeting;
+	if (!read_until(conn.fd, MessageType::SYSTEM_NOTICE_INDICATION, pkt) ||
+	    !decode_payload(PacketView{pkt.type, pkt.content, pkt.codec}, greeting)) {
+		LOG(ERROR) << "[Error] No greeting from the server";
+		return false;
+	}
+	// "Hello! Your ID is N"
+	size_t digits = greeting.notice.find_last_of(' ');
+	conn.client_id = strtoull(greeting.notice.c_str() + digits + 1, nullptr, 10);
+
+	HelloRequest hello;
+	hello.codecs.push_back(options.codec);
+	if (options.compression != FrameCompression::NONE) {
+		hello.compressions.push_back(options.compression);
+	}
+	HelloResponse response;
+	if (!write_packet(conn.fd, MessageType::HELLO_REQUEST,
+	                  encode_payload(PayloadCodec::JSON, MessageType::HELLO_REQUEST, hello)) ||
+	    !read_until(conn.fd, MessageType::HELLO_RESPONSE, pkt) ||
+	    !decode_payload(PacketView{pkt.type, pkt.content, pkt.codec}, response) ||
+	    response.codec != options.codec || response.compression != options.compression) {
+		LOG(ERROR) << "[Error] The server did not accept the payload format";
+		return false;
+	}
+
+	fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+// Drives a share of the connections with one epoll instance
+class Worker
+{
+public:
+	Worker(const LoadOptions &options, std::vector<Connection> connections, unsigned seed)
+	    : options_(options), connections_(std::move(connections)), random_(seed),
+	      kind_picker_(options.weights, options.weights + REQUEST_KIND_COUNT),
+	      message_(options.message_size, 'x')
+	{
+		size_t limit = options.rate > 0 ? MAX_PACED_IN_FLIGHT : options.depth;
+		size_t slots = 1;
+		while (slots <= limit) {
+			slots <<= 1;
+		}
+		for (auto &conn : connections_) {
+			conn.in_flight.resize(slots);
+		}
+		in_flight_limit_ = limit;
+		interval_ = options.rate > 0
+		                    ? std::chrono::duration<double>(options.connections / options.rate)
+		                    : std::chrono::duration<double>(0);
+	}
+
+	~Worker()
+	{
+		for (auto &conn : connections_) {
+			if (conn.fd >= 0) {
+				close(conn.fd);
+			}
+		}
+	}
+
+	void run()
+	{
+		epoll_fd_ = epoll_create1(0);
+		for (size_t i = 0; i < connections_.size(); i++) {
+			struct epoll_event event;
+			event.events = EPOLLIN;
+			event.data.u64 = i;
+			epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, connections_[i].fd, &event);
+		}
+
+		// Spread the first requests of paced connections over one interval
+		Clock::time_point now = Clock::now();
+		std::uniform_real_distribution<double> offset(0, interval_.count());
+		for (size_t i = 0; i < connections_.size(); i++) {
+			if (options_.rate > 0) {
+				connections_[i].next_due =
+				        now + std::chrono::duration_cast<Clock::duration>(
+				                      std::chrono::duration<double>(offset(random_)));
+				schedule_.push({connections_[i].next_due, i});
+			} else {
+				fill(i, now);
+			}
+		}
+
+		Clock::time_point drain_deadline;
+		bool draining = false;
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+		for (;;) {
+			now = Clock::now();
+			if (!draining && g_stop_sending) {
+				draining = true;
+				drain_deadline = now + std::chrono::milliseconds(DRAIN_TIMEOUT_MS);
+			}
+			if (draining && (in_flight_total() == 0 || now >= drain_deadline)) {
+				break;
+			}
+			// epoll_pwait2() takes a timeout in nanoseconds; rounding the wait up
+			// to whole milliseconds would add to every paced latency
+			std::chrono::nanoseconds wait = std::chrono::milliseconds(100);
+			if (!draining && options_.rate > 0) {
+				send_due(now);
+				if (!schedule_.empty()) {
+					wait = std::min(wait, std::max<std::chrono::nanoseconds>(
+					                              std::chrono::nanoseconds(0),
+					                              schedule_.top().first - Clock::now()));
+				}
+			}
+			struct timespec timeout;
+			timeout.tv_sec = wait.count() / 1000000000;
+			timeout.tv_nsec = wait.count() % 1000000000;
+
+			int ready = epoll_pwait2(epoll_fd_, events, MAX_EPOLL_EVENTS, &timeout, nullptr);
+			for (int i = 0; i < ready; i++) {
+				size_t index = events[i].data.u64;
+				if (events[i].events & EPOLLOUT) {
+					flush(index);
+				}
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					receive(index, draining);
+				}
+			}
+		}
+
+		for (auto &conn : connections_) {
+			stats_.lost += conn.in_flight_count;
+		}
+		close(epoll_fd_);
+	}
+
+	const WorkerStats &stats() const
+	{
+		return stats_;
+	}
+
+private:
+	using Due = std::pair<Clock::time_point, size_t>;
+
+	size_t in_flight_total() const
+	{
+		size_t total = 0;
+		for (const auto &conn : connections_) {
+			total += conn.open ? conn.in_flight_count : 0;
+		}
+		return total;
+	}
+
+	// Sends every paced request whose time has come
+	void send_due(Clock::time_point now)
+	{
+		while (!schedule_.empty() && schedule_.top().first <= now) {
+			size_t index = schedule_.top().second;
+			schedule_.pop();
+			Connection &conn = connections_[index];
+			if (!conn.open) {
+				continue;
+			}
+			if (conn.in_flight_count < in_flight_limit_) {
+				issue(index, conn.next_due);
+				conn.next_due += std::chrono::duration_cast<Clock::duration>(interval_);
+				schedule_.push({conn.next_due, index});
+			} else {
+				// Rescheduled once a reply frees a slot, and still timed
+				// from when it was due
+				conn.stalled = true;
+			}
+		}
+	}
+
+	// Keeps an unpaced connection's pipeline full
+	void fill(size_t index, Clock::time_point now)
+	{
+		Connection &conn = connections_[index];
+		while (conn.open && conn.in_flight_count < in_flight_limit_) {
+			issue(index, now);
+		}
+	}
+
+	void issue(size_t index, Clock::time_point start)
+	{
+		Connection &conn = connections_[index];
+		size_t kind = kind_picker_(random_);
+
+		Packet pkt;
+		pkt.type = REQUEST_KINDS[kind].request;
+		pkt.codec = options_.codec;
+		pkt.compression = options_.compression;
+		if (pkt.type == MessageType::SEND_MESSAGE_REQUEST) {
+			std::uniform_int_distribution<size_t> target(0, g_client_ids.size() - 1);
+			pkt.content = encode_payload(options_.codec, pkt.type,
+			                             SendMessageRequest{g_client_ids[target(random_)],
+			                                                message_});
+		}
+		if (conn.next_correlation_id == 0) {
+			conn.next_correlation_id = 1;
+		}
+		pkt.correlation_id = conn.next_correlation_id++;
+
+		InFlight &slot = conn.in_flight[pkt.correlation_id & (conn.in_flight.size() - 1)];
+		slot.start = start;
+		slot.kind = kind;
+		slot.active = true;
+		conn.in_flight_count++;
+		stats_.sent[kind]++;
+
+		std::vector<char> frame = create_message_stream(pkt);
+		conn.outbox.append(frame.data(), frame.size());
+		flush(index);
+	}
+
+	void flush(size_t index)
+	{
+		Connection &conn = connections_[index];
+		size_t written = 0;
+		while (written < conn.outbox.size()) {
+			ssize_t result = send(conn.fd, conn.outbox.data() + written,
+			                      conn.outbox.size() - written, MSG_NOSIGNAL);
+			if (result < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					disconnect(index);
+					return;
+				}
+				break;
+			}
+			written += result;
+		}
+		conn.outbox.erase(0, written);
+
+		bool writing = !conn.outbox.empty();
+		if (writing != conn.writing) {
+			struct epoll_event event;
+			event.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+			event.data.u64 = index;
+			epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &event);
+			conn.writing = writing;
+		}
+	}
+
+	void receive(size_t index, bool draining)
+	{
+		Connection &conn = connections_[index];
+		ssize_t result = conn.decoder.read_from(conn.fd);
+		if (result == 0 || (result < 0 && errno != EAGAIN && errno != EINTR)) {
+			disconnect(index);
+			return;
+		}
+
+		PacketView pkt;
+		DecodeStatus status;
+		Clock::time_point now = Clock::now();
+		while ((status = conn.decoder.next(pkt)) == DecodeStatus::PACKET) {
+			if (pkt.type == MessageType::MESSAGE_INDICATION) {
+				stats_.indications++;
+				continue;
+			}
+			InFlight &slot = conn.in_flight[pkt.correlation_id & (conn.in_flight.size() - 1)];
+			if (pkt.correlation_id == 0 || !slot.active ||
+			    REQUEST_KINDS[slot.kind].response != pkt.type) {
+				stats_.unmatched++;
+				continue;
+			}
+			slot.active = false;
+			conn.in_flight_count--;
+			stats_.latencies_ns[slot.kind].push_back(
+			        std::chrono::duration_cast<std::chrono::nanoseconds>(now - slot.start)
+			                .count());
+			if (pkt.type == MessageType::SEND_MESSAGE_RESPONSE) {
+				SendMessageResponse response;
+				if (!decode_payload(pkt, response) || !response.success) {
+					stats_.failed[slot.kind]++;
+				}
+			}
+		}
+		if (status == DecodeStatus::INVALID) {
+			disconnect(index);
+			return;
+		}
+		if (draining) {
+			return;
+		}
+		if (options_.rate <= 0) {
+			fill(index, now);
+		} else if (conn.stalled && conn.in_flight_count < in_flight_limit_) {
+			conn.stalled = false;
+			schedule_.push({conn.next_due, index});
+			send_due(now);
+		}
+	}
+
+	void disconnect(size_t index)
+	{
+		Connection &conn = connections_[index];
+		if (!conn.open) {
+			return;
+		}
+		conn.open = false;
+		stats_.disconnects++;
+		stats_.lost += conn.in_flight_count;
+		conn.in_flight_count = 0;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+	}
+
+	const LoadOptions &options_;
+	std::vector<Connection> connections_;
+	std::mt19937 random_;
+	std::discrete_distribution<size_t> kind_picker_;
+	const std::string message_;
+	size_t in_flight_limit_ = 1;
+	std::chrono::duration<double> interval_; // Between requests of one paced connection
+	std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule_;
+	int epoll_fd_ = -1;
+	WorkerStats stats_;
+};
+
+// Returns the latency below which a fraction of the sorted samples fall
+double percentile_us(const std::vector<uint64_t> &sorted, double fraction)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+	return sorted[std::max<size_t>(rank, 1) - 1] / 1000.0;
+}
+
+void print_report(const LoadOptions &options, const std::vector<std::unique_ptr<Worker>> &workers,
+                  double elapsed)
+{
+	WorkerStats total;
+	for (const auto &worker : workers) {
+		const WorkerStats &stats = worker->stats();
+		for (size_t kind = 0; kind < REQUEST_KIND_COUNT; kind++) {
+			total.latencies_ns[kind].insert(total.latencies_ns[kind].end(),
+			                                stats.latencies_ns[kind].begin(),
+			                                stats.latencies_ns[kind].end());
+			total.sent[kind] += stats.sent[kind];
+			total.failed[kind] += stats.failed[kind];
+		}
+		total.indications += stats.indications;
+		total.unmatched += stats.unmatched;
+		total.lost += stats.lost;
+		total.disconnects += stats.disconnects;
+	}
+
+	std::cout << "Connections: " << options.connections << ", threads: " << options.threads
+	          << ", duration: " << std::fixed << std::setprecision(2) << elapsed << " s, ";
+	if (options.rate > 0) {
+		std::cout << "target rate: " << std::setprecision(0) << options.rate << " req/s\n";
+	} else {
+		std::cout << "unpaced, depth " << options.depth << "\n";
+	}
+	std::cout << std::left << std::setw(26) << "Type" << std::right << std::setw(10)
+	          << "Replies" << std::setw(12) << "Req/s" << std::setw(10) << "p50 us"
+	          << std::setw(10) << "p99 us" << std::setw(10) << "p999 us" << std::setw(10)
+	          << "max us" << std::setw(8) << "Failed" << "\n";
+
+	std::vector<uint64_t> all;
+	uint64_t all_failed = 0;
+	for (size_t kind = 0; kind < REQUEST_KIND_COUNT; kind++) {
+		std::vector<uint64_t> &latencies = total.latencies_ns[kind];
+		if (total.sent[kind] == 0) {
+			continue;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		all.insert(all.end(), latencies.begin(), latencies.end());
+		all_failed += total.failed[kind];
+		std::cout << std::left << std::setw(26) << MessageTypeToString(REQUEST_KINDS[kind].request)
+		          << std::right << std::setw(10) << latencies.size() << std::setw(12)
+		          << std::setprecision(1) << latencies.size() / elapsed << std::setw(10)
+		          << percentile_us(latencies, 0.50) << std::setw(10)
+		          << percentile_us(latencies, 0.99) << std::setw(10)
+		          << percentile_us(latencies, 0.999) << std::setw(10)
+		          << percentile_us(latencies, 1.0) << std::setw(8) << total.failed[kind] << "\n";
+	}
+	std::sort(all.begin(), all.end());
+	std::cout << std::left << std::setw(26) << "TOTAL" << std::right << std::setw(10)
+	          << all.size() << std::setw(12) << all.size() / elapsed << std::setw(10)
+	          << percentile_us(all, 0.50) << std::setw(10) << percentile_us(all, 0.99)
+	          << std::setw(10) << percentile_us(all, 0.999) << std::setw(10)
+	          << percentile_us(all, 1.0) << std::setw(8) << all_failed << "\n";
+	std::cout << total.lost << " requests unanswered, " << total.unmatched
+	          << " unmatched replies, " << total.disconnects << " disconnects, "
+	          << total.indications << " messages received\n";
+}
+
+int main(int argc, char *argv[])
+{
+	auto glog = GlogWrapper(argv[0]);
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+
+	LoadOptions options;
+	if (!parse_args(argc, argv, options)) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	// Every connection is set up before any load starts, so the run only
+	// measures requests
+	std::vector<std::vector<Connection>> shares(options.threads);
+	for (size_t i = 0; i < options.connections; i++) {
+		Connection conn;
+		if (!open_connection(options, conn)) {
+			return -1;
+		}
+		g_client_ids.push_back(conn.client_id);
+		shares[i % options.threads].push_back(std::move(conn));
+	}
+	LOG(INFO) << "[Info] " << options.connections << " connections open, running for "
+	          << options.duration << " s";
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::random_device seed;
+	for (auto &share : shares) {
+		workers.push_back(std::make_unique<Worker>(options, std::move(share), seed()));
+	}
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> threads;
+	for (auto &worker : workers) {
+		threads.emplace_back([&worker]() { worker->run(); });
+	}
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+	g_stop_sending = true;
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	print_report(options, workers, elapsed);
+	return 0;
+}
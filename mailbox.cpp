@@ -0,0 +1,403 @@
+#include "include/mailbox.h"
+#include "include/glog_wrapper.h"
+#include "include/buffer_pool.h"
+#include "include/payload_codec.h"
+#include "include/protocol.h" // For FRAME_PREFIX_SIZE
+#include <algorithm>       // For std::min, std::reverse
+#include <cerrno>
+#include <cstring>         // For memcpy, strerror
+#include <dirent.h>        // For opendir, readdir
+#include <fcntl.h>         // For open
+#include <sys/mman.h>      // For mmap, munmap
+#include <sys/random.h>    // For getrandom
+#include <sys/stat.h>      // For mkdir
+#include <unistd.h>        // For close, ftruncate, pread, unlink
+
+// How long a mailbox is kept after its client went offline
+#define MAILBOX_RETENTION_HOURS 24
+#define SEGMENT_PREFIX "segment-"
+#define SEGMENT_SUFFIX ".mbx"
+
+// Precedes the text of every message in a segment. A record starts on an
+// 8-byte boundary; its position is segment * SEGMENT_SIZE + offset.
+struct MailboxRecord {
+	uint32_t length;   // Bytes of text that follow
+	uint32_t reserved;
+	uint64_t target_id;
+	uint64_t from_id;
+	uint64_t previous; // Position of the target's previous message
+};
+
+static size_t record_size(size_t length)
+{
+	return (sizeof(MailboxRecord) + length + 7) & ~static_cast<size_t>(7);
+}
+
+// Draws a token from the kernel's CSPRNG. 0 stands for no token, so it is
+// never returned. Returns false if getrandom() fails.
+static bool random_token(uint64_t &token)
+{
+	token = 0;
+	while (token == 0) {
+		ssize_t got = getrandom(&token, sizeof(token), 0);
+		if (got < 0 && errno == EINTR) {
+			token = 0;
+			continue;
+		}
+		// Reads of up to 256 bytes are never short
+		if (got != static_cast<ssize_t>(sizeof(token))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Takes as long whatever the tokens, so that the time a claim takes tells
+// nothing about how close a guess came
+static bool same_token(uint64_t a, uint64_t b)
+{
+	volatile uint64_t difference = a ^ b;
+	return difference == 0;
+}
+
+// Bytes of the MESSAGE_INDICATION that delivers a message. JSON escapes
+// control bytes to six and invalid UTF-8 to three, so it is never smaller
+// than the binary encoding, and compression only makes a frame smaller.
+static size_t delivery_size(uint64_t from_id, std::string_view text)
+{
+	static thread_local ChatIndication delivery;
+	delivery.from_id = from_id;
+	delivery.message.assign(text);
+	std::string payload =
+	        encode_payload(PayloadCodec::JSON, MessageType::MESSAGE_INDICATION, delivery);
+	size_t size = FRAME_PREFIX_SIZE + payload.size();
+	BufferPool::give(std::move(payload));
+	return size;
+}
+
+static bool read_exactly(int fd, void *data, size_t size, off_t offset)
+{
+	char *out = static_cast<char *>(data);
+	while (size > 0) {
+		ssize_t got = pread(fd, out, size, offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		out += got;
+		size -= got;
+		offset += got;
+	}
+	return true;
+}
+
+Mailbox::~Mailbox()
+{
+	if (segment_map_ != nullptr) {
+		munmap(segment_map_, SEGMENT_SIZE);
+	}
+	if (segment_fd_ >= 0) {
+		close(segment_fd_);
+	}
+}
+
+bool Mailbox::open(const std::string &directory, size_t max_bytes, std::string &error)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	max_bytes_ = std::min(max_bytes, MAX_MAILBOX_BYTES);
+
+	if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST) {
+		error = "Cannot create " + directory + ": " + strerror(errno);
+		return false;
+	}
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		error = "Cannot open " + directory + ": " + strerror(errno);
+		return false;
+	}
+	std::string_view prefix = SEGMENT_PREFIX;
+	std::string_view suffix = SEGMENT_SUFFIX;
+	while (struct dirent *entry = readdir(dir)) {
+		std::string_view name = entry->d_name;
+		if (name.size() > prefix.size() + suffix.size() &&
+		    name.substr(0, prefix.size()) == prefix &&
+		    name.substr(name.size() - suffix.size()) == suffix) {
+			unlink((directory + "/" + entry->d_name).c_str());
+		}
+	}
+	closedir(dir);
+
+	directory_ = directory;
+	if (!start_segment(error)) {
+		return false;
+	}
+	open_ = true;
+	return true;
+}
+
+bool Mailbox::is_open() const
+{
+	return open_;
+}
+
+uint64_t Mailbox::add_client(uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = owners_.find(client_id);
+	if (it != owners_.end()) {
+		return it->second.token;
+	}
+	uint64_t token;
+	if (!random_token(token)) {
+		LOG(ERROR) << "[Error] getrandom() failed: " << strerror(errno);
+		return 0;
+	}
+	owners_[client_id].token = token;
+	return token;
+}
+
+void Mailbox::client_offline(uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto now = Clock::now();
+	expire_owners(now);
+	auto it = owners_.find(client_id);
+	if (it == owners_.end() || !it->second.online) {
+		return;
+	}
+	it->second.online = false;
+	it->second.expires = now + std::chrono::hours(MAILBOX_RETENTION_HOURS);
+	expiry_.emplace_back(it->second.expires, client_id);
+}
+
+Mailbox::StoreResult Mailbox::store(uint64_t target_id, uint64_t from_id,
+                                    std::string_view text)
+{
+	// Measured before taking the lock
+	size_t delivery = delivery_size(from_id, text);
+	if (delivery > FRAME_PREFIX_SIZE + MAX_PAYLOAD_SIZE) {
+		return StoreResult::TOO_LONG;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	expire_owners(Clock::now());
+	auto it = owners_.find(target_id);
+	if (it == owners_.end() || it->second.online) {
+		return StoreResult::UNKNOWN;
+	}
+	Owner &owner = it->second;
+	if (owner.count >= MAX_MAILBOX_MESSAGES || owner.bytes + delivery > max_bytes_) {
+		return StoreResult::FULL;
+	}
+
+	size_t size = record_size(text.size());
+	if (segment_map_ == nullptr || segment_used_ + size > SEGMENT_SIZE) {
+		finish_segment();
+		std::string error;
+		if (!start_segment(error)) {
+			LOG(ERROR) << "[Error] Mailbox cannot start a segment: " << error;
+			return StoreResult::FULL;
+		}
+	}
+
+	MailboxRecord record = {};
+	record.length = static_cast<uint32_t>(text.size());
+	record.target_id = target_id;
+	record.from_id = from_id;
+	record.previous = owner.newest;
+	char *out = segment_map_ + segment_used_;
+	memcpy(out, &record, sizeof(record));
+	memcpy(out + sizeof(record), text.data(), text.size());
+
+	owner.newest = segment_ * SEGMENT_SIZE + segment_used_;
+	owner.count++;
+	owner.bytes += delivery;
+	if (owner.segments.empty() || owner.segments.back().first != segment_) {
+		owner.segments.emplace_back(segment_, 0);
+	}
+	owner.segments.back().second++;
+	live_[segment_]++;
+	segment_used_ += size;
+	stats_.stored++;
+	return StoreResult::STORED;
+}
+
+bool Mailbox::claim(uint64_t client_id, uint64_t token, std::vector<Message> &messages)
+{
+	Owner owner;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		expire_owners(Clock::now());
+		auto it = owners_.find(client_id);
+		if (it == owners_.end() || it->second.online || !same_token(it->second.token, token)) {
+			return false;
+		}
+		owner = std::move(it->second);
+		owners_.erase(it);
+	}
+
+	// The segments stay on disk until released below, so they are read
+	// without the lock
+	bool complete = read_messages(client_id, owner, messages);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	release_segments(owner);
+	stats_.delivered += messages.size();
+	stats_.expired += owner.count - messages.size();
+	return complete;
+}
+
+MailboxStats Mailbox::stats()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+bool Mailbox::start_segment(std::string &error)
+{
+	uint64_t segment = segment_ + 1;
+	std::string path = segment_path(segment);
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		error = "Cannot create " + path + ": " + strerror(errno);
+		return false;
+	}
+	if (ftruncate(fd, SEGMENT_SIZE) < 0) {
+		error = "Cannot size " + path + ": " + strerror(errno);
+		close(fd);
+		unlink(path.c_str());
+		return false;
+	}
+	void *map = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		error = "Cannot map " + path + ": " + strerror(errno);
+		close(fd);
+		unlink(path.c_str());
+		return false;
+	}
+	segment_ = segment;
+	segment_fd_ = fd;
+	segment_map_ = static_cast<char *>(map);
+	segment_used_ = 0;
+	live_[segment_] = 0;
+	stats_.segments++;
+	return true;
+}
+
+// Leaves the segment to be read by claim() only, or deletes it right away
+// if none of its messages is waiting
+void Mailbox::finish_segment()
+{
+	if (segment_map_ == nullptr) {
+		return;
+	}
+	munmap(segment_map_, SEGMENT_SIZE);
+	close(segment_fd_);
+	segment_map_ = nullptr;
+	segment_fd_ = -1;
+	auto it = live_.find(segment_);
+	if (it != live_.end() && it->second == 0) {
+		unlink(segment_path(segment_).c_str());
+		live_.erase(it);
+	}
+}
+
+void Mailbox::expire_owners(Clock::time_point now)
+{
+	while (!expiry_.empty() && expiry_.front().first <= now) {
+		auto it = owners_.find(expiry_.front().second);
+		if (it != owners_.end() && !it->second.online &&
+		    it->second.expires == expiry_.front().first) {
+			stats_.expired += it->second.count;
+			release_segments(it->second);
+			owners_.erase(it);
+		}
+		expiry_.pop_front();
+	}
+}
+
+void Mailbox::release_segments(const Owner &owner)
+{
+	for (const auto &[segment, count] : owner.segments) {
+		auto it = live_.find(segment);
+		if (it == live_.end()) {
+			continue;
+		}
+		it->second -= std::min(it->second, count);
+		if (it->second == 0 && segment != segment_) {
+			unlink(segment_path(segment).c_str());
+			live_.erase(it);
+		}
+	}
+}
+
+// Follows the owner's chain from its newest message back. The segment being
+// written is read through the file as well, which shares the mapping's pages.
+bool Mailbox::read_messages(uint64_t client_id, const Owner &owner,
+                            std::vector<Message> &messages)
+{
+	messages.reserve(owner.count);
+	uint64_t position = owner.newest;
+	uint64_t open_segment = 0;
+	int fd = -1;
+	bool complete = true;
+	char buffer[512];
+	for (uint32_t i = 0; i < owner.count; i++) {
+		uint64_t segment = position / SEGMENT_SIZE;
+		off_t offset = static_cast<off_t>(position % SEGMENT_SIZE);
+		if (fd < 0 || segment != open_segment) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			fd = ::open(segment_path(segment).c_str(), O_RDONLY | O_CLOEXEC);
+			open_segment = segment;
+			if (fd < 0) {
+				LOG(ERROR) << "[Error] Cannot open mailbox segment " << segment << ": "
+				           << strerror(errno);
+				complete = false;
+				break;
+			}
+		}
+		// Most messages are short enough to come with their header in one
+		// read; the rest of a longer one is read on its own
+		size_t head = std::min(sizeof(buffer), SEGMENT_SIZE - static_cast<size_t>(offset));
+		MailboxRecord record;
+		bool valid = head >= sizeof(record) && read_exactly(fd, buffer, head, offset);
+		if (valid) {
+			memcpy(&record, buffer, sizeof(record));
+			valid = record.target_id == client_id &&
+			        offset + record_size(record.length) <= SEGMENT_SIZE;
+		}
+		Message message;
+		if (valid) {
+			size_t first = std::min<size_t>(record.length, head - sizeof(record));
+			message.from_id = record.from_id;
+			message.text.assign(buffer + sizeof(record), first);
+			message.text.resize(record.length);
+			valid = read_exactly(fd, message.text.data() + first, record.length - first,
+			                     offset + sizeof(record) + first);
+		}
+		if (!valid) {
+			LOG(ERROR) << "[Error] Mailbox segment " << segment << " is corrupt at " << offset;
+			complete = false;
+			break;
+		}
+		messages.push_back(std::move(message));
+		position = record.previous;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	std::reverse(messages.begin(), messages.end());
+	return complete;
+}
+
+std::string Mailbox::segment_path(uint64_t segment) const
+{
+	return directory_ + "/" SEGMENT_PREFIX + std::to_string(segment) + SEGMENT_SUFFIX;
+}
@@ -0,0 +1,385 @@
+#include "include/message_journal.h"
+#include "include/glog_wrapper.h"
+#include "include/protocol.h" // For MAX_PACKET_SIZE
+#include <algorithm>       // For std::max
+#include <cerrno>
+#include <chrono>
+#include <cstring>         // For memcmp, memcpy, memmove, strerror
+#include <fcntl.h>         // For open
+#include <sys/stat.h>      // For fstat
+#include <unistd.h>        // For close, fdatasync, ftruncate, lseek, read, write
+
+// Bytes a JournalReader reads at once
+#define JOURNAL_READ_BLOCK (1024 * 1024)
+// A batch buffer that grew past this during a burst is given back afterwards
+#define JOURNAL_KEEP_BATCH_BYTES (1024 * 1024)
+
+static_assert(MAX_JOURNAL_TEXT_SIZE == MAX_PACKET_SIZE,
+              "every message the server sends must fit in a journal record");
+
+static void put_u32(char *out, uint32_t value)
+{
+	for (int i = 0; i < 4; i++) {
+		out[i] = static_cast<char>(value >> (8 * i));
+	}
+}
+
+static void put_u64(char *out, uint64_t value)
+{
+	for (int i = 0; i < 8; i++) {
+		out[i] = static_cast<char>(value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const char *in)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t get_u64(const char *in)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+	}
+	return value;
+}
+
+// CRC-32C (Castagnoli), eight bytes per step with the slicing-by-8 tables
+struct Crc32cTables {
+	uint32_t table[8][256];
+
+	Crc32cTables()
+	{
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+			}
+			table[0][i] = crc;
+		}
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int k = 1; k < 8; k++) {
+				table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+			}
+		}
+	}
+};
+
+static uint32_t crc32c(const char *data, size_t size)
+{
+	static const Crc32cTables tables;
+	const uint32_t(*t)[256] = tables.table;
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+	uint32_t crc = 0xFFFFFFFFu;
+	for (; size >= 8; p += 8, size -= 8) {
+		uint32_t low = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24);
+		crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^
+		      t[4][low >> 24] ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+	}
+	for (; size > 0; p++, size--) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+	}
+	return ~crc;
+}
+
+// The checksum covers everything after the checksum field itself
+static uint32_t record_checksum(const char *record, size_t length)
+{
+	return crc32c(record + 4, JOURNAL_HEADER_SIZE - 4 + length);
+}
+
+static bool write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+JournalReader::~JournalReader()
+{
+	if (fd_ >= 0) {
+		close(fd_);
+	}
+}
+
+bool JournalReader::open(const std::string &path, uint64_t offset, std::string &error)
+{
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0) {
+		error = "Cannot open " + path + ": " + strerror(errno);
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd_, &info) < 0) {
+		error = "Cannot stat " + path + ": " + strerror(errno);
+		return false;
+	}
+	file_size_ = static_cast<uint64_t>(info.st_size);
+	char magic[sizeof(JOURNAL_MAGIC)];
+	if (pread(fd_, magic, sizeof(magic), 0) != static_cast<ssize_t>(sizeof(magic)) ||
+	    memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0) {
+		error = path + " is not a message journal";
+		return false;
+	}
+	if (offset == 0) {
+		offset = sizeof(JOURNAL_MAGIC);
+	}
+	if (offset < sizeof(JOURNAL_MAGIC) || offset > file_size_) {
+		error = "Offset " + std::to_string(offset) + " is outside the journal";
+		return false;
+	}
+	if (lseek(fd_, static_cast<off_t>(offset), SEEK_SET) < 0) {
+		error = "Cannot seek in " + path + ": " + strerror(errno);
+		return false;
+	}
+	offset_ = offset;
+	buffer_.resize(JOURNAL_READ_BLOCK);
+	return true;
+}
+
+bool JournalReader::next(JournalRecord &record)
+{
+	if (offset_ + JOURNAL_HEADER_SIZE > file_size_ || !fill(JOURNAL_HEADER_SIZE)) {
+		return false;
+	}
+	const char *header = buffer_.data() + start_;
+	uint32_t length = get_u32(header + 4);
+	// append() writes no longer text; a longer length is a corrupt header
+	if (length > MAX_JOURNAL_TEXT_SIZE || offset_ + JOURNAL_HEADER_SIZE + length > file_size_ ||
+	    !fill(JOURNAL_HEADER_SIZE + length)) {
+		return false;
+	}
+	header = buffer_.data() + start_;
+	if (get_u32(header) != record_checksum(header, length)) {
+		return false;
+	}
+	record.offset = offset_;
+	record.time_us = get_u64(header + 8);
+	record.from_id = get_u64(header + 16);
+	record.target_id = get_u64(header + 24);
+	record.text = std::string_view(header + JOURNAL_HEADER_SIZE, length);
+	start_ += JOURNAL_HEADER_SIZE + length;
+	offset_ += JOURNAL_HEADER_SIZE + length;
+	return true;
+}
+
+uint64_t JournalReader::offset() const
+{
+	return offset_;
+}
+
+uint64_t JournalReader::file_size() const
+{
+	return file_size_;
+}
+
+// Makes at least needed unread bytes available. Returns false if the file
+// ends first.
+bool JournalReader::fill(size_t needed)
+{
+	if (end_ - start_ >= needed) {
+		return true;
+	}
+	memmove(buffer_.data(), buffer_.data() + start_, end_ - start_);
+	end_ -= start_;
+	start_ = 0;
+	if (buffer_.size() < needed) {
+		buffer_.resize(std::max(needed, buffer_.size() * 2));
+	}
+	while (end_ < needed) {
+		ssize_t got = read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		end_ += got;
+	}
+	return true;
+}
+
+MessageJournal::~MessageJournal()
+{
+	stop();
+	if (fd_ >= 0) {
+		close(fd_);
+	}
+}
+
+bool MessageJournal::open(const std::string &path, std::string &error)
+{
+	fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd_ < 0) {
+		error = "Cannot open " + path + ": " + strerror(errno);
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd_, &info) < 0) {
+		error = "Cannot stat " + path + ": " + strerror(errno);
+		return false;
+	}
+
+	if (info.st_size == 0) {
+		if (!write_all(fd_, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) || fdatasync(fd_) < 0) {
+			error = "Cannot write " + path + ": " + strerror(errno);
+			return false;
+		}
+		start_offset_ = sizeof(JOURNAL_MAGIC);
+	} else {
+		// Appends go after the last complete record
+		JournalReader reader;
+		if (!reader.open(path, 0, error)) {
+			return false;
+		}
+		JournalRecord record;
+		while (reader.next(record)) {
+		}
+		start_offset_ = reader.offset();
+		if (start_offset_ < reader.file_size()) {
+			LOG(WARNING) << "[Warning] Cutting " << reader.file_size() - start_offset_
+			             << " bytes of a torn record off the end of " << path;
+			if (ftruncate(fd_, static_cast<off_t>(start_offset_)) < 0) {
+				error = "Cannot truncate " + path + ": " + strerror(errno);
+				return false;
+			}
+		}
+	}
+
+	open_ = true;
+	writer_ = std::thread(&MessageJournal::run_writer, this);
+	return true;
+}
+
+bool MessageJournal::is_open() const
+{
+	return open_;
+}
+
+void MessageJournal::append(uint64_t from_id, uint64_t target_id, std::string_view text)
+{
+	if (!open_) {
+		return;
+	}
+	// A longer record would read back as corrupt and cut the journal there
+	if (text.size() > MAX_JOURNAL_TEXT_SIZE) {
+		text = text.substr(0, MAX_JOURNAL_TEXT_SIZE);
+	}
+	auto now = std::chrono::system_clock::now().time_since_epoch();
+	char header[JOURNAL_HEADER_SIZE];
+	put_u32(header, 0); // The checksum, filled in by the writer
+	put_u32(header + 4, static_cast<uint32_t>(text.size()));
+	put_u64(header + 8, std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+	put_u64(header + 16, from_id);
+	put_u64(header + 24, target_id);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (pending_.size() >= MAX_PENDING_BYTES) {
+		stats_.stalls++;
+		room_.wait(lock, [this]() { return pending_.size() < MAX_PENDING_BYTES || stopping_; });
+	}
+	if (stopping_) {
+		return;
+	}
+	// The writer only sleeps while nothing is pending
+	bool wake = pending_.empty();
+	pending_.append(header, sizeof(header));
+	pending_.append(text);
+	lock.unlock();
+	if (wake) {
+		wakeup_.notify_one();
+	}
+}
+
+void MessageJournal::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wakeup_.notify_all();
+	room_.notify_all();
+	if (writer_.joinable()) {
+		writer_.join();
+	}
+}
+
+JournalStats MessageJournal::stats()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+uint64_t MessageJournal::start_offset() const
+{
+	return start_offset_;
+}
+
+// Takes everything pending as one batch, so that the records appended
+// while a batch is synced share the next sync
+void MessageJournal::run_writer()
+{
+	std::string batch;
+	uint64_t file_end = start_offset_;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wakeup_.wait(lock, [this]() { return !pending_.empty() || stopping_; });
+			if (pending_.empty()) {
+				return;
+			}
+			// pending_ keeps the capacity of the previous batch
+			batch.swap(pending_);
+		}
+		room_.notify_all();
+
+		uint64_t records = 0;
+		for (size_t at = 0; at < batch.size(); records++) {
+			char *record = &batch[at];
+			uint32_t length = get_u32(record + 4);
+			put_u32(record, record_checksum(record, length));
+			at += JOURNAL_HEADER_SIZE + length;
+		}
+		bool written = write_all(fd_, batch.data(), batch.size()) && fdatasync(fd_) == 0;
+		if (written) {
+			file_end += batch.size();
+		} else {
+			LOG(ERROR) << "[Error] Failed to write " << records
+			           << " journal records: " << strerror(errno);
+			// Later records must not follow a torn one
+			if (ftruncate(fd_, static_cast<off_t>(file_end)) < 0) {
+				LOG(ERROR) << "[Error] Failed to truncate the journal: " << strerror(errno);
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (written) {
+				stats_.records += records;
+				stats_.bytes += batch.size();
+				stats_.syncs++;
+			} else {
+				stats_.write_errors++;
+			}
+		}
+		if (batch.capacity() > JOURNAL_KEEP_BATCH_BYTES) {
+			std::string().swap(batch);
+		} else {
+			batch.clear();
+		}
+	}
+}
@@ -0,0 +1,278 @@
+#include "include/metrics.h"
+#include <atomic>
+#include <chrono>          // For std::chrono::steady_clock
+#include <cstring>         // For strcmp
+#include <iomanip>         // For std::setprecision
+#include <mutex>
+#include <sstream>         // For std::ostringstream
+#include <utility>         // For std::pair
+#include <vector>
+
+// Metric names in the text format start with this
+#define METRIC_PREFIX "chat_"
+// Percentiles reported for every request type
+#define LATENCY_QUANTILES {0.5, 0.9, 0.99, 0.999}
+
+// One thread's metrics. Only that thread writes them; snapshot() reads them
+// from any thread.
+struct ThreadMetrics {
+	std::atomic<uint64_t> counters[COUNTER_COUNT];
+	std::atomic<uint64_t> frame_errors[FRAME_ERROR_COUNT];
+	std::atomic<uint64_t> frames_in[MESSAGE_TYPE_SLOTS];
+	std::atomic<uint64_t> frames_out[MESSAGE_TYPE_SLOTS];
+	// Allocated on the first sample of a type, then never replaced
+	std::atomic<LatencyHistogram *> latency[MESSAGE_TYPE_SLOTS];
+
+	~ThreadMetrics()
+	{
+		for (auto &histogram : latency) {
+			delete histogram.load(std::memory_order_relaxed);
+		}
+	}
+};
+
+// The metrics of every thread that has recorded something
+struct MetricsRegistry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+
+static const std::chrono::steady_clock::time_point g_start_time = std::chrono::steady_clock::now();
+
+static thread_local ThreadMetrics *t_metrics = nullptr;
+
+static MetricsRegistry &registry()
+{
+	static MetricsRegistry instance;
+	return instance;
+}
+
+static ThreadMetrics &local_metrics()
+{
+	if (__builtin_expect(t_metrics == nullptr, 0)) {
+		// Value-initialized, so every count starts at zero
+		auto metrics = std::make_unique<ThreadMetrics>();
+		t_metrics = metrics.get();
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		registry().threads.push_back(std::move(metrics));
+	}
+	return *t_metrics;
+}
+
+// Adds to a count that only the calling thread writes, see LatencyHistogram
+static void add(std::atomic<uint64_t> &count, uint64_t amount)
+{
+	count.store(count.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void Metrics::count(Counter which, uint64_t amount)
+{
+	add(local_metrics().counters[static_cast<size_t>(which)], amount);
+}
+
+void Metrics::count_frame_error(FrameError error)
+{
+	add(local_metrics().frame_errors[static_cast<size_t>(error)], 1);
+}
+
+void Metrics::count_frame_in(MessageType type)
+{
+	add(local_metrics().frames_in[static_cast<size_t>(type)], 1);
+}
+
+void Metrics::count_frame_out(MessageType type)
+{
+	add(local_metrics().frames_out[static_cast<size_t>(type)], 1);
+}
+
+void Metrics::record_latency(MessageType type, uint64_t nanoseconds)
+{
+	auto &slot = local_metrics().latency[static_cast<size_t>(type)];
+	LatencyHistogram *histogram = slot.load(std::memory_order_relaxed);
+	if (histogram == nullptr) {
+		histogram = new LatencyHistogram();
+		// Release, so a snapshot that sees the pointer sees a zeroed histogram
+		slot.store(histogram, std::memory_order_release);
+	}
+	histogram->record(nanoseconds);
+}
+
+MetricsSnapshot Metrics::snapshot()
+{
+	MetricsSnapshot snapshot;
+	snapshot.uptime_seconds = std::chrono::duration_cast<std::chrono::seconds>(
+	                                  std::chrono::steady_clock::now() - g_start_time)
+	                                  .count();
+
+	std::lock_guard<std::mutex> lock(registry().mutex);
+	for (const auto &thread : registry().threads) {
+		for (size_t i = 0; i < COUNTER_COUNT; i++) {
+			snapshot.counters[i] += thread->counters[i].load(std::memory_order_relaxed);
+		}
+		for (size_t i = 0; i < FRAME_ERROR_COUNT; i++) {
+			snapshot.frame_errors[i] += thread->frame_errors[i].load(std::memory_order_relaxed);
+		}
+		for (size_t i = 0; i < MESSAGE_TYPE_SLOTS; i++) {
+			snapshot.frames_in[i] += thread->frames_in[i].load(std::memory_order_relaxed);
+			snapshot.frames_out[i] += thread->frames_out[i].load(std::memory_order_relaxed);
+			const LatencyHistogram *histogram =
+			        thread->latency[i].load(std::memory_order_acquire);
+			if (histogram == nullptr) {
+				continue;
+			}
+			if (!snapshot.latency[i]) {
+				snapshot.latency[i] = std::make_unique<LatencyHistogram>();
+			}
+			snapshot.latency[i]->merge(*histogram);
+		}
+	}
+	return snapshot;
+}
+
+const char *CounterToString(Counter which)
+{
+	switch (which) {
+	case Counter::BYTES_IN:
+		return "bytes_in";
+	case Counter::BYTES_OUT:
+		return "bytes_out";
+	case Counter::CLIENTS_ACCEPTED:
+		return "clients_accepted";
+	case Counter::CLIENTS_CLOSED:
+		return "clients_closed";
+	case Counter::OUTBOUND_OVERFLOWS:
+		return "outbound_overflows";
+	case Counter::MALFORMED_REQUESTS:
+		return "malformed_requests";
+	case Counter::UNKNOWN_REQUESTS:
+		return "unknown_requests";
+	case Counter::TRANSFER_BYTES:
+		return "transfer_bytes";
+	case Counter::TRANSFERS_ABORTED:
+		return "transfers_aborted";
+	}
+	return "unknown";
+}
+
+// Clients may send any type byte. Every type without a name is counted
+// under UNKNOWN_TYPE, so that no two entries share a name.
+static std::vector<std::pair<const char *, uint64_t>> named_frame_counts(const uint64_t *counts)
+{
+	std::vector<std::pair<const char *, uint64_t>> named;
+	uint64_t unnamed = 0;
+	for (size_t i = 0; i < MESSAGE_TYPE_SLOTS; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		const char *name = MessageTypeToString(static_cast<MessageType>(i));
+		if (strcmp(name, "UNKNOWN_TYPE") == 0) {
+			unnamed += counts[i];
+		} else {
+			named.emplace_back(name, counts[i]);
+		}
+	}
+	if (unnamed > 0) {
+		named.emplace_back("UNKNOWN_TYPE", unnamed);
+	}
+	return named;
+}
+
+static uint64_t clients_connected(const MetricsSnapshot &snapshot)
+{
+	return snapshot.counter(Counter::CLIENTS_ACCEPTED) - snapshot.counter(Counter::CLIENTS_CLOSED);
+}
+
+StatsResponse make_stats_response(const MetricsSnapshot &snapshot)
+{
+	StatsResponse response;
+	response.counters.push_back({"uptime_seconds", snapshot.uptime_seconds});
+	response.counters.push_back({"clients_connected", clients_connected(snapshot)});
+	for (size_t i = 0; i < COUNTER_COUNT; i++) {
+		response.counters.push_back(
+		        {CounterToString(static_cast<Counter>(i)), snapshot.counters[i]});
+	}
+	// Skips FrameError::NONE
+	for (size_t i = 1; i < FRAME_ERROR_COUNT; i++) {
+		response.counters.push_back(
+		        {std::string("frame_errors.") + FrameErrorToString(static_cast<FrameError>(i)),
+		         snapshot.frame_errors[i]});
+	}
+	for (const auto &[name, count] : named_frame_counts(snapshot.frames_in)) {
+		response.counters.push_back({std::string("frames_in.") + name, count});
+	}
+	for (const auto &[name, count] : named_frame_counts(snapshot.frames_out)) {
+		response.counters.push_back({std::string("frames_out.") + name, count});
+	}
+
+	for (size_t i = 0; i < MESSAGE_TYPE_SLOTS; i++) {
+		const LatencyHistogram *histogram = snapshot.latency[i].get();
+		if (histogram == nullptr) {
+			continue;
+		}
+		StatsLatency latency;
+		latency.type = MessageTypeToString(static_cast<MessageType>(i));
+		latency.count = histogram->count();
+		latency.p50 = histogram->percentile(0.5);
+		latency.p90 = histogram->percentile(0.9);
+		latency.p99 = histogram->percentile(0.99);
+		latency.p999 = histogram->percentile(0.999);
+		latency.max = histogram->max();
+		response.latencies.push_back(std::move(latency));
+	}
+	return response;
+}
+
+static double to_seconds(uint64_t nanoseconds)
+{
+	return static_cast<double>(nanoseconds) / 1e9;
+}
+
+std::string format_metrics_text(const MetricsSnapshot &snapshot)
+{
+	std::ostringstream out;
+	out << std::setprecision(9);
+
+	out << "# TYPE " METRIC_PREFIX "uptime_seconds gauge\n"
+	    << METRIC_PREFIX "uptime_seconds " << snapshot.uptime_seconds << "\n";
+	out << "# TYPE " METRIC_PREFIX "clients_connected gauge\n"
+	    << METRIC_PREFIX "clients_connected " << clients_connected(snapshot) << "\n";
+	for (size_t i = 0; i < COUNTER_COUNT; i++) {
+		const char *name = CounterToString(static_cast<Counter>(i));
+		out << "# TYPE " METRIC_PREFIX << name << "_total counter\n"
+		    << METRIC_PREFIX << name << "_total " << snapshot.counters[i] << "\n";
+	}
+
+	out << "# TYPE " METRIC_PREFIX "frame_errors_total counter\n";
+	for (size_t i = 1; i < FRAME_ERROR_COUNT; i++) {
+		out << METRIC_PREFIX "frame_errors_total{cause=\""
+		    << FrameErrorToString(static_cast<FrameError>(i)) << "\"} "
+		    << snapshot.frame_errors[i] << "\n";
+	}
+	out << "# TYPE " METRIC_PREFIX "frames_in_total counter\n";
+	for (const auto &[name, count] : named_frame_counts(snapshot.frames_in)) {
+		out << METRIC_PREFIX "frames_in_total{type=\"" << name << "\"} " << count << "\n";
+	}
+	out << "# TYPE " METRIC_PREFIX "frames_out_total counter\n";
+	for (const auto &[name, count] : named_frame_counts(snapshot.frames_out)) {
+		out << METRIC_PREFIX "frames_out_total{type=\"" << name << "\"} " << count << "\n";
+	}
+
+	out << "# TYPE " METRIC_PREFIX "handler_latency_seconds summary\n";
+	for (size_t i = 0; i < MESSAGE_TYPE_SLOTS; i++) {
+		const LatencyHistogram *histogram = snapshot.latency[i].get();
+		if (histogram == nullptr) {
+			continue;
+		}
+		const char *type = MessageTypeToString(static_cast<MessageType>(i));
+		for (double quantile : LATENCY_QUANTILES) {
+			out << METRIC_PREFIX "handler_latency_seconds{type=\"" << type
+			    << "\",quantile=\"" << quantile << "\"} "
+			    << to_seconds(histogram->percentile(quantile)) << "\n";
+		}
+		out << METRIC_PREFIX "handler_latency_seconds_sum{type=\"" << type << "\"} "
+		    << to_seconds(histogram->sum()) << "\n";
+		out << METRIC_PREFIX "handler_latency_seconds_count{type=\"" << type << "\"} "
+		    << histogram->count() << "\n";
+	}
+	return out.str();
+}
@@ -0,0 +1,79 @@
+#include "include/outbound_queue.h"
+#include <algorithm>       // For std::min
+#include <cstring>         // For memcpy
+
+// A drained queue keeps its slots unless it grew past this many
+#define OUTBOUND_KEEP_SLOTS 16
+
+bool OutboundQueue::push(const OutboundFrame &frame, size_t limit)
+{
+	if (!empty() && bytes_ + frame.size() > limit) {
+		return false;
+	}
+	frames_.push_back(frame);
+	bytes_ += frame.size();
+	return true;
+}
+
+void OutboundQueue::gather(std::vector<struct iovec> &iov, size_t max_iov)
+{
+	// Each frame contributes its header and its payload. The payload is
+	// written from where it already is; only the header is copied.
+	size_t count = std::min(frames_.size() - head_, max_iov / 2);
+	prefixes_.resize(count * FRAME_PREFIX_SIZE);
+
+	iov.clear();
+	size_t offset = offset_;
+	for (size_t i = 0; i < count; i++) {
+		const OutboundFrame &frame = frames_[head_ + i];
+		char *prefix = prefixes_.data() + i * FRAME_PREFIX_SIZE;
+		memcpy(prefix, frame.prefix, FRAME_PREFIX_SIZE);
+		if (offset < FRAME_PREFIX_SIZE) {
+			iov.push_back({prefix + offset, FRAME_PREFIX_SIZE - offset});
+			offset = 0;
+		} else {
+			offset -= FRAME_PREFIX_SIZE;
+		}
+		if (frame.payload_size() > offset) {
+			char *payload = const_cast<char *>(frame.payload->data());
+			iov.push_back({payload + offset, frame.payload_size() - offset});
+		}
+		offset = 0;
+	}
+}
+
+void OutboundQueue::consume(size_t bytes)
+{
+	bytes_ -= bytes;
+	while (bytes > 0 && !empty()) {
+		size_t left = frames_[head_].size() - offset_;
+		if (bytes < left) {
+			offset_ += bytes;
+			return;
+		}
+		bytes -= left;
+		// Release the payload as soon as it is written
+		frames_[head_++].payload.reset();
+		offset_ = 0;
+	}
+	if (empty()) {
+		clear();
+	} else if (head_ >= OUTBOUND_KEEP_SLOTS && head_ * 2 >= frames_.size()) {
+		// A queue that never quite drains drops its written frames here
+		frames_.erase(frames_.begin(), frames_.begin() + head_);
+		head_ = 0;
+	}
+}
+
+void OutboundQueue::clear()
+{
+	if (frames_.capacity() > OUTBOUND_KEEP_SLOTS) {
+		std::vector<OutboundFrame>().swap(frames_);
+		std::vector<char>().swap(prefixes_);
+	} else {
+		frames_.clear();
+	}
+	head_ = 0;
+	offset_ = 0;
+	bytes_ = 0;
+}
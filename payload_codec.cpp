@@ -0,0 +1,1599 @@
+#include "include/payload_codec.h"
+#include "include/json_fields.h"
+#include "include/json_writer.h"
+#include "include/buffer_pool.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>       // For std::min
+#include <arpa/inet.h>     // For inet_pton, inet_ntop
+
+using json = nlohmann::json;
+
+// Longest string that fits behind a 1-byte length
+#define MAX_SHORT_STRING 255
+// In binary HELLO payloads, compressions are the bytes with this bit set
+#define HELLO_COMPRESSION_FLAG 0x80
+
+// Appends big-endian integers and strings to a payload
+class BinaryWriter
+{
+public:
+	explicit BinaryWriter(size_t capacity = 64) : out_(BufferPool::take(capacity)) {}
+
+	void u8(uint8_t value)
+	{
+		out_.push_back(static_cast<char>(value));
+	}
+
+	void u16(uint16_t value)
+	{
+		u8(value >> 8);
+		u8(value & 0xff);
+	}
+
+	void u32(uint32_t value)
+	{
+		u16(value >> 16);
+		u16(value & 0xffff);
+	}
+
+	void u64(uint64_t value)
+	{
+		u32(value >> 32);
+		u32(value & 0xffffffff);
+	}
+
+	// Longer strings are truncated
+	void short_string(std::string_view text)
+	{
+		text = text.substr(0, MAX_SHORT_STRING);
+		u8(static_cast<uint8_t>(text.size()));
+		out_.append(text);
+	}
+
+	void text(std::string_view text)
+	{
+		out_.append(text);
+	}
+
+	std::string take()
+	{
+		return std::move(out_);
+	}
+
+private:
+	std::string out_;
+};
+
+// Reads big-endian integers and strings from a payload. Every read fails
+// once the payload is exhausted.
+class BinaryReader
+{
+public:
+	explicit BinaryReader(std::string_view in) : in_(in) {}
+
+	bool u8(uint8_t &value)
+	{
+		if (in_.empty()) {
+			return false;
+		}
+		value = static_cast<uint8_t>(in_[0]);
+		in_.remove_prefix(1);
+		return true;
+	}
+
+	bool u16(uint16_t &value)
+	{
+		uint8_t high, low;
+		if (!u8(high) || !u8(low)) {
+			return false;
+		}
+		value = static_cast<uint16_t>(high << 8 | low);
+		return true;
+	}
+
+	bool u32(uint32_t &value)
+	{
+		uint16_t high, low;
+		if (!u16(high) || !u16(low)) {
+			return false;
+		}
+		value = static_cast<uint32_t>(high) << 16 | low;
+		return true;
+	}
+
+	bool u64(uint64_t &value)
+	{
+		uint32_t high, low;
+		if (!u32(high) || !u32(low)) {
+			return false;
+		}
+		value = static_cast<uint64_t>(high) << 32 | low;
+		return true;
+	}
+
+	bool short_string(std::string &text)
+	{
+		uint8_t len;
+		if (!u8(len) || in_.size() < len) {
+			return false;
+		}
+		text.assign(in_.data(), len);
+		in_.remove_prefix(len);
+		return true;
+	}
+
+	// Takes the rest of the payload
+	void text(std::string &text)
+	{
+		text.assign(in_.data(), in_.size());
+		in_ = std::string_view();
+	}
+
+	size_t remaining() const
+	{
+		return in_.size();
+	}
+
+private:
+	std::string_view in_;
+};
+
+// JSON decoders first try a JsonFieldExtractor, which reads the flat objects
+// this protocol sends without building a DOM, and hand anything else to
+// read_json().
+
+// Parses a JSON payload and reads fields from it with read(data). Returns
+// false if the payload is not a JSON object or read() fails or throws.
+template <typename Reader>
+static bool read_json(std::string_view content, Reader read)
+{
+	json data = json::parse(content.begin(), content.end(), nullptr, false);
+	if (!data.is_object()) {
+		return false;
+	}
+	try {
+		return read(data);
+	} catch (const json::exception &) {
+		return false;
+	}
+}
+
+// JSON payloads are written with a JsonWriter into a pooled buffer. The
+// members of each object are written in alphabetical order, as json::dump()
+// wrote them, so the bytes on the wire did not change with the DOM's removal.
+
+// A text payload in a pooled buffer
+static std::string pooled_text(std::string_view text)
+{
+	std::string payload = BufferPool::take(text.size());
+	payload.append(text);
+	return payload;
+}
+
+static void write_status(JsonWriter &out, bool success)
+{
+	out.member("status", std::string_view(success ? "success" : "error"));
+}
+
+static bool is_success(const json &data)
+{
+	return data.value("status", "") == "success";
+}
+
+// Client lists run to hundreds of entries, so they are written straight
+// into the payload instead of through a DOM
+static void write_client_entries(JsonWriter &out, const std::vector<ClientListEntry> &clients)
+{
+	out.begin_array();
+	for (const auto &client : clients) {
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &client.ipv4, ip, sizeof(ip));
+		out.begin_object();
+		out.member("id", client.client_id);
+		out.member("ip", std::string_view(ip));
+		out.member("port", uint64_t(client.port));
+		out.end_object();
+	}
+	out.end_array();
+}
+
+static void write_client_entries(BinaryWriter &out, const std::vector<ClientListEntry> &clients)
+{
+	out.u32(static_cast<uint32_t>(clients.size()));
+	for (const auto &client : clients) {
+		out.u64(client.client_id);
+		out.u32(ntohl(client.ipv4));
+		out.u16(client.port);
+	}
+}
+
+static void read_client_entries(const json &entries, std::vector<ClientListEntry> &clients)
+{
+	for (const auto &entry : entries) {
+		ClientListEntry client;
+		client.client_id = entry.value("id", uint64_t(0));
+		inet_pton(AF_INET, entry.value("ip", "").c_str(), &client.ipv4);
+		client.port = entry.value("port", uint16_t(0));
+		clients.push_back(client);
+	}
+}
+
+static bool read_client_entries(BinaryReader &in, std::vector<ClientListEntry> &clients)
+{
+	uint32_t count;
+	// Check the count against the payload before reserving for it
+	if (!in.u32(count) || in.remaining() / 14 < count) {
+		return false;
+	}
+	clients.reserve(count);
+	for (uint32_t i = 0; i < count; i++) {
+		ClientListEntry client;
+		// Cannot fail, the count was checked
+		in.u64(client.client_id);
+		in.u32(client.ipv4);
+		in.u16(client.port);
+		client.ipv4 = htonl(client.ipv4);
+		clients.push_back(client);
+	}
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const SendMessageRequest &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(32 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("message", std::string_view(msg.message));
+		out.member("target_id", msg.target_id);
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(8 + msg.message.size());
+	out.u64(msg.target_id);
+	out.text(msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, SendMessageRequest &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		JsonFieldExtractor fields;
+		fields.add("target_id", msg.target_id);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content) && fields.found_all()) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.target_id = data.at("target_id").get<uint64_t>();
+			msg.message = data.at("message").get<std::string>();
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	if (!in.u64(msg.target_id)) {
+		return false;
+	}
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const SendMessageResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(48 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		if (!msg.success) {
+			out.member("message", std::string_view(msg.message));
+		}
+		write_status(out, msg.success);
+		if (msg.target_id != 0) {
+			out.member("target_id", msg.target_id);
+		}
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u8(msg.success);
+	out.u64(msg.target_id);
+	out.text(msg.success ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, SendMessageResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view status;
+		msg.target_id = 0;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("status", status);
+		fields.add("target_id", msg.target_id);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			msg.success = status == "success";
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.success = is_success(data);
+			msg.target_id = data.value("target_id", uint64_t(0));
+			msg.message = data.value("message", "");
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t success;
+	if (!in.u8(success) || !in.u64(msg.target_id)) {
+		return false;
+	}
+	msg.success = success != 0;
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const TimeResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(16 + msg.time.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("time", std::string_view(msg.time));
+		out.end_object();
+		return payload;
+	}
+	return pooled_text(msg.time);
+}
+
+bool decode_payload(const PacketView &pkt, TimeResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		msg.time.clear();
+		JsonFieldExtractor fields;
+		fields.add("time", msg.time);
+		if (fields.extract(pkt.content)) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.time = data.value("time", "");
+			return true;
+		});
+	}
+	msg.time.assign(pkt.content);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const NameResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(16 + msg.name.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("name", std::string_view(msg.name));
+		out.end_object();
+		return payload;
+	}
+	return pooled_text(msg.name);
+}
+
+bool decode_payload(const PacketView &pkt, NameResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		msg.name.clear();
+		JsonFieldExtractor fields;
+		fields.add("name", msg.name);
+		if (fields.extract(pkt.content)) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.name = data.value("name", "");
+			return true;
+		});
+	}
+	msg.name.assign(pkt.content);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const ClientListRequest &msg)
+{
+	// The first page is asked for with an empty payload, as before pages
+	if (msg.cursor == 0 && msg.limit == 0) {
+		return std::string();
+	}
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(64);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("cursor", msg.cursor);
+		out.member("limit", uint64_t(msg.limit));
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u64(msg.cursor);
+	out.u32(msg.limit);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, ClientListRequest &msg)
+{
+	msg.cursor = 0;
+	msg.limit = 0;
+	if (pkt.content.empty()) {
+		return true;
+	}
+	if (pkt.codec == PayloadCodec::JSON) {
+		uint64_t limit = 0;
+		JsonFieldExtractor fields;
+		fields.add("cursor", msg.cursor);
+		fields.add("limit", limit);
+		if (fields.extract(pkt.content)) {
+			msg.limit = static_cast<uint32_t>(std::min<uint64_t>(limit, UINT32_MAX));
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.cursor = data.value("cursor", uint64_t(0));
+			limit = data.value("limit", uint64_t(0));
+			msg.limit = static_cast<uint32_t>(std::min<uint64_t>(limit, UINT32_MAX));
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	return in.u64(msg.cursor) && in.u32(msg.limit);
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const ClientListResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(32 + msg.clients.size() * 56);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.key("clients");
+		write_client_entries(out, msg.clients);
+		if (msg.next_cursor != 0) {
+			out.member("next_cursor", msg.next_cursor);
+		}
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(12 + msg.clients.size() * 14);
+	write_client_entries(out, msg.clients);
+	out.u64(msg.next_cursor);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, ClientListResponse &msg)
+{
+	msg.clients.clear();
+	msg.next_cursor = 0;
+	if (pkt.codec == PayloadCodec::JSON) {
+		return read_json(pkt.content, [&](const json &data) {
+			read_client_entries(data.at("clients"), msg.clients);
+			msg.next_cursor = data.value("next_cursor", uint64_t(0));
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	if (!read_client_entries(in, msg.clients)) {
+		return false;
+	}
+	// Absent from servers that list every client at once
+	in.u64(msg.next_cursor);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const ChatIndication &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(32 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("from_id", msg.from_id);
+		out.member("message", std::string_view(msg.message));
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(8 + msg.message.size());
+	out.u64(msg.from_id);
+	out.text(msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, ChatIndication &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		msg.from_id = 0;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("from_id", msg.from_id);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.from_id = data.value("from_id", uint64_t(0));
+			msg.message = data.value("message", "");
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	if (!in.u64(msg.from_id)) {
+		return false;
+	}
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const NoticeIndication &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(16 + msg.notice.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("notice", std::string_view(msg.notice));
+		out.end_object();
+		return payload;
+	}
+	return pooled_text(msg.notice);
+}
+
+bool decode_payload(const PacketView &pkt, NoticeIndication &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		msg.notice.clear();
+		JsonFieldExtractor fields;
+		fields.add("notice", msg.notice);
+		if (fields.extract(pkt.content)) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.notice = data.value("notice", "");
+			return true;
+		});
+	}
+	msg.notice.assign(pkt.content);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const BroadcastRequest &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(16 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("message", std::string_view(msg.message));
+		out.end_object();
+		return payload;
+	}
+	return pooled_text(msg.message);
+}
+
+bool decode_payload(const PacketView &pkt, BroadcastRequest &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		JsonFieldExtractor fields;
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content) && fields.found_all()) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.message = data.at("message").get<std::string>();
+			return true;
+		});
+	}
+	msg.message.assign(pkt.content);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const BroadcastResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(48 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		if (msg.success) {
+			out.member("recipients", uint64_t(msg.recipients));
+		} else {
+			out.member("message", std::string_view(msg.message));
+		}
+		write_status(out, msg.success);
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u8(msg.success);
+	out.u64(msg.recipients);
+	out.text(msg.success ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, BroadcastResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view status;
+		msg.recipients = 0;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("status", status);
+		fields.add("recipients", msg.recipients);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			msg.success = status == "success";
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.success = is_success(data);
+			msg.recipients = data.value("recipients", uint64_t(0));
+			msg.message = data.value("message", "");
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t success;
+	if (!in.u8(success) || !in.u64(msg.recipients)) {
+		return false;
+	}
+	msg.success = success != 0;
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType type, const GroupRequest &msg)
+{
+	bool has_message = type == MessageType::GROUP_MESSAGE_REQUEST;
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(32 + msg.group.size() + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("group", std::string_view(msg.group));
+		if (has_message) {
+			out.member("message", std::string_view(msg.message));
+		}
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(1 + msg.group.size() + msg.message.size());
+	out.short_string(msg.group);
+	if (has_message) {
+		out.text(msg.message);
+	}
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, GroupRequest &msg)
+{
+	bool has_message = pkt.type == MessageType::GROUP_MESSAGE_REQUEST;
+	msg.message.clear();
+	if (pkt.codec == PayloadCodec::JSON) {
+		JsonFieldExtractor fields;
+		fields.add("group", msg.group);
+		if (has_message) {
+			fields.add("message", msg.message);
+		}
+		if (fields.extract(pkt.content) && fields.found_all()) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.group = data.at("group").get<std::string>();
+			if (has_message) {
+				msg.message = data.at("message").get<std::string>();
+			}
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	if (!in.short_string(msg.group)) {
+		return false;
+	}
+	if (has_message) {
+		in.text(msg.message);
+	}
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType type, const GroupResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(64 + msg.group.size() + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		if (!msg.group.empty()) {
+			out.member("group", std::string_view(msg.group));
+		}
+		if (msg.success && type == MessageType::JOIN_GROUP_RESPONSE) {
+			out.member("members", uint64_t(msg.count));
+		}
+		if (!msg.success) {
+			out.member("message", std::string_view(msg.message));
+		}
+		if (msg.success && type == MessageType::GROUP_MESSAGE_RESPONSE) {
+			out.member("recipients", uint64_t(msg.count));
+		}
+		write_status(out, msg.success);
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u8(msg.success);
+	out.u64(msg.count);
+	out.short_string(msg.group);
+	out.text(msg.success ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, GroupResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view status;
+		msg.group.clear();
+		msg.count = 0;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("status", status);
+		fields.add("group", msg.group);
+		fields.add(pkt.type == MessageType::JOIN_GROUP_RESPONSE ? "members" : "recipients",
+		           msg.count);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			msg.success = status == "success";
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.success = is_success(data);
+			msg.group = data.value("group", "");
+			msg.count = data.value(pkt.type == MessageType::JOIN_GROUP_RESPONSE ? "members"
+			                                                                    : "recipients",
+			                       uint64_t(0));
+			msg.message = data.value("message", "");
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t success;
+	if (!in.u8(success) || !in.u64(msg.count) || !in.short_string(msg.group)) {
+		return false;
+	}
+	msg.success = success != 0;
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const GroupMessageIndication &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(48 + msg.group.size() + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("from_id", msg.from_id);
+		out.member("group", std::string_view(msg.group));
+		out.member("message", std::string_view(msg.message));
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(9 + msg.group.size() + msg.message.size());
+	out.u64(msg.from_id);
+	out.short_string(msg.group);
+	out.text(msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, GroupMessageIndication &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		msg.from_id = 0;
+		msg.group.clear();
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("from_id", msg.from_id);
+		fields.add("group", msg.group);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.from_id = data.value("from_id", uint64_t(0));
+			msg.group = data.value("group", "");
+			msg.message = data.value("message", "");
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	if (!in.u64(msg.from_id) || !in.short_string(msg.group)) {
+		return false;
+	}
+	in.text(msg.message);
+	return true;
+}
+
+// Compressions other than NONE that this side can decompress
+static bool is_known_compression(uint8_t value)
+{
+	return value != 0 && value < FRAME_COMPRESSION_COUNT;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const HelloRequest &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(64);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.key("codecs");
+		out.begin_array();
+		for (PayloadCodec offered : msg.codecs) {
+			out.value(std::string_view(PayloadCodecToString(offered)));
+		}
+		out.end_array();
+		if (!msg.compressions.empty()) {
+			out.key("compressions");
+			out.begin_array();
+			for (FrameCompression offered : msg.compressions) {
+				out.value(std::string_view(FrameCompressionToString(offered)));
+			}
+			out.end_array();
+		}
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	for (PayloadCodec offered : msg.codecs) {
+		out.u8(static_cast<uint8_t>(offered));
+	}
+	for (FrameCompression offered : msg.compressions) {
+		out.u8(HELLO_COMPRESSION_FLAG | static_cast<uint8_t>(offered));
+	}
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, HelloRequest &msg)
+{
+	// Codecs and compressions this side does not know are skipped, not
+	// rejected
+	msg.codecs.clear();
+	msg.compressions.clear();
+	if (pkt.codec == PayloadCodec::JSON) {
+		return read_json(pkt.content, [&](const json &data) {
+			for (const auto &name : data.at("codecs")) {
+				PayloadCodec codec;
+				if (name.is_string() && parse_codec_name(name.get<std::string>(), codec)) {
+					msg.codecs.push_back(codec);
+				}
+			}
+			auto compressions = data.find("compressions");
+			if (compressions != data.end() && compressions->is_array()) {
+				for (const auto &name : *compressions) {
+					FrameCompression compression;
+					if (name.is_string() &&
+					    parse_compression_name(name.get<std::string>(), compression)) {
+						msg.compressions.push_back(compression);
+					}
+				}
+			}
+			return true;
+		});
+	}
+	for (char byte : pkt.content) {
+		uint8_t value = static_cast<uint8_t>(byte);
+		if (value < PAYLOAD_CODEC_COUNT) {
+			msg.codecs.push_back(static_cast<PayloadCodec>(value));
+		} else if ((value & HELLO_COMPRESSION_FLAG) &&
+		           is_known_compression(value & ~HELLO_COMPRESSION_FLAG)) {
+			msg.compressions.push_back(
+			        static_cast<FrameCompression>(value & ~HELLO_COMPRESSION_FLAG));
+		}
+	}
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const HelloResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(64);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("codec", std::string_view(PayloadCodecToString(msg.codec)));
+		if (msg.compression != FrameCompression::NONE) {
+			out.member("compression",
+			           std::string_view(FrameCompressionToString(msg.compression)));
+		}
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u8(static_cast<uint8_t>(msg.codec));
+	if (msg.compression != FrameCompression::NONE) {
+		out.u8(HELLO_COMPRESSION_FLAG | static_cast<uint8_t>(msg.compression));
+	}
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, HelloResponse &msg)
+{
+	msg.compression = FrameCompression::NONE;
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view codec;
+		std::string_view compression;
+		JsonFieldExtractor fields;
+		fields.add("codec", codec);
+		fields.add("compression", compression);
+		if (fields.extract(pkt.content)) {
+			return parse_codec_name(codec, msg.codec) &&
+			       (!fields.found("compression") ||
+			        parse_compression_name(compression, msg.compression));
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			return parse_codec_name(data.value("codec", ""), msg.codec) &&
+			       (!data.contains("compression") ||
+			        parse_compression_name(data.value("compression", ""),
+			                               msg.compression));
+		});
+	}
+	if (pkt.content.empty() || pkt.content.size() > 2 ||
+	    static_cast<uint8_t>(pkt.content[0]) >= PAYLOAD_CODEC_COUNT) {
+		return false;
+	}
+	msg.codec = static_cast<PayloadCodec>(pkt.content[0]);
+	if (pkt.content.size() == 2) {
+		uint8_t value = static_cast<uint8_t>(pkt.content[1]);
+		if (!(value & HELLO_COMPRESSION_FLAG) ||
+		    !is_known_compression(value & ~HELLO_COMPRESSION_FLAG)) {
+			return false;
+		}
+		msg.compression = static_cast<FrameCompression>(value & ~HELLO_COMPRESSION_FLAG);
+	}
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const PresenceDelta &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(32 + msg.joined.size() * 56 + msg.left.size() * 21);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.key("joined");
+		write_client_entries(out, msg.joined);
+		out.key("left");
+		out.begin_array();
+		for (uint64_t client_id : msg.left) {
+			out.value(client_id);
+		}
+		out.end_array();
+		if (msg.more) {
+			out.member("more", true);
+		}
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(9 + msg.joined.size() * 14 + msg.left.size() * 8);
+	write_client_entries(out, msg.joined);
+	out.u32(static_cast<uint32_t>(msg.left.size()));
+	for (uint64_t client_id : msg.left) {
+		out.u64(client_id);
+	}
+	out.u8(msg.more);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, PresenceDelta &msg)
+{
+	msg.joined.clear();
+	msg.left.clear();
+	msg.more = false;
+	if (pkt.codec == PayloadCodec::JSON) {
+		return read_json(pkt.content, [&](const json &data) {
+			read_client_entries(data.at("joined"), msg.joined);
+			msg.left = data.at("left").get<std::vector<uint64_t>>();
+			msg.more = data.value("more", false);
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint32_t count;
+	if (!read_client_entries(in, msg.joined) || !in.u32(count) ||
+	    in.remaining() / 8 < count) {
+		return false;
+	}
+	msg.left.resize(count);
+	for (uint64_t &client_id : msg.left) {
+		in.u64(client_id);
+	}
+	// Absent from servers that send everything in one frame
+	uint8_t more = 0;
+	in.u8(more);
+	msg.more = more != 0;
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const PresenceResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(32 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		if (!msg.success) {
+			out.member("message", std::string_view(msg.message));
+		}
+		write_status(out, msg.success);
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u8(msg.success);
+	out.text(msg.success ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, PresenceResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view status;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("status", status);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			msg.success = status == "success";
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.success = is_success(data);
+			msg.message = data.value("message", "");
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t success;
+	if (!in.u8(success)) {
+		return false;
+	}
+	msg.success = success != 0;
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const StatsResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload =
+		        BufferPool::take(32 + msg.counters.size() * 40 + msg.latencies.size() * 128);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.key("counters");
+		out.begin_object();
+		for (const auto &counter : msg.counters) {
+			out.member(counter.name, counter.value);
+		}
+		out.end_object();
+		out.key("latency");
+		out.begin_array();
+		for (const auto &latency : msg.latencies) {
+			out.begin_object();
+			out.member("type", std::string_view(latency.type));
+			out.member("count", latency.count);
+			out.member("p50_ns", latency.p50);
+			out.member("p90_ns", latency.p90);
+			out.member("p99_ns", latency.p99);
+			out.member("p999_ns", latency.p999);
+			out.member("max_ns", latency.max);
+			out.end_object();
+		}
+		out.end_array();
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u32(static_cast<uint32_t>(msg.counters.size()));
+	for (const auto &counter : msg.counters) {
+		out.short_string(counter.name);
+		out.u64(counter.value);
+	}
+	out.u32(static_cast<uint32_t>(msg.latencies.size()));
+	for (const auto &latency : msg.latencies) {
+		out.short_string(latency.type);
+		out.u64(latency.count);
+		out.u64(latency.p50);
+		out.u64(latency.p90);
+		out.u64(latency.p99);
+		out.u64(latency.p999);
+		out.u64(latency.max);
+	}
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, StatsResponse &msg)
+{
+	msg.counters.clear();
+	msg.latencies.clear();
+	if (pkt.codec == PayloadCodec::JSON) {
+		return read_json(pkt.content, [&](const json &data) {
+			for (const auto &[name, value] : data.at("counters").items()) {
+				msg.counters.push_back(StatsCounter{name, value.get<uint64_t>()});
+			}
+			for (const auto &entry : data.at("latency")) {
+				StatsLatency latency;
+				latency.type = entry.value("type", "");
+				latency.count = entry.value("count", uint64_t(0));
+				latency.p50 = entry.value("p50_ns", uint64_t(0));
+				latency.p90 = entry.value("p90_ns", uint64_t(0));
+				latency.p99 = entry.value("p99_ns", uint64_t(0));
+				latency.p999 = entry.value("p999_ns", uint64_t(0));
+				latency.max = entry.value("max_ns", uint64_t(0));
+				msg.latencies.push_back(std::move(latency));
+			}
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint32_t count;
+	if (!in.u32(count)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		StatsCounter counter;
+		if (!in.short_string(counter.name) || !in.u64(counter.value)) {
+			return false;
+		}
+		msg.counters.push_back(std::move(counter));
+	}
+	if (!in.u32(count)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		StatsLatency latency;
+		if (!in.short_string(latency.type) || !in.u64(latency.count) ||
+		    !in.u64(latency.p50) || !in.u64(latency.p90) || !in.u64(latency.p99) ||
+		    !in.u64(latency.p999) || !in.u64(latency.max)) {
+			return false;
+		}
+		msg.latencies.push_back(std::move(latency));
+	}
+	return true;
+}
+
+// Transfer requests name the other client target_id, indications from_id
+static bool is_transfer_request(MessageType type)
+{
+	return type == MessageType::TRANSFER_BEGIN_REQUEST ||
+	       type == MessageType::TRANSFER_CHUNK_REQUEST ||
+	       type == MessageType::TRANSFER_END_REQUEST ||
+	       type == MessageType::TRANSFER_ACK_REQUEST;
+}
+
+static const char *transfer_peer_key(MessageType type)
+{
+	return is_transfer_request(type) ? "target_id" : "from_id";
+}
+
+// The members around a transfer message's own ones, in alphabetical order:
+// from_id comes first, target_id and transfer_id last
+static void write_transfer_head(JsonWriter &out, MessageType type, uint64_t peer_id)
+{
+	out.begin_object();
+	if (!is_transfer_request(type)) {
+		out.member("from_id", peer_id);
+	}
+}
+
+static void write_transfer_tail(JsonWriter &out, MessageType type, uint64_t peer_id,
+                                uint32_t transfer_id)
+{
+	if (is_transfer_request(type)) {
+		out.member("target_id", peer_id);
+	}
+	out.member("transfer_id", uint64_t(transfer_id));
+	out.end_object();
+}
+
+// Transfer IDs are 32 bits; JSON readers take them as any number
+static bool read_transfer_id(uint64_t value, uint32_t &transfer_id)
+{
+	if (value > UINT32_MAX) {
+		return false;
+	}
+	transfer_id = static_cast<uint32_t>(value);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferBegin &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(80 + msg.name.size());
+		JsonWriter out(payload);
+		write_transfer_head(out, type, msg.peer_id);
+		out.member("name", std::string_view(msg.name));
+		out.member("size", msg.size);
+		write_transfer_tail(out, type, msg.peer_id, msg.transfer_id);
+		return payload;
+	}
+	BinaryWriter out(20 + msg.name.size());
+	out.u64(msg.peer_id);
+	out.u32(msg.transfer_id);
+	out.u64(msg.size);
+	out.text(msg.name);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, TransferBegin &msg)
+{
+	bool request = is_transfer_request(pkt.type);
+	if (pkt.codec == PayloadCodec::JSON) {
+		const char *peer_key = transfer_peer_key(pkt.type);
+		uint64_t transfer_id = 0;
+		msg.peer_id = 0;
+		msg.size = 0;
+		msg.name.clear();
+		JsonFieldExtractor fields;
+		fields.add(peer_key, msg.peer_id);
+		fields.add("transfer_id", transfer_id);
+		fields.add("size", msg.size);
+		fields.add("name", msg.name);
+		if (fields.extract(pkt.content) && (!request || fields.found_all())) {
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			if (request) {
+				msg.peer_id = data.at(peer_key).get<uint64_t>();
+				transfer_id = data.at("transfer_id").get<uint64_t>();
+				msg.size = data.at("size").get<uint64_t>();
+				msg.name = data.at("name").get<std::string>();
+			} else {
+				msg.peer_id = data.value(peer_key, uint64_t(0));
+				transfer_id = data.value("transfer_id", uint64_t(0));
+				msg.size = data.value("size", uint64_t(0));
+				msg.name = data.value("name", "");
+			}
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		});
+	}
+	BinaryReader in(pkt.content);
+	if (!in.u64(msg.peer_id) || !in.u32(msg.transfer_id) || !in.u64(msg.size)) {
+		return false;
+	}
+	in.text(msg.name);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const TransferResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(64 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		if (!msg.success) {
+			out.member("message", std::string_view(msg.message));
+		}
+		write_status(out, msg.success);
+		out.member("transfer_id", uint64_t(msg.transfer_id));
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out;
+	out.u8(msg.success);
+	out.u32(msg.transfer_id);
+	out.text(msg.success ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, TransferResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view status;
+		uint64_t transfer_id = 0;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add("status", status);
+		fields.add("transfer_id", transfer_id);
+		fields.add("message", msg.message);
+		if (fields.extract(pkt.content)) {
+			msg.success = status == "success";
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.success = is_success(data);
+			transfer_id = data.value("transfer_id", uint64_t(0));
+			msg.message = data.value("message", "");
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t success;
+	if (!in.u8(success) || !in.u32(msg.transfer_id)) {
+		return false;
+	}
+	msg.success = success != 0;
+	in.text(msg.message);
+	return true;
+}
+
+// Always BINARY, see the top of payload_codec.h
+std::string encode_payload(PayloadCodec, MessageType, const TransferChunk &msg)
+{
+	BinaryWriter out(12 + msg.data.size());
+	out.u64(msg.peer_id);
+	out.u32(msg.transfer_id);
+	out.text(msg.data);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, TransferChunk &msg)
+{
+	if (pkt.codec != PayloadCodec::BINARY) {
+		return false;
+	}
+	BinaryReader in(pkt.content);
+	if (!in.u64(msg.peer_id) || !in.u32(msg.transfer_id)) {
+		return false;
+	}
+	msg.data = pkt.content.substr(12);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferEnd &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(96 + msg.message.size());
+		JsonWriter out(payload);
+		write_transfer_head(out, type, msg.peer_id);
+		if (!msg.complete) {
+			out.member("message", std::string_view(msg.message));
+		}
+		out.member("status", std::string_view(msg.complete ? "complete" : "aborted"));
+		write_transfer_tail(out, type, msg.peer_id, msg.transfer_id);
+		return payload;
+	}
+	BinaryWriter out(13 + msg.message.size());
+	out.u64(msg.peer_id);
+	out.u32(msg.transfer_id);
+	out.u8(msg.complete);
+	out.text(msg.complete ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, TransferEnd &msg)
+{
+	bool request = is_transfer_request(pkt.type);
+	if (pkt.codec == PayloadCodec::JSON) {
+		const char *peer_key = transfer_peer_key(pkt.type);
+		std::string_view status;
+		uint64_t transfer_id = 0;
+		msg.peer_id = 0;
+		msg.message.clear();
+		JsonFieldExtractor fields;
+		fields.add(peer_key, msg.peer_id);
+		fields.add("transfer_id", transfer_id);
+		fields.add("status", status);
+		fields.add("message", msg.message);
+		// The message is optional even in a request
+		if (fields.extract(pkt.content) &&
+		    (!request || (msg.peer_id != 0 && (status == "complete" || status == "aborted")))) {
+			msg.complete = status == "complete";
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			std::string status_text;
+			if (request) {
+				msg.peer_id = data.at(peer_key).get<uint64_t>();
+				transfer_id = data.at("transfer_id").get<uint64_t>();
+				status_text = data.at("status").get<std::string>();
+			} else {
+				msg.peer_id = data.value(peer_key, uint64_t(0));
+				transfer_id = data.value("transfer_id", uint64_t(0));
+				status_text = data.value("status", "");
+			}
+			msg.complete = status_text == "complete";
+			msg.message = data.value("message", "");
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t complete;
+	if (!in.u64(msg.peer_id) || !in.u32(msg.transfer_id) || !in.u8(complete)) {
+		return false;
+	}
+	msg.complete = complete != 0;
+	in.text(msg.message);
+	return true;
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType type, const TransferAck &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(96);
+		JsonWriter out(payload);
+		write_transfer_head(out, type, msg.peer_id);
+		out.member("received", msg.received);
+		write_transfer_tail(out, type, msg.peer_id, msg.transfer_id);
+		return payload;
+	}
+	BinaryWriter out(20);
+	out.u64(msg.peer_id);
+	out.u32(msg.transfer_id);
+	out.u64(msg.received);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, TransferAck &msg)
+{
+	bool request = is_transfer_request(pkt.type);
+	if (pkt.codec == PayloadCodec::JSON) {
+		const char *peer_key = transfer_peer_key(pkt.type);
+		uint64_t transfer_id = 0;
+		msg.peer_id = 0;
+		msg.received = 0;
+		JsonFieldExtractor fields;
+		fields.add(peer_key, msg.peer_id);
+		fields.add("transfer_id", transfer_id);
+		fields.add("received", msg.received);
+		if (fields.extract(pkt.content) && (!request || fields.found_all())) {
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			if (request) {
+				msg.peer_id = data.at(peer_key).get<uint64_t>();
+				transfer_id = data.at("transfer_id").get<uint64_t>();
+				msg.received = data.at("received").get<uint64_t>();
+			} else {
+				msg.peer_id = data.value(peer_key, uint64_t(0));
+				transfer_id = data.value("transfer_id", uint64_t(0));
+				msg.received = data.value("received", uint64_t(0));
+			}
+			return read_transfer_id(transfer_id, msg.transfer_id);
+		});
+	}
+	BinaryReader in(pkt.content);
+	return in.u64(msg.peer_id) && in.u32(msg.transfer_id) && in.u64(msg.received);
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const MailboxRequest &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(64);
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("client_id", msg.client_id);
+		out.member("token", msg.token);
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(16);
+	out.u64(msg.client_id);
+	out.u64(msg.token);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, MailboxRequest &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		msg.client_id = 0;
+		msg.token = 0;
+		JsonFieldExtractor fields;
+		fields.add("client_id", msg.client_id);
+		fields.add("token", msg.token);
+		if (fields.extract(pkt.content) && fields.found_all()) {
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.client_id = data.at("client_id").get<uint64_t>();
+			msg.token = data.at("token").get<uint64_t>();
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	return in.u64(msg.client_id) && in.u64(msg.token);
+}
+
+std::string encode_payload(PayloadCodec codec, MessageType, const MailboxResponse &msg)
+{
+	if (codec == PayloadCodec::JSON) {
+		std::string payload = BufferPool::take(128 + msg.message.size());
+		JsonWriter out(payload);
+		out.begin_object();
+		out.member("client_id", msg.client_id);
+		out.member("delivered", uint64_t(msg.delivered));
+		if (!msg.success) {
+			out.member("message", std::string_view(msg.message));
+		}
+		write_status(out, msg.success);
+		out.member("token", msg.token);
+		out.end_object();
+		return payload;
+	}
+	BinaryWriter out(21 + msg.message.size());
+	out.u8(msg.success);
+	out.u64(msg.client_id);
+	out.u64(msg.token);
+	out.u32(msg.delivered);
+	out.text(msg.success ? std::string_view() : msg.message);
+	return out.take();
+}
+
+bool decode_payload(const PacketView &pkt, MailboxResponse &msg)
+{
+	if (pkt.codec == PayloadCodec::JSON) {
+		std::string_view status;
+		uint64_t delivered = 0;
+		msg.client_id = 0;
+		msg.token = 0;
+		msg.message.clear();
+		// Five members are one too many for an extractor; a failure, the
+		// only response with a message, goes to the full parser
+		JsonFieldExtractor fields;
+		fields.add("status", status);
+		fields.add("client_id", msg.client_id);
+		fields.add("token", msg.token);
+		fields.add("delivered", delivered);
+		if (fields.extract(pkt.content) && status == "success" && delivered <= UINT32_MAX) {
+			msg.success = true;
+			msg.delivered = static_cast<uint32_t>(delivered);
+			return true;
+		}
+		return read_json(pkt.content, [&](const json &data) {
+			msg.success = is_success(data);
+			msg.client_id = data.value("client_id", uint64_t(0));
+			msg.token = data.value("token", uint64_t(0));
+			delivered = data.value("delivered", uint64_t(0));
+			msg.message = data.value("message", "");
+			if (delivered > UINT32_MAX) {
+				return false;
+			}
+			msg.delivered = static_cast<uint32_t>(delivered);
+			return true;
+		});
+	}
+	BinaryReader in(pkt.content);
+	uint8_t success;
+	if (!in.u8(success) || !in.u64(msg.client_id) || !in.u64(msg.token) ||
+	    !in.u32(msg.delivered)) {
+		return false;
+	}
+	msg.success = success != 0;
+	in.text(msg.message);
+	return true;
+}
+
+const char *PayloadCodecToString(PayloadCodec codec)
+{
+	switch (codec) {
+	case PayloadCodec::JSON:
+		return "json";
+	case PayloadCodec::BINARY:
+		return "binary";
+	}
+	return "unknown";
+}
+
+bool parse_codec_name(std::string_view name, PayloadCodec &codec)
+{
+	if (name == "json") {
+		codec = PayloadCodec::JSON;
+	} else if (name == "binary") {
+		codec = PayloadCodec::BINARY;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+const char *FrameCompressionToString(FrameCompression compression)
+{
+	switch (compression) {
+	case FrameCompression::NONE:
+		return "none";
+	case FrameCompression::LZ4:
+		return "lz4";
+	case FrameCompression::LZ4_DICT:
+		return "lz4-dict";
+	}
+	return "unknown";
+}
+
+bool parse_compression_name(std::string_view name, FrameCompression &compression)
+{
+	if (name == "lz4") {
+		compression = FrameCompression::LZ4;
+	} else if (name == "lz4-dict") {
+		compression = FrameCompression::LZ4_DICT;
+	} else {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,115 @@
+#include "include/presence_feed.h"
+#include <algorithm>       // For std::find, std::sort
+#include <thread>          // For std::this_thread::sleep_for
+
+PresenceFeed::PresenceFeed(std::chrono::milliseconds window)
+    : window_(window), subscribers_(std::make_shared<std::vector<uint64_t>>()),
+      subscriber_count_(0)
+{
+}
+
+void PresenceFeed::client_connected(const ClientListEntry &client)
+{
+	if (subscriber_count_ == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (subscribers_->empty()) {
+		return;
+	}
+	if (!has_pending()) {
+		pending_cv_.notify_one();
+	}
+	joined_.push_back(client);
+}
+
+void PresenceFeed::client_disconnected(uint64_t client_id)
+{
+	if (subscriber_count_ == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (subscribers_->empty()) {
+		return;
+	}
+	if (!has_pending()) {
+		pending_cv_.notify_one();
+	}
+	left_.push_back(client_id);
+}
+
+bool PresenceFeed::subscribe(uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (std::find(subscribers_->begin(), subscribers_->end(), client_id) !=
+	    subscribers_->end()) {
+		return false;
+	}
+	auto updated = std::make_shared<std::vector<uint64_t>>(*subscribers_);
+	updated->push_back(client_id);
+	subscribers_ = std::move(updated);
+	subscriber_count_ = subscribers_->size();
+	return true;
+}
+
+bool PresenceFeed::unsubscribe(uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = std::find(subscribers_->begin(), subscribers_->end(), client_id);
+	if (it == subscribers_->end()) {
+		return false;
+	}
+	auto updated = std::make_shared<std::vector<uint64_t>>(*subscribers_);
+	updated->erase(updated->begin() + (it - subscribers_->begin()));
+	subscribers_ = std::move(updated);
+	subscriber_count_ = subscribers_->size();
+	if (subscribers_->empty()) {
+		// Nobody is left to tell
+		joined_.clear();
+		left_.clear();
+	}
+	return true;
+}
+
+bool PresenceFeed::wait_batch(const std::atomic<bool> &running, PresenceDelta &delta,
+                              SubscriberList &subscribers)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		while (!has_pending()) {
+			if (!running) {
+				return false;
+			}
+			pending_cv_.wait_for(lock, std::chrono::seconds(1));
+		}
+		// Let the rest of the batch arrive before sending the first event
+		lock.unlock();
+		std::this_thread::sleep_for(window_);
+		lock.lock();
+		// The last subscriber may have left in the meantime
+		if (has_pending()) {
+			break;
+		}
+	}
+
+	delta.joined.swap(joined_);
+	delta.left.swap(left_);
+	joined_.clear();
+	left_.clear();
+	subscribers = subscribers_;
+	lock.unlock();
+
+	std::sort(delta.joined.begin(), delta.joined.end(),
+	          [](const ClientListEntry &a, const ClientListEntry &b) {
+		          return a.client_id < b.client_id;
+	          });
+	std::sort(delta.left.begin(), delta.left.end());
+	return true;
+}
+
+bool PresenceFeed::has_pending() const
+{
+	return !joined_.empty() || !left_.empty();
+}
@@ -1,41 +1,213 @@
 #include "include/protocol.h"
+#include "include/frame_compression.h"
+#include "include/buffer_pool.h"
 #include <nlohmann/json.hpp>
 #include <arpa/inet.h>      // For htonl, ntohl
+#include <cstring>          // For memcpy
+#include <cerrno>           // For errno
+#include <sys/socket.h>     // For recv, sendmsg
+#include <sys/uio.h>        // For iovec
 #include <vector>
 #include <map>
 #include <glog/logging.h>
 
 using json = nlohmann::json;
 
+// The correlation ID is stored big-endian like every other header field
+static void store_correlation_id(char *out, uint16_t correlation_id)
+{
+	uint16_t correlation_id_n = htons(correlation_id);
+	memcpy(out, &correlation_id_n, sizeof(correlation_id_n));
+}
+
+static uint16_t load_correlation_id(const char *in)
+{
+	uint16_t correlation_id_n;
+	memcpy(&correlation_id_n, in, sizeof(correlation_id_n));
+	return ntohs(correlation_id_n);
+}
+
+// Stores the total length and the payload length of a frame
+static void store_lengths(char *out, size_t payload_len)
+{
+	uint32_t total_len_n = htonl(HEADER_SIZE + payload_len);
+	uint32_t payload_len_n = htonl(payload_len);
+	memcpy(out, &total_len_n, sizeof(total_len_n));
+	memcpy(out + 12, &payload_len_n, sizeof(payload_len_n));
+}
+
+// Tells a caller that asked for it why a packet was rejected
+static void set_error(FrameError *error, FrameError value)
+{
+	if (error) {
+		*error = value;
+	}
+}
+
+// Flags the payload of an encoded frame prefix as compressed
+static void mark_compressed(char *prefix)
+{
+	prefix[9] = static_cast<char>(prefix[9] | PAYLOAD_COMPRESSED);
+}
+
 std::vector<char> create_message_stream(const Packet &pkt)
 {
-	// 1. Serialize the Packet's content to a JSON string
-	std::string payload_str = pkt.content; // For now, we assume content is already a valid JSON string or simple text.
-	uint32_t payload_len = payload_str.length();
+	// [Total Length, 4 bytes][Header][Payload], built in a single allocation.
+	// The content is assumed to be a valid JSON string or simple text.
+	std::string compressed;
+	std::string_view payload = pkt.content;
+	bool is_compressed = compress_payload(pkt.content, pkt.compression, compressed);
+	if (is_compressed) {
+		payload = compressed;
+	}
+	std::vector<char> message_stream(FRAME_PREFIX_SIZE + payload.size());
+	encode_frame_prefix(pkt.type, pkt.codec, payload.size(), message_stream.data(),
+	                    pkt.correlation_id);
+	if (is_compressed) {
+		mark_compressed(message_stream.data());
+	}
+	memcpy(message_stream.data() + FRAME_PREFIX_SIZE, payload.data(), payload.size());
+	return message_stream;
+}
 
-	// 2. Build the fixed-size header
-	std::vector<char> header(HEADER_SIZE);
+void encode_frame_prefix(MessageType type, PayloadCodec codec, size_t payload_len,
+                         char *out, uint16_t correlation_id)
+{
 	uint32_t magic = htonl(MAGIC_NUMBER);
-	uint8_t type = static_cast<uint8_t>(pkt.type);
-	uint32_t payload_len_n = htonl(payload_len);
+	uint8_t type_byte = static_cast<uint8_t>(type);
+
+	store_lengths(out, payload_len);
+	memcpy(out + 4, &magic, sizeof(magic));
+	memcpy(out + 8, &type_byte, sizeof(type_byte));
+	// Byte 5 of the header holds the payload codec, bytes 6 and 7 the
+	// correlation ID
+	out[9] = static_cast<char>(codec);
+	store_correlation_id(out + 10, correlation_id);
+}
 
-	memcpy(header.data(), &magic, sizeof(magic));
-	memcpy(header.data() + 4, &type, sizeof(type));
-	// Bytes 5, 6, 7 are reserved and remain 0
-	memcpy(header.data() + 8, &payload_len_n, sizeof(payload_len_n));
+OutboundFrame make_frame(MessageType type, SharedPayload payload, PayloadCodec codec,
+                         uint16_t correlation_id)
+{
+	OutboundFrame frame;
+	size_t payload_len = payload ? payload->size() : 0;
+	encode_frame_prefix(type, codec, payload_len, frame.prefix, correlation_id);
+	if (payload_len > 0) {
+		frame.payload = std::move(payload);
+	}
+	return frame;
+}
 
-	// 3. Construct the final message stream: [Total Length, 4 bytes][Header][Payload]
-	uint32_t total_len = HEADER_SIZE + payload_len;
-	uint32_t total_len_n = htonl(total_len);
+OutboundFrame make_frame(MessageType type, std::string payload, PayloadCodec codec,
+                         uint16_t correlation_id, FrameCompression compression)
+{
+	if (payload.empty()) {
+		return make_frame(type, SharedPayload(), codec, correlation_id);
+	}
+	if (compression != FrameCompression::NONE) {
+		std::string compressed = BufferPool::take(payload.size());
+		if (compress_payload(payload, compression, compressed)) {
+			BufferPool::give(std::move(payload));
+			OutboundFrame frame = make_frame(type, BufferPool::share(std::move(compressed)),
+			                                 codec, correlation_id);
+			mark_compressed(frame.prefix);
+			return frame;
+		}
+		BufferPool::give(std::move(compressed));
+	}
+	return make_frame(type, BufferPool::share(std::move(payload)), codec, correlation_id);
+}
 
-	std::vector<char> message_stream;
-	message_stream.resize(4 + total_len); // Allocate space for the full message
+OutboundFrame compress_frame(const OutboundFrame &frame, FrameCompression compression)
+{
+	if (frame.payload_size() == 0 || compression == FrameCompression::NONE) {
+		return frame;
+	}
+	std::string compressed = BufferPool::take(frame.payload_size());
+	if (!compress_payload(*frame.payload, compression, compressed)) {
+		BufferPool::give(std::move(compressed));
+		return frame;
+	}
+	OutboundFrame result;
+	memcpy(result.prefix, frame.prefix, FRAME_PREFIX_SIZE);
+	store_lengths(result.prefix, compressed.size());
+	mark_compressed(result.prefix);
+	result.payload = BufferPool::share(std::move(compressed));
+	return result;
+}
 
-	memcpy(message_stream.data(), &total_len_n, sizeof(total_len_n));
-	memcpy(message_stream.data() + 4, header.data(), HEADER_SIZE);
-	memcpy(message_stream.data() + 4 + HEADER_SIZE, payload_str.data(), payload_len);
+const OutboundFrame &FrameSet::for_format(WireFormat format) const
+{
+	size_t codec = static_cast<size_t>(format.codec);
+	size_t compression = static_cast<size_t>(format.compression);
+	if (format.compression == FrameCompression::NONE) {
+		return frames[codec];
+	}
+	if (!compressed_built_[codec][compression]) {
+		compressed_[codec][compression] = compress_frame(frames[codec], format.compression);
+		compressed_built_[codec][compression] = true;
+	}
+	return compressed_[codec][compression];
+}
 
-	return message_stream;
+void set_correlation_id(OutboundFrame &frame, uint16_t correlation_id)
+{
+	store_correlation_id(frame.prefix + 10, correlation_id);
+}
+
+// Writes every byte described by iov, resuming after partial writes
+static bool write_iov(int socket, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t result = sendmsg(socket, &msg, MSG_NOSIGNAL);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		size_t sent = result;
+		while (msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = static_cast<char *>(msg.msg_iov->iov_base) + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+	return true;
+}
+
+bool write_packet(int socket, MessageType type, std::string_view payload,
+                  PayloadCodec codec, uint16_t correlation_id)
+{
+	char prefix[FRAME_PREFIX_SIZE];
+	encode_frame_prefix(type, codec, payload.size(), prefix, correlation_id);
+
+	struct iovec iov[2];
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = FRAME_PREFIX_SIZE;
+	iov[1].iov_base = const_cast<char *>(payload.data());
+	iov[1].iov_len = payload.size();
+	return write_iov(socket, iov, payload.empty() ? 1 : 2);
+}
+
+bool write_frame(int socket, const OutboundFrame& frame)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = const_cast<char *>(frame.prefix);
+	iov[0].iov_len = FRAME_PREFIX_SIZE;
+	if (frame.payload_size() > 0) {
+		iov[1].iov_base = const_cast<char *>(frame.payload->data());
+		iov[1].iov_len = frame.payload->size();
+	}
+	return write_iov(socket, iov, frame.payload_size() > 0 ? 2 : 1);
 }
 
 bool read_n_bytes(int socket, size_t n, std::vector<char>& buffer)
@@ -53,9 +225,11 @@ bool read_n_bytes(int socket, size_t n, std::vector<char>& buffer)
 	return true;
 }
 
-bool read_packet(int socket, Packet& pkt)
+bool read_packet(int socket, Packet& pkt, FrameError *error)
 {
-	std::vector<char> length_buffer;
+	set_error(error, FrameError::NONE);
+	// Kept per thread, so that a reading loop allocates nothing per packet
+	static thread_local std::vector<char> length_buffer;
 	// 1. Read the 4-byte total length prefix
 	if (!read_n_bytes(socket, 4, length_buffer)) {
 		// Failed to read, likely a disconnect
@@ -67,18 +241,21 @@ bool read_packet(int socket, Packet& pkt)
 		LOG(ERROR) << "[Error] Packet size " << total_len
 			   << " exceeds max limit of " << MAX_PACKET_SIZE
 			   << ". Kicking client.";
+		set_error(error, FrameError::OVERSIZE);
 		return false;
 	}
 	if (total_len < HEADER_SIZE) {
 		LOG(ERROR) << "[Error] Packet size " << total_len
 			   << " is smaller than header. Kicking client.";
+		set_error(error, FrameError::UNDERSIZE);
 		return false;
 	}
 
 	// 2. Read the rest of the packet data (Header + Payload)
-	std::vector<char> packet_data_buffer;
+	static thread_local std::vector<char> packet_data_buffer;
 	if (!read_n_bytes(socket, total_len, packet_data_buffer)) {
 		LOG(ERROR) << "[Error] Failed to read packet data.";
+		set_error(error, FrameError::TRUNCATED);
 		return false;
 	}
 
@@ -86,23 +263,109 @@ bool read_packet(int socket, Packet& pkt)
 	uint32_t magic = ntohl(*reinterpret_cast<uint32_t*>(packet_data_buffer.data()));
 	if (magic != MAGIC_NUMBER) {
 		LOG(ERROR) << "[Error] Invalid magic number.";
+		set_error(error, FrameError::BAD_MAGIC);
 		return false;
 	}
 
 	// Populate the output packet
+	uint8_t codec = static_cast<uint8_t>(packet_data_buffer[5]);
+	if ((codec & ~PAYLOAD_COMPRESSED) >= PAYLOAD_CODEC_COUNT) {
+		LOG(ERROR) << "[Error] Unknown payload codec "
+			   << static_cast<int>(codec & ~PAYLOAD_COMPRESSED) << ".";
+		set_error(error, FrameError::BAD_CODEC);
+		return false;
+	}
 	pkt.type = static_cast<MessageType>(packet_data_buffer[4]);
+	pkt.codec = static_cast<PayloadCodec>(codec & ~PAYLOAD_COMPRESSED);
+	pkt.correlation_id = load_correlation_id(packet_data_buffer.data() + 6);
+	pkt.compression = FrameCompression::NONE;
 
 	uint32_t payload_len = ntohl(*reinterpret_cast<uint32_t*>(packet_data_buffer.data() + 8));
-	if (payload_len > 0) {
-		pkt.content.assign(packet_data_buffer.data() + HEADER_SIZE, payload_len);
+	if (payload_len > total_len - HEADER_SIZE) {
+		LOG(ERROR) << "[Error] Payload length " << payload_len
+			   << " exceeds packet size " << total_len << ".";
+		set_error(error, FrameError::BAD_LENGTH);
+		return false;
+	}
+	std::string_view payload(packet_data_buffer.data() + HEADER_SIZE, payload_len);
+	if (codec & PAYLOAD_COMPRESSED) {
+		if (!decompress_payload(payload, pkt.content)) {
+			LOG(ERROR) << "[Error] Malformed compressed payload.";
+			set_error(error, FrameError::BAD_COMPRESSION);
+			return false;
+		}
 	} else {
-		pkt.content.clear();
+		pkt.content.assign(payload);
 	}
 
 	// Successfully parsed
 	return true;
 }
 
+ssize_t parse_packet(const char *data, size_t len, PacketView& pkt, FrameError *error)
+{
+	// 1. Wait for the 4-byte total length prefix
+	if (len < 4) {
+		return 0;
+	}
+	uint32_t total_len;
+	memcpy(&total_len, data, sizeof(total_len));
+	total_len = ntohl(total_len);
+
+	if (total_len > MAX_PACKET_SIZE) {
+		LOG(ERROR) << "[Error] Packet size " << total_len
+			   << " exceeds max limit of " << MAX_PACKET_SIZE
+			   << ". Kicking client.";
+		set_error(error, FrameError::OVERSIZE);
+		return -1;
+	}
+	if (total_len < HEADER_SIZE) {
+		LOG(ERROR) << "[Error] Packet size " << total_len
+			   << " is smaller than header. Kicking client.";
+		set_error(error, FrameError::UNDERSIZE);
+		return -1;
+	}
+
+	// 2. Wait for the rest of the packet data (Header + Payload)
+	if (len - 4 < total_len) {
+		return 0;
+	}
+	const char *packet_data = data + 4;
+
+	// 3. Parse the header and deserialize the payload
+	uint32_t magic;
+	memcpy(&magic, packet_data, sizeof(magic));
+	if (ntohl(magic) != MAGIC_NUMBER) {
+		LOG(ERROR) << "[Error] Invalid magic number.";
+		set_error(error, FrameError::BAD_MAGIC);
+		return -1;
+	}
+
+	pkt.type = static_cast<MessageType>(packet_data[4]);
+	uint8_t codec = static_cast<uint8_t>(packet_data[5]) & ~PAYLOAD_COMPRESSED;
+	if (codec >= PAYLOAD_CODEC_COUNT) {
+		LOG(ERROR) << "[Error] Unknown payload codec " << static_cast<int>(codec) << ".";
+		set_error(error, FrameError::BAD_CODEC);
+		return -1;
+	}
+	pkt.codec = static_cast<PayloadCodec>(codec);
+	pkt.compressed = (static_cast<uint8_t>(packet_data[5]) & PAYLOAD_COMPRESSED) != 0;
+	pkt.correlation_id = load_correlation_id(packet_data + 6);
+
+	uint32_t payload_len;
+	memcpy(&payload_len, packet_data + 8, sizeof(payload_len));
+	payload_len = ntohl(payload_len);
+	if (payload_len > total_len - HEADER_SIZE) {
+		LOG(ERROR) << "[Error] Payload length " << payload_len
+			   << " exceeds packet size " << total_len << ".";
+		set_error(error, FrameError::BAD_LENGTH);
+		return -1;
+	}
+	pkt.content = std::string_view(packet_data + HEADER_SIZE, payload_len);
+
+	return 4 + total_len;
+}
+
 const char* MessageTypeToString(MessageType type) {
 	// Using a map for easy lookup.
 	// Note: A switch statement would be slightly more performant, but a map is more concise.
@@ -113,13 +376,43 @@ const char* MessageTypeToString(MessageType type) {
 		{MessageType::GET_CLIENT_LIST_REQUEST, "GET_CLIENT_LIST_REQUEST"},
 		{MessageType::SEND_MESSAGE_REQUEST, "SEND_MESSAGE_REQUEST"},
 		{MessageType::DISCONNECT_REQUEST, "DISCONNECT_REQUEST"},
+		{MessageType::BROADCAST_REQUEST, "BROADCAST_REQUEST"},
+		{MessageType::JOIN_GROUP_REQUEST, "JOIN_GROUP_REQUEST"},
+		{MessageType::LEAVE_GROUP_REQUEST, "LEAVE_GROUP_REQUEST"},
+		{MessageType::GROUP_MESSAGE_REQUEST, "GROUP_MESSAGE_REQUEST"},
+		{MessageType::HELLO_REQUEST, "HELLO_REQUEST"},
+		{MessageType::PRESENCE_SUBSCRIBE_REQUEST, "PRESENCE_SUBSCRIBE_REQUEST"},
+		{MessageType::PRESENCE_UNSUBSCRIBE_REQUEST, "PRESENCE_UNSUBSCRIBE_REQUEST"},
+		{MessageType::GET_STATS_REQUEST, "GET_STATS_REQUEST"},
+		{MessageType::TRANSFER_BEGIN_REQUEST, "TRANSFER_BEGIN_REQUEST"},
+		{MessageType::TRANSFER_CHUNK_REQUEST, "TRANSFER_CHUNK_REQUEST"},
+		{MessageType::TRANSFER_END_REQUEST, "TRANSFER_END_REQUEST"},
+		{MessageType::TRANSFER_ACK_REQUEST, "TRANSFER_ACK_REQUEST"},
+		{MessageType::MAILBOX_REQUEST, "MAILBOX_REQUEST"},
 		{MessageType::GET_TIME_RESPONSE, "GET_TIME_RESPONSE"},
 		{MessageType::GET_NAME_RESPONSE, "GET_NAME_RESPONSE"},
 		{MessageType::GET_CLIENT_LIST_RESPONSE, "GET_CLIENT_LIST_RESPONSE"},
 		{MessageType::SEND_MESSAGE_RESPONSE, "SEND_MESSAGE_RESPONSE"},
+		{MessageType::BROADCAST_RESPONSE, "BROADCAST_RESPONSE"},
+		{MessageType::JOIN_GROUP_RESPONSE, "JOIN_GROUP_RESPONSE"},
+		{MessageType::LEAVE_GROUP_RESPONSE, "LEAVE_GROUP_RESPONSE"},
+		{MessageType::GROUP_MESSAGE_RESPONSE, "GROUP_MESSAGE_RESPONSE"},
+		{MessageType::HELLO_RESPONSE, "HELLO_RESPONSE"},
+		{MessageType::PRESENCE_SUBSCRIBE_RESPONSE, "PRESENCE_SUBSCRIBE_RESPONSE"},
+		{MessageType::PRESENCE_UNSUBSCRIBE_RESPONSE, "PRESENCE_UNSUBSCRIBE_RESPONSE"},
+		{MessageType::GET_STATS_RESPONSE, "GET_STATS_RESPONSE"},
+		{MessageType::TRANSFER_BEGIN_RESPONSE, "TRANSFER_BEGIN_RESPONSE"},
+		{MessageType::MAILBOX_RESPONSE, "MAILBOX_RESPONSE"},
 		{MessageType::MESSAGE_INDICATION, "MESSAGE_INDICATION"},
 		{MessageType::SERVER_SHUTDOWN_INDICATION, "SERVER_SHUTDOWN_INDICATION"},
-		{MessageType::SYSTEM_NOTICE_INDICATION, "SYSTEM_NOTICE_INDICATION"}
+		{MessageType::SYSTEM_NOTICE_INDICATION, "SYSTEM_NOTICE_INDICATION"},
+		{MessageType::BROADCAST_INDICATION, "BROADCAST_INDICATION"},
+		{MessageType::GROUP_MESSAGE_INDICATION, "GROUP_MESSAGE_INDICATION"},
+		{MessageType::PRESENCE_DELTA_INDICATION, "PRESENCE_DELTA_INDICATION"},
+		{MessageType::TRANSFER_BEGIN_INDICATION, "TRANSFER_BEGIN_INDICATION"},
+		{MessageType::TRANSFER_CHUNK_INDICATION, "TRANSFER_CHUNK_INDICATION"},
+		{MessageType::TRANSFER_END_INDICATION, "TRANSFER_END_INDICATION"},
+		{MessageType::TRANSFER_ACK_INDICATION, "TRANSFER_ACK_INDICATION"}
 	};
 
 	auto it = type_map.find(type);
@@ -127,4 +420,27 @@ const char* MessageTypeToString(MessageType type) {
 		return it->second;
 	}
 	return "UNKNOWN_TYPE";
-}
\ No newline at end of file
+}
+
+const char *FrameErrorToString(FrameError error)
+{
+	switch (error) {
+	case FrameError::NONE:
+		return "none";
+	case FrameError::OVERSIZE:
+		return "oversize";
+	case FrameError::UNDERSIZE:
+		return "undersize";
+	case FrameError::BAD_MAGIC:
+		return "bad_magic";
+	case FrameError::BAD_CODEC:
+		return "bad_codec";
+	case FrameError::BAD_LENGTH:
+		return "bad_length";
+	case FrameError::BAD_COMPRESSION:
+		return "bad_compression";
+	case FrameError::TRUNCATED:
+		return "truncated";
+	}
+	return "unknown";
+}
@@ -0,0 +1,719 @@
+#include <algorithm>       // For std::min, std::max
+#include <atomic>
+#include <chrono>
+#include <cstdlib>         // For malloc, free, strtod, mkdtemp
+#include <cstring>         // For strcmp, strerror
+#include <filesystem>      // For the mailbox benchmark's directory
+#include <iomanip>
+#include <iostream>
+#include <new>             // For std::bad_alloc
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>     // For htonl
+#include <sys/socket.h>    // For socketpair
+#include <thread>          // For std::this_thread::yield
+#include <unistd.h>        // For close
+#include <nlohmann/json.hpp>
+
+#include "include/glog_wrapper.h"
+#include "include/packet.h"
+#include "include/protocol.h"
+#include "include/frame_decoder.h"
+#include "include/frame_compression.h"
+#include "include/payload_codec.h"
+#include "include/json_fields.h"
+#include "include/client_manager.h"
+#include "include/metrics.h"
+#include "include/async_log.h"
+#include "include/buffer_pool.h"
+#include "include/worker_pool.h"
+#include "include/transfer_table.h"
+#include "include/mailbox.h"
+#include "include/message_journal.h"
+#include "include/utility.h"
+
+// Packets in the buffer a FrameDecoder benchmark decodes per operation
+#define PIPELINED_PACKETS 32
+// Recipients of the fan-out benchmarks
+#define FANOUT_CLIENTS 10000
+// Made-up socket numbers of those recipients; no socket is ever touched
+#define FANOUT_FIRST_FD 100000
+// Entries of an uncached GET_CLIENT_LIST_RESPONSE page, as in the server
+#define CLIENT_LIST_PAGE_SIZE 500
+
+using Clock = std::chrono::steady_clock;
+using json = nlohmann::json;
+
+// Payload sizes most benchmarks run at: a chat line, a long message, a large
+// client-list page and a payload near the packet limit
+static const size_t PAYLOAD_SIZES[] = {100, 1024, 16384, 61440};
+
+// Settings taken from the command line
+struct BenchOptions {
+	std::string filter;     // Run only benchmarks whose name contains it
+	double min_time_ms = 200; // Shortest measured batch
+};
+
+BenchOptions g_options;
+
+// Every call of the global operator new, so that a benchmark can report its
+// allocations per operation. The replacements are kept out of line, or GCC
+// takes the free() in an inlined delete for a mismatched deallocation.
+std::atomic<uint64_t> g_allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	void *block = malloc(size > 0 ? size : 1);
+	if (!block) {
+		throw std::bad_alloc();
+	}
+	return block;
+}
+
+__attribute__((noinline)) void operator delete(void *block) noexcept
+{
+	free(block);
+}
+
+__attribute__((noinline)) void operator delete(void *block, size_t) noexcept
+{
+	free(block);
+}
+
+// Keeps the compiler from dropping a result that is never used
+template <typename T>
+void keep(const T &value)
+{
+	asm volatile("" : : "r"(&value) : "memory");
+}
+
+// Runs op in batches of growing size until one batch takes at least the
+// minimum time, and prints that batch's figures as one line of JSON:
+//
+//   {"benchmark":NAME,"size":BYTES,"iterations":N,"ns_per_op":T,
+//    "mb_per_s":R,"allocs_per_op":A[,"output_size":BYTES]}
+//
+// size is the input one operation handles and sets mb_per_s; output_size is
+// only printed where the output size is the point, as for compression.
+template <typename Op>
+void run_bench(const std::string &name, size_t size, Op op, size_t output_size = 0)
+{
+	if (name.find(g_options.filter) == std::string::npos) {
+		return;
+	}
+	// Builds lazy tables and thread-local buffers outside the measurement
+	op();
+
+	uint64_t iterations = 1;
+	for (;;) {
+		uint64_t allocations = g_allocations.load(std::memory_order_relaxed);
+		Clock::time_point start = Clock::now();
+		for (uint64_t i = 0; i < iterations; i++) {
+			op();
+		}
+		double elapsed_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		allocations = g_allocations.load(std::memory_order_relaxed) - allocations;
+
+		if (elapsed_ns < g_options.min_time_ms * 1e6) {
+			// Aim a little past the minimum, growing at most tenfold at once
+			double wanted = iterations * g_options.min_time_ms * 1.2e6 / std::max(elapsed_ns, 1.0);
+			iterations = std::max<uint64_t>(iterations + 1,
+			                                std::min<double>(wanted, iterations * 10.0));
+			continue;
+		}
+
+		double ns_per_op = elapsed_ns / iterations;
+		std::ostringstream line;
+		line << std::fixed << "{\"benchmark\":\"" << name << "\",\"size\":" << size
+		     << ",\"iterations\":" << iterations << ",\"ns_per_op\":" << std::setprecision(1)
+		     << ns_per_op << ",\"mb_per_s\":" << size * 1e3 / ns_per_op
+		     << ",\"allocs_per_op\":" << std::setprecision(2)
+		     << static_cast<double>(allocations) / iterations;
+		if (output_size > 0) {
+			line << ",\"output_size\":" << output_size;
+		}
+		line << "}";
+		std::cout << line.str() << std::endl;
+		return;
+	}
+}
+
+// Chat-like text: words from a small vocabulary, picked with a fixed seed so
+// every run compresses the same bytes
+std::string chat_text(size_t length)
+{
+	static const char *const WORDS[] = {
+	        "the", "meeting", "is", "moved", "to", "three", "o'clock", "please",
+	        "send", "me", "latest", "build", "logs", "server", "looks", "fine",
+	        "again", "thanks", "for", "quick", "fix", "who", "owns", "client",
+	        "list", "page", "tomorrow", "morning", "ok", "sounds", "good", "and"};
+	std::mt19937 random(42);
+	std::string text;
+	while (text.size() < length) {
+		text += WORDS[random() % (sizeof(WORDS) / sizeof(WORDS[0]))];
+		text += random() % 8 == 0 ? ". " : " ";
+	}
+	text.resize(length);
+	return text;
+}
+
+// A SEND_MESSAGE_REQUEST payload of about size bytes in a codec
+std::string send_request_payload(PayloadCodec codec, size_t size)
+{
+	SendMessageRequest request{42, ""};
+	size_t overhead = encode_payload(codec, MessageType::SEND_MESSAGE_REQUEST, request).size();
+	request.message = chat_text(size > overhead ? size - overhead : 1);
+	return encode_payload(codec, MessageType::SEND_MESSAGE_REQUEST, request);
+}
+
+ClientListResponse client_list(size_t count)
+{
+	ClientListResponse list;
+	for (size_t i = 0; i < count; i++) {
+		uint32_t ipv4 = (10u << 24) | (static_cast<uint32_t>(i / 250) << 8) | (i % 250 + 1);
+		list.clients.push_back(ClientListEntry{i + 1, htonl(ipv4),
+		                                       static_cast<uint16_t>(40000 + i)});
+	}
+	return list;
+}
+
+// The JSON of the longest client list that stays within size bytes
+std::string client_list_payload(size_t size)
+{
+	size_t count = 1;
+	while (encode_payload(PayloadCodec::JSON, MessageType::GET_CLIENT_LIST_RESPONSE,
+	                      client_list(count * 2)).size() <= size) {
+		count *= 2;
+	}
+	for (size_t step = count / 2; step > 0; step /= 2) {
+		if (encode_payload(PayloadCodec::JSON, MessageType::GET_CLIENT_LIST_RESPONSE,
+		                   client_list(count + step)).size() <= size) {
+			count += step;
+		}
+	}
+	return encode_payload(PayloadCodec::JSON, MessageType::GET_CLIENT_LIST_RESPONSE,
+	                      client_list(count));
+}
+
+PacketView view_of(MessageType type, PayloadCodec codec, const std::string &payload)
+{
+	PacketView view;
+	view.type = type;
+	view.codec = codec;
+	view.content = payload;
+	return view;
+}
+
+// Building and parsing frames in memory
+void bench_framing()
+{
+	char prefix[FRAME_PREFIX_SIZE];
+	run_bench("encode_frame_prefix", FRAME_PREFIX_SIZE, [&]() {
+		encode_frame_prefix(MessageType::MESSAGE_INDICATION, PayloadCodec::JSON, 100, prefix, 7);
+		keep(prefix);
+	});
+
+	for (size_t size : PAYLOAD_SIZES) {
+		Packet pkt{MessageType::SEND_MESSAGE_REQUEST, send_request_payload(PayloadCodec::JSON, size)};
+		run_bench("create_message_stream", size, [&]() { keep(create_message_stream(pkt)); });
+
+		SharedPayload shared = std::make_shared<const std::string>(pkt.content);
+		run_bench("make_frame_shared", size, [&]() {
+			keep(make_frame(pkt.type, shared, pkt.codec, 7));
+		});
+
+		std::vector<char> stream = create_message_stream(pkt);
+		run_bench("parse_packet", size, [&]() {
+			PacketView view;
+			keep(parse_packet(stream.data(), stream.size(), view));
+			keep(view);
+		});
+
+		std::vector<char> pipelined;
+		for (int i = 0; i < PIPELINED_PACKETS; i++) {
+			pipelined.insert(pipelined.end(), stream.begin(), stream.end());
+		}
+		FrameDecoder decoder;
+		run_bench("frame_decoder_pipelined", pipelined.size(), [&]() {
+			PacketView view;
+			decoder.feed(pipelined.data(), pipelined.size());
+			while (decoder.next(view) == DecodeStatus::PACKET) {
+				keep(view);
+			}
+			decoder.finish();
+		});
+	}
+}
+
+// Sending and receiving frames through a socketpair, system calls included
+void bench_socketpair()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		LOG(ERROR) << "[Error] socketpair() failed: " << strerror(errno);
+		return;
+	}
+	int buffer_size = 4 * MAX_PACKET_SIZE;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+	for (size_t size : PAYLOAD_SIZES) {
+		std::string payload = send_request_payload(PayloadCodec::JSON, size);
+		run_bench("socket_write_packet_read_packet", size, [&]() {
+			Packet pkt;
+			write_packet(fds[0], MessageType::SEND_MESSAGE_REQUEST, payload);
+			keep(read_packet(fds[1], pkt));
+		});
+
+		OutboundFrame frame = make_frame(MessageType::SEND_MESSAGE_REQUEST, payload);
+		FrameDecoder decoder;
+		run_bench("socket_write_frame_frame_decoder", size, [&]() {
+			PacketView view;
+			write_frame(fds[0], frame);
+			DecodeStatus status;
+			while ((status = decoder.next(view)) == DecodeStatus::NEED_MORE) {
+				if (decoder.read_from(fds[1]) <= 0) {
+					return;
+				}
+			}
+			keep(view);
+		});
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// The type names every log line of a packet looks up
+void bench_message_type_to_string()
+{
+	std::vector<MessageType> types;
+	for (int value = 0; value <= 0xff; value++) {
+		MessageType type = static_cast<MessageType>(value);
+		if (strcmp(MessageTypeToString(type), "UNKNOWN_TYPE") != 0) {
+			types.push_back(type);
+		}
+	}
+	size_t next = 0;
+	run_bench("message_type_to_string", 0, [&]() {
+		keep(MessageTypeToString(types[next]));
+		next = next + 1 < types.size() ? next + 1 : 0;
+	});
+}
+
+// Message text is sanitized once per delivered or logged message
+void bench_sanitize()
+{
+	for (size_t size : PAYLOAD_SIZES) {
+		std::string text = chat_text(size);
+		run_bench("sanitize_for_terminal_clean", size, [&]() {
+			keep(sanitize_for_terminal(text));
+		});
+
+		std::string escaped = text;
+		for (size_t pos = 0; pos < escaped.size(); pos += 64) {
+			escaped[pos] = '\x1b';
+		}
+		run_bench("sanitize_for_terminal_escapes", size, [&]() {
+			keep(sanitize_for_terminal(escaped));
+		});
+	}
+}
+
+// Reading a SEND_MESSAGE_REQUEST: the single-pass extractor against a DOM,
+// and decode_payload(), which tries the first and falls back to the second
+void bench_json_decode()
+{
+	for (size_t size : PAYLOAD_SIZES) {
+		std::string payload = send_request_payload(PayloadCodec::JSON, size);
+
+		run_bench("json_extractor_send_message", size, [&]() {
+			SendMessageRequest request;
+			JsonFieldExtractor fields;
+			fields.add("target_id", request.target_id);
+			fields.add("message", request.message);
+			keep(fields.extract(payload));
+			keep(request);
+		});
+
+		run_bench("json_dom_send_message", size, [&]() {
+			SendMessageRequest request;
+			json data = json::parse(payload.begin(), payload.end(), nullptr, false);
+			request.target_id = data.at("target_id").get<uint64_t>();
+			request.message = data.at("message").get<std::string>();
+			keep(request);
+		});
+
+		for (PayloadCodec codec : {PayloadCodec::JSON, PayloadCodec::BINARY}) {
+			std::string encoded = send_request_payload(codec, size);
+			PacketView view = view_of(MessageType::SEND_MESSAGE_REQUEST, codec, encoded);
+			run_bench(std::string("decode_payload_send_message_") + PayloadCodecToString(codec),
+			          size, [&]() {
+				          SendMessageRequest request;
+				          keep(decode_payload(view, request));
+				          keep(request);
+			          });
+		}
+	}
+}
+
+// The work of the server's request handlers without their shard lookups and
+// sends, which need a running server: decoding the request and encoding the
+// frames of the reply and of what it forwards
+void bench_handlers()
+{
+	for (PayloadCodec codec : {PayloadCodec::JSON, PayloadCodec::BINARY}) {
+		std::string suffix = std::string("_") + PayloadCodecToString(codec);
+
+		std::string payload = send_request_payload(codec, 100);
+		PacketView request = view_of(MessageType::SEND_MESSAGE_REQUEST, codec, payload);
+		// Reused across requests like the server's handler reuses them
+		SendMessageRequest send_request;
+		ChatIndication forward;
+		run_bench("handle_send_message" + suffix, payload.size(), [&]() {
+			decode_payload(request, send_request);
+			forward.from_id = 7;
+			sanitize_for_terminal(send_request.message, forward.message);
+			keep(encode_frame(MessageType::MESSAGE_INDICATION, codec, forward));
+			SendMessageResponse response;
+			response.success = true;
+			response.target_id = send_request.target_id;
+			keep(encode_frame(MessageType::SEND_MESSAGE_RESPONSE, codec, response));
+		});
+
+		TimeResponse time{"2025-10-06T15:30:00Z"};
+		run_bench("handle_get_time" + suffix, 0, [&]() {
+			keep(encode_frame(MessageType::GET_TIME_RESPONSE, codec, time));
+		});
+
+		ClientListResponse page = client_list(CLIENT_LIST_PAGE_SIZE);
+		size_t page_size = encode_payload(codec, MessageType::GET_CLIENT_LIST_RESPONSE, page).size();
+		run_bench("handle_get_client_list_page" + suffix, page_size, [&]() {
+			keep(encode_frame(MessageType::GET_CLIENT_LIST_RESPONSE, codec, page));
+		});
+	}
+
+	HelloRequest hello;
+	hello.codecs = {PayloadCodec::BINARY, PayloadCodec::JSON};
+	hello.compressions = {FrameCompression::LZ4_DICT, FrameCompression::LZ4};
+	std::string payload = encode_payload(PayloadCodec::JSON, MessageType::HELLO_REQUEST, hello);
+	PacketView request = view_of(MessageType::HELLO_REQUEST, PayloadCodec::JSON, payload);
+	run_bench("handle_hello", payload.size(), [&]() {
+		HelloRequest offer;
+		decode_payload(request, offer);
+		HelloResponse response;
+		response.codec = offer.codecs.front();
+		response.compression = offer.compressions.front();
+		keep(encode_frame(MessageType::HELLO_RESPONSE, PayloadCodec::JSON, response));
+	});
+}
+
+// Bandwidth saved against CPU spent, on the payload that compresses best and
+// on chat text
+void bench_compression()
+{
+	for (size_t size : PAYLOAD_SIZES) {
+		if (size < 1024) {
+			// Below the threshold nothing is compressed
+			continue;
+		}
+		struct Input {
+			const char *name;
+			std::string payload;
+		};
+		Input inputs[] = {{"client_list", client_list_payload(size)},
+		                  {"chat", send_request_payload(PayloadCodec::JSON, size)}};
+		for (const Input &input : inputs) {
+			for (FrameCompression mode : {FrameCompression::LZ4, FrameCompression::LZ4_DICT}) {
+				std::string name = std::string("_") + FrameCompressionToString(mode) + "_" +
+				                   input.name;
+				std::string compressed;
+				if (!compress_payload(input.payload, mode, compressed)) {
+					LOG(WARNING) << "[Warning] " << input.name << " at " << size
+					             << " bytes does not compress with "
+					             << FrameCompressionToString(mode);
+					continue;
+				}
+				run_bench("compress" + name, input.payload.size(), [&]() {
+					keep(compress_payload(input.payload, mode, compressed));
+				}, compressed.size());
+
+				std::string restored;
+				run_bench("decompress" + name, input.payload.size(), [&]() {
+					keep(decompress_payload(compressed, restored));
+				}, compressed.size());
+			}
+		}
+	}
+}
+
+// One message to every client of a ClientManager, once encoded a single
+// time and shared, once encoded per recipient as the server used to. The
+// frame writer keeps the last frame of each client instead of queueing it.
+void bench_fanout()
+{
+	FLAGS_minloglevel = google::WARNING; // Not a line per added client
+	ClientManager manager;
+	for (int i = 0; i < FANOUT_CLIENTS; i++) {
+		manager.add_client(FANOUT_FIRST_FD + i, "10.0.0.1", 40000 + i % 20000);
+	}
+	FLAGS_minloglevel = google::INFO;
+
+	std::vector<OutboundFrame> delivered(FANOUT_CLIENTS);
+	manager.set_frame_writer([&delivered](int socket_fd, const OutboundFrame &frame) {
+		delivered[socket_fd - FANOUT_FIRST_FD] = frame;
+		return true;
+	});
+	std::vector<uint64_t> client_ids;
+	manager.for_each_client([&](const ClientRegistry::Entry &client) {
+		client_ids.push_back(client.client_id);
+	});
+
+	ChatIndication message{1, chat_text(100)};
+	std::string name = "_" + std::to_string(FANOUT_CLIENTS);
+	run_bench("fanout_broadcast_shared" + name, message.message.size(), [&]() {
+		FrameSet frames = encode_frame_set(MessageType::BROADCAST_INDICATION, message);
+		keep(manager.broadcast(frames));
+	});
+	run_bench("fanout_encode_per_recipient" + name, message.message.size(), [&]() {
+		for (uint64_t client_id : client_ids) {
+			manager.send_to_client(client_id, encode_packet(MessageType::BROADCAST_INDICATION,
+			                                                PayloadCodec::JSON, message));
+		}
+	});
+}
+
+// What the server pays per frame and request to keep its metrics, and what
+// a GET_STATS or a scrape costs. The latencies cycle through a spread of
+// values so that they land in different buckets.
+void bench_metrics()
+{
+	run_bench("metrics_count", 0, [&]() { Metrics::count(Counter::BYTES_IN, 100); });
+	run_bench("metrics_count_frame_in", 0, [&]() {
+		Metrics::count_frame_in(MessageType::SEND_MESSAGE_REQUEST);
+	});
+	uint64_t latency = 1;
+	run_bench("metrics_record_latency", 0, [&]() {
+		latency = latency * 7 % 1000003;
+		Metrics::record_latency(MessageType::SEND_MESSAGE_REQUEST, latency);
+	});
+
+	MetricsSnapshot snapshot = Metrics::snapshot();
+	run_bench("metrics_snapshot", 0, [&]() { keep(Metrics::snapshot().uptime_seconds); });
+	run_bench("metrics_stats_response", 0, [&]() {
+		keep(encode_payload(PayloadCodec::JSON, MessageType::GET_STATS_RESPONSE,
+		                    make_stats_response(snapshot)));
+	});
+	run_bench("metrics_format_text", 0, [&]() { keep(format_metrics_text(snapshot)); });
+}
+
+// What a per-packet log record costs when it is not written: cutting the
+// payload it would show, skipping it by sampling and skipping it by level
+void bench_logging()
+{
+	for (size_t size : PAYLOAD_SIZES) {
+		std::string text = chat_text(size);
+		run_bench("log_truncate_payload", size, [&]() {
+			keep(sanitize_for_terminal(truncate_for_log(text, 128)));
+		});
+	}
+
+	uint64_t client_id = 42;
+	// The first record is written; the counter then skips the rest
+	AsyncLog::start(LogMode::SYNC, 1u << 30);
+	run_bench("hot_log_sampled_out", 0, [&]() {
+		HOT_LOG_SAMPLED(INFO) << "Received from ID " << client_id++ << ", Type: "
+		                      << MessageTypeToString(MessageType::SEND_MESSAGE_REQUEST);
+	});
+	AsyncLog::start(LogMode::SYNC, 1);
+
+	int min_level = FLAGS_minloglevel;
+	FLAGS_minloglevel = google::GLOG_ERROR;
+	run_bench("hot_log_disabled", 0, [&]() {
+		HOT_LOG(INFO) << "Received from ID " << client_id++ << ", Type: "
+		              << MessageTypeToString(MessageType::SEND_MESSAGE_REQUEST);
+	});
+	FLAGS_minloglevel = min_level;
+}
+
+// A payload made shareable and released, as each reply is once it has been
+// sent: from the pool, whose buffers and reference counts are reused, and
+// from the allocator, as before the pool
+void bench_buffer_pool()
+{
+	for (size_t size : PAYLOAD_SIZES) {
+		std::string text = chat_text(size);
+		run_bench("buffer_pool_share", size, [&]() {
+			std::string payload = BufferPool::take(text.size());
+			payload.append(text);
+			keep(BufferPool::share(std::move(payload)));
+		});
+		run_bench("buffer_alloc_share", size, [&]() {
+			keep(std::make_shared<const std::string>(text));
+		});
+	}
+}
+
+// What an event loop pays to hand a request to the workers, and how long
+// the request waits: one item through a client's SerialQueue, from the post
+// until a worker has run it
+void bench_workers()
+{
+	WorkerPool pool(1);
+	std::atomic<uint64_t> done(0);
+	auto queue = std::make_shared<SerialQueue<uint64_t>>(pool, [&done](uint64_t &item) {
+		done.store(item, std::memory_order_release);
+	});
+	uint64_t posted = 0;
+	run_bench("worker_queue_round_trip", 0, [&]() {
+		queue->post(++posted);
+		while (done.load(std::memory_order_acquire) != posted) {
+			std::this_thread::yield();
+		}
+	});
+}
+
+// What the server does with every chunk of a file transfer: decode it in
+// place, count it against the window and copy it into the indication for
+// the receiver. The receiver's acknowledgement keeps the window open.
+void bench_transfer_relay()
+{
+	std::string data = chat_text(TRANSFER_CHUNK_SIZE);
+	std::string payload = encode_payload(PayloadCodec::BINARY, MessageType::TRANSFER_CHUNK_REQUEST,
+	                                     TransferChunk{2, 7, data});
+	PacketView request = view_of(MessageType::TRANSFER_CHUNK_REQUEST, PayloadCodec::BINARY, payload);
+	TransferTable transfers;
+	std::string error;
+	transfers.begin(1, 7, 2, error);
+	uint64_t relayed = 0;
+	run_bench("transfer_relay_chunk", data.size(), [&]() {
+		TransferChunk chunk;
+		uint64_t receiver_id = 0;
+		decode_payload(request, chunk);
+		transfers.chunk(1, chunk.transfer_id, chunk.data.size(), receiver_id);
+		chunk.peer_id = 1;
+		keep(encode_frame(MessageType::TRANSFER_CHUNK_INDICATION, PayloadCodec::BINARY, chunk));
+		relayed += chunk.data.size();
+		transfers.acknowledge(1, 7, receiver_id, relayed);
+	});
+}
+
+// A chat message kept for an offline client, and claimed back with the
+// others once its mailbox is full, as its client would on reconnecting. The
+// segments go to a temporary directory, removed afterwards.
+void bench_mailbox()
+{
+	char directory[] = "/tmp/protocol_bench.XXXXXX";
+	if (mkdtemp(directory) == nullptr) {
+		LOG(ERROR) << "[Error] mkdtemp() failed: " << strerror(errno);
+		return;
+	}
+	{
+		Mailbox mailbox;
+		std::string error;
+		if (!mailbox.open(directory, Mailbox::MAX_MAILBOX_BYTES, error)) {
+			LOG(ERROR) << "[Error] " << error;
+			std::filesystem::remove_all(directory);
+			return;
+		}
+		std::string text = chat_text(100);
+		uint64_t client_id = 1;
+		uint64_t token = mailbox.add_client(client_id);
+		mailbox.client_offline(client_id);
+		std::vector<Mailbox::Message> messages;
+		run_bench("mailbox_store_claim", text.size(), [&]() {
+			if (mailbox.store(client_id, 2, text) == Mailbox::StoreResult::FULL) {
+				messages.clear();
+				mailbox.claim(client_id, token, messages);
+				token = mailbox.add_client(++client_id);
+				mailbox.client_offline(client_id);
+				mailbox.store(client_id, 2, text);
+			}
+		});
+	}
+	std::filesystem::remove_all(directory);
+}
+
+// What the send path adds to a message with --journal: queueing its record
+// for the writer thread, which meanwhile writes and syncs the batches to a
+// temporary file.
+void bench_journal()
+{
+	char directory[] = "/tmp/protocol_bench.XXXXXX";
+	if (mkdtemp(directory) == nullptr) {
+		LOG(ERROR) << "[Error] mkdtemp() failed: " << strerror(errno);
+		return;
+	}
+	{
+		MessageJournal journal;
+		std::string error;
+		if (!journal.open(std::string(directory) + "/journal", error)) {
+			LOG(ERROR) << "[Error] " << error;
+			std::filesystem::remove_all(directory);
+			return;
+		}
+		std::string text = chat_text(100);
+		run_bench("journal_append", text.size(), [&]() { journal.append(1, 2, text); });
+	}
+	std::filesystem::remove_all(directory);
+}
+
+void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [--filter TEXT] [--min-time MS]\n"
+	          << "  --filter TEXT  Run only benchmarks whose name contains TEXT\n"
+	          << "  --min-time MS  Shortest measured batch per benchmark (default 200)\n"
+	          << "Prints one JSON object per benchmark and line.\n";
+}
+
+bool parse_args(int argc, char *argv[], BenchOptions &options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			return false;
+		}
+		const char *value = argv[++i];
+		if (arg == "--filter") {
+			options.filter = value;
+		} else if (arg == "--min-time") {
+			char *end;
+			options.min_time_ms = strtod(value, &end);
+			if (*end != '\0' || !(options.min_time_ms > 0)) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	auto glog = GlogWrapper(argv[0]);
+
+	if (!parse_args(argc, argv, g_options)) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	bench_framing();
+	bench_socketpair();
+	bench_message_type_to_string();
+	bench_sanitize();
+	bench_json_decode();
+	bench_handlers();
+	bench_compression();
+	bench_fanout();
+	bench_metrics();
+	bench_logging();
+	bench_buffer_pool();
+	bench_workers();
+	bench_transfer_relay();
+	bench_mailbox();
+	bench_journal();
+	return 0;
+}
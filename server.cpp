@@ -5,32 +5,106 @@
 #include <unistd.h>        // For close
 #include <sys/socket.h>    // For socket functions
 #include <netinet/in.h>    // For sockaddr_in
-#include <thread>          // For threading
+#include <netinet/tcp.h>   // For TCP_NODELAY
+#include <arpa/inet.h>     // For inet_pton
 #include <csignal>         // For signal handling
 #include <atomic>          // For std::atomic
-#include <sys/select.h>    // For select()
+#include <sys/resource.h>  // For getrlimit, setrlimit
+#include <pthread.h>       // For pthread_setaffinity_np
+#include <thread>          // For reactor threads
+#include <memory>          // For std::unique_ptr
+#include <functional>      // For std::function
+#include <unordered_map>   // For the request queues of a shard
+#include <algorithm>       // For std::sort, heap functions
 #include <cerrno>          // For errno
-#include <nlohmann/json.hpp>
+#include <poll.h>          // For poll
+#include <sys/time.h>      // For timeval
 
 #include <chrono>
 #include <iomanip>
 #include <sstream>
 
 #define SERVER_PORT 4468
-#define MAX_CLIENT_QUEUE 20
+#define MAX_GROUP_NAME_LENGTH 32
+#define MAX_CLIENT_QUEUE SOMAXCONN
+#define CLIENT_LIST_PAGE_SIZE 500
+#define PRESENCE_BATCH_WINDOW_MS 100
+// How often the metrics endpoint checks whether the server is stopping
+#define METRICS_POLL_INTERVAL_MS 1000
+// How long a scrape may take to send its request or read the reply
+#define METRICS_IO_TIMEOUT_S 5
+// Bytes of a text payload shown in the per-packet log
+#define LOG_PAYLOAD_LIMIT 128
+// Requests a client may have waiting for the workers before it is dropped
+#define MAX_QUEUED_REQUESTS 1024
+// Longest file name passed on with a transfer
+#define MAX_TRANSFER_NAME_LENGTH 255
 
 #include "include/glog_wrapper.h"
 #include "include/protocol.h"
 #include "include/client_info.h"
 #include "include/client_manager.h"
 #include "include/utility.h"
+#include "include/event_loop.h"
+#include "include/group_directory.h"
+#include "include/payload_codec.h"
+#include "include/response_cache.h"
+#include "include/presence_feed.h"
+#include "include/metrics.h"
+#include "include/async_log.h"
+#include "include/buffer_pool.h"
+#include "include/worker_pool.h"
+#include "include/transfer_table.h"
+#include "include/mailbox.h"
+#include "include/message_journal.h"
 
-using json = nlohmann::json;
 // clang-format on
 
+// A request copied off its loop thread's receive buffer for a worker
+struct QueuedRequest {
+	uint64_t client_id = 0;
+	Packet packet;
+};
+
+// The requests of one client, handled in order by the workers
+using RequestQueue = SerialQueue<QueuedRequest>;
+
+/**
+ * A shard is one event loop thread together with its own listening socket and
+ * the clients accepted on it. Client IDs are striped across shards, so the
+ * shard that owns an ID is (id - 1) % shard count and never needs a lookup.
+ */
+struct Shard {
+	int index;
+	int listen_fd;
+	ClientManager clients;
+	std::unique_ptr<EventLoop> loop;
+	ResponseCache cache; // Replies to the shard's clients; loop thread only
+	// The queue of each client while workers handle the requests; loop
+	// thread only
+	std::unordered_map<uint64_t, std::shared_ptr<RequestQueue>> requests;
+
+	Shard(int index, int count)
+	    : index(index), listen_fd(-1), clients(index + 1, count)
+	{
+	}
+};
+
 std::atomic<bool> g_server_running(true);
-ClientManager g_client_manager;
+std::vector<std::unique_ptr<Shard>> g_shards;
+GroupDirectory g_groups;
+TransferTable g_transfers;
+// Keeps messages for offline clients if the server was started with --mailbox
+Mailbox g_mailbox;
+// Records every message the server accepts if started with --journal
+MessageJournal g_journal;
+PresenceFeed g_presence{std::chrono::milliseconds(PRESENCE_BATCH_WINDOW_MS)};
 const std::string g_server_name = "Lab7-SocketServer";
+// Runs the request handlers if the server was started with --workers;
+// otherwise every handler runs on its client's loop thread
+std::unique_ptr<WorkerPool> g_workers;
+// The ResponseCache of each worker, by worker index
+std::vector<std::unique_ptr<ResponseCache>> g_worker_caches;
 
 // Signal handler function
 // Called when SIGINT (Ctrl+C) or SIGTERM (kill) is received
@@ -41,208 +115,1087 @@ void signal_handler(int signum)
 	g_server_running = false;
 }
 
-std::string get_current_time_str()
+// Returns the shard that owns a client ID, or nullptr if no shard could own it
+Shard *find_owner_shard(uint64_t client_id)
 {
-	auto now = std::chrono::system_clock::now();
-	auto in_time_t = std::chrono::system_clock::to_time_t(now);
+	if (client_id == 0) {
+		return nullptr;
+	}
+	return g_shards[(client_id - 1) % g_shards.size()].get();
+}
 
-	std::tm timeinfo = *gmtime(&in_time_t);
+bool client_exists(uint64_t client_id)
+{
+	Shard *shard = find_owner_shard(client_id);
+	return shard && shard->clients.has_client(client_id);
+}
 
-	std::ostringstream oss;
-	oss << std::put_time(&timeinfo, "%Y-%m-%dT%H:%M:%SZ");
-	return oss.str();
+// Delivers a frame to a client on any shard. Only the owning loop thread
+// writes to a client socket, so a send to another shard's client is handed
+// off through that shard's queue and reported as successful once queued.
+bool send_frame_to_client(uint64_t client_id, const OutboundFrame &frame)
+{
+	Shard *shard = find_owner_shard(client_id);
+	if (!shard) {
+		HOT_LOG(WARNING) << "[Warning] Failed to send: Client ID " << client_id
+		                 << " not found.";
+		return false;
+	}
+	if (shard->loop->in_loop_thread()) {
+		return shard->clients.send_frame(client_id, frame);
+	}
+	shard->loop->post([shard, client_id, frame]() {
+		shard->clients.send_frame(client_id, frame);
+	});
+	return true;
+}
+
+// Delivers a packet like send_frame_to_client(). Unless it is compressed,
+// the packet's content becomes the frame's payload without being copied.
+bool send_to_client(uint64_t client_id, Packet pkt)
+{
+	return send_frame_to_client(client_id,
+	                            make_frame(pkt.type, std::move(pkt.content), pkt.codec,
+	                                       pkt.correlation_id, pkt.compression));
 }
 
-void handle_get_time_request(int client_id)
+// Returns the payload codec and compression a client negotiated; JSON and
+// no compression until it has
+WireFormat client_format(uint64_t client_id)
 {
-	Packet time_response_pkt;
-	time_response_pkt.type = MessageType::GET_TIME_RESPONSE;
+	Shard *shard = find_owner_shard(client_id);
+	return shard ? shard->clients.get_client_format(client_id) : WireFormat();
+}
+
+// Encodes a message in the format the client negotiated and sends it. A
+// reply carries the correlation ID of the request it answers.
+template <typename Message>
+bool send_message(uint64_t client_id, MessageType type, const Message &msg,
+                  uint16_t correlation_id = 0)
+{
+	WireFormat format = client_format(client_id);
+	Packet pkt = encode_packet(type, format.codec, msg);
+	pkt.correlation_id = correlation_id;
+	pkt.compression = format.compression;
+	return send_to_client(client_id, std::move(pkt));
+}
+
+// Whether every recipient of a FrameSet can read it. A client's text can
+// grow past what it sent: sanitizing makes each ESC five bytes, and JSON
+// escapes every control byte to six, so a text that fitted in the request
+// may not fit in the indication.
+bool fits_every_codec(const FrameSet &frames)
+{
+	for (const OutboundFrame &frame : frames.frames) {
+		if (frame.payload_size() > MAX_PAYLOAD_SIZE) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	std::string time_str = get_current_time_str();
-	time_response_pkt.content = json{{"time", time_str}}.dump();
+// The ResponseCache of the thread running a request handler: the cache of
+// the client's shard on its loop thread, the worker's own on a worker
+ResponseCache &handler_cache(Shard *shard)
+{
+	int worker = WorkerPool::current_worker();
+	return worker < 0 ? shard->cache : *g_worker_caches[worker];
+}
 
-	g_client_manager.send_to_client(client_id, time_response_pkt);
+// Replies to a client with a frame from a ResponseCache. The frame is
+// encoded with build() only if the cached one is missing or was built for
+// another stamp. Must run on the client's loop thread or on a worker, like
+// every request handler.
+template <typename Build>
+bool send_cached_reply(uint64_t client_id, const PacketView &request, MessageType type,
+                       uint64_t stamp, Build build)
+{
+	Shard *shard = find_owner_shard(client_id);
+	WireFormat format = shard->clients.get_client_format(client_id);
+	const OutboundFrame &cached = handler_cache(shard).get(type, format, stamp, [&]() {
+		return compress_frame(encode_frame(type, format.codec, build()), format.compression);
+	});
+	if (request.correlation_id == 0) {
+		return send_frame_to_client(client_id, cached);
+	}
+	// The copy shares the cached payload; only its header differs
+	OutboundFrame frame = cached;
+	set_correlation_id(frame, request.correlation_id);
+	return send_frame_to_client(client_id, frame);
 }
 
-void handle_get_name_request(int client_id)
+// Runs a task on every shard's loop thread: directly for the caller's own
+// shard, through the queue for the others
+void run_on_every_shard(const std::function<void(Shard &)> &task)
 {
-	Packet name_response_pkt;
-	name_response_pkt.type = MessageType::GET_NAME_RESPONSE;
+	for (const auto &shard : g_shards) {
+		if (shard->loop->in_loop_thread()) {
+			task(*shard);
+		} else {
+			Shard *target = shard.get();
+			shard->loop->post([target, task]() { task(*target); });
+		}
+	}
+}
 
-	name_response_pkt.content = json{{"name", g_server_name}}.dump();
+// Queues one message to every client except the sender. The message is
+// encoded once per codec and all recipients of a codec share its payload;
+// each shard walks its own clients and compresses the frames its clients
+// need on its own copy of the FrameSet. Returns the number of recipients at
+// the time of the call.
+size_t broadcast_frame(const FrameSet &frames, uint64_t sender_id)
+{
+	size_t recipients = 0;
+	for (const auto &shard : g_shards) {
+		recipients += shard->clients.client_count();
+	}
+	run_on_every_shard([frames, sender_id](Shard &shard) {
+		shard.clients.broadcast(frames, sender_id);
+	});
+	return recipients > 0 ? recipients - 1 : 0;
+}
 
-	g_client_manager.send_to_client(client_id, name_response_pkt);
+// Queues one message to every client of a member list, such as a group's,
+// except the sender, sharing the encoded payloads like broadcast_frame().
+// Every shard is handed the same list and picks out the members it owns.
+void send_frame_to_members(const GroupDirectory::MemberList &members,
+                           const FrameSet &frames, uint64_t sender_id)
+{
+	run_on_every_shard([members, frames, sender_id](Shard &shard) {
+		for (uint64_t member_id : *members) {
+			if (member_id != sender_id && find_owner_shard(member_id) == &shard) {
+				shard.clients.send_frame(member_id, frames);
+			}
+		}
+	});
 }
 
-void handle_get_client_list_request(int client_id)
+// A counter that changes whenever a client connects or disconnects on any
+// shard: the sum of the shards' versions, each of which only grows
+uint64_t clients_version()
 {
-	Packet list_response_pkt;
-	list_response_pkt.type = MessageType::GET_CLIENT_LIST_RESPONSE;
+	uint64_t version = 0;
+	for (const auto &shard : g_shards) {
+		version += shard->clients.version();
+	}
+	return version;
+}
 
-	json client_list_json = json::array();
+// Lists the clients of every shard whose IDs are at least cursor, up to
+// limit of them, ordered by ID. The smallest IDs are kept in a max-heap of
+// limit + 1 entries while the registries are walked, so memory follows the
+// page size rather than the number of clients; the extra entry tells
+// whether another page follows.
+ClientListResponse get_client_page(uint64_t cursor, size_t limit)
+{
+	auto by_id = [](const ClientListEntry &a, const ClientListEntry &b) {
+		return a.client_id < b.client_id;
+	};
+	std::vector<ClientListEntry> page;
+	page.reserve(limit + 1);
+	for (const auto &shard : g_shards) {
+		shard->clients.for_each_client([&](const ClientRegistry::Entry &client) {
+			if (client.client_id < cursor) {
+				return;
+			}
+			ClientListEntry entry{client.client_id, client.ipv4,
+			                      static_cast<uint16_t>(client.port)};
+			if (page.size() <= limit) {
+				page.push_back(entry);
+				std::push_heap(page.begin(), page.end(), by_id);
+			} else if (entry.client_id < page.front().client_id) {
+				std::pop_heap(page.begin(), page.end(), by_id);
+				page.back() = entry;
+				std::push_heap(page.begin(), page.end(), by_id);
+			}
+		});
+	}
+	std::sort_heap(page.begin(), page.end(), by_id);
 
-	std::vector<ClientInfo> clients = g_client_manager.get_all_clients();
+	ClientListResponse response;
+	if (page.size() > limit) {
+		response.next_cursor = page.back().client_id;
+		page.pop_back();
+	}
+	response.clients = std::move(page);
+	return response;
+}
 
-	for (const auto& client : clients) {
-		client_list_json.push_back(json{
-		    {"id", client.client_id},
-		    {"ip", client.ip_address},
-		    {"port", client.port}
+// Collects the clients of every shard, ordered by ID
+std::vector<ClientListEntry> get_all_client_entries()
+{
+	std::vector<ClientListEntry> clients;
+	for (const auto &shard : g_shards) {
+		shard->clients.for_each_client([&](const ClientRegistry::Entry &client) {
+			clients.push_back(ClientListEntry{client.client_id, client.ipv4,
+			                                  static_cast<uint16_t>(client.port)});
 		});
 	}
+	std::sort(clients.begin(), clients.end(),
+	          [](const ClientListEntry &a, const ClientListEntry &b) {
+		          return a.client_id < b.client_id;
+	          });
+	return clients;
+}
+
+std::string get_time_str(std::time_t in_time_t)
+{
+	std::tm timeinfo = *gmtime(&in_time_t);
+
+	std::ostringstream oss;
+	oss << std::put_time(&timeinfo, "%Y-%m-%dT%H:%M:%SZ");
+	return oss.str();
+}
+
+// The reply has second resolution, so it is encoded once per second
+void handle_get_time_request(uint64_t client_id, const PacketView &request)
+{
+	std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	send_cached_reply(client_id, request, MessageType::GET_TIME_RESPONSE, now,
+	                  [now]() { return TimeResponse{get_time_str(now)}; });
+}
 
-	list_response_pkt.content = json{
-	        {"clients", client_list_json}
-	}.dump();
+// The reply never changes, so it is encoded once
+void handle_get_name_request(uint64_t client_id, const PacketView &request)
+{
+	send_cached_reply(client_id, request, MessageType::GET_NAME_RESPONSE, 0,
+	                  []() { return NameResponse{g_server_name}; });
+}
 
-	g_client_manager.send_to_client(client_id, list_response_pkt);
+// Replies with one page of clients. The first page is what a plain request
+// asks for, so it is cached and rebuilt only after clients have come or
+// gone; later pages are built on demand.
+void handle_get_client_list_request(uint64_t client_id, const PacketView &request)
+{
+	ClientListRequest list_request;
+	if (!decode_payload(request, list_request)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse GET_CLIENT_LIST_REQUEST from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		send_message(client_id, MessageType::SYSTEM_NOTICE_INDICATION,
+		             NoticeIndication{"Error: Bad request format."}, request.correlation_id);
+		return;
+	}
+	if (list_request.cursor == 0 && list_request.limit == 0) {
+		send_cached_reply(client_id, request, MessageType::GET_CLIENT_LIST_RESPONSE,
+		                  clients_version(),
+		                  []() { return get_client_page(0, CLIENT_LIST_PAGE_SIZE); });
+		return;
+	}
+	size_t limit = CLIENT_LIST_PAGE_SIZE;
+	if (list_request.limit != 0) {
+		limit = std::min<size_t>(list_request.limit, CLIENT_LIST_PAGE_SIZE);
+	}
+	uint64_t cursor = list_request.cursor;
+	uint16_t correlation_id = request.correlation_id;
+	auto send_page = [client_id, cursor, limit, correlation_id]() {
+		send_message(client_id, MessageType::GET_CLIENT_LIST_RESPONSE,
+		             get_client_page(cursor, limit), correlation_id);
+	};
+	if (correlation_id == 0) {
+		send_page();
+		return;
+	}
+	// The client matches this reply by its ID, so the walk over every shard
+	// can wait until the requests that arrived with it have been answered.
+	// With workers it leaves the client's queue instead, so that any idle
+	// worker can take it while the client's next requests are handled.
+	if (g_workers) {
+		g_workers->submit(send_page);
+		return;
+	}
+	find_owner_shard(client_id)->loop->post(send_page);
 }
 
-void handle_send_message_request(int client_id, const std::string &content)
+void handle_send_message_request(uint64_t client_id, const PacketView &request)
 {
-    uint64_t target_id;
-    std::string message;
-    Packet response_pkt;
-    response_pkt.type = MessageType::SEND_MESSAGE_RESPONSE;
+    // Reused by every request of the thread, so that the text is decoded and
+    // sanitized into buffers left over from the previous one
+    static thread_local SendMessageRequest send_request;
+    static thread_local ChatIndication forward;
+    SendMessageResponse response;
 
-    try {
-        json data = json::parse(content);
-    	target_id = data.at("target_id").get<uint64_t>();
-        message = data.at("message").get<std::string>();
-    } catch (const json::exception& e) {
-        LOG(ERROR) << "[Error] Failed to parse SEND_MESSAGE_REQUEST from client "
-                   << client_id << ": " << e.what();
-        response_pkt.content = json{
-            {"status", "error"},
-            {"message", "Bad request format"}
-        }.dump();
-        g_client_manager.send_to_client(client_id, response_pkt);
+    if (!decode_payload(request, send_request)) {
+        HOT_LOG(ERROR) << "[Error] Failed to parse SEND_MESSAGE_REQUEST from client "
+                       << client_id;
+        Metrics::count(Counter::MALFORMED_REQUESTS);
+        response.message = "Bad request format";
+        send_message(client_id, MessageType::SEND_MESSAGE_RESPONSE, response,
+                     request.correlation_id);
         return;
     }
 
-    if (!g_client_manager.get_client(target_id).has_value()) {
-        LOG(WARNING) << "[Warning] Client " << client_id << " tried to send to non-existent client ID "
-                     << target_id;
-        response_pkt.content = json{
-            {"status", "error"},
-            {"target_id", target_id},
-            {"message", "Client not found"}
-        }.dump();
-        g_client_manager.send_to_client(client_id, response_pkt);
+    uint64_t target_id = send_request.target_id;
+    response.target_id = target_id;
+    forward.from_id = client_id;
+    if (!client_exists(target_id)) {
+        // A client that went offline with a mailbox gets it on its return
+        Mailbox::StoreResult stored = Mailbox::StoreResult::UNKNOWN;
+        if (g_mailbox.is_open()) {
+            sanitize_for_terminal(send_request.message, forward.message);
+            stored = g_mailbox.store(target_id, client_id, forward.message);
+        }
+        switch (stored) {
+        case Mailbox::StoreResult::STORED:
+            g_journal.append(client_id, target_id, forward.message);
+            response.success = true;
+            break;
+        case Mailbox::StoreResult::FULL:
+            response.message = "Mailbox full";
+            break;
+        case Mailbox::StoreResult::TOO_LONG:
+            response.message = "Message too long";
+            break;
+        case Mailbox::StoreResult::UNKNOWN:
+            HOT_LOG(WARNING) << "[Warning] Client " << client_id << " tried to send to non-existent client ID "
+                             << target_id;
+            response.message = "Client not found";
+            break;
+        }
+        send_message(client_id, MessageType::SEND_MESSAGE_RESPONSE, response,
+                     request.correlation_id);
         return;
     }
 
-    Packet forward_pkt;
-    forward_pkt.type = MessageType::MESSAGE_INDICATION;
-    forward_pkt.content = json{
-        {"from_id", client_id},
-        {"message", sanitize_for_terminal(message)}
-    }.dump();
-
-    if (g_client_manager.send_to_client(target_id, forward_pkt)) {
-        response_pkt.content = json{
-            {"status", "success"},
-            {"target_id", target_id}
-        }.dump();
-        g_client_manager.send_to_client(client_id, response_pkt);
+    sanitize_for_terminal(send_request.message, forward.message);
+    // Encoded like send_message() does, but checked first: the recipient
+    // drops the connection over a packet larger than it accepts
+    WireFormat format = client_format(target_id);
+    Packet indication = encode_packet(MessageType::MESSAGE_INDICATION, format.codec, forward);
+    indication.compression = format.compression;
+    if (indication.content.size() > MAX_PAYLOAD_SIZE) {
+        response.message = "Message too long";
     } else {
-        response_pkt.content = json{
-            {"status", "error"},
-            {"target_id", target_id},
-            {"message", "Failed to send message"}
-        }.dump();
-        g_client_manager.send_to_client(client_id, response_pkt);
+        // Queued for the journal before it is delivered
+        g_journal.append(client_id, target_id, forward.message);
+        if (send_to_client(target_id, std::move(indication))) {
+            response.success = true;
+        } else {
+            response.message = "Failed to send message";
+        }
     }
+    send_message(client_id, MessageType::SEND_MESSAGE_RESPONSE, response,
+                 request.correlation_id);
 }
 
-void handle_unhandled_request(int client_id, MessageType type, const std::string &content)
+// Group names are short and printable so they can be shown as they are
+bool is_valid_group_name(const std::string &group)
 {
-	LOG(WARNING) << "[Warning] Unhandled message type from client " << client_id
-	    << ": " << MessageTypeToString(type);
+	if (group.empty() || group.size() > MAX_GROUP_NAME_LENGTH) {
+		return false;
+	}
+	return std::all_of(group.begin(), group.end(), [](unsigned char c) {
+		return c > ' ' && c < 0x7f;
+	});
+}
+
+void handle_broadcast_request(uint64_t client_id, const PacketView &request)
+{
+	// Reused like those of handle_send_message_request()
+	static thread_local BroadcastRequest broadcast;
+	static thread_local ChatIndication message;
+	if (!decode_payload(request, broadcast)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse BROADCAST_REQUEST from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		send_message(client_id, MessageType::BROADCAST_RESPONSE,
+		             BroadcastResponse{false, 0, "Bad request format"},
+		             request.correlation_id);
+		return;
+	}
+
+	// Encoded once per codec, however many clients receive it
+	message.from_id = client_id;
+	sanitize_for_terminal(broadcast.message, message.message);
+	FrameSet frames = encode_frame_set(MessageType::BROADCAST_INDICATION, message);
+	if (!fits_every_codec(frames)) {
+		send_message(client_id, MessageType::BROADCAST_RESPONSE,
+		             BroadcastResponse{false, 0, "Message too long"}, request.correlation_id);
+		return;
+	}
+	size_t recipients = broadcast_frame(frames, client_id);
+
+	send_message(client_id, MessageType::BROADCAST_RESPONSE,
+	             BroadcastResponse{true, recipients, ""}, request.correlation_id);
+}
+
+// Decodes a group request and checks its group name. Replies with an error
+// and returns false if it is malformed or the name is invalid.
+bool parse_group_request(uint64_t client_id, MessageType response_type,
+                         const PacketView &request, GroupRequest &group_request)
+{
+	if (!decode_payload(request, group_request)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse group request from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		send_message(client_id, response_type,
+		             GroupResponse{false, "", 0, "Bad request format"},
+		             request.correlation_id);
+		return false;
+	}
+	if (!is_valid_group_name(group_request.group)) {
+		send_message(client_id, response_type,
+		             GroupResponse{false, "", 0,
+		                           "Group names are 1 to " +
+		                                   std::to_string(MAX_GROUP_NAME_LENGTH) +
+		                                   " printable characters without spaces"},
+		             request.correlation_id);
+		return false;
+	}
+	return true;
+}
 
-	Packet error_pkt;
-	error_pkt.type = MessageType::SYSTEM_NOTICE_INDICATION;
-	error_pkt.content = json{
-	        {"notice", "Error: Unhandled or unknown command."}
-	}.dump();
-	g_client_manager.send_to_client(client_id, error_pkt);
+void handle_join_group_request(uint64_t client_id, const PacketView &request)
+{
+	GroupRequest join;
+	if (!parse_group_request(client_id, MessageType::JOIN_GROUP_RESPONSE, request, join)) {
+		return;
+	}
+	size_t members = g_groups.join(join.group, client_id);
+	HOT_LOG(INFO) << "[Info] Client " << client_id << " joined group " << join.group;
+	send_message(client_id, MessageType::JOIN_GROUP_RESPONSE,
+	             GroupResponse{true, join.group, members, ""}, request.correlation_id);
 }
 
-// Client handler function
-// This function is executed in a separate thread for each new connection
-void handle_client(int client_id, int client_socket)
+void handle_leave_group_request(uint64_t client_id, const PacketView &request)
 {
+	GroupRequest leave;
+	if (!parse_group_request(client_id, MessageType::LEAVE_GROUP_RESPONSE, request, leave)) {
+		return;
+	}
+	if (!g_groups.leave(leave.group, client_id)) {
+		send_message(client_id, MessageType::LEAVE_GROUP_RESPONSE,
+		             GroupResponse{false, leave.group, 0, "Not a member of this group"},
+		             request.correlation_id);
+		return;
+	}
+	HOT_LOG(INFO) << "[Info] Client " << client_id << " left group " << leave.group;
+	send_message(client_id, MessageType::LEAVE_GROUP_RESPONSE,
+	             GroupResponse{true, leave.group, 0, ""}, request.correlation_id);
+}
 
-	LOG(INFO) << "[Info] Client Handler started for ID: " << client_id
-	          << ", Socket: " << client_socket;
+void handle_group_message_request(uint64_t client_id, const PacketView &request)
+{
+	// Reused like those of handle_send_message_request()
+	static thread_local GroupRequest post;
+	static thread_local GroupMessageIndication message;
+	if (!parse_group_request(client_id, MessageType::GROUP_MESSAGE_RESPONSE, request, post)) {
+		return;
+	}
 
-	// Send an initial greeting message
-	Packet greeting_pkt;
-	greeting_pkt.type = MessageType::SYSTEM_NOTICE_INDICATION;
-	greeting_pkt.content =
-	    json{{"notice", "Hello! Your ID is " + std::to_string(client_id)}}
-	        .dump();
+	// Only members may write to a group
+	GroupDirectory::MemberList members = g_groups.members(post.group);
+	if (!members || std::find(members->begin(), members->end(), client_id) == members->end()) {
+		send_message(client_id, MessageType::GROUP_MESSAGE_RESPONSE,
+		             GroupResponse{false, post.group, 0, "Not a member of this group"},
+		             request.correlation_id);
+		return;
+	}
 
-	g_client_manager.send_to_client(client_id, greeting_pkt);
+	message.from_id = client_id;
+	message.group = post.group;
+	sanitize_for_terminal(post.message, message.message);
+	FrameSet frames = encode_frame_set(MessageType::GROUP_MESSAGE_INDICATION, message);
+	if (!fits_every_codec(frames)) {
+		send_message(client_id, MessageType::GROUP_MESSAGE_RESPONSE,
+		             GroupResponse{false, post.group, 0, "Message too long"},
+		             request.correlation_id);
+		return;
+	}
+	send_frame_to_members(members, frames, client_id);
 
-	bool client_requested_disconnect = false;
+	send_message(client_id, MessageType::GROUP_MESSAGE_RESPONSE,
+	             GroupResponse{true, post.group, members->size() - 1, ""},
+	             request.correlation_id);
+}
 
-	// Main loop to handle incoming packets
-	while (g_server_running && !client_requested_disconnect) {
-		Packet received_pkt;
-		if (!read_packet(client_socket, received_pkt)) {
-			// read_packet returns false on disconnect or critical error
-			LOG(INFO) << "[Info] Client " << client_id
-			          << " connection closed or errored.";
-			break;
+// Settles the payload codec of a client, the first one it offers or JSON
+// if it offers none the server knows, and likewise its compression, none
+// by default. The reply is encoded like the request and never compressed,
+// which the client can always read; every later packet to the client uses
+// the chosen format.
+void handle_hello_request(uint64_t client_id, const PacketView &request)
+{
+	HelloRequest hello;
+	HelloResponse response;
+	if (!decode_payload(request, hello)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse HELLO_REQUEST from client " << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+	} else {
+		if (!hello.codecs.empty()) {
+			response.codec = hello.codecs.front();
 		}
-		LOG(INFO) << "Received from ID " << client_id
-		          << ", Type: " << MessageTypeToString(received_pkt.type)
-		          << ", Payload: " << sanitize_for_terminal(received_pkt.content);
-
-		switch (received_pkt.type) {
-		case MessageType::GET_TIME_REQUEST:
-			handle_get_time_request(client_id);
-			break;
-		case MessageType::GET_NAME_REQUEST:
-			handle_get_name_request(client_id);
-			break;
-		case MessageType::GET_CLIENT_LIST_REQUEST:
-			handle_get_client_list_request(client_id);
-			break;
-		case MessageType::SEND_MESSAGE_REQUEST:
-			handle_send_message_request(client_id, received_pkt.content);
-			break;
-		case MessageType::DISCONNECT_REQUEST:
-			LOG(INFO)
-			    << "[Info] Client " << client_id << " requested disconnect.";
-			client_requested_disconnect = true;
-			break;
-		default:
-			handle_unhandled_request(client_id, received_pkt.type,
-			                         received_pkt.content);
-			break;
+		if (!hello.compressions.empty()) {
+			response.compression = hello.compressions.front();
 		}
 	}
 
-	LOG(INFO) << "[Info] Finished handling client ID: " << client_id;
-	g_client_manager.remove_client(client_id);
+	Packet reply = encode_packet(MessageType::HELLO_RESPONSE, request.codec, response);
+	reply.correlation_id = request.correlation_id;
+	send_to_client(client_id, std::move(reply));
+	find_owner_shard(client_id)->clients.set_client_format(
+	        client_id, WireFormat{response.codec, response.compression});
+	HOT_LOG(INFO) << "[Info] Client " << client_id << " uses the "
+	              << PayloadCodecToString(response.codec) << " codec and "
+	              << FrameCompressionToString(response.compression) << " compression";
 }
 
-int main(int argc, char *argv[])
+// Cuts a snapshot or delta into frames of at most CLIENT_LIST_PAGE_SIZE
+// clients, like the pages of the client list, so that each fits in a
+// packet however many clients came or went. Joins go before leaves, which
+// is the order a subscriber applies them in, and every frame but the last
+// has more set.
+template <typename SendFrame>
+void for_each_presence_frame(const PresenceDelta &delta, SendFrame send_frame)
 {
-	auto glog = GlogWrapper(argv[0]);
+	PresenceDelta frame;
+	size_t joined = 0;
+	size_t left = 0;
+	do {
+		size_t count = std::min<size_t>(CLIENT_LIST_PAGE_SIZE, delta.joined.size() - joined);
+		frame.joined.assign(delta.joined.begin() + joined, delta.joined.begin() + joined + count);
+		joined += count;
+		count = std::min<size_t>(CLIENT_LIST_PAGE_SIZE - count, delta.left.size() - left);
+		frame.left.assign(delta.left.begin() + left, delta.left.begin() + left + count);
+		left += count;
+		frame.more = joined < delta.joined.size() || left < delta.left.size();
+		send_frame(frame);
+	} while (frame.more);
+}
 
-	// Register signal handlers
-	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
+// Subscribing again only resends the snapshot
+void handle_presence_subscribe_request(uint64_t client_id, const PacketView &request)
+{
+	if (g_presence.subscribe(client_id)) {
+		HOT_LOG(INFO) << "[Info] Client " << client_id << " subscribed to presence";
+	}
+	PresenceDelta snapshot;
+	snapshot.joined = get_all_client_entries();
+	for_each_presence_frame(snapshot, [&](const PresenceDelta &frame) {
+		send_message(client_id, MessageType::PRESENCE_SUBSCRIBE_RESPONSE, frame,
+		             request.correlation_id);
+	});
+}
+
+void handle_presence_unsubscribe_request(uint64_t client_id, const PacketView &request)
+{
+	PresenceResponse response;
+	response.success = g_presence.unsubscribe(client_id);
+	if (response.success) {
+		HOT_LOG(INFO) << "[Info] Client " << client_id << " unsubscribed from presence";
+	} else {
+		response.message = "Not subscribed";
+	}
+	send_message(client_id, MessageType::PRESENCE_UNSUBSCRIBE_RESPONSE, response,
+	             request.correlation_id);
+}
+
+// Tells both ends of a transfer that the server stopped it
+void abort_transfer(uint64_t sender_id, uint64_t receiver_id, uint32_t transfer_id,
+                    const std::string &reason)
+{
+	Metrics::count(Counter::TRANSFERS_ABORTED);
+	HOT_LOG(INFO) << "[Info] Transfer " << transfer_id << " from client " << sender_id
+	              << " to client " << receiver_id << " aborted: " << reason;
+	send_message(sender_id, MessageType::TRANSFER_END_INDICATION,
+	             TransferEnd{receiver_id, transfer_id, false, reason});
+	send_message(receiver_id, MessageType::TRANSFER_END_INDICATION,
+	             TransferEnd{sender_id, transfer_id, false, reason});
+}
+
+// Offers the file to the receiver, which stores what follows or aborts it
+void handle_transfer_begin_request(uint64_t client_id, const PacketView &request)
+{
+	TransferBegin begin;
+	if (!decode_payload(request, begin)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse TRANSFER_BEGIN_REQUEST from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		send_message(client_id, MessageType::TRANSFER_BEGIN_RESPONSE,
+		             TransferResponse{false, 0, "Bad request format"},
+		             request.correlation_id);
+		return;
+	}
+
+	uint64_t receiver_id = begin.peer_id;
+	std::string error;
+	if (receiver_id == client_id) {
+		error = "Cannot send a file to yourself";
+	} else if (!client_exists(receiver_id)) {
+		error = "Client not found";
+	} else {
+		g_transfers.begin(client_id, begin.transfer_id, receiver_id, error);
+	}
+	if (!error.empty()) {
+		send_message(client_id, MessageType::TRANSFER_BEGIN_RESPONSE,
+		             TransferResponse{false, begin.transfer_id, error},
+		             request.correlation_id);
+		return;
+	}
+
+	HOT_LOG(INFO) << "[Info] Client " << client_id << " sends " << begin.size
+	              << " bytes to client " << receiver_id << " as transfer "
+	              << begin.transfer_id;
+	TransferBegin offer;
+	offer.peer_id = client_id;
+	offer.transfer_id = begin.transfer_id;
+	offer.size = begin.size;
+	offer.name = sanitize_for_terminal(begin.name.substr(0, MAX_TRANSFER_NAME_LENGTH));
+	send_message(receiver_id, MessageType::TRANSFER_BEGIN_INDICATION, offer);
+	send_message(client_id, MessageType::TRANSFER_BEGIN_RESPONSE,
+	             TransferResponse{true, begin.transfer_id, ""}, request.correlation_id);
+}
+
+// Relays a chunk as it arrives. Its data is copied once, from the receive
+// buffer into the pooled payload of the indication; the file is never
+// gathered on the server.
+void handle_transfer_chunk_request(uint64_t client_id, const PacketView &request)
+{
+	TransferChunk chunk;
+	if (!decode_payload(request, chunk)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse TRANSFER_CHUNK_REQUEST from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		return;
+	}
+
+	uint64_t receiver_id = 0;
+	switch (g_transfers.chunk(client_id, chunk.transfer_id, chunk.data.size(), receiver_id)) {
+	case TransferTable::ChunkResult::UNKNOWN:
+		// Chunks still on the way when a transfer is aborted end up here
+		return;
+	case TransferTable::ChunkResult::OVER_WINDOW:
+		abort_transfer(client_id, receiver_id, chunk.transfer_id,
+		               "Sender exceeded the transfer window");
+		return;
+	case TransferTable::ChunkResult::RELAY:
+		break;
+	}
+	chunk.peer_id = client_id;
+	// Never compressed: most large files are compressed already
+	if (!send_frame_to_client(receiver_id, encode_frame(MessageType::TRANSFER_CHUNK_INDICATION,
+	                                                    PayloadCodec::BINARY, chunk))) {
+		// The receiver left before its departure removed the transfer
+		g_transfers.end(client_id, receiver_id, chunk.transfer_id);
+		abort_transfer(client_id, receiver_id, chunk.transfer_id, "Peer disconnected");
+		return;
+	}
+	Metrics::count(Counter::TRANSFER_BYTES, chunk.data.size());
+}
+
+// Ends a transfer for its sender, once the receiver acknowledged every
+// byte, or for either end giving it up
+void handle_transfer_end_request(uint64_t client_id, const PacketView &request)
+{
+	TransferEnd end;
+	if (!decode_payload(request, end)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse TRANSFER_END_REQUEST from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		return;
+	}
+	uint64_t peer_id = end.peer_id;
+	if (!g_transfers.end(client_id, peer_id, end.transfer_id)) {
+		return;
+	}
+	if (!end.complete) {
+		Metrics::count(Counter::TRANSFERS_ABORTED);
+	}
+	HOT_LOG(INFO) << "[Info] Client " << client_id << " ended transfer " << end.transfer_id
+	              << " with client " << peer_id << (end.complete ? ": complete" : ": aborted");
+	end.peer_id = client_id;
+	end.message = sanitize_for_terminal(std::move(end.message));
+	send_message(peer_id, MessageType::TRANSFER_END_INDICATION, end);
+}
+
+// Passes the receiver's progress on to the sender, whose window it opens
+void handle_transfer_ack_request(uint64_t client_id, const PacketView &request)
+{
+	TransferAck ack;
+	if (!decode_payload(request, ack)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse TRANSFER_ACK_REQUEST from client "
+		               << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		return;
+	}
+	uint64_t sender_id = ack.peer_id;
+	if (!g_transfers.acknowledge(sender_id, ack.transfer_id, client_id, ack.received)) {
+		return;
+	}
+	ack.peer_id = client_id;
+	send_message(sender_id, MessageType::TRANSFER_ACK_INDICATION, ack);
+}
+
+// Gives the client a mailbox for its current ID and hands it the messages
+// kept under the ID it had before, if its token for that one matches. The
+// messages follow the response, oldest first, as if they had just been sent.
+void handle_mailbox_request(uint64_t client_id, const PacketView &request)
+{
+	MailboxRequest claim;
+	MailboxResponse response;
+	response.client_id = client_id;
+	if (!g_mailbox.is_open()) {
+		response.message = "Mailbox disabled";
+		send_message(client_id, MessageType::MAILBOX_RESPONSE, response,
+		             request.correlation_id);
+		return;
+	}
+	if (!decode_payload(request, claim)) {
+		HOT_LOG(ERROR) << "[Error] Failed to parse MAILBOX_REQUEST from client " << client_id;
+		Metrics::count(Counter::MALFORMED_REQUESTS);
+		response.message = "Bad request format";
+		send_message(client_id, MessageType::MAILBOX_RESPONSE, response,
+		             request.correlation_id);
+		return;
+	}
+
+	response.token = g_mailbox.add_client(client_id);
+	if (response.token == 0) {
+		response.message = "Mailbox unavailable";
+		send_message(client_id, MessageType::MAILBOX_RESPONSE, response,
+		             request.correlation_id);
+		return;
+	}
+	std::vector<Mailbox::Message> messages;
+	if (claim.client_id == 0) {
+		response.success = true;
+	} else if (g_mailbox.claim(claim.client_id, claim.token, messages)) {
+		response.success = true;
+		HOT_LOG(INFO) << "[Info] Client " << client_id << " claimed " << messages.size()
+		              << " message(s) sent to client " << claim.client_id;
+	} else if (messages.empty()) {
+		response.message = "No mailbox to claim";
+	} else {
+		response.message = "Some messages were lost";
+	}
+	response.delivered = static_cast<uint32_t>(messages.size());
+	send_message(client_id, MessageType::MAILBOX_RESPONSE, response, request.correlation_id);
+
+	ChatIndication delivery;
+	for (Mailbox::Message &message : messages) {
+		delivery.from_id = message.from_id;
+		delivery.message = std::move(message.text);
+		send_message(client_id, MessageType::MESSAGE_INDICATION, delivery);
+	}
+}
+
+// Replies with the metrics of every thread, added up
+void handle_get_stats_request(uint64_t client_id, const PacketView &request)
+{
+	send_message(client_id, MessageType::GET_STATS_RESPONSE,
+	             make_stats_response(Metrics::snapshot()), request.correlation_id);
+}
+
+void handle_unhandled_request(uint64_t client_id, const PacketView &request)
+{
+	Metrics::count(Counter::UNKNOWN_REQUESTS);
+	HOT_LOG(WARNING) << "[Warning] Unhandled message type from client " << client_id
+	    << ": " << MessageTypeToString(request.type);
+
+	send_message(client_id, MessageType::SYSTEM_NOTICE_INDICATION,
+	             NoticeIndication{"Error: Unhandled or unknown command."},
+	             request.correlation_id);
+}
+
+// Runs the handler of a request and records how long it took
+void handle_request(uint64_t client_id, const PacketView &received_pkt)
+{
+	auto started = std::chrono::steady_clock::now();
+	switch (received_pkt.type) {
+	case MessageType::GET_TIME_REQUEST:
+		handle_get_time_request(client_id, received_pkt);
+		break;
+	case MessageType::GET_NAME_REQUEST:
+		handle_get_name_request(client_id, received_pkt);
+		break;
+	case MessageType::GET_CLIENT_LIST_REQUEST:
+		handle_get_client_list_request(client_id, received_pkt);
+		break;
+	case MessageType::SEND_MESSAGE_REQUEST:
+		handle_send_message_request(client_id, received_pkt);
+		break;
+	case MessageType::BROADCAST_REQUEST:
+		handle_broadcast_request(client_id, received_pkt);
+		break;
+	case MessageType::JOIN_GROUP_REQUEST:
+		handle_join_group_request(client_id, received_pkt);
+		break;
+	case MessageType::LEAVE_GROUP_REQUEST:
+		handle_leave_group_request(client_id, received_pkt);
+		break;
+	case MessageType::GROUP_MESSAGE_REQUEST:
+		handle_group_message_request(client_id, received_pkt);
+		break;
+	case MessageType::HELLO_REQUEST:
+		handle_hello_request(client_id, received_pkt);
+		break;
+	case MessageType::PRESENCE_SUBSCRIBE_REQUEST:
+		handle_presence_subscribe_request(client_id, received_pkt);
+		break;
+	case MessageType::PRESENCE_UNSUBSCRIBE_REQUEST:
+		handle_presence_unsubscribe_request(client_id, received_pkt);
+		break;
+	case MessageType::GET_STATS_REQUEST:
+		handle_get_stats_request(client_id, received_pkt);
+		break;
+	case MessageType::TRANSFER_BEGIN_REQUEST:
+		handle_transfer_begin_request(client_id, received_pkt);
+		break;
+	case MessageType::TRANSFER_CHUNK_REQUEST:
+		handle_transfer_chunk_request(client_id, received_pkt);
+		break;
+	case MessageType::TRANSFER_END_REQUEST:
+		handle_transfer_end_request(client_id, received_pkt);
+		break;
+	case MessageType::TRANSFER_ACK_REQUEST:
+		handle_transfer_ack_request(client_id, received_pkt);
+		break;
+	case MessageType::MAILBOX_REQUEST:
+		handle_mailbox_request(client_id, received_pkt);
+		break;
+	default:
+		// Not timed: any type byte would get a histogram of its own
+		handle_unhandled_request(client_id, received_pkt);
+		return;
+	}
+	Metrics::record_latency(received_pkt.type,
+	                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+	                                std::chrono::steady_clock::now() - started)
+	                                .count());
+}
+
+// Runs on a worker for every request taken from a client's queue
+void handle_queued_request(QueuedRequest &request)
+{
+	PacketView view;
+	view.type = request.packet.type;
+	view.content = request.packet.content;
+	view.codec = request.packet.codec;
+	view.correlation_id = request.packet.correlation_id;
+	handle_request(request.client_id, view);
+	BufferPool::give(std::move(request.packet.content));
+}
+
+// Copies a request into its client's queue for the workers. Returns false
+// if the client has too many requests waiting, like a client that stops
+// reading is dropped over the outbound limit.
+bool queue_request(uint64_t client_id, const PacketView &received_pkt)
+{
+	Shard *shard = find_owner_shard(client_id);
+	auto found = shard->requests.find(client_id);
+	if (found == shard->requests.end()) {
+		return false;
+	}
+	QueuedRequest request;
+	request.client_id = client_id;
+	request.packet.type = received_pkt.type;
+	request.packet.content = BufferPool::take(received_pkt.content.size());
+	request.packet.content.append(received_pkt.content);
+	request.packet.codec = received_pkt.codec;
+	request.packet.correlation_id = received_pkt.correlation_id;
+	if (found->second->post(std::move(request)) > MAX_QUEUED_REQUESTS) {
+		HOT_LOG(WARNING) << "[Warning] Client " << client_id << " has over "
+		                 << MAX_QUEUED_REQUESTS << " requests waiting; disconnecting.";
+		return false;
+	}
+	return true;
+}
+
+// Called by a shard's event loop for every accepted connection
+uint64_t on_client_accepted(Shard &shard, int client_socket, const std::string &ip, int port)
+{
+	// Add client to the shard's manager and get its ID
+	uint64_t client_id = shard.clients.add_client(client_socket, ip, port);
+	if (client_id == 0) {
+		return 0;
+	}
+	Metrics::count(Counter::CLIENTS_ACCEPTED);
+
+	HOT_LOG(INFO) << "[Info] Client Handler started for ID: " << client_id
+	              << ", Socket: " << client_socket;
+
+	// Send an initial greeting message. It always goes out as JSON: the
+	// client has had no chance to pick a codec yet.
+	send_message(client_id, MessageType::SYSTEM_NOTICE_INDICATION,
+	             NoticeIndication{"Hello! Your ID is " + std::to_string(client_id)});
+	if (g_workers) {
+		shard.requests[client_id] =
+		        std::make_shared<RequestQueue>(*g_workers, handle_queued_request);
+	}
+	return client_id;
+}
+
+// Called by the event loop for every packet decoded from a client.
+// Returns false when the connection should be closed.
+bool on_client_packet(uint64_t client_id, const PacketView &received_pkt)
+{
+	// Binary payloads are not text, so only their size is logged. Long text
+	// is cut, so that a large message costs no more to log than a short one.
+	HOT_LOG_SAMPLED(INFO) << "Received from ID " << client_id
+	                      << ", Type: " << MessageTypeToString(received_pkt.type)
+	                      << ", Codec: " << PayloadCodecToString(received_pkt.codec)
+	                      << ", Payload: "
+	                      << (received_pkt.codec == PayloadCodec::JSON
+	                                  ? sanitize_for_terminal(truncate_for_log(
+	                                            received_pkt.content, LOG_PAYLOAD_LIMIT))
+	                                  : std::to_string(received_pkt.content.size()) + " bytes");
+
+	if (received_pkt.type == MessageType::DISCONNECT_REQUEST) {
+		HOT_LOG(INFO) << "[Info] Client " << client_id << " requested disconnect.";
+		return false;
+	}
+	if (g_workers) {
+		return queue_request(client_id, received_pkt);
+	}
+	handle_request(client_id, received_pkt);
+	return true;
+}
+
+// Called by a shard's event loop once a connection is gone
+void on_client_closed(Shard &shard, uint64_t client_id)
+{
+	HOT_LOG(INFO) << "[Info] Finished handling client ID: " << client_id;
+	Metrics::count(Counter::CLIENTS_CLOSED);
+	g_groups.leave_all(client_id);
+	g_presence.unsubscribe(client_id);
+	for (const auto &transfer : g_transfers.remove_client(client_id)) {
+		uint64_t peer_id = transfer.sender_id == client_id ? transfer.receiver_id
+		                                                   : transfer.sender_id;
+		Metrics::count(Counter::TRANSFERS_ABORTED);
+		send_message(peer_id, MessageType::TRANSFER_END_INDICATION,
+		             TransferEnd{client_id, transfer.transfer_id, false, "Peer disconnected"});
+	}
+	g_mailbox.client_offline(client_id);
+	auto queue = shard.requests.find(client_id);
+	if (queue != shard.requests.end()) {
+		// Its waiting requests would only be answered to a closed socket
+		queue->second->close();
+		shard.requests.erase(queue);
+	}
+	shard.clients.remove_client(client_id);
+}
+
+// Called by a ClientManager whenever a client is added or removed
+void on_presence_change(const ClientInfo &client, bool connected)
+{
+	if (!connected) {
+		g_presence.client_disconnected(client.client_id);
+		return;
+	}
+	ClientListEntry entry{client.client_id, 0, static_cast<uint16_t>(client.port)};
+	inet_pton(AF_INET, client.ip_address.c_str(), &entry.ipv4);
+	g_presence.client_connected(entry);
+}
+
+// Sends the presence deltas until the server stops. Each batch is encoded
+// once per codec and shared by every subscriber.
+void run_presence_feed()
+{
+	PresenceDelta delta;
+	PresenceFeed::SubscriberList subscribers;
+	while (g_presence.wait_batch(g_server_running, delta, subscribers)) {
+		for_each_presence_frame(delta, [&](const PresenceDelta &frame) {
+			send_frame_to_members(
+			        subscribers,
+			        encode_frame_set(MessageType::PRESENCE_DELTA_INDICATION, frame), 0);
+		});
+	}
+}
+
+// Creates a blocking listening socket for the metrics endpoint. It only
+// binds the loopback address: the metrics are for local collectors, not for
+// chat clients. Returns the socket, or -1 on failure.
+int create_metrics_listener(int port)
+{
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		LOG(ERROR) << "[Error] Failed to create metrics socket: " << strerror(errno);
+		return -1;
+	}
+	int opt = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+	    listen(listen_fd, MAX_CLIENT_QUEUE) < 0) {
+		LOG(ERROR) << "[Error] Failed to listen for metrics on port " << port << ": "
+		           << strerror(errno);
+		close(listen_fd);
+		return -1;
+	}
+	return listen_fd;
+}
+
+// Answers every HTTP request on the metrics socket with the metrics in the
+// Prometheus text format, until the server stops. Scrapes come seconds
+// apart, so they are served one at a time with blocking calls.
+void run_metrics_endpoint(int listen_fd)
+{
+	while (g_server_running) {
+		struct pollfd ready = {listen_fd, POLLIN, 0};
+		if (poll(&ready, 1, METRICS_POLL_INTERVAL_MS) <= 0) {
+			continue;
+		}
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		// A collector that stops halfway must not hold up the next one
+		struct timeval timeout = {METRICS_IO_TIMEOUT_S, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-	int server_socket, client_socket;
-	struct sockaddr_in server_address, client_address;
-	socklen_t client_address_length = sizeof(client_address);
+		// The request line and headers are read and ignored: every path
+		// returns the metrics
+		char request[4096];
+		if (recv(fd, request, sizeof(request), 0) <= 0) {
+			close(fd);
+			continue;
+		}
+		std::string body = format_metrics_text(Metrics::snapshot());
+		std::string reply = "HTTP/1.0 200 OK\r\n"
+		                    "Content-Type: text/plain; version=0.0.4\r\n"
+		                    "Content-Length: " +
+		                    std::to_string(body.size()) + "\r\n\r\n" + body;
+		size_t sent = 0;
+		while (sent < reply.size()) {
+			ssize_t result = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+			if (result <= 0) {
+				break;
+			}
+			sent += result;
+		}
+		close(fd);
+	}
+}
+
+// Lift the soft descriptor limit to the hard limit so that one process can
+// hold tens of thousands of connections
+void raise_fd_limit()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+			LOG(WARNING) << "[Warning] Failed to raise descriptor limit: "
+			             << strerror(errno);
+		}
+	}
+}
+
+// Creates a non-blocking listening socket on SERVER_PORT. With reuse_port
+// several sockets can bind the same port and the kernel spreads incoming
+// connections across them. Returns the socket, or -1 on failure.
+int create_listener(bool reuse_port)
+{
+	struct sockaddr_in server_address;
 
 	// 1. Create socket
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
+	int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server_socket < 0) {
 		LOG(ERROR) << "[Error] Failed to create socket";
 		return -1;
@@ -252,6 +1205,17 @@ int main(int argc, char *argv[])
 	// after server restarts
 	int opt = 1;
 	setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (reuse_port &&
+	    setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		LOG(ERROR) << "[Error] Failed to set SO_REUSEPORT: " << strerror(errno);
+		close(server_socket);
+		return -1;
+	}
+	// Accepted sockets inherit it. Replies are already batched per loop
+	// iteration, and Nagle would hold each one back until the client
+	// acknowledges the previous one, which a client with delayed ACKs does
+	// only with its next request.
+	setsockopt(server_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
 
 	// 2. Set server address
 	memset(&server_address, 0, sizeof(server_address));
@@ -263,86 +1227,344 @@ int main(int argc, char *argv[])
 	if (bind(server_socket, (struct sockaddr *)&server_address,
 	         sizeof(server_address)) < 0) {
 		LOG(ERROR) << "[Error] Binding failed";
+		close(server_socket);
 		return -1;
 	}
 
 	// 4. Listen to connection from client
 	if (listen(server_socket, MAX_CLIENT_QUEUE) < 0) {
 		LOG(ERROR) << "[Error] Listening failed";
+		close(server_socket);
 		return -1;
 	}
-	LOG(INFO) << "[Info] Server is listening on port " << SERVER_PORT << "...";
+	return server_socket;
+}
 
-	// Server main loop
-	while (g_server_running) {
-		fd_set read_fds;
-		FD_ZERO(&read_fds);
-		FD_SET(server_socket, &read_fds);
-
-		// Set a timeout for select()
-		struct timeval tv;
-		tv.tv_sec = 1; // 1 second timeout
-		tv.tv_usec = 0;
-
-		// 5. Use select() for I/O multiplexing to wait for events
-		// without blocking
-		int activity = select(server_socket + 1, &read_fds, NULL, NULL, &tv);
-
-		// If select() returns an error, but it's not an interrupt from
-		// a signal (EINTR), then exit
-		if (activity < 0 && errno != EINTR) {
-			LOG(ERROR) << "[Error] select() error";
-			break;
-		}
+// Pins the calling thread to one CPU so that a shard keeps its caches warm
+void pin_to_cpu(int cpu)
+{
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		LOG(WARNING) << "[Warning] Failed to pin reactor thread to CPU " << cpu;
+	}
+}
+
+// Settings taken from the command line
+struct ServerOptions {
+	int reactors = 1;
+	IoBackend backend = IoBackend::EPOLL;
+	size_t outbound_limit = DEFAULT_OUTBOUND_LIMIT;
+	int metrics_port = 0; // 0 serves no metrics endpoint
+	LogMode log_mode = LogMode::SYNC;
+	uint32_t log_sample = 1; // Log one in this many received packets
+	bool quiet = false;      // Keep INFO records out of stderr
+	int workers = -1;        // -1 runs the handlers on the loop threads
+	std::string mailbox;     // Directory of the mailbox segments; empty for none
+	std::string journal;     // File every message is recorded in; empty for none
+};
 
-		// A new connection is pending
-		if (activity > 0 && FD_ISSET(server_socket, &read_fds)) {
-			// 6. Accept the new connection
-			client_socket =
-			    accept(server_socket, (struct sockaddr *)&client_address,
-			           &client_address_length);
+void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [--reactors N] [--io-backend epoll|io_uring]\n"
+	          << "       [--outbound-limit-kb N] [--metrics-port N]\n"
+	          << "       [--log-mode sync|async] [--log-sample N] [--quiet]\n"
+	          << "       [--workers N] [--mailbox DIR] [--journal FILE]\n"
+	          << "  --reactors N    Number of event loop threads, each with its own\n"
+	          << "                  SO_REUSEPORT listener (0 = one per core, default 1)\n"
+	          << "  --io-backend B  Socket I/O interface of the event loops\n"
+	          << "                  (default epoll)\n"
+	          << "  --outbound-limit-kb N\n"
+	          << "                  Unsent data a client may have queued before it is\n"
+	          << "                  disconnected, in KiB (default "
+	          << DEFAULT_OUTBOUND_LIMIT / 1024 << ")\n"
+	          << "  --metrics-port N\n"
+	          << "                  Serve the metrics as text over HTTP on\n"
+	          << "                  127.0.0.1:N (default off)\n"
+	          << "  --log-mode M    Write client logs on the threads that serve the\n"
+	          << "                  clients (sync, default) or on a background thread\n"
+	          << "                  (async)\n"
+	          << "  --log-sample N  Log one in N received packets (default 1)\n"
+	          << "  --quiet         Print only warnings and errors to stderr; the log\n"
+	          << "                  files still get everything\n"
+	          << "  --workers N     Run the request handlers on N worker threads and\n"
+	          << "                  leave only I/O to the event loops (0 = one per\n"
+	          << "                  core; default off)\n"
+	          << "  --mailbox DIR   Keep messages for clients that asked for a mailbox\n"
+	          << "                  while they are offline, in segment files in DIR,\n"
+	          << "                  which is emptied on start (default off)\n"
+	          << "  --journal FILE  Append every message to FILE, for journal_replay\n"
+	          << "                  (default off)\n";
+}
+
+// Parses a decimal number in [min, max]. Returns false if it is malformed.
+bool parse_number(const char *text, long min, long max, long &value)
+{
+	char *end;
+	errno = 0;
+	value = strtol(text, &end, 10);
+	return *text != '\0' && *end == '\0' && errno == 0 && value >= min && value <= max;
+}
 
-			if (client_socket < 0) {
-				LOG(ERROR)
-				    << "[Error] accept() failed: " << strerror(errno);
+// Parses the command line. Returns false if it is malformed.
+bool parse_args(int argc, char *argv[], ServerOptions &options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		long value;
+		if (arg == "--reactors" && i + 1 < argc) {
+			if (!parse_number(argv[++i], 0, 1024, value)) {
+				return false;
+			}
+			options.reactors = static_cast<int>(value);
+		} else if (arg == "--io-backend" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "epoll") {
+				options.backend = IoBackend::EPOLL;
+			} else if (name == "io_uring") {
+				options.backend = IoBackend::IO_URING;
 			} else {
-				// Get client details for logging and ClientManager
-				std::string ip = inet_ntoa(client_address.sin_addr);
-				int port = ntohs(client_address.sin_port);
-
-				// 7. Add client to manager and get its ID
-				int client_id =
-				    g_client_manager.add_client(client_socket, ip, port);
-
-				// 8. Create and detach a new thread to handle the client
-				// request.
-				std::thread(handle_client, client_id, client_socket)
-				    .detach();
+				return false;
+			}
+		} else if (arg == "--outbound-limit-kb" && i + 1 < argc) {
+			if (!parse_number(argv[++i], 1, 1024 * 1024, value)) {
+				return false;
+			}
+			options.outbound_limit = static_cast<size_t>(value) * 1024;
+		} else if (arg == "--metrics-port" && i + 1 < argc) {
+			if (!parse_number(argv[++i], 1, 65535, value)) {
+				return false;
+			}
+			options.metrics_port = static_cast<int>(value);
+		} else if (arg == "--log-mode" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "sync") {
+				options.log_mode = LogMode::SYNC;
+			} else if (name == "async") {
+				options.log_mode = LogMode::ASYNC;
+			} else {
+				return false;
+			}
+		} else if (arg == "--log-sample" && i + 1 < argc) {
+			if (!parse_number(argv[++i], 1, 1000000, value)) {
+				return false;
+			}
+			options.log_sample = static_cast<uint32_t>(value);
+		} else if (arg == "--quiet") {
+			options.quiet = true;
+		} else if (arg == "--workers" && i + 1 < argc) {
+			if (!parse_number(argv[++i], 0, 1024, value)) {
+				return false;
 			}
+			options.workers = static_cast<int>(value);
+		} else if (arg == "--mailbox" && i + 1 < argc) {
+			options.mailbox = argv[++i];
+		} else if (arg == "--journal" && i + 1 < argc) {
+			options.journal = argv[++i];
+		} else {
+			return false;
 		}
 	}
+	if (options.reactors == 0) {
+		options.reactors = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (options.workers == 0) {
+		options.workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+	return true;
+}
 
-	// Close socket
-	LOG(INFO) << "[Info] Server is shutting down. Closing server socket to stop new connections.";
-	close(server_socket);
+int main(int argc, char *argv[])
+{
+	auto glog = GlogWrapper(argv[0]);
+
+	// Register signal handlers
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	// A peer that disconnects mid-send must not take the whole server down
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+
+	ServerOptions options;
+	if (!parse_args(argc, argv, options)) {
+		print_usage(argv[0]);
+		return -1;
+	}
+	if (options.quiet) {
+		glog.quiet_stderr();
+	}
+	int reactors = options.reactors;
+	IoBackend backend = options.backend;
+
+	// Every shard gets its own listener, event loop and client set
+	for (int i = 0; i < reactors; i++) {
+		auto shard = std::make_unique<Shard>(i, reactors);
+		shard->listen_fd = create_listener(reactors > 1);
+		if (shard->listen_fd < 0) {
+			return -1;
+		}
+		Shard *raw = shard.get();
+		shard->loop = EventLoop::create(
+		    backend, shard->listen_fd,
+		    EventLoopCallbacks{
+		        [raw](int fd, const std::string &ip, int port) {
+			        return on_client_accepted(*raw, fd, ip, port);
+		        },
+		        on_client_packet,
+		        [raw](uint64_t client_id) { on_client_closed(*raw, client_id); }});
+		if (!shard->loop->init()) {
+			return -1;
+		}
+		shard->loop->set_outbound_limit(options.outbound_limit);
+		// Client sockets are written through the shard's I/O backend
+		raw->clients.set_frame_writer([raw](int fd, const OutboundFrame &frame) {
+			return raw->loop->send_frame(fd, frame);
+		});
+		raw->clients.set_presence_listener(on_presence_change);
+		g_shards.push_back(std::move(shard));
+	}
+	LOG(INFO) << "[Info] Server is listening on port " << SERVER_PORT << " with "
+	          << reactors << " reactor(s) using "
+	          << (backend == IoBackend::IO_URING ? "io_uring" : "epoll") << "...";
+
+	if (!options.mailbox.empty()) {
+		std::string error;
+		// A claim is sent at once; half the outbound limit leaves room for
+		// whatever else the client is sent meanwhile
+		if (!g_mailbox.open(options.mailbox, options.outbound_limit / 2, error)) {
+			LOG(ERROR) << "[Error] Failed to open the mailbox: " << error;
+			return -1;
+		}
+		LOG(INFO) << "[Info] Keeping messages for offline clients in " << options.mailbox;
+	}
+	if (!options.journal.empty()) {
+		std::string error;
+		if (!g_journal.open(options.journal, error)) {
+			LOG(ERROR) << "[Error] Failed to open the journal: " << error;
+			return -1;
+		}
+		LOG(INFO) << "[Info] Recording messages in " << options.journal << " from offset "
+		          << g_journal.start_offset();
+	}
+
+	// Server main loop: each shard's reactor serves its listening socket and
+	// its own client sockets until a shutdown signal arrives. The first shard
+	// runs on the main thread.
+	int metrics_fd = -1;
+	std::thread metrics_thread;
+	if (options.metrics_port != 0) {
+		metrics_fd = create_metrics_listener(options.metrics_port);
+		if (metrics_fd < 0) {
+			return -1;
+		}
+		metrics_thread = std::thread(run_metrics_endpoint, metrics_fd);
+		LOG(INFO) << "[Info] Serving metrics on 127.0.0.1:" << options.metrics_port;
+	}
+
+	AsyncLog::start(options.log_mode, options.log_sample);
+	if (options.workers > 0) {
+		for (int i = 0; i < options.workers; i++) {
+			g_worker_caches.push_back(std::make_unique<ResponseCache>());
+		}
+		g_workers = std::make_unique<WorkerPool>(options.workers);
+		LOG(INFO) << "[Info] Request handlers run on " << options.workers << " worker(s)";
+	}
+	std::thread presence_thread(run_presence_feed);
+	std::vector<std::thread> reactor_threads;
+	for (int i = 1; i < reactors; i++) {
+		reactor_threads.emplace_back([i]() {
+			pin_to_cpu(i % std::max(1u, std::thread::hardware_concurrency()));
+			g_shards[i]->loop->run(g_server_running);
+		});
+	}
+	if (reactors > 1) {
+		pin_to_cpu(0);
+	}
+	g_shards[0]->loop->run(g_server_running);
+	for (auto &thread : reactor_threads) {
+		thread.join();
+	}
+	presence_thread.join();
+	if (g_workers) {
+		// Their remaining replies go to loops that have stopped, so they
+		// are dropped like any frame queued at shutdown
+		g_workers->stop();
+		for (int i = 0; i < g_workers->size(); i++) {
+			const WorkerStats &stats = g_workers->stats(i);
+			const ResponseCache &cache = *g_worker_caches[i];
+			LOG(INFO) << "[Info] Worker " << i << ": " << stats.tasks << " tasks, "
+			          << stats.stolen << " stolen from other workers, " << cache.hits()
+			          << " of " << cache.hits() + cache.misses()
+			          << " cacheable replies served from the cache";
+		}
+	}
+	if (metrics_thread.joinable()) {
+		metrics_thread.join();
+		close(metrics_fd);
+	}
+
+	// Close sockets
+	LOG(INFO) << "[Info] Server is shutting down. Closing server sockets to stop new connections.";
+	for (const auto &shard : g_shards) {
+		close(shard->listen_fd);
+		// With the loops stopped, fall back to plain blocking sends
+		shard->clients.set_frame_writer(nullptr);
+		// Nobody is left to receive presence deltas
+		shard->clients.set_presence_listener(nullptr);
+
+		const IoStats &stats = shard->loop->stats();
+		uint64_t frames = stats.frames_in + stats.frames_out;
+		LOG(INFO) << "[Info] Reactor " << shard->index << ": " << stats.frames_in
+		          << " frames in, " << stats.frames_out << " frames out, "
+		          << stats.syscalls << " syscalls ("
+		          << (frames ? static_cast<double>(stats.syscalls) / frames : 0.0)
+		          << " per frame), " << stats.overflows
+		          << " clients dropped over the outbound limit, "
+		          << shard->cache.hits() << " of "
+		          << shard->cache.hits() + shard->cache.misses()
+		          << " cacheable replies served from the cache";
+	}
+	if (g_journal.is_open()) {
+		// Every handler has returned, so nothing is appended any more
+		g_journal.stop();
+		JournalStats stats = g_journal.stats();
+		LOG(INFO) << "[Info] Journal: " << stats.records << " records, " << stats.bytes
+		          << " bytes in " << stats.syncs << " syncs ("
+		          << (stats.syncs ? static_cast<double>(stats.records) / stats.syncs : 0.0)
+		          << " records per sync), " << stats.stalls << " appends stalled, "
+		          << stats.write_errors << " failed writes";
+	}
+	if (g_mailbox.is_open()) {
+		MailboxStats stats = g_mailbox.stats();
+		LOG(INFO) << "[Info] Mailbox: " << stats.stored << " messages stored, "
+		          << stats.delivered << " delivered, " << stats.expired << " expired, "
+		          << stats.segments << " segment(s) written";
+	}
 
 	// Prepare shutdown indication packet
 	LOG(INFO) << "[Info] Notifying all connected clients of shutdown...";
-	Packet shutdown_pkt;
-	shutdown_pkt.type = MessageType::SERVER_SHUTDOWN_INDICATION;
-	shutdown_pkt.content = json{
-	        {"notice", "Server is shutting down for maintenance. Please reconnect later."}
-	}.dump();
+	// The notice is encoded once per codec and every client of a codec is
+	// sent the same frame
+	FrameSet shutdown_frames = encode_frame_set(
+	        MessageType::SERVER_SHUTDOWN_INDICATION,
+	        NoticeIndication{
+	                "Server is shutting down for maintenance. Please reconnect later."});
 
-	// Notify all clients
-	std::vector<ClientInfo> all_clients = g_client_manager.get_all_clients();
-	for (const auto& client : all_clients) {
-		LOG(INFO) << "[Info] Sending shutdown notice to Client ID: " << client.client_id;
-		g_client_manager.send_to_client(client.client_id, shutdown_pkt);
-		g_client_manager.remove_client(client.client_id);
+	// Notify all clients. The reactors have stopped, so the main thread
+	// can write to every shard's sockets directly.
+	for (const auto &shard : g_shards) {
+		std::vector<ClientInfo> all_clients = shard->clients.get_all_clients();
+		for (const auto& client : all_clients) {
+			LOG(INFO) << "[Info] Sending shutdown notice to Client ID: " << client.client_id;
+			shard->clients.send_frame(client.client_id, shutdown_frames);
+			shard->clients.remove_client(client.client_id);
+		}
 	}
 
 	LOG(INFO) << "[Info] All clients notified. Server has shut down.";
+	AsyncLog::stop();
 
 	return 0;
 }
\ No newline at end of file
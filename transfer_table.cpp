@@ -0,0 +1,126 @@
+#include "include/transfer_table.h"
+#include "include/payload_codec.h" // For TRANSFER_WINDOW
+#include <iterator>        // For std::distance
+
+// Files a client may receive at once. Their windows together stay well
+// below the outbound limit, so a receiver is never dropped for the chunks
+// the server let through.
+#define MAX_INCOMING_TRANSFERS 4
+// Files a client may send at once
+#define MAX_OUTGOING_TRANSFERS 16
+
+bool TransferTable::begin(uint64_t sender_id, uint32_t transfer_id, uint64_t receiver_id,
+                          std::string &error)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	Key key(sender_id, transfer_id);
+	if (transfers_.count(key) != 0) {
+		error = "Transfer ID already in use";
+		return false;
+	}
+	auto first = transfers_.lower_bound(Key(sender_id, 0));
+	auto last = transfers_.lower_bound(Key(sender_id + 1, 0));
+	if (std::distance(first, last) >= MAX_OUTGOING_TRANSFERS) {
+		error = "Too many transfers in progress";
+		return false;
+	}
+	size_t &incoming = incoming_[receiver_id];
+	if (incoming >= MAX_INCOMING_TRANSFERS) {
+		error = "The receiver has too many transfers in progress";
+		return false;
+	}
+	incoming++;
+
+	Transfer &transfer = transfers_[key];
+	transfer.sender_id = sender_id;
+	transfer.transfer_id = transfer_id;
+	transfer.receiver_id = receiver_id;
+	return true;
+}
+
+TransferTable::ChunkResult TransferTable::chunk(uint64_t sender_id, uint32_t transfer_id,
+                                                size_t bytes, uint64_t &receiver_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = transfers_.find(Key(sender_id, transfer_id));
+	if (it == transfers_.end()) {
+		return ChunkResult::UNKNOWN;
+	}
+	Transfer &transfer = it->second;
+	receiver_id = transfer.receiver_id;
+	if (transfer.relayed + bytes - transfer.acknowledged > TRANSFER_WINDOW) {
+		erase(it);
+		return ChunkResult::OVER_WINDOW;
+	}
+	transfer.relayed += bytes;
+	return ChunkResult::RELAY;
+}
+
+bool TransferTable::acknowledge(uint64_t sender_id, uint32_t transfer_id,
+                                uint64_t receiver_id, uint64_t received)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = transfers_.find(Key(sender_id, transfer_id));
+	if (it == transfers_.end()) {
+		return false;
+	}
+	Transfer &transfer = it->second;
+	if (transfer.receiver_id != receiver_id || received > transfer.relayed ||
+	    received < transfer.acknowledged) {
+		return false;
+	}
+	transfer.acknowledged = received;
+	return true;
+}
+
+bool TransferTable::end(uint64_t client_id, uint64_t peer_id, uint32_t transfer_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = transfers_.find(Key(client_id, transfer_id));
+	if (it == transfers_.end() || it->second.receiver_id != peer_id) {
+		it = transfers_.find(Key(peer_id, transfer_id));
+		if (it == transfers_.end() || it->second.receiver_id != client_id) {
+			return false;
+		}
+	}
+	erase(it);
+	return true;
+}
+
+std::vector<TransferTable::Transfer> TransferTable::remove_client(uint64_t client_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	std::vector<Transfer> removed;
+	auto it = transfers_.lower_bound(Key(client_id, 0));
+	while (it != transfers_.end() && it->first.first == client_id) {
+		removed.push_back(it->second);
+		erase(it++);
+	}
+	auto incoming = incoming_.find(client_id);
+	if (incoming == incoming_.end()) {
+		return removed;
+	}
+	for (it = transfers_.begin(); it != transfers_.end();) {
+		if (it->second.receiver_id == client_id) {
+			removed.push_back(it->second);
+			erase(it++);
+		} else {
+			++it;
+		}
+	}
+	return removed;
+}
+
+void TransferTable::erase(std::map<Key, Transfer>::iterator it)
+{
+	auto incoming = incoming_.find(it->second.receiver_id);
+	if (incoming != incoming_.end() && --incoming->second == 0) {
+		incoming_.erase(incoming);
+	}
+	transfers_.erase(it);
+}
@@ -0,0 +1,538 @@
+#include "include/uring_loop.h"
+#include "include/async_log.h"
+#include "include/metrics.h"
+#include "include/protocol.h"
+#include <sys/mman.h>      // For mmap, munmap
+#include <sys/syscall.h>   // For SYS_io_uring_*
+#include <netinet/in.h>    // For sockaddr_in
+#include <arpa/inet.h>     // For inet_ntoa, ntohs
+#include <fcntl.h>         // For open
+#include <poll.h>          // For POLLIN
+#include <unistd.h>        // For close, syscall
+#include <climits>         // For IOV_MAX
+#include <algorithm>       // For std::max
+#include <cerrno>          // For errno
+#include <cstring>         // For memset, strerror
+#include <glog/logging.h>
+
+#define URING_QUEUE_DEPTH 4096
+#define URING_CQ_DEPTH 16384
+#define URING_TIMEOUT_SEC 1
+
+// Received data is spread over this many provided buffers of this size.
+// Packets that span buffers are reassembled by the connection's decoder.
+#define RECV_BUFFER_COUNT 1024
+#define RECV_BUFFER_SIZE 4096
+#define RECV_BUFFER_GROUP 0
+
+// The low bits of a request's user_data tell what kind of request it is.
+// The remaining bits hold the UringConnection it belongs to, if any.
+#define TAG_ACCEPT 1
+#define TAG_WAKEUP 2
+#define TAG_RECV 3
+#define TAG_SEND 4
+#define TAG_CANCEL 5
+#define TAG_PROVIDE 6
+#define TAG_MASK 7ULL
+
+static inline uint64_t make_user_data(void *ptr, uint64_t tag)
+{
+	return reinterpret_cast<uint64_t>(ptr) | tag;
+}
+
+UringLoop::UringLoop(int listen_fd, EventLoopCallbacks callbacks)
+    : EventLoop(listen_fd, std::move(callbacks)), ring_fd_(-1), spare_fd_(-1),
+      sq_ring_(MAP_FAILED), sq_ring_size_(0), sq_head_(nullptr), sq_tail_(nullptr),
+      sq_mask_(nullptr), sq_array_(nullptr), sq_entries_(0), sq_local_tail_(0),
+      sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)), sqes_size_(0),
+      cq_ring_(MAP_FAILED), cq_ring_size_(0), cq_head_(nullptr), cq_tail_(nullptr),
+      cq_mask_(nullptr), cqes_(nullptr), buffers_(static_cast<char *>(MAP_FAILED)),
+      buffers_size_(0)
+{
+}
+
+UringLoop::~UringLoop()
+{
+	// Closing the ring cancels every request, after which the connection
+	// state and the buffers can no longer be referenced by the kernel
+	if (ring_fd_ >= 0) {
+		close(ring_fd_);
+	}
+	if (sqes_ != MAP_FAILED) {
+		munmap(sqes_, sqes_size_);
+	}
+	if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+		munmap(cq_ring_, cq_ring_size_);
+	}
+	if (sq_ring_ != MAP_FAILED) {
+		munmap(sq_ring_, sq_ring_size_);
+	}
+	if (buffers_ != MAP_FAILED) {
+		munmap(buffers_, buffers_size_);
+	}
+	if (spare_fd_ >= 0) {
+		close(spare_fd_);
+	}
+	for (auto &pair : connections_) {
+		delete pair.second;
+	}
+	for (UringConnection *conn : closing_) {
+		delete conn;
+	}
+}
+
+bool UringLoop::init()
+{
+	if (!setup_ring() || !setup_buffers() || !create_wakeup_fd()) {
+		return false;
+	}
+	spare_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return true;
+}
+
+bool UringLoop::setup_ring()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_DEPTH;
+
+	ring_fd_ = syscall(SYS_io_uring_setup, URING_QUEUE_DEPTH, &params);
+	if (ring_fd_ < 0) {
+		LOG(ERROR) << "[Error] io_uring_setup() failed: " << strerror(errno);
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG) ||
+	    !(params.features & IORING_FEAT_NODROP)) {
+		LOG(ERROR) << "[Error] The kernel's io_uring lacks required features.";
+		return false;
+	}
+
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+		cq_ring_size_ = sq_ring_size_;
+	}
+
+	sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+	if (sq_ring_ == MAP_FAILED) {
+		LOG(ERROR) << "[Error] Failed to map submission ring: " << strerror(errno);
+		return false;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring_ = sq_ring_;
+	} else {
+		cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+		                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+		if (cq_ring_ == MAP_FAILED) {
+			LOG(ERROR) << "[Error] Failed to map completion ring: "
+			           << strerror(errno);
+			return false;
+		}
+	}
+
+	sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_ = static_cast<struct io_uring_sqe *>(
+	    mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	         ring_fd_, IORING_OFF_SQES));
+	if (sqes_ == MAP_FAILED) {
+		LOG(ERROR) << "[Error] Failed to map submission entries: " << strerror(errno);
+		return false;
+	}
+
+	char *sq = static_cast<char *>(sq_ring_);
+	sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	sq_entries_ = params.sq_entries;
+	sq_local_tail_ = *sq_tail_;
+
+	char *cq = static_cast<char *>(cq_ring_);
+	cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+	return true;
+}
+
+bool UringLoop::setup_buffers()
+{
+	buffers_size_ = RECV_BUFFER_COUNT * RECV_BUFFER_SIZE;
+	buffers_ = static_cast<char *>(mmap(NULL, buffers_size_, PROT_READ | PROT_WRITE,
+	                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (buffers_ == MAP_FAILED) {
+		LOG(ERROR) << "[Error] Failed to allocate receive buffers: " << strerror(errno);
+		return false;
+	}
+
+	// Hand the whole pool to the kernel. It goes out with the first
+	// submission, ahead of any receive.
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = RECV_BUFFER_COUNT;
+	sqe->addr = reinterpret_cast<uint64_t>(buffers_);
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->off = 0;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = make_user_data(nullptr, TAG_PROVIDE);
+	return true;
+}
+
+void UringLoop::recycle_buffer(uint16_t bid)
+{
+	// Returned with the next batch; a successful return posts no completion
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = 1;
+	sqe->addr = reinterpret_cast<uint64_t>(buffers_ + bid * RECV_BUFFER_SIZE);
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = make_user_data(nullptr, TAG_PROVIDE);
+}
+
+struct io_uring_sqe *UringLoop::get_sqe()
+{
+	// The kernel consumes entries up to the published tail on every enter,
+	// so a full queue only has to be flushed without waiting
+	while (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+		enter(0, false);
+	}
+	unsigned index = sq_local_tail_ & *sq_mask_;
+	struct io_uring_sqe *sqe = &sqes_[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array_[index] = index;
+	sq_local_tail_++;
+	return sqe;
+}
+
+int UringLoop::enter(unsigned min_complete, bool wait)
+{
+	__atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+	unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+	struct __kernel_timespec timeout;
+	timeout.tv_sec = URING_TIMEOUT_SEC;
+	timeout.tv_nsec = 0;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uint64_t>(&timeout);
+
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	stats_.syscalls++;
+	int result = syscall(SYS_io_uring_enter, ring_fd_, to_submit, min_complete, flags,
+	                     &arg, sizeof(arg));
+	if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY &&
+	    errno != EAGAIN) {
+		LOG(ERROR) << "[Error] io_uring_enter() failed: " << strerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+void UringLoop::run(const std::atomic<bool> &running)
+{
+	mark_loop_thread();
+	arm_accept();
+	arm_wakeup();
+
+	while (running) {
+		flush_sends();
+		// Submit everything queued during the last iteration and wait for
+		// the next completions with a single system call
+		if (enter(1, true) < 0) {
+			break;
+		}
+		process_completions();
+	}
+}
+
+void UringLoop::process_completions()
+{
+	// Only the completions present now are handled, so that queued sends
+	// are flushed even while busy connections keep producing more
+	unsigned head = *cq_head_;
+	unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe cqe = cqes_[head & *cq_mask_];
+		head++;
+		// Hand the slot back before handling, handlers may submit more
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+		auto *conn = reinterpret_cast<UringConnection *>(cqe.user_data & ~TAG_MASK);
+		switch (cqe.user_data & TAG_MASK) {
+		case TAG_ACCEPT:
+			handle_accept(cqe.res, cqe.flags);
+			break;
+		case TAG_WAKEUP:
+			run_posted_tasks();
+			if (!(cqe.flags & IORING_CQE_F_MORE)) {
+				arm_wakeup();
+			}
+			break;
+		case TAG_RECV:
+			handle_recv(conn, cqe.res, cqe.flags);
+			break;
+		case TAG_SEND:
+			handle_send(conn, cqe.res);
+			break;
+		case TAG_PROVIDE:
+			if (cqe.res < 0) {
+				LOG(ERROR) << "[Error] Failed to provide receive buffers: "
+				           << strerror(-cqe.res);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void UringLoop::arm_accept()
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd_;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = make_user_data(nullptr, TAG_ACCEPT);
+}
+
+void UringLoop::arm_wakeup()
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = wakeup_fd_;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = make_user_data(nullptr, TAG_WAKEUP);
+}
+
+void UringLoop::arm_recv(UringConnection *conn)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->socket_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = make_user_data(conn, TAG_RECV);
+	conn->recv_armed = true;
+	conn->inflight++;
+}
+
+void UringLoop::arm_send(UringConnection *conn)
+{
+	// Gather every queued frame into one sendmsg
+	conn->outbound.gather(conn->iov, IOV_MAX);
+	memset(&conn->msg, 0, sizeof(conn->msg));
+	conn->msg.msg_iov = conn->iov.data();
+	conn->msg.msg_iovlen = conn->iov.size();
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->socket_fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&conn->msg);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = make_user_data(conn, TAG_SEND);
+	conn->sending = true;
+	conn->inflight++;
+}
+
+void UringLoop::cancel(uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = make_user_data(nullptr, TAG_CANCEL);
+}
+
+// Walked until nothing new was scheduled, like EpollLoop::flush_sends():
+// closing a connection may queue frames for others. A connection scheduled
+// again is only released once its second turn comes.
+void UringLoop::flush_sends()
+{
+	while (!flush_list_.empty()) {
+		flushing_.swap(flush_list_);
+		for (UringConnection *conn : flushing_) {
+			conn->flush_scheduled = false;
+			if (conn->overflowed) {
+				close_connection(conn);
+			} else if (!conn->closed && !conn->sending && !conn->outbound.empty()) {
+				arm_send(conn);
+			}
+			release_if_done(conn);
+		}
+		flushing_.clear();
+	}
+}
+
+bool UringLoop::send_frame(int socket_fd, const OutboundFrame &frame)
+{
+	auto it = connections_.find(socket_fd);
+	if (it == connections_.end()) {
+		return false;
+	}
+	UringConnection *conn = it->second;
+	bool queued = queue_frame(*conn, frame);
+	// The send itself is issued at the end of the iteration, together with
+	// everything else queued for this connection in the meantime. An
+	// overflowed connection is closed there too.
+	if ((!conn->sending || conn->overflowed) && !conn->flush_scheduled) {
+		conn->flush_scheduled = true;
+		flush_list_.push_back(conn);
+	}
+	return queued;
+}
+
+void UringLoop::handle_accept(int res, uint32_t flags)
+{
+	if (!(flags & IORING_CQE_F_MORE)) {
+		arm_accept();
+	}
+	if (res < 0) {
+		if ((res == -EMFILE || res == -ENFILE) && spare_fd_ >= 0) {
+			// Out of descriptors. Release the spare one to accept and
+			// immediately drop the pending connection.
+			LOG(ERROR) << "[Error] accept() failed: " << strerror(-res)
+			           << ". Dropping connection.";
+			close(spare_fd_);
+			int fd = accept(listen_fd_, NULL, NULL);
+			if (fd >= 0) {
+				close(fd);
+			}
+			spare_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		} else if (res != -ECANCELED) {
+			LOG(ERROR) << "[Error] accept() failed: " << strerror(-res);
+		}
+		return;
+	}
+
+	struct sockaddr_in client_address;
+	socklen_t client_address_length = sizeof(client_address);
+	memset(&client_address, 0, sizeof(client_address));
+	getpeername(res, (struct sockaddr *)&client_address, &client_address_length);
+	stats_.syscalls++;
+
+	std::string ip = inet_ntoa(client_address.sin_addr);
+	int port = ntohs(client_address.sin_port);
+
+	auto *conn = new UringConnection();
+	conn->socket_fd = res;
+	connections_[res] = conn;
+	conn->client_id = callbacks_.on_accept(res, ip, port);
+	if (conn->client_id == 0) {
+		// Refused before any request referenced the connection
+		connections_.erase(res);
+		delete conn;
+		close(res);
+		return;
+	}
+	arm_recv(conn);
+}
+
+void UringLoop::handle_recv(UringConnection *conn, int res, uint32_t flags)
+{
+	bool more = flags & IORING_CQE_F_MORE;
+	if (!more) {
+		conn->recv_armed = false;
+		conn->inflight--;
+	}
+
+	const char *data = nullptr;
+	uint16_t bid = 0;
+	bool has_buffer = flags & IORING_CQE_F_BUFFER;
+	if (has_buffer) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		data = buffers_ + bid * RECV_BUFFER_SIZE;
+	}
+
+	if (conn->closed) {
+		if (has_buffer) {
+			recycle_buffer(bid);
+		}
+		release_if_done(conn);
+		return;
+	}
+
+	if (res > 0 && has_buffer) {
+		bool ok = consume(*conn, data, res);
+		recycle_buffer(bid);
+		if (!ok) {
+			close_connection(conn);
+		} else if (!more) {
+			arm_recv(conn);
+		}
+	} else if (res == -ENOBUFS) {
+		// Every buffer is in use; they are returned with the next
+		// submission, so simply ask again
+		if (!more) {
+			arm_recv(conn);
+		}
+	} else {
+		peer_closed(*conn);
+		close_connection(conn);
+	}
+	release_if_done(conn);
+}
+
+void UringLoop::handle_send(UringConnection *conn, int res)
+{
+	conn->sending = false;
+	conn->inflight--;
+	if (conn->closed) {
+		release_if_done(conn);
+		return;
+	}
+	if (res < 0) {
+		HOT_LOG(ERROR) << "[Error] Failed to send to Client ID " << conn->client_id
+		               << ": " << strerror(-res);
+		// Let the receive side detect the broken connection
+		conn->outbound.clear();
+		return;
+	}
+
+	Metrics::count(Counter::BYTES_OUT, res);
+	conn->outbound.consume(res);
+	if (!conn->outbound.empty() && !conn->flush_scheduled) {
+		conn->flush_scheduled = true;
+		flush_list_.push_back(conn);
+	}
+}
+
+void UringLoop::close_connection(UringConnection *conn)
+{
+	if (conn->closed) {
+		return;
+	}
+	conn->closed = true;
+	connections_.erase(conn->socket_fd);
+	closing_.insert(conn);
+
+	// Requests are cancelled by user_data rather than by descriptor, since
+	// the descriptor is closed below and may be reused before they run
+	if (conn->recv_armed) {
+		cancel(make_user_data(conn, TAG_RECV));
+	}
+	if (conn->sending) {
+		cancel(make_user_data(conn, TAG_SEND));
+	}
+	callbacks_.on_close(conn->client_id);
+}
+
+void UringLoop::release_if_done(UringConnection *conn)
+{
+	if (conn->closed && conn->inflight == 0 && !conn->flush_scheduled) {
+		closing_.erase(conn);
+		delete conn;
+	}
+}
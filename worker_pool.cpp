@@ -0,0 +1,114 @@
+#include "include/worker_pool.h"
+
+static thread_local int t_worker_index = -1;
+
+WorkerPool::WorkerPool(int threads)
+{
+	if (threads < 1) {
+		threads = 1;
+	}
+	for (int i = 0; i < threads; i++) {
+		workers_.push_back(std::make_unique<Worker>());
+	}
+	// Started once every queue exists, as any worker may steal from any
+	for (int i = 0; i < threads; i++) {
+		workers_[i]->thread = std::thread(&WorkerPool::run_worker, this, i);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+void WorkerPool::submit(Task task)
+{
+	int index = t_worker_index;
+	if (index < 0 || index >= static_cast<int>(workers_.size())) {
+		index = next_queue_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+	}
+	Worker &worker = *workers_[index];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(std::move(task));
+	}
+	// Sequentially consistent with the check of a worker going to sleep:
+	// either it sees the task, or this sees it sleeping and wakes it
+	queued_.fetch_add(1);
+	if (sleeping_.load() > 0) {
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+		wakeup_.notify_one();
+	}
+}
+
+void WorkerPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+		if (stopping_.exchange(true)) {
+			return;
+		}
+		wakeup_.notify_all();
+	}
+	for (auto &worker : workers_) {
+		worker->thread.join();
+	}
+}
+
+int WorkerPool::size() const
+{
+	return static_cast<int>(workers_.size());
+}
+
+const WorkerStats &WorkerPool::stats(int worker) const
+{
+	return workers_[worker]->stats;
+}
+
+int WorkerPool::current_worker()
+{
+	return t_worker_index;
+}
+
+// Takes the oldest task of the worker's own queue, or else of the first
+// other queue that has one, starting with the next worker's
+bool WorkerPool::take_task(int index, Task &task)
+{
+	size_t count = workers_.size();
+	for (size_t i = 0; i < count; i++) {
+		Worker &victim = *workers_[(index + i) % count];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (victim.tasks.empty()) {
+			continue;
+		}
+		task = std::move(victim.tasks.front());
+		victim.tasks.pop_front();
+		queued_.fetch_sub(1);
+		if (i > 0) {
+			workers_[index]->stats.stolen++;
+		}
+		return true;
+	}
+	return false;
+}
+
+void WorkerPool::run_worker(int index)
+{
+	t_worker_index = index;
+	Worker &self = *workers_[index];
+	for (;;) {
+		Task task;
+		if (take_task(index, task)) {
+			task();
+			self.stats.tasks++;
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex_);
+		sleeping_.fetch_add(1);
+		wakeup_.wait(lock, [this]() { return queued_.load() > 0 || stopping_.load(); });
+		sleeping_.fetch_sub(1);
+		if (queued_.load() == 0 && stopping_.load()) {
+			return;
+		}
+	}
+}